@@ -4,6 +4,8 @@ pub type VirtAddr = usize;
 pub type PhysAddr = usize;
 
 pub const PAGE_SIZE: usize = 1 << 12;
+/// Size of a huge page, which is mapped by one entry of the second level page table
+pub const HUGE_PAGE_SIZE: usize = 1 << 21;
 
 #[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord)]
 pub struct Page {
@@ -19,11 +19,19 @@
 //! so we need to maintain the count of write and read reference.
 //! When page fault occurs, if the read reference count is 0 and the write reference count is 1，
 //! The copy process should be skipped and the entry is mark as writable directly.
+//!
+//! `CowExt` only counts references inside one page table.
+//! Frames shared between page tables by fork are counted in the global `SHARED_FRAMES`,
+//! see `share_page`, `unshare_page` and `handle_cow_fault`,
+//! which are used by the memory handlers to implement copy-on-write `clone_map`.
 
+use super::memory_set::handler::FrameAllocator;
 use super::paging::*;
 use super::*;
 use alloc::collections::BTreeMap;
+use core::cell::UnsafeCell;
 use core::ops::{Deref, DerefMut};
+use core::sync::atomic::{spin_loop_hint, AtomicBool, Ordering};
 
 /// Wrapper for page table, supporting shared map & copy-on-write
 pub struct CowExt<T: PageTable> {
@@ -136,6 +144,156 @@ impl<T: PageTable> DerefMut for CowExt<T> {
     }
 }
 
+/// Reference count of frames shared between page tables by copy-on-write clone
+struct SharedFrames {
+    locked: AtomicBool,
+    rc_map: UnsafeCell<FrameRcMap>,
+}
+
+unsafe impl Sync for SharedFrames {}
+
+static SHARED_FRAMES: SharedFrames = SharedFrames {
+    locked: AtomicBool::new(false),
+    rc_map: UnsafeCell::new(FrameRcMap(None)),
+};
+
+impl SharedFrames {
+    /// Run `f` on the map locked, with interrupts disabled by `allocator`
+    fn with<R>(&self, allocator: &impl FrameAllocator, f: impl FnOnce(&mut FrameRcMap) -> R) -> R {
+        allocator.no_irq(|| {
+            while self
+                .locked
+                .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+                .is_err()
+            {
+                spin_loop_hint();
+            }
+            let ret = f(unsafe { &mut *self.rc_map.get() });
+            self.locked.store(false, Ordering::Release);
+            ret
+        })
+    }
+}
+
+/*
+ **  @brief  map `addr` in `pt` to the frame mapped at `addr` in `src_pt`, copy-on-write
+ **          Both entries become readonly and shared, and `init` is used to set
+ **          the other flags of the new entry.
+ **  @param  pt: &mut PageTable   the page table to map into
+ **  @param  src_pt: &mut PageTable
+ **                               the page table to share the frame from
+ **  @param  addr: VirtAddr       the virual address to map
+ **  @param  writable: bool       whether the page should be writable after copy
+ **  @param  allocator: &impl FrameAllocator
+ **                               the allocator of the frames, which locks the counts
+ **  @param  init: impl FnOnce(&mut Entry)
+ **                               set the flags of the new entry
+ **  @retval bool                 false if the page is not present, or the page table
+ **                               can not mark shared entries. Then the caller should
+ **                               map the page by itself.
+ */
+pub fn share_page(
+    pt: &mut PageTable,
+    src_pt: &mut PageTable,
+    addr: VirtAddr,
+    writable: bool,
+    allocator: &impl FrameAllocator,
+    init: impl FnOnce(&mut Entry),
+) -> bool {
+    let src_entry = match src_pt.get_entry(addr) {
+        Some(entry) if entry.present() => entry,
+        _ => return false,
+    };
+    let target = src_entry.target();
+    let frame = target / PAGE_SIZE;
+    if !src_entry.readonly_shared() && !src_entry.writable_shared() {
+        src_entry.set_shared(writable);
+        if !src_entry.readonly_shared() && !src_entry.writable_shared() {
+            // shared bits are not supported on this arch
+            return false;
+        }
+        src_entry.set_writable(false);
+        src_entry.update();
+        SHARED_FRAMES.with(allocator, |rc_map| rc_map.increase(&frame, writable));
+    }
+    let entry = pt.map(addr, target);
+    init(entry);
+    entry.set_writable(false);
+    entry.set_shared(writable);
+    entry.update();
+    SHARED_FRAMES.with(allocator, |rc_map| rc_map.increase(&frame, writable));
+    true
+}
+
+/*
+ **  @brief  drop the reference of a shared entry before unmapping it
+ **  @param  entry: &mut Entry    the entry to unmap
+ **  @param  allocator: &impl FrameAllocator
+ **                               the allocator of the frame, which locks the counts
+ **  @retval bool                 whether the frame is not referenced anymore
+ **                               and should be deallocated by the caller
+ */
+pub fn unshare_page(entry: &mut Entry, allocator: &impl FrameAllocator) -> bool {
+    let writable = if entry.writable_shared() {
+        true
+    } else if entry.readonly_shared() {
+        false
+    } else {
+        return true;
+    };
+    let frame = entry.target() / PAGE_SIZE;
+    entry.clear_shared();
+    SHARED_FRAMES.with(allocator, |rc_map| rc_map.decrease(&frame, writable))
+}
+
+/*
+ **  @brief  execute the COW process for page fault on a page shared by `share_page`
+ **  @param  pt: &mut PageTable   the page table where page fault happens
+ **  @param  addr: VirtAddr       the virual address of the page fault
+ **  @param  allocator: &impl FrameAllocator
+ **                               the allocator of the new frame
+ **  @retval bool                 whether copy-on-write happens
+ */
+pub fn handle_cow_fault(
+    pt: &mut PageTable,
+    addr: VirtAddr,
+    allocator: &impl FrameAllocator,
+) -> bool {
+    let addr = addr & !(PAGE_SIZE - 1);
+    let frame = match pt.get_entry(addr) {
+        Some(entry) if entry.present() && entry.writable_shared() => entry.target() / PAGE_SIZE,
+        _ => return false,
+    };
+    // the last reference takes the frame without copy
+    let last = SHARED_FRAMES.with(allocator, |rc_map| {
+        let last = rc_map.read_count(&frame) == 0 && rc_map.write_count(&frame) == 1;
+        if last {
+            rc_map.decrease(&frame, true);
+        }
+        last
+    });
+    if !last {
+        // copy before dropping our reference,
+        // otherwise the frame may be freed by the others at the same time
+        let target = allocator.alloc().expect("failed to alloc frame");
+        use core::mem::MaybeUninit;
+        let mut temp_data: [u8; PAGE_SIZE] =
+            unsafe { MaybeUninit::uninitialized().into_initialized() };
+        temp_data[..].copy_from_slice(pt.get_page_slice_mut(addr));
+        pt.get_entry(addr).unwrap().set_target(target);
+        pt.get_entry(addr).unwrap().update();
+        pt.get_page_slice_mut(addr).copy_from_slice(&temp_data[..]);
+        if SHARED_FRAMES.with(allocator, |rc_map| rc_map.decrease(&frame, true)) {
+            allocator.dealloc(frame * PAGE_SIZE);
+        }
+    }
+    let entry = pt.get_entry(addr).unwrap();
+    entry.clear_shared();
+    entry.set_writable(true);
+    entry.update();
+    true
+}
+
 /// A map contains reference count for shared frame
 ///
 /// It will lazily construct the `BTreeMap`, to avoid heap alloc when heap is unavailable.
@@ -195,6 +353,37 @@ impl FrameRcMap {
     fn write_decrease(&mut self, frame: &Frame) {
         self.map().get_mut(frame).unwrap().1 -= 1;
     }
+    /*
+     **  @brief  increase the read or write reference count of the frame
+     **  @param  frame: &Frame        the frame to increase the reference count
+     **  @param  writable: bool       increase the write count if it is true
+     **  @retval none
+     */
+    fn increase(&mut self, frame: &Frame, writable: bool) {
+        match writable {
+            true => self.write_increase(frame),
+            false => self.read_increase(frame),
+        }
+    }
+    /*
+     **  @brief  decrease the read or write reference count of the frame,
+     **          and remove it from the map when no reference is left
+     **  @param  frame: &Frame        the frame to decrease the reference count
+     **  @param  writable: bool       decrease the write count if it is true
+     **  @retval bool                 whether no reference is left
+     */
+    fn decrease(&mut self, frame: &Frame, writable: bool) -> bool {
+        match writable {
+            true => self.write_decrease(frame),
+            false => self.read_decrease(frame),
+        }
+        if self.map()[frame] == (0, 0) {
+            self.map().remove(frame);
+            true
+        } else {
+            false
+        }
+    }
     /*
      **  @brief  get the internal btree map, lazily initialize the btree map if it is not present
      **  @retval &mut BTreeMap<Frame, (u16, u16)>
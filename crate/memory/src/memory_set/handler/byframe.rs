@@ -17,11 +17,33 @@ impl<T: FrameAllocator> MemoryHandler for ByFrame<T> {
     }
 
     fn unmap(&self, pt: &mut PageTable, addr: VirtAddr) {
-        let target = pt.get_entry(addr).expect("fail to get entry").target();
-        self.allocator.dealloc(target);
+        let entry = pt.get_entry(addr).expect("fail to get entry");
+        if unshare_page(entry, &self.allocator) {
+            self.allocator.dealloc(entry.target());
+        }
         pt.unmap(addr);
     }
 
+    fn map_range(&self, pt: &mut PageTable, start: VirtAddr, end: VirtAddr, attr: &MemoryAttr) {
+        let mut addr = Page::of_addr(start).start_address();
+        while addr < end {
+            if huge::huge_page_in(addr, start, end) == Some(addr)
+                && huge::map_huge(pt, addr, attr, &self.allocator)
+            {
+                addr += HUGE_PAGE_SIZE;
+                continue;
+            }
+            self.map(pt, addr, attr);
+            addr += PAGE_SIZE;
+        }
+    }
+
+    fn unmap_range(&self, pt: &mut PageTable, start: VirtAddr, end: VirtAddr) {
+        huge::unmap_range(pt, start, end, &self.allocator, |pt, addr| {
+            self.unmap(pt, addr)
+        });
+    }
+
     fn clone_map(
         &self,
         pt: &mut PageTable,
@@ -29,13 +51,18 @@ impl<T: FrameAllocator> MemoryHandler for ByFrame<T> {
         addr: VirtAddr,
         attr: &MemoryAttr,
     ) {
+        if share_page(pt, src_pt, addr, !attr.readonly, &self.allocator, |entry| {
+            attr.apply(entry)
+        }) {
+            return;
+        }
         self.map(pt, addr, attr);
         let data = src_pt.get_page_slice_mut(addr);
         pt.get_page_slice_mut(addr).copy_from_slice(data);
     }
 
-    fn handle_page_fault(&self, _pt: &mut PageTable, _addr: VirtAddr) -> bool {
-        false
+    fn handle_page_fault(&self, pt: &mut PageTable, addr: VirtAddr) -> bool {
+        handle_cow_fault(pt, addr, &self.allocator)
     }
 }
 
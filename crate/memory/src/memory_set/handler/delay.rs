@@ -18,7 +18,7 @@ impl<T: FrameAllocator> MemoryHandler for Delay<T> {
 
     fn unmap(&self, pt: &mut PageTable, addr: VirtAddr) {
         let entry = pt.get_entry(addr).expect("failed to get entry");
-        if entry.present() {
+        if entry.present() && unshare_page(entry) {
             self.allocator.dealloc(entry.target());
         }
 
@@ -27,6 +27,12 @@ impl<T: FrameAllocator> MemoryHandler for Delay<T> {
         pt.unmap(addr);
     }
 
+    fn unmap_range(&self, pt: &mut PageTable, start: VirtAddr, end: VirtAddr) {
+        huge::unmap_range(pt, start, end, &self.allocator, |pt, addr| {
+            self.unmap(pt, addr)
+        });
+    }
+
     fn clone_map(
         &self,
         pt: &mut PageTable,
@@ -34,6 +40,9 @@ impl<T: FrameAllocator> MemoryHandler for Delay<T> {
         addr: VirtAddr,
         attr: &MemoryAttr,
     ) {
+        if share_page(pt, src_pt, addr, !attr.readonly, |entry| attr.apply(entry)) {
+            return;
+        }
         let entry = src_pt.get_entry(addr).expect("failed to get entry");
         if entry.present() {
             // eager map and copy data
@@ -49,6 +58,9 @@ impl<T: FrameAllocator> MemoryHandler for Delay<T> {
     }
 
     fn handle_page_fault(&self, pt: &mut PageTable, addr: VirtAddr) -> bool {
+        if handle_cow_fault(pt, addr, &self.allocator) {
+            return true;
+        }
         let entry = pt.get_entry(addr).expect("failed to get entry");
         if entry.present() {
             // not a delay case
@@ -65,10 +77,68 @@ impl<T: FrameAllocator> MemoryHandler for Delay<T> {
         }
         true
     }
+
+    fn handle_page_fault_in(
+        &self,
+        pt: &mut PageTable,
+        addr: VirtAddr,
+        start: VirtAddr,
+        end: VirtAddr,
+        attr: &MemoryAttr,
+    ) -> bool {
+        if let Some(base) = huge::huge_page_in(addr, start, end) {
+            if self.fault_huge(pt, base, attr) {
+                return true;
+            }
+        }
+        self.handle_page_fault(pt, addr)
+    }
 }
 
 impl<T: FrameAllocator> Delay<T> {
     pub fn new(allocator: T) -> Self {
         Delay { allocator }
     }
+
+    /// Map the huge page at `base` on the first fault in it,
+    /// if none of its pages has been mapped yet
+    fn fault_huge(&self, pt: &mut PageTable, base: VirtAddr, attr: &MemoryAttr) -> bool {
+        if !pt.huge_page_enabled() {
+            return false;
+        }
+        let end = base + HUGE_PAGE_SIZE;
+        for page in Page::range_of(base, end) {
+            match pt.get_entry(page.start_address()) {
+                Some(entry) if !entry.present() => {}
+                _ => return false,
+            }
+        }
+        let frames = huge::HUGE_PAGE_FRAMES;
+        let target = match self.allocator.alloc_contiguous(frames, HUGE_PAGE_SIZE) {
+            Some(target) => target,
+            None => return false,
+        };
+        // the delay entries are replaced by the huge one
+        for page in Page::range_of(base, end) {
+            let entry = pt.get_entry(page.start_address()).unwrap();
+            entry.set_present(true);
+            pt.unmap(page.start_address());
+        }
+        match pt.map_huge(base, target) {
+            Some(entry) => attr.apply(entry),
+            None => {
+                for page in Page::range_of(base, end) {
+                    self.map(pt, page.start_address(), attr);
+                }
+                self.allocator.dealloc_contiguous(target, frames);
+                return false;
+            }
+        }
+        for page in Page::range_of(base, end) {
+            for x in pt.get_page_slice_mut(page.start_address()) {
+                *x = 0;
+            }
+        }
+        true
+    }
 }
@@ -12,6 +12,19 @@ pub struct File<F, T> {
 
 pub trait Read: Clone + Send + Sync + 'static {
     fn read_at(&self, offset: usize, buf: &mut [u8]) -> usize;
+
+    /// Get a frame holding the page at `offset`, which can be mapped readonly
+    /// by multiple page tables. It is held until `put_page`.
+    /// Return None if not supported.
+    fn get_page(&self, _offset: usize) -> Option<PhysAddr> {
+        None
+    }
+
+    /// Release a frame got from `get_page`.
+    /// Return false if `frame` is not from `get_page`.
+    fn put_page(&self, _frame: PhysAddr) -> bool {
+        false
+    }
 }
 
 impl<F: Read, T: FrameAllocator> MemoryHandler for File<F, T> {
@@ -27,7 +40,10 @@ impl<F: Read, T: FrameAllocator> MemoryHandler for File<F, T> {
 
     fn unmap(&self, pt: &mut PageTable, addr: usize) {
         let entry = pt.get_entry(addr).expect("failed to get entry");
-        if entry.present() {
+        if entry.present()
+            && unshare_page(entry, &self.allocator)
+            && !self.file.put_page(entry.target())
+        {
             self.allocator.dealloc(entry.target());
         }
 
@@ -43,6 +59,14 @@ impl<F: Read, T: FrameAllocator> MemoryHandler for File<F, T> {
         addr: usize,
         attr: &MemoryAttr,
     ) {
+        // readonly pages are refilled from the shared page by fault
+        if !attr.readonly
+            && share_page(pt, src_pt, addr, true, &self.allocator, |entry| {
+                attr.apply(entry)
+            })
+        {
+            return;
+        }
         let entry = src_pt.get_entry(addr).expect("failed to get entry");
         if entry.present() && !attr.readonly {
             // eager map and copy data
@@ -58,11 +82,27 @@ impl<F: Read, T: FrameAllocator> MemoryHandler for File<F, T> {
     }
 
     fn handle_page_fault(&self, pt: &mut PageTable, addr: usize) -> bool {
+        if handle_cow_fault(pt, addr, &self.allocator) {
+            return true;
+        }
         let addr = addr & !(PAGE_SIZE - 1);
         let entry = pt.get_entry(addr).expect("failed to get entry");
         if entry.present() {
             return false;
         }
+        // map the shared page if the whole page is in the file
+        let file_offset = addr + self.file_start - self.mem_start;
+        if !entry.writable()
+            && file_offset % PAGE_SIZE == 0
+            && file_offset + PAGE_SIZE <= self.file_end
+        {
+            if let Some(frame) = self.file.get_page(file_offset) {
+                entry.set_target(frame);
+                entry.set_present(true);
+                entry.update();
+                return true;
+            }
+        }
         let frame = self.allocator.alloc().expect("failed to alloc frame");
         entry.set_target(frame);
         entry.set_present(true);
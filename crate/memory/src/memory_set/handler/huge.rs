@@ -0,0 +1,75 @@
+//! Transparent huge pages for handlers backed by a `FrameAllocator`
+//!
+//! Aligned `HUGE_PAGE_SIZE` ranges inside an area are mapped by one entry
+//! with contiguous frames when the allocator and the page table can,
+//! otherwise by pages as usual.
+//! A huge page only partly unmapped, or cloned by fork, is split into pages first.
+
+use super::*;
+
+/// Number of pages in a huge page
+pub const HUGE_PAGE_FRAMES: usize = HUGE_PAGE_SIZE / PAGE_SIZE;
+
+/// Start of the huge page around `addr`, if it is inside [`start`, `end`)
+pub fn huge_page_in(addr: VirtAddr, start: VirtAddr, end: VirtAddr) -> Option<VirtAddr> {
+    let base = addr & !(HUGE_PAGE_SIZE - 1);
+    if base >= start && base + HUGE_PAGE_SIZE <= end {
+        Some(base)
+    } else {
+        None
+    }
+}
+
+/// Map a huge page at `addr` to new frames from `allocator`.
+/// Return false if there are no contiguous frames or the page table refuses.
+pub fn map_huge(
+    pt: &mut PageTable,
+    addr: VirtAddr,
+    attr: &MemoryAttr,
+    allocator: &impl FrameAllocator,
+) -> bool {
+    if !pt.huge_page_enabled() {
+        return false;
+    }
+    let target = match allocator.alloc_contiguous(HUGE_PAGE_FRAMES, HUGE_PAGE_SIZE) {
+        Some(target) => target,
+        None => return false,
+    };
+    match pt.map_huge(addr, target) {
+        Some(entry) => {
+            attr.apply(entry);
+            true
+        }
+        None => {
+            allocator.dealloc_contiguous(target, HUGE_PAGE_FRAMES);
+            false
+        }
+    }
+}
+
+/// Unmap [`start`, `end`) with frames from `allocator`.
+/// Huge pages inside the range are freed at once,
+/// the others are split and `unmap` is called for each page.
+pub fn unmap_range(
+    pt: &mut PageTable,
+    start: VirtAddr,
+    end: VirtAddr,
+    allocator: &impl FrameAllocator,
+    mut unmap: impl FnMut(&mut PageTable, VirtAddr),
+) {
+    let mut addr = Page::of_addr(start).start_address();
+    while addr < end {
+        if pt.is_huge(addr) {
+            if huge_page_in(addr, addr, end) == Some(addr) {
+                let target = pt.get_entry(addr).expect("failed to get entry").target();
+                pt.unmap_huge(addr);
+                allocator.dealloc_contiguous(target, HUGE_PAGE_FRAMES);
+                addr += HUGE_PAGE_SIZE;
+                continue;
+            }
+            pt.split_huge(addr);
+        }
+        unmap(pt, addr);
+        addr += PAGE_SIZE;
+    }
+}
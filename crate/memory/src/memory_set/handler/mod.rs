@@ -1,4 +1,5 @@
 use super::*;
+use crate::cow::{handle_cow_fault, share_page, unshare_page};
 
 // here may be a interesting part for lab
 pub trait MemoryHandler: Debug + Send + Sync + 'static {
@@ -11,7 +12,23 @@ pub trait MemoryHandler: Debug + Send + Sync + 'static {
     /// Unmap `addr` in the page table
     fn unmap(&self, pt: &mut PageTable, addr: VirtAddr);
 
+    /// Map all pages in [`start`, `end`)
+    /// Handlers may map aligned ranges with huge pages here.
+    fn map_range(&self, pt: &mut PageTable, start: VirtAddr, end: VirtAddr, attr: &MemoryAttr) {
+        for page in Page::range_of(start, end) {
+            self.map(pt, page.start_address(), attr);
+        }
+    }
+
+    /// Unmap all pages in [`start`, `end`)
+    fn unmap_range(&self, pt: &mut PageTable, start: VirtAddr, end: VirtAddr) {
+        for page in Page::range_of(start, end) {
+            self.unmap(pt, page.start_address());
+        }
+    }
+
     /// Clone map `addr` from page table `src_pt` to `pt`.
+    /// Present pages may be shared copy-on-write, see `crate::cow::share_page`.
     fn clone_map(
         &self,
         pt: &mut PageTable,
@@ -23,6 +40,19 @@ pub trait MemoryHandler: Debug + Send + Sync + 'static {
     /// Handle page fault on `addr`
     /// Return true if success, false if error
     fn handle_page_fault(&self, pt: &mut PageTable, addr: VirtAddr) -> bool;
+
+    /// Handle page fault on `addr` in the area [`start`, `end`) with `attr`
+    /// Handlers may map the whole huge page around `addr` here.
+    fn handle_page_fault_in(
+        &self,
+        pt: &mut PageTable,
+        addr: VirtAddr,
+        _start: VirtAddr,
+        _end: VirtAddr,
+        _attr: &MemoryAttr,
+    ) -> bool {
+        self.handle_page_fault(pt, addr)
+    }
 }
 
 impl Clone for Box<MemoryHandler> {
@@ -34,11 +64,31 @@ impl Clone for Box<MemoryHandler> {
 pub trait FrameAllocator: Debug + Clone + Send + Sync + 'static {
     fn alloc(&self) -> Option<PhysAddr>;
     fn dealloc(&self, target: PhysAddr);
+
+    /// Allocate `count` contiguous frames aligned to `align` bytes
+    /// Return `None` if not supported or there is no such free range.
+    fn alloc_contiguous(&self, _count: usize, _align: usize) -> Option<PhysAddr> {
+        None
+    }
+
+    /// Deallocate `count` contiguous frames from `alloc_contiguous`
+    fn dealloc_contiguous(&self, target: PhysAddr, count: usize) {
+        for i in 0..count {
+            self.dealloc(target + i * PAGE_SIZE);
+        }
+    }
+
+    /// Run `f` with interrupts disabled on current CPU,
+    /// so the spinlocks taken in `f` are not held across preemption.
+    fn no_irq<R>(&self, f: impl FnOnce() -> R) -> R {
+        f()
+    }
 }
 
 mod byframe;
 mod delay;
 mod file;
+mod huge;
 mod linear;
 //mod swap;
 
@@ -57,16 +57,27 @@ impl MemoryArea {
         let p3 = Page::of_addr(end_addr - 1) + 1;
         !(p1 <= p2 || p0 >= p3)
     }
+    /// Name given when the area is pushed
+    pub fn name(&self) -> &'static str {
+        self.name
+    }
     /// Map all pages in the area to page table `pt`
     fn map(&self, pt: &mut PageTable) {
-        for page in Page::range_of(self.start_addr, self.end_addr) {
-            self.handler.map(pt, page.start_address(), &self.attr);
-        }
+        self.handler
+            .map_range(pt, self.start_addr, self.end_addr, &self.attr);
     }
     /// Unmap all pages in the area from page table `pt`
     fn unmap(&self, pt: &mut PageTable) {
-        for page in Page::range_of(self.start_addr, self.end_addr) {
-            self.handler.unmap(pt, page.start_address());
+        self.handler.unmap_range(pt, self.start_addr, self.end_addr);
+    }
+    /// Split the huge pages in the area of page table `pt` into pages
+    fn split_huge(&self, pt: &mut PageTable) {
+        let mut addr = (self.start_addr + HUGE_PAGE_SIZE - 1) & !(HUGE_PAGE_SIZE - 1);
+        while addr + HUGE_PAGE_SIZE <= self.end_addr {
+            if pt.is_huge(addr) {
+                pt.split_huge(addr);
+            }
+            addr += HUGE_PAGE_SIZE;
         }
     }
 }
@@ -178,11 +189,17 @@ impl<T: PageTableExt> MemorySet<T> {
     /// Return the start address of found free area.
     /// Used for mmap.
     pub fn find_free_area(&self, addr_hint: usize, len: usize) -> VirtAddr {
+        // align large areas to huge pages, so that they may be mapped by them
+        let align = if len >= HUGE_PAGE_SIZE {
+            HUGE_PAGE_SIZE
+        } else {
+            PAGE_SIZE
+        };
         // brute force:
         // try each area's end address as the start
         core::iter::once(addr_hint)
             .chain(self.areas.iter().map(|area| area.end_addr))
-            .map(|addr| (addr + PAGE_SIZE - 1) & !(PAGE_SIZE - 1)) // round up a page
+            .map(|addr| (addr + align - 1) & !(align - 1)) // round up
             .find(|&addr| self.test_free_area(addr, addr + len))
             .expect("failed to find free area ???")
     }
@@ -215,6 +232,7 @@ impl<T: PageTableExt> MemorySet<T> {
             name,
         };
         area.map(&mut self.page_table);
+        self.page_table.flush_batch();
         // keep order by start address
         let idx = self
             .areas
@@ -233,6 +251,7 @@ impl<T: PageTableExt> MemorySet<T> {
             if self.areas[i].start_addr == start_addr && self.areas[i].end_addr == end_addr {
                 let area = self.areas.remove(i);
                 area.unmap(&mut self.page_table);
+                self.page_table.flush_batch();
                 return;
             }
         }
@@ -324,6 +343,7 @@ impl<T: PageTableExt> MemorySet<T> {
             }
             i += 1;
         }
+        self.page_table.flush_batch();
     }
 
     /// Get iterator of areas
@@ -355,6 +375,7 @@ impl<T: PageTableExt> MemorySet<T> {
         for area in areas.iter() {
             area.unmap(page_table);
         }
+        page_table.flush_batch();
         areas.clear();
     }
 
@@ -376,10 +397,18 @@ impl<T: PageTableExt> MemorySet<T> {
 
     pub fn handle_page_fault(&mut self, addr: VirtAddr) -> bool {
         let area = self.areas.iter().find(|area| area.contains(addr));
-        match area {
-            Some(area) => area.handler.handle_page_fault(&mut self.page_table, addr),
+        let handled = match area {
+            Some(area) => area.handler.handle_page_fault_in(
+                &mut self.page_table,
+                addr,
+                area.start_addr,
+                area.end_addr,
+                &area.attr,
+            ),
             None => false,
-        }
+        };
+        self.page_table.flush_batch();
+        handled
     }
 
     pub fn clone(&mut self) -> Self {
@@ -390,6 +419,8 @@ impl<T: PageTableExt> MemorySet<T> {
             ..
         } = self;
         for area in areas.iter() {
+            // huge pages are shared copy-on-write by pages
+            area.split_huge(page_table);
             for page in Page::range_of(area.start_addr, area.end_addr) {
                 area.handler.clone_map(
                     &mut new_page_table,
@@ -399,6 +430,8 @@ impl<T: PageTableExt> MemorySet<T> {
                 );
             }
         }
+        // pages of the parent are write-protected for copy-on-write
+        page_table.flush_batch();
         MemorySet {
             areas: areas.clone(),
             page_table: new_page_table,
@@ -26,6 +26,41 @@ pub trait PageTable {
     /// Get a mutable reference of the content of a page of virtual address `addr`
     fn get_page_slice_mut<'a>(&mut self, addr: VirtAddr) -> &'a mut [u8];
 
+    /// Whether huge pages can be mapped by `map_huge`
+    fn huge_page_enabled(&self) -> bool {
+        false
+    }
+
+    /// Map a huge page of virual address `addr` to the contiguous frames from `target`,
+    /// both aligned to `HUGE_PAGE_SIZE`.
+    /// Return `None` if huge pages are not supported, or a page in the range is mapped.
+    fn map_huge(&mut self, _addr: VirtAddr, _target: PhysAddr) -> Option<&mut Entry> {
+        None
+    }
+
+    /// Unmap a huge page of virual address `addr`.
+    /// Only called for pages mapped by `map_huge`, so never without huge page support.
+    fn unmap_huge(&mut self, _addr: VirtAddr) {
+        unreachable!("huge pages not supported")
+    }
+
+    /// Whether `addr` is mapped by a huge page
+    fn is_huge(&mut self, _addr: VirtAddr) -> bool {
+        false
+    }
+
+    /// Split the huge page of `addr` into pages, mapping the same frames with the same flags.
+    /// Only called when `is_huge` is true, so never without huge page support.
+    fn split_huge(&mut self, _addr: VirtAddr) {
+        unreachable!("huge pages not supported")
+    }
+
+    /// Flush the entries changed since last call on the other CPUs using this table
+    ///
+    /// Changes are flushed on current CPU at once, but remote CPUs are only
+    /// interrupted here, once for a whole operation.
+    fn flush_batch(&mut self) {}
+
     /// Read data from virtual address `addr`
     /// Used for testing with mock
     fn read(&mut self, _addr: VirtAddr) -> u8 {
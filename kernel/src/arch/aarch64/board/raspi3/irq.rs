@@ -9,8 +9,7 @@ static IRQ_HANDLERS: &'static [Option<fn()>; 64] = &[None; 64];
 pub fn handle_irq(_tf: &mut TrapFrame) {
     let controller = bcm2837::timer::Timer::new();
     if controller.is_pending() {
-        super::timer::set_next();
-        crate::trap::timer();
+        crate::hrtimer::interrupt();
     }
 
     for int in Controller::new().pending_interrupts() {
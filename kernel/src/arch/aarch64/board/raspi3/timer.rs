@@ -17,3 +17,9 @@ pub fn get_cycle() -> u64 {
 pub fn set_next() {
     Timer::new().tick_in(10 * 1000);
 }
+
+/// Set next timer interrupt at `cycle` microseconds, or 1 second from now at most.
+pub fn set_deadline(cycle: u64) {
+    let delay = cycle.saturating_sub(get_cycle()).max(1).min(1000 * 1000);
+    Timer::new().tick_in(delay as usize);
+}
@@ -1,3 +1,16 @@
+pub use super::board::timer::get_cycle;
+
 pub fn read_epoch() -> u64 {
     0
 }
+
+/// Frequency of `get_cycle`, the board timer counts microseconds
+pub fn cycle_freq() -> u64 {
+    1000 * 1000
+}
+
+/// Program the timer interrupt at `cycle` of the board timer
+pub fn set_deadline(cycle: u64) -> bool {
+    super::board::timer::set_deadline(cycle);
+    true
+}
@@ -15,6 +15,23 @@ pub fn init() {
     info!("timer: init end");
 }
 
+/// The count register restarts at every tick, so there is no cycle clock
+pub fn get_cycle() -> u64 {
+    0
+}
+
+/// Frequency of `get_cycle`, 0 as there is none
+pub fn cycle_freq() -> u64 {
+    0
+}
+
+/// The compare register can only be set for the next tick.
+/// Return false as the timer is periodic.
+pub fn set_deadline(_cycle: u64) -> bool {
+    set_next();
+    false
+}
+
 /// Set the next timer interrupt
 pub fn set_next() {
     // 100Hz @ QEMU
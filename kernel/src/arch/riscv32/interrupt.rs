@@ -113,8 +113,7 @@ fn ipi() {
 }
 
 fn timer() {
-    super::timer::set_next();
-    crate::trap::timer();
+    crate::hrtimer::interrupt();
 }
 
 fn syscall(tf: &mut TrapFrame) {
@@ -29,14 +29,30 @@ pub fn init() {
     // Enable supervisor timer interrupt
     unsafe {
         sie::set_stimer();
+        // allow `rdtime` in user mode for the vDSO: scounteren.TM
+        asm!("csrsi 0x106, 2" :::: "volatile");
     }
     set_next();
     info!("timer: init end");
 }
 
+/// Frequency of the `time` CSR, 250000 cycles per 10ms tick as `set_next` assumes
+const TIMEBASE_FREQ: u64 = 25_000_000;
+
+/// Frequency of `get_cycle`
+pub fn cycle_freq() -> u64 {
+    TIMEBASE_FREQ
+}
+
 /// Set the next timer interrupt
 pub fn set_next() {
     // 100Hz @ QEMU
     let timebase = 250000;
     sbi::set_timer(get_cycle() + timebase);
 }
+
+/// Program the timer interrupt of this hart at `cycle` of the `time` CSR
+pub fn set_deadline(cycle: u64) -> bool {
+    sbi::set_timer(cycle);
+    true
+}
@@ -0,0 +1,108 @@
+# vDSO text for riscv32 and riscv64, see `vdso/vdso.asm`
+#
+# `rdtime` is allowed in U-mode by `scounteren`, set in `timer::init`.
+
+.equ VDSO_MACHINE,      243     # EM_RISCV
+.equ SYS_CLOCK_GETTIME, 113
+
+.macro VDSO_TEXT
+
+.equ VDSO_CYCLE_LAST_HI, VDSO_CYCLE_LAST + 4
+
+# int __vdso_clock_gettime(clockid_t clock, struct timespec *ts)
+#
+# Every clock reads the realtime clock, like `sys_clock_gettime`.
+__vdso_clock_gettime:
+    lla t0, vdso_start
+    li t1, -VDSO_DATA
+    sub t0, t0, t1
+1:
+    lw t1, VDSO_SEQ(t0)
+    andi t2, t1, 1
+    bnez t2, 1b
+    fence r, r
+    lw t2, VDSO_ENABLED(t0)
+    beqz t2, 5f
+
+.if VDSO_PTRSIZE == 8
+    rdtime t2
+    ld t3, VDSO_CYCLE_LAST(t0)
+    # the time of this hart may be behind the one which wrote the data
+    bgeu t2, t3, 2f
+    mv t2, t3
+2:
+    sub t2, t2, t3
+    # 128-bit delta * mult >> shift
+    lwu t3, VDSO_MULT(t0)
+    mulhu t4, t2, t3
+    mul t2, t2, t3
+    lw t3, VDSO_SHIFT(t0)
+    srl t2, t2, t3
+    li t5, 64
+    sub t5, t5, t3
+    sll t4, t4, t5
+    or t2, t2, t4
+    lwu t3, VDSO_NSEC(t0)
+    add t2, t2, t3
+    ld t4, VDSO_SEC(t0)
+    fence r, r
+    lw t3, VDSO_SEQ(t0)
+    bne t1, t3, 1b
+    li t3, NSEC_PER_SEC
+    divu t5, t2, t3
+    remu t2, t2, t3
+    add t4, t4, t5
+    sd t4, 0(a1)
+    sd t2, 8(a1)
+.else
+    # 64-bit time, read until the high word is stable
+3:
+    rdtimeh t3
+    rdtime t2
+    rdtimeh t4
+    bne t3, t4, 3b
+    lw t5, VDSO_CYCLE_LAST(t0)
+    lw t6, VDSO_CYCLE_LAST_HI(t0)
+    sltu t4, t2, t5
+    sub t2, t2, t5
+    sub t3, t3, t6
+    sub t3, t3, t4
+    # without 64-bit division, leave deltas of 2^32 cycles or 2^31 ns to the
+    # kernel, which only happen if every hart was idle for long
+    bnez t3, 5f
+    lw t5, VDSO_MULT(t0)
+    mulhu t3, t2, t5
+    mul t2, t2, t5
+    lw t5, VDSO_SHIFT(t0)
+    srl t2, t2, t5
+    srl t4, t3, t5
+    bnez t4, 5f
+    li t4, 32
+    sub t4, t4, t5
+    sll t3, t3, t4
+    or t2, t2, t3
+    bltz t2, 5f
+    lw t3, VDSO_NSEC(t0)
+    add t2, t2, t3
+    lw t4, VDSO_SEC(t0)
+    fence r, r
+    lw t3, VDSO_SEQ(t0)
+    bne t1, t3, 1b
+    li t3, NSEC_PER_SEC
+4:
+    bltu t2, t3, 6f
+    sub t2, t2, t3
+    addi t4, t4, 1
+    j 4b
+6:
+    sw t4, 0(a1)
+    sw t2, 4(a1)
+.endif
+    li a0, 0
+    ret
+5:
+    li a7, SYS_CLOCK_GETTIME
+    ecall
+    ret
+
+.endm
@@ -40,6 +40,8 @@ pub fn init() {
         Cr0::update(|cr0| {
             cr0.remove(Cr0Flags::EMULATE_COPROCESSOR);
             cr0.insert(Cr0Flags::MONITOR_COPROCESSOR);
+            // fault on kernel writes to readonly user pages, required by copy-on-write
+            cr0.insert(Cr0Flags::WRITE_PROTECT);
         });
     }
 }
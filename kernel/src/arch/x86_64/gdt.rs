@@ -39,6 +39,11 @@ impl Cpu {
         unsafe { CPUS[super::cpu::id()].as_mut().unwrap() }
     }
 
+    /// Current CPU, or None if it is not initialized yet
+    pub fn try_current() -> Option<&'static Self> {
+        unsafe { CPUS[super::cpu::id()].as_ref() }
+    }
+
     fn new() -> Self {
         Cpu {
             gdt: GlobalDescriptorTable::new(),
@@ -68,6 +73,21 @@ impl Cpu {
             handler();
         }
     }
+    /// Like `handle_ipi`, but return at once if the queue is busy
+    pub fn try_handle_ipi(&self) {
+        let mut queue = match self.ipi_handler_queue.try_lock() {
+            Some(queue) => queue,
+            None => return,
+        };
+        if queue.is_empty() {
+            return;
+        }
+        let handlers = core::mem::replace(queue.as_mut(), vec![]);
+        drop(queue);
+        for handler in handlers {
+            handler();
+        }
+    }
     pub fn disable_preemption(&self) -> bool {
         self.preemption_disabled.swap(true, Ordering::Relaxed)
     }
@@ -90,7 +90,7 @@ pub extern "C" fn rust_trap(tf: &mut TrapFrame) {
             let irq = tf.trap_num as u8 - IRQ0;
             super::ack(irq); // must ack before switching
             match irq {
-                Timer => crate::trap::timer(),
+                Timer => crate::hrtimer::interrupt(),
                 Keyboard => keyboard(),
                 COM1 => com1(),
                 COM2 => com2(),
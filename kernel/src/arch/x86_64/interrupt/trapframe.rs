@@ -135,14 +135,20 @@ pub struct Context(usize);
 impl Context {
     /// Switch to another kernel thread.
     ///
-    /// Defined in `trap.asm`.
-    ///
+    /// The page table of target is recorded as active on current CPU first,
+    /// so that TLB shootdowns of it will reach this CPU.
+    pub unsafe fn switch(&mut self, target: &mut Self) {
+        let data = &*(target.0 as *const ContextData);
+        crate::arch::paging::set_active_token(data.cr3);
+        self.switch_to(target);
+    }
+
     /// Push all callee-saved registers at the current kernel stack.
     /// Store current rsp, switch to target.
     /// Pop all callee-saved registers, then return to the target.
     #[naked]
     #[inline(never)]
-    pub unsafe extern "C" fn switch(&mut self, _target: &mut Self) {
+    unsafe extern "C" fn switch_to(&mut self, _target: &mut Self) {
         asm!(
         "
         // push rip (by caller)
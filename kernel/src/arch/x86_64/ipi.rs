@@ -14,14 +14,23 @@ unsafe fn get_apic() -> XApic {
 }
 
 pub fn invoke_on_allcpu(f: impl Fn() + 'static, wait: bool) {
+    invoke_on_cpus(!0, f, wait);
+}
+
+/// Invoke `f` on the CPUs whose bit is set in `cpus`.
+///
+/// Functions may run while the target CPU is spinning for a lock,
+/// so they must not take any lock themselves.
+pub fn invoke_on_cpus(cpus: usize, f: impl Fn() + 'static, wait: bool) {
     // Step 1: initialize
     use super::interrupt::consts::IPIFuncCall;
     let mut apic = unsafe { get_apic() };
     let func = Arc::new(f);
-    let cpu_count = super::gdt::Cpu::iter().count();
+    let targets = || super::gdt::Cpu::iter().filter(move |cpu| cpus & (1 << cpu.id()) != 0);
+    let cpu_count = targets().count();
     let rest_count = Arc::new(AtomicU8::new(cpu_count as u8));
     // Step 2: invoke
-    for cpu in super::gdt::Cpu::iter() {
+    for cpu in targets() {
         let func_clone = func.clone();
         let rest_clone = rest_count.clone();
         cpu.notify_event(Box::new(move || {
@@ -31,9 +40,21 @@ pub fn invoke_on_allcpu(f: impl Fn() + 'static, wait: bool) {
         apic.send_ipi(cpu.id() as u8, IPIFuncCall);
     }
     if wait {
-        // spin if remote invocation do not complete
+        // spin if remote invocation do not complete,
+        // serving other CPUs which may be waiting for us as well
         while rest_count.load(Ordering::Relaxed) != 0 {
+            poll();
             spin_loop_hint();
         }
     }
 }
+
+/// Run the functions queued for current CPU without waiting for the interrupt.
+///
+/// Called when spinning with interrupts disabled, or two CPUs waiting for
+/// each other's IPI would deadlock.
+pub fn poll() {
+    if let Some(cpu) = super::gdt::Cpu::try_current() {
+        cpu.try_handle_ipi();
+    }
+}
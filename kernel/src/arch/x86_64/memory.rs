@@ -1,11 +1,18 @@
 use super::{BootInfo, MemoryRegionType};
-use crate::memory::{init_heap, FRAME_ALLOCATOR};
+use crate::consts::PHYSICAL_MEMORY_OFFSET;
+use crate::memory::{alloc_frame, init_heap, phys_to_virt, FRAME_ALLOCATOR};
 use bitmap_allocator::BitAlloc;
 use rcore_memory::paging::*;
+use rcore_memory::HUGE_PAGE_SIZE;
+use x86_64::instructions::tlb;
+use x86_64::registers::control::Cr3;
+use x86_64::structures::paging::{PageTable as x86PageTable, PageTableFlags as EF};
+use x86_64::PhysAddr;
 
 pub fn init(boot_info: &BootInfo) {
     init_frame_allocator(boot_info);
     init_heap();
+    remap_physical_memory();
     info!("memory: init end");
 }
 
@@ -20,3 +27,39 @@ fn init_frame_allocator(boot_info: &BootInfo) {
         }
     }
 }
+
+/// Remap the physical memory at PHYSICAL_MEMORY_OFFSET with 2 MiB pages.
+///
+/// Every GiB mapped by the bootloader, including the MMIO holes used by drivers,
+/// is mapped again, so the linear map costs few TLB entries and page table frames.
+/// New page tables are forked from the active one, so they share this mapping.
+fn remap_physical_memory() {
+    let table = |paddr: u64| unsafe { &mut *(phys_to_virt(paddr as usize) as *mut x86PageTable) };
+    let p4 = table(Cr3::read().0.start_address().as_u64());
+    let p4_index = (PHYSICAL_MEMORY_OFFSET >> 39) & 0o777;
+    let old_p3 = table(p4[p4_index].addr().as_u64());
+
+    let new_p3_paddr = alloc_frame().expect("failed to allocate frame") as u64;
+    let new_p3 = table(new_p3_paddr);
+    new_p3.zero();
+    let flags = EF::PRESENT | EF::WRITABLE | EF::GLOBAL | EF::NO_EXECUTE | EF::HUGE_PAGE;
+    let mut count = 0;
+    for i in 0..512 {
+        if !old_p3[i].flags().contains(EF::PRESENT) {
+            continue;
+        }
+        let p2_paddr = alloc_frame().expect("failed to allocate frame") as u64;
+        let p2 = table(p2_paddr);
+        for j in 0..512 {
+            let paddr = (i << 30) + j * HUGE_PAGE_SIZE;
+            p2[j].set_addr(PhysAddr::new(paddr as u64), flags);
+        }
+        new_p3[i].set_addr(PhysAddr::new(p2_paddr), EF::PRESENT | EF::WRITABLE);
+        count += 1;
+    }
+    // the old tables belong to the bootloader and are not freed
+    let p4_flags = p4[p4_index].flags();
+    p4[p4_index].set_addr(PhysAddr::new(new_p3_paddr), p4_flags);
+    tlb::flush_all();
+    info!("remap physical memory: {} GiB with 2 MiB pages", count);
+}
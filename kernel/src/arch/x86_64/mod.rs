@@ -54,6 +54,8 @@ pub extern "C" fn _start(boot_info: &'static BootInfo) -> ! {
     gdt::init();
     //get local apic id of cpu
     cpu::init();
+    // measure TSC and switch LAPIC timer to TSC-deadline mode
+    timer::init();
     // Use IOAPIC instead of PIC, use APIC Timer instead of PIT, init serial&keyboard in x86_64
     driver::init(boot_info);
     // init pci/bus-based devices ,e.g. Intel 10Gb NIC, ...
@@ -76,6 +78,7 @@ fn other_start() -> ! {
     gdt::init();
     // init local apic
     cpu::init();
+    timer::init();
     // setup fast syscall in x86_64
     interrupt::fast_syscall::init();
     // call the first main function in kernel.
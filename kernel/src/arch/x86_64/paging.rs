@@ -1,7 +1,12 @@
+use crate::consts::MAX_CPU_NUM;
 use crate::memory::{alloc_frame, dealloc_frame, phys_to_virt};
-use core::sync::atomic::Ordering;
+use alloc::vec::Vec;
+use core::ptr::null_mut;
+use core::sync::atomic::{fence, AtomicUsize, Ordering};
+use lazy_static::*;
 use log::*;
 use rcore_memory::paging::*;
+use rcore_memory::{HUGE_PAGE_SIZE, PAGE_SIZE};
 use x86_64::instructions::tlb;
 use x86_64::registers::control::{Cr3, Cr3Flags};
 use x86_64::structures::paging::{
@@ -42,9 +47,15 @@ pub struct PageTableImpl(
     MappedPageTable<'static, fn(Frame) -> *mut x86PageTable>,
     PageEntry,
     Frame,
+    TlbBatch,
 );
 
-pub struct PageEntry(&'static mut PageTableEntry, Page, Frame);
+/// The last field is the batch to record the page in when it is updated,
+/// null if the entry was not present, so no CPU can have cached it.
+pub struct PageEntry(&'static mut PageTableEntry, Page, Frame, *mut TlbBatch);
+
+// The batch pointer is only used while the page table is borrowed
+unsafe impl Send for PageEntry {}
 
 impl PageTable for PageTableImpl {
     fn map(&mut self, addr: usize, target: usize) -> &mut Entry {
@@ -60,13 +71,15 @@ impl PageTable for PageTableImpl {
                 .unwrap()
                 .flush();
         }
-        flush_tlb_all(addr);
-        self.get_entry(addr).unwrap()
+        self.get_entry(addr).unwrap();
+        // a new entry is not cached by other CPUs
+        self.1 .3 = null_mut();
+        &mut self.1
     }
 
     fn unmap(&mut self, addr: usize) {
         self.0.unmap(Page::of_addr(addr)).unwrap().1.flush();
-        flush_tlb_all(addr);
+        self.3.add(addr, addr + PAGE_SIZE);
     }
 
     fn get_entry(&mut self, addr: usize) -> Option<&mut Entry> {
@@ -76,22 +89,124 @@ impl PageTable for PageTableImpl {
             let entry = unsafe { &mut (&mut *page_table)[index] };
             if level == 3 {
                 let page = Page::of_addr(addr);
-                self.1 = PageEntry(entry, page, self.2);
+                let batch = self.batch_of(entry);
+                self.1 = PageEntry(entry, page, self.2, batch);
                 return Some(&mut self.1 as &mut Entry);
             }
             if !entry.flags().contains(EF::PRESENT) {
                 return None;
             }
+            if level == 2 && entry.flags().contains(EF::HUGE_PAGE) {
+                let page = Page::of_addr(addr);
+                let batch = self.batch_of(entry);
+                self.1 = PageEntry(entry, page, self.2, batch);
+                return Some(&mut self.1 as &mut Entry);
+            }
             page_table = frame_to_page_table(entry.frame().unwrap());
         }
         unreachable!();
     }
 
     fn get_page_slice_mut<'a>(&mut self, addr: usize) -> &'a mut [u8] {
-        let frame = self.0.translate_page(Page::of_addr(addr)).unwrap();
-        let vaddr = phys_to_virt(frame.start_address().as_u64() as usize);
+        let target = self.get_entry(addr).unwrap().target();
+        let vaddr = phys_to_virt(target);
         unsafe { core::slice::from_raw_parts_mut(vaddr as *mut u8, 0x1000) }
     }
+
+    fn huge_page_enabled(&self) -> bool {
+        true
+    }
+
+    fn map_huge(&mut self, addr: usize, target: usize) -> Option<&mut Entry> {
+        let entry = self.get_p2_entry(addr, true)?;
+        if entry.flags().contains(EF::PRESENT) {
+            if entry.flags().contains(EF::HUGE_PAGE) {
+                return None;
+            }
+            // a page table left by unmapped pages can be replaced
+            let table = unsafe { &*frame_to_page_table(entry.frame().unwrap()) };
+            if !(0..512).all(|i| table[i].is_unused()) {
+                return None;
+            }
+            dealloc_frame(entry.addr().as_u64() as usize);
+        }
+        let flags = EF::PRESENT | EF::WRITABLE | EF::NO_EXECUTE | EF::HUGE_PAGE;
+        entry.set_addr(PhysAddr::new(target as u64), flags);
+        tlb::flush(VirtAddr::new(addr as u64));
+        self.get_entry(addr)
+    }
+
+    fn unmap_huge(&mut self, addr: usize) {
+        let entry = self
+            .get_p2_entry(addr, false)
+            .expect("huge page not mapped");
+        entry.set_unused();
+        tlb::flush(VirtAddr::new(addr as u64));
+        self.3.add(addr, addr + HUGE_PAGE_SIZE);
+    }
+
+    fn is_huge(&mut self, addr: usize) -> bool {
+        self.get_p2_entry(addr, false).map_or(false, |entry| {
+            entry.flags().contains(EF::PRESENT | EF::HUGE_PAGE)
+        })
+    }
+
+    fn split_huge(&mut self, addr: usize) {
+        let entry = self
+            .get_p2_entry(addr, false)
+            .expect("huge page not mapped");
+        let target = entry.addr().as_u64() as usize;
+        let flags = entry.flags() - EF::HUGE_PAGE;
+        let frame = Frame::of_addr(alloc_frame().expect("failed to allocate frame"));
+        let table = unsafe { &mut *frame_to_page_table(frame) };
+        for i in 0..512 {
+            table[i].set_addr(PhysAddr::new((target + i * PAGE_SIZE) as u64), flags);
+        }
+        let table_flags = EF::PRESENT | EF::WRITABLE | (flags & EF::USER_ACCESSIBLE);
+        entry.set_addr(frame.start_address(), table_flags);
+        tlb::flush(VirtAddr::new(addr as u64));
+        self.3.add(addr, addr + HUGE_PAGE_SIZE);
+    }
+
+    fn flush_batch(&mut self) {
+        if let Some((start, end)) = self.3.take() {
+            shootdown(self.token(), start, end);
+        }
+    }
+}
+
+impl PageTableImpl {
+    /// Get the entry of `addr` in the second level table (P2), which maps a huge page.
+    /// Missing upper tables are created if `create`.
+    fn get_p2_entry(&mut self, addr: usize, create: bool) -> Option<&'static mut PageTableEntry> {
+        let mut page_table = frame_to_page_table(self.2);
+        for level in 0..3 {
+            let index = (addr >> (12 + (3 - level) * 9)) & 0o777;
+            let entry = unsafe { &mut (&mut *page_table)[index] };
+            if level == 2 {
+                return Some(entry);
+            }
+            if !entry.flags().contains(EF::PRESENT) {
+                if !create {
+                    return None;
+                }
+                let frame = Frame::of_addr(alloc_frame()?);
+                unsafe { (*frame_to_page_table(frame)).zero() };
+                entry.set_addr(frame.start_address(), EF::PRESENT | EF::WRITABLE);
+            }
+            page_table = frame_to_page_table(entry.frame().ok()?);
+        }
+        unreachable!();
+    }
+
+    /// The batch to record changes of `entry` in.
+    /// Other CPUs can only have cached the entry if it was present.
+    fn batch_of(&mut self, entry: &PageTableEntry) -> *mut TlbBatch {
+        match entry.flags().contains(EF::PRESENT) {
+            true => &mut self.3,
+            false => null_mut(),
+        }
+    }
 }
 
 fn frame_to_page_table(frame: Frame) -> *mut x86PageTable {
@@ -104,7 +219,14 @@ impl Entry for PageEntry {
         use x86_64::instructions::tlb::flush;
         let addr = self.1.start_address();
         flush(addr);
-        flush_tlb_all(addr.as_u64() as usize);
+        if !self.3.is_null() {
+            let addr = addr.as_u64() as usize;
+            let size = match self.0.flags().contains(EF::HUGE_PAGE) {
+                true => HUGE_PAGE_SIZE,
+                false => PAGE_SIZE,
+            };
+            unsafe { (*self.3).add(addr, addr + size) };
+        }
     }
     fn accessed(&self) -> bool {
         self.0.flags().contains(EF::ACCESSED)
@@ -131,7 +253,13 @@ impl Entry for PageEntry {
         self.as_flags().set(EF::PRESENT, value);
     }
     fn target(&self) -> usize {
-        self.0.addr().as_u64() as usize
+        let target = self.0.addr().as_u64() as usize;
+        if self.0.flags().contains(EF::HUGE_PAGE) {
+            // the frame of this page in the huge page
+            target + (self.1.start_address().as_u64() as usize & (HUGE_PAGE_SIZE - 1))
+        } else {
+            target
+        }
     }
     fn set_target(&mut self, target: usize) {
         let flags = self.0.flags();
@@ -169,7 +297,7 @@ impl Entry for PageEntry {
                     (self.1.start_address().as_u64() as usize >> (12 + (3 - level) * 9)) & 0o777;
                 let entry = unsafe { &mut (&mut *page_table)[index] };
                 entry.set_flags(entry.flags() | EF::USER_ACCESSIBLE);
-                if level == 3 {
+                if level == 3 || entry.flags().contains(EF::HUGE_PAGE) {
                     return;
                 }
                 page_table = frame_to_page_table(entry.frame().unwrap());
@@ -204,6 +332,7 @@ impl PageTableImpl {
             MappedPageTable::new(table, frame_to_page_table),
             core::mem::MaybeUninit::uninitialized().into_initialized(),
             frame,
+            TlbBatch::default(),
         )
     }
 }
@@ -219,6 +348,7 @@ impl PageTableExt for PageTableImpl {
                 MappedPageTable::new(table, frame_to_page_table),
                 core::mem::MaybeUninit::uninitialized().into_initialized(),
                 frame,
+                TlbBatch::default(),
             )
         }
     }
@@ -242,6 +372,7 @@ impl PageTableExt for PageTableImpl {
     }
 
     unsafe fn set_token(token: usize) {
+        set_active_token(token);
         Cr3::write(
             Frame::containing_address(PhysAddr::new(token as u64)),
             Cr3Flags::empty(),
@@ -278,12 +409,95 @@ impl FrameDeallocator<Size4KiB> for FrameAllocatorForX86 {
     }
 }
 
-/// Flush TLB for `vaddr` on all CPU
-fn flush_tlb_all(vaddr: usize) {
-    // FIXME: too slow, disable now.
-    return;
+/// Range of pages changed in a page table, to be flushed on other CPUs at once
+///
+/// Entries are flushed on current CPU right away. Other CPUs are only
+/// interrupted by `flush_batch` at the end of an operation on the `MemorySet`.
+#[derive(Debug, Default)]
+pub struct TlbBatch {
+    start: usize,
+    end: usize,
+}
+
+impl TlbBatch {
+    fn add(&mut self, start: usize, end: usize) {
+        if self.start == self.end {
+            self.start = start;
+            self.end = end;
+        } else {
+            self.start = self.start.min(start);
+            self.end = self.end.max(end);
+        }
+    }
+
+    fn take(&mut self) -> Option<(usize, usize)> {
+        if self.start == self.end {
+            return None;
+        }
+        let range = (self.start, self.end);
+        self.start = 0;
+        self.end = 0;
+        Some(range)
+    }
+}
+
+/// Flush the whole TLB instead of pages when a shootdown covers more pages
+const SHOOTDOWN_MAX_PAGES: usize = 32;
+
+/// Token of the page table loaded on each CPU.
+///
+/// Loading CR3 flushes the non-global TLB entries,
+/// so only the CPUs running a page table may cache its user pages.
+lazy_static! {
+    static ref ACTIVE_TOKENS: Vec<AtomicUsize> =
+        (0..MAX_CPU_NUM).map(|_| AtomicUsize::new(0)).collect();
+}
+
+fn active_token_of(cpu: usize) -> &'static AtomicUsize {
+    &ACTIVE_TOKENS[cpu]
+}
+
+/// Record the page table current CPU is going to load,
+/// must be called before writing CR3
+pub fn set_active_token(token: usize) {
+    active_token_of(super::cpu::id()).store(token, Ordering::SeqCst);
+}
+
+/// Flush [`start`, `end`) of page table `token` on the other CPUs running it,
+/// and wait until they are done, so that the unmapped frames can be reused.
+fn shootdown(token: usize, start: usize, end: usize) {
     if !super::AP_CAN_INIT.load(Ordering::Relaxed) {
         return;
     }
-    super::ipi::invoke_on_allcpu(move || tlb::flush(VirtAddr::new(vaddr as u64)), false);
+    // order the entry changes before reading the active tokens,
+    // a CPU loading the page table after this sees the changes
+    fence(Ordering::SeqCst);
+    let cpu_id = super::cpu::id();
+    let mut cpus = 0usize;
+    for cpu in 0..MAX_CPU_NUM {
+        if cpu != cpu_id && active_token_of(cpu).load(Ordering::SeqCst) == token {
+            cpus |= 1 << cpu;
+        }
+    }
+    if cpus == 0 {
+        return;
+    }
+    let pages = (end - start) / PAGE_SIZE;
+    super::ipi::invoke_on_cpus(
+        cpus,
+        move || {
+            if PageTableImpl::active_token() != token {
+                // switched away, which has flushed the TLB
+                return;
+            }
+            if pages > SHOOTDOWN_MAX_PAGES {
+                tlb::flush_all();
+            } else {
+                for page in Page::range_of(start, end) {
+                    tlb::flush(page.start_address());
+                }
+            }
+        },
+        true,
+    );
 }
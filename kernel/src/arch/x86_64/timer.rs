@@ -1,3 +1,102 @@
+use crate::consts::USEC_PER_TICK;
+use crate::memory::phys_to_virt;
+use apic::LAPIC_ADDR;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use log::*;
+use raw_cpuid::CpuId;
+use x86_64::instructions::port::Port;
+use x86_64::registers::model_specific::Msr;
+
+/// TSC frequency in Hz, measured against the PIT on CPU 0
+static TSC_FREQ: AtomicUsize = AtomicUsize::new(0);
+
+/// The LAPIC timers run in TSC-deadline mode
+static TSC_DEADLINE: AtomicBool = AtomicBool::new(false);
+
+const LAPIC_LVT_TIMER: usize = 0x320;
+const LVT_MASKED: u32 = 1 << 16;
+const LVT_TIMER_MODE: u32 = 0b11 << 17;
+const LVT_TIMER_TSC_DEADLINE: u32 = 0b10 << 17;
+const MSR_IA32_TSC_DEADLINE: u32 = 0x6e0;
+
+const PIT_FREQ: u64 = 1_193_182;
+const CALIBRATE_MSEC: u64 = 10;
+
 pub fn read_epoch() -> u64 {
     super::driver::rtc_cmos::read_epoch()
 }
+
+pub fn get_cycle() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// Frequency of `get_cycle`, 0 before `init` on CPU 0
+pub fn cycle_freq() -> u64 {
+    TSC_FREQ.load(Ordering::Relaxed) as u64
+}
+
+/// Measure the TSC on CPU 0, then switch the LAPIC timer of this CPU to
+/// TSC-deadline mode if supported, otherwise it keeps ticking periodically.
+///
+/// Must be called after `cpu::init`, which starts the periodic LAPIC timer.
+pub fn init() {
+    if super::cpu::id() == 0 {
+        TSC_FREQ.store(calibrate_tsc() as usize, Ordering::Relaxed);
+        let supported = CpuId::new()
+            .get_feature_info()
+            .map_or(false, |info| info.has_tsc_deadline());
+        TSC_DEADLINE.store(supported, Ordering::Relaxed);
+        info!(
+            "timer: TSC {} MHz, TSC-deadline {}",
+            cycle_freq() / 1_000_000,
+            supported
+        );
+    }
+    if !TSC_DEADLINE.load(Ordering::Relaxed) {
+        return;
+    }
+    unsafe {
+        let lvt = phys_to_virt(LAPIC_ADDR + LAPIC_LVT_TIMER) as *mut u32;
+        let value = lvt.read_volatile();
+        lvt.write_volatile(value & !(LVT_MASKED | LVT_TIMER_MODE) | LVT_TIMER_TSC_DEADLINE);
+        // the mode switch must be done before the deadline is written
+        asm!("mfence" :::: "volatile");
+    }
+    // the first tick, later ones are programmed by `hrtimer`
+    set_deadline(get_cycle() + cycle_freq() * USEC_PER_TICK as u64 / 1_000_000);
+}
+
+/// Program the timer interrupt of this CPU at TSC `cycle`.
+/// Return false if the LAPIC timer is periodic.
+pub fn set_deadline(cycle: u64) -> bool {
+    if !TSC_DEADLINE.load(Ordering::Relaxed) {
+        return false;
+    }
+    unsafe {
+        // 0 would disarm it
+        Msr::new(MSR_IA32_TSC_DEADLINE).write(cycle.max(1));
+    }
+    true
+}
+
+/// Count TSC cycles while PIT channel 2 counts down `CALIBRATE_MSEC`
+fn calibrate_tsc() -> u64 {
+    let count = (PIT_FREQ * CALIBRATE_MSEC / 1000) as u16;
+    let mut gate = Port::<u8>::new(0x61);
+    let mut command = Port::<u8>::new(0x43);
+    let mut channel2 = Port::<u8>::new(0x42);
+    unsafe {
+        // gate high, speaker off
+        let value = gate.read();
+        gate.write(value & !0x02 | 0x01);
+        // channel 2, lobyte/hibyte, mode 0: interrupt on terminal count
+        command.write(0xb0);
+        channel2.write(count as u8);
+        channel2.write((count >> 8) as u8);
+        let start = get_cycle();
+        // OUT2 goes high at terminal count
+        while gate.read() & 0x20 == 0 {}
+        let end = get_cycle();
+        (end - start) * 1000 / CALIBRATE_MSEC
+    }
+}
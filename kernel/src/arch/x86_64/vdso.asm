@@ -0,0 +1,57 @@
+# vDSO text for x86_64, see `vdso/vdso.asm`
+
+.equ VDSO_MACHINE,      62      # EM_X86_64
+
+.macro VDSO_TEXT
+.intel_syntax noprefix
+
+# int __vdso_clock_gettime(clockid_t clock, struct timespec *ts)
+#
+# Every clock reads the realtime clock, like `sys_clock_gettime`.
+__vdso_clock_gettime:
+    lea r8, [rip + vdso_start + VDSO_DATA]
+1:
+    mov r11d, dword ptr [r8 + VDSO_SEQ]
+    test r11d, 1
+    jnz 4f
+    cmp dword ptr [r8 + VDSO_ENABLED], 0
+    je 5f
+    # the TSC must not be read before `seq`
+    lfence
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, qword ptr [r8 + VDSO_CYCLE_LAST]
+    # the TSC of this CPU may be behind the one which wrote the data
+    jae 2f
+    xor eax, eax
+2:
+    mov r9d, dword ptr [r8 + VDSO_MULT]
+    mul r9
+    mov ecx, dword ptr [r8 + VDSO_SHIFT]
+    shrd rax, rdx, cl
+    mov r9d, dword ptr [r8 + VDSO_NSEC]
+    add rax, r9
+    mov r10, qword ptr [r8 + VDSO_SEC]
+    # loads are not reordered with each other on x86
+    cmp r11d, dword ptr [r8 + VDSO_SEQ]
+    jne 1b
+    xor edx, edx
+    mov r9d, 1000000000         # NSEC_PER_SEC
+    div r9
+    add rax, r10
+    mov qword ptr [rsi], rax
+    mov qword ptr [rsi + 8], rdx
+    xor eax, eax
+    ret
+4:
+    # being written
+    pause
+    jmp 1b
+5:
+    mov eax, 228                # SYS_CLOCK_GETTIME
+    syscall
+    ret
+
+.att_syntax
+.endm
@@ -1,8 +1,12 @@
+use alloc::boxed::Box;
+use alloc::collections::{BTreeMap, VecDeque};
 use alloc::string::String;
 use alloc::sync::Arc;
-use core::cmp::min;
+use alloc::vec::Vec;
 use core::mem::{size_of, zeroed};
 use core::slice;
+use core::sync::atomic::{spin_loop_hint, AtomicBool, Ordering};
+use core::time::Duration;
 
 use bitflags::*;
 use device_tree::util::SliceRead;
@@ -11,6 +15,8 @@ use log::*;
 use rcore_memory::PAGE_SIZE;
 use volatile::Volatile;
 
+use crate::processor;
+use crate::sync::Condvar;
 use crate::sync::SpinNoIrqLock as Mutex;
 
 use super::super::bus::virtio_mmio::*;
@@ -23,46 +29,63 @@ pub struct VirtIOBlk {
     header: usize,
     queue: VirtIOVirtqueue,
     capacity: usize,
+    features: VirtIOBlkFeature,
+    /// max number of data segments in one request
+    seg_max: usize,
+    /// all requests not returned to their callers, by id
+    requests: BTreeMap<usize, Box<VirtIOBlkRequest>>,
+    /// ids of requests not submitted to the device yet
+    pending: VecDeque<usize>,
+    /// submitted batches, by id of their first request
+    inflight: BTreeMap<usize, VirtIOBlkBatch>,
+    next_id: usize,
 }
 
-pub struct VirtIOBlkDriver(Mutex<VirtIOBlk>);
+pub struct VirtIOBlkDriver {
+    inner: Mutex<VirtIOBlk>,
+    /// notified when requests are completed in interrupt
+    completed: Condvar,
+    /// whether interrupts of the device are delivered to us,
+    /// otherwise waiters poll the used ring every `BLK_POLL_INTERVAL`
+    irq_working: AtomicBool,
+}
 
 #[repr(C)]
 #[derive(Debug)]
 struct VirtIOBlkConfig {
     capacity: Volatile<u64>, // number of 512 sectors
+    size_max: Volatile<u32>,
+    seg_max: Volatile<u32>,
 }
 
 #[repr(C)]
 #[derive(Debug, Default)]
-struct VirtIOBlkReadReq {
+struct VirtIOBlkReq {
     req_type: u32,
     reserved: u32,
     sector: u64,
 }
 
-#[repr(C)]
-struct VirtIOBlkWriteReq {
-    req_type: u32,
-    reserved: u32,
-    sector: u64,
-    data: [u8; VIRTIO_BLK_BLK_SIZE],
-}
-
-#[repr(C)]
-struct VirtIOBlkReadResp {
-    data: [u8; VIRTIO_BLK_BLK_SIZE],
+/// A block request and the buffer of its caller
+struct VirtIOBlkRequest {
+    req: VirtIOBlkReq,
+    /// written by device
     status: u8,
+    buf: usize,
+    len: usize,
+    done: bool,
 }
 
-#[repr(C)]
-#[derive(Debug, Default)]
-struct VirtIOBlkWriteResp {
-    status: u8,
+/// Requests on consecutive sectors sent to the device as one
+struct VirtIOBlkBatch {
+    ids: Vec<usize>,
+    /// indirect descriptor table, if used
+    table: Option<Vec<VirtIOVirtqueueDesc>>,
 }
 
 const VIRTIO_BLK_T_IN: u32 = 0;
 const VIRTIO_BLK_T_OUT: u32 = 1;
+const VIRTIO_BLK_T_FLUSH: u32 = 4;
 
 const VIRTIO_BLK_S_OK: u8 = 0;
 const VIRTIO_BLK_S_IOERR: u8 = 1;
@@ -70,6 +93,12 @@ const VIRTIO_BLK_S_UNSUPP: u8 = 2;
 
 const VIRTIO_BLK_BLK_SIZE: usize = 512;
 
+/// Virtqueue size, limited by the ring arrays of `VirtIOVirtqueueAvailableRing`
+const VIRTIO_BLK_QUEUE_SIZE: usize = 32;
+
+/// Interval to check for completed requests while interrupts are not seen
+const BLK_POLL_INTERVAL: Duration = Duration::from_millis(1);
+
 bitflags! {
     struct VirtIOBlkFeature : u64 {
         const BARRIER = 1 << 0;
@@ -100,14 +129,187 @@ bitflags! {
     }
 }
 
+impl VirtIOBlk {
+    /// Submit pending requests until the virtqueue is full.
+    /// Requests on consecutive sectors are merged up to `seg_max` segments.
+    fn submit(&mut self) {
+        let mut submitted = false;
+        while let Some(&first) = self.pending.front() {
+            let (req_type, mut next_sector) = {
+                let req = &self.requests[&first].req;
+                (req.req_type, req.sector)
+            };
+            let mut ids = Vec::new();
+            for &id in self.pending.iter() {
+                let request = &self.requests[&id];
+                if ids.len() == self.seg_max
+                    || request.req.req_type != req_type
+                    || request.req.sector != next_sector
+                {
+                    break;
+                }
+                ids.push(id);
+                next_sector += (request.len / VIRTIO_BLK_BLK_SIZE) as u64;
+                if req_type == VIRTIO_BLK_T_FLUSH {
+                    break;
+                }
+            }
+
+            let head = &self.requests[&first];
+            let req = unsafe {
+                slice::from_raw_parts(
+                    &head.req as *const VirtIOBlkReq as *const u8,
+                    size_of::<VirtIOBlkReq>(),
+                )
+            };
+            let status = slice::from_ref(&head.status);
+            let data = ids.iter().map(|id| {
+                let request = &self.requests[id];
+                unsafe { slice::from_raw_parts(request.buf as *const u8, request.len) }
+            });
+            let mut input = Vec::new();
+            let mut output = vec![req];
+            match req_type {
+                VIRTIO_BLK_T_IN => input.extend(data),
+                VIRTIO_BLK_T_OUT => output.extend(data),
+                _ => {}
+            }
+            input.push(status);
+
+            let mut table = None;
+            let added = if self.features.contains(VirtIOBlkFeature::RING_INDIRECT_DESC)
+                && input.len() + output.len() > 2
+            {
+                let mut descs: Vec<VirtIOVirtqueueDesc> = (0..input.len() + output.len())
+                    .map(|_| unsafe { zeroed() })
+                    .collect();
+                let added = self
+                    .queue
+                    .add_indirect(&input, &output, &mut descs, first);
+                table = Some(descs);
+                added
+            } else {
+                self.queue.add(&input, &output, first)
+            };
+            if !added {
+                break;
+            }
+            for _ in 0..ids.len() {
+                self.pending.pop_front();
+            }
+            self.inflight.insert(first, VirtIOBlkBatch { ids, table });
+            submitted = true;
+        }
+        if submitted {
+            self.queue.notify();
+        }
+    }
+
+    /// Collect completed requests from the used ring, then submit more.
+    /// Return true if any request completed.
+    fn complete(&mut self) -> bool {
+        let mut completed = false;
+        while let Some((_, _, _, first)) = self.queue.get() {
+            let batch = self.inflight.remove(&first).expect("unknown virtio-blk request");
+            let status = self.requests[&first].status;
+            for id in batch.ids.iter() {
+                let request = self.requests.get_mut(id).unwrap();
+                request.status = status;
+                request.done = true;
+            }
+            completed = true;
+        }
+        if completed {
+            self.submit();
+        }
+        completed
+    }
+}
+
+impl VirtIOBlkDriver {
+    /// Queue a request and wait for it to complete.
+    /// `len` must be a multiple of the sector size.
+    /// The buffer is queued in segments of at most a page, which `submit`
+    /// merges back into requests of up to `seg_max` segments.
+    fn request(&self, req_type: u32, sector: usize, buf: usize, len: usize) -> bool {
+        let ids = {
+            let mut driver = self.inner.lock();
+            let mut ids = Vec::new();
+            let mut offset = 0;
+            loop {
+                let seg_len = (len - offset).min(PAGE_SIZE);
+                let id = driver.next_id;
+                driver.next_id += 1;
+                let mut req = VirtIOBlkReq::default();
+                req.req_type = req_type;
+                req.sector = (sector + offset / VIRTIO_BLK_BLK_SIZE) as u64;
+                let request = Box::new(VirtIOBlkRequest {
+                    req,
+                    status: VIRTIO_BLK_S_IOERR,
+                    buf: buf + offset,
+                    len: seg_len,
+                    done: false,
+                });
+                driver.requests.insert(id, request);
+                driver.pending.push_back(id);
+                ids.push(id);
+                offset += seg_len;
+                if offset >= len {
+                    break;
+                }
+            }
+            driver.submit();
+            ids
+        };
+        let mut done = || {
+            let mut driver = self.inner.lock();
+            // the interrupt may be not routed to us, check by ourselves
+            driver.complete();
+            if !ids.iter().all(|id| driver.requests[id].done) {
+                return None;
+            }
+            let mut ok = true;
+            for id in ids.iter() {
+                let request = driver.requests.remove(id).unwrap();
+                ok &= request.status == VIRTIO_BLK_S_OK;
+            }
+            Some(ok)
+        };
+        if processor().tid_option().is_none() {
+            // no thread to sleep yet, e.g. when the init program is loaded at boot
+            loop {
+                if let Some(ok) = done() {
+                    return ok;
+                }
+                spin_loop_hint();
+            }
+        }
+        if self.irq_working.load(Ordering::Relaxed) {
+            return Condvar::wait_event(&self.completed, done);
+        }
+        // poll the used ring until an interrupt shows up
+        loop {
+            let ok = Condvar::wait_events_timeout(&[&self.completed], BLK_POLL_INTERVAL, &mut done);
+            if let Some(ok) = ok {
+                return ok;
+            }
+        }
+    }
+}
+
 impl Driver for VirtIOBlkDriver {
     fn try_handle_interrupt(&self, _irq: Option<u32>) -> bool {
-        let driver = self.0.lock();
+        let mut driver = self.inner.lock();
 
         let header = unsafe { &mut *(driver.header as *mut VirtIOHeader) };
         let interrupt = header.interrupt_status.read();
         if interrupt != 0 {
             header.interrupt_ack.write(interrupt);
+            if driver.complete() {
+                self.irq_working.store(true, Ordering::Relaxed);
+            }
+            drop(driver);
+            self.completed.notify_all();
             return true;
         }
         return false;
@@ -122,53 +324,33 @@ impl Driver for VirtIOBlkDriver {
     }
 
     fn read_block(&self, block_id: usize, buf: &mut [u8]) -> bool {
-        let mut driver = self.0.lock();
-        let mut req = VirtIOBlkReadReq::default();
-        req.req_type = VIRTIO_BLK_T_IN;
-        req.reserved = 0;
-        req.sector = block_id as u64;
-        let input = [0; size_of::<VirtIOBlkReadResp>()];
-        let output = unsafe {
-            slice::from_raw_parts(
-                &req as *const VirtIOBlkReadReq as *const u8,
-                size_of::<VirtIOBlkReadReq>(),
-            )
-        };
-        driver.queue.add_and_notify(&[&input], &[output], 0);
-        driver.queue.get_block();
-        let resp = unsafe { &*(&input as *const u8 as *const VirtIOBlkReadResp) };
-        if resp.status == VIRTIO_BLK_S_OK {
-            let len = min(buf.len(), VIRTIO_BLK_BLK_SIZE);
-            buf[..len].clone_from_slice(&resp.data[..len]);
-            true
-        } else {
-            false
+        if buf.len() % VIRTIO_BLK_BLK_SIZE == 0 {
+            return self.request(VIRTIO_BLK_T_IN, block_id, buf.as_mut_ptr() as usize, buf.len());
         }
+        // partial sector
+        let mut data = vec![0u8; (buf.len() / VIRTIO_BLK_BLK_SIZE + 1) * VIRTIO_BLK_BLK_SIZE];
+        let len = buf.len();
+        let ok = self.request(VIRTIO_BLK_T_IN, block_id, data.as_mut_ptr() as usize, data.len());
+        buf.copy_from_slice(&data[..len]);
+        ok
     }
 
     fn write_block(&self, block_id: usize, buf: &[u8]) -> bool {
-        let mut driver = self.0.lock();
-        let mut req: VirtIOBlkWriteReq = unsafe { zeroed() };
-        req.req_type = VIRTIO_BLK_T_OUT;
-        req.reserved = 0;
-        req.sector = block_id as u64;
-        let len = min(buf.len(), VIRTIO_BLK_BLK_SIZE);
-        req.data[..len].clone_from_slice(&buf[..len]);
-        let input = [0; size_of::<VirtIOBlkWriteResp>()];
-        let output = unsafe {
-            slice::from_raw_parts(
-                &req as *const VirtIOBlkWriteReq as *const u8,
-                size_of::<VirtIOBlkWriteReq>(),
-            )
-        };
-        driver.queue.add_and_notify(&[&input], &[output], 0);
-        driver.queue.get_block();
-        let resp = unsafe { &*(&input as *const u8 as *const VirtIOBlkWriteResp) };
-        if resp.status == VIRTIO_BLK_S_OK {
-            true
-        } else {
-            false
+        if buf.len() % VIRTIO_BLK_BLK_SIZE == 0 {
+            return self.request(VIRTIO_BLK_T_OUT, block_id, buf.as_ptr() as usize, buf.len());
+        }
+        // partial sector, pad with zero
+        let mut data = vec![0u8; (buf.len() / VIRTIO_BLK_BLK_SIZE + 1) * VIRTIO_BLK_BLK_SIZE];
+        data[..buf.len()].copy_from_slice(buf);
+        self.request(VIRTIO_BLK_T_OUT, block_id, data.as_ptr() as usize, data.len())
+    }
+
+    fn sync(&self) -> bool {
+        let flush = self.inner.lock().features.contains(VirtIOBlkFeature::FLUSH);
+        if !flush {
+            return true;
         }
+        self.request(VIRTIO_BLK_T_FLUSH, 0, 0, 0)
     }
 }
 
@@ -185,9 +367,11 @@ pub fn virtio_blk_init(node: &Node) {
     info!("Device features {:?}", device_features);
 
     // negotiate these flags only
-    let supported_features = VirtIOBlkFeature::empty();
-    let driver_features = (device_features & supported_features).bits();
-    header.write_driver_features(driver_features);
+    let supported_features = VirtIOBlkFeature::SEG_MAX
+        | VirtIOBlkFeature::FLUSH
+        | VirtIOBlkFeature::RING_INDIRECT_DESC;
+    let features = device_features & supported_features;
+    header.write_driver_features(features.bits());
 
     // read configuration space
     let config = unsafe { &mut *((vaddr + VIRTIO_CONFIG_SPACE_OFFSET) as *mut VirtIOBlkConfig) };
@@ -197,17 +381,39 @@ pub fn virtio_blk_init(node: &Node) {
         config.capacity.read() / 2
     );
 
+    // at most one page per segment of a request
+    let seg_max = if features.contains(VirtIOBlkFeature::SEG_MAX) {
+        let max_descs = if features.contains(VirtIOBlkFeature::RING_INDIRECT_DESC) {
+            PAGE_SIZE / size_of::<VirtIOVirtqueueDesc>()
+        } else {
+            VIRTIO_BLK_QUEUE_SIZE
+        };
+        (config.seg_max.read() as usize).min(max_descs - 2).max(1)
+    } else {
+        1
+    };
+
     // virtio 4.2.4 Legacy interface
     // configure two virtqueues: ingress and egress
     header.guest_page_size.write(PAGE_SIZE as u32); // one page
 
-    let driver = VirtIOBlkDriver(Mutex::new(VirtIOBlk {
-        interrupt: node.prop_u32("interrupts").unwrap(),
-        interrupt_parent: node.prop_u32("interrupt-parent").unwrap(),
-        header: vaddr as usize,
-        queue: VirtIOVirtqueue::new(header, 0, 16),
-        capacity: config.capacity.read() as usize,
-    }));
+    let driver = VirtIOBlkDriver {
+        inner: Mutex::new(VirtIOBlk {
+            interrupt: node.prop_u32("interrupts").unwrap(),
+            interrupt_parent: node.prop_u32("interrupt-parent").unwrap(),
+            header: vaddr as usize,
+            queue: VirtIOVirtqueue::new(header, 0, VIRTIO_BLK_QUEUE_SIZE),
+            capacity: config.capacity.read() as usize,
+            features,
+            seg_max,
+            requests: BTreeMap::new(),
+            pending: VecDeque::new(),
+            inflight: BTreeMap::new(),
+            next_id: 0,
+        }),
+        completed: Condvar::new(),
+        irq_working: AtomicBool::new(false),
+    };
 
     header.status.write(VirtIODeviceStatus::DRIVER_OK.bits());
 
@@ -165,6 +165,67 @@ impl VirtIOVirtqueue {
         self.num_used += input.len() + output.len();
         self.free_head = cur;
 
+        self.push_avail(head, user_data);
+        return true;
+    }
+
+    // Add buffers to the virtqueue through an indirect descriptor table,
+    // so that they take only one descriptor of the ring.
+    // `table` must not be freed until the buffers are used by the device.
+    // Return true on success, false otherwise
+    pub fn add_indirect(
+        &mut self,
+        input: &[&[u8]],
+        output: &[&[u8]],
+        table: &mut [VirtIOVirtqueueDesc],
+        user_data: usize,
+    ) -> bool {
+        assert!(input.len() + output.len() > 0);
+        assert_eq!(input.len() + output.len(), table.len());
+        if !self.can_add(1, 0) {
+            return false;
+        }
+
+        let buffers = output.iter().map(|buf| (buf, VirtIOVirtqueueFlag::NEXT));
+        let buffers = buffers.chain(
+            input
+                .iter()
+                .map(|buf| (buf, VirtIOVirtqueueFlag::NEXT | VirtIOVirtqueueFlag::WRITE)),
+        );
+        for (i, (buf, flags)) in buffers.enumerate() {
+            table[i].addr.write(virt_to_phys(buf.as_ptr() as usize) as u64);
+            table[i].len.write(buf.len() as u32);
+            table[i].flags.write(flags.bits());
+            table[i].next.write((i + 1) as u16);
+        }
+        let last = table.len() - 1;
+        table[last]
+            .flags
+            .write(table[last].flags.read() & !(VirtIOVirtqueueFlag::NEXT.bits()));
+
+        let desc = unsafe {
+            slice::from_raw_parts_mut(self.desc as *mut VirtIOVirtqueueDesc, self.queue_num)
+        };
+        let head = self.free_head;
+        desc[head]
+            .addr
+            .write(virt_to_phys(table.as_ptr() as usize) as u64);
+        desc[head]
+            .len
+            .write((size_of::<VirtIOVirtqueueDesc>() * table.len()) as u32);
+        desc[head]
+            .flags
+            .write(VirtIOVirtqueueFlag::INDIRECT.bits());
+
+        self.num_used += 1;
+        self.free_head = desc[head].next.read() as usize;
+
+        self.push_avail(head, user_data);
+        return true;
+    }
+
+    // Put the descriptor chain starting at `head` to the available ring
+    fn push_avail(&mut self, head: usize, user_data: usize) {
         let avail = unsafe { &mut *(self.avail as *mut VirtIOVirtqueueAvailableRing) };
 
         let avail_slot = self.avail_idx as usize & (self.queue_num - 1);
@@ -176,7 +237,6 @@ impl VirtIOVirtqueue {
         self.avail_idx = self.avail_idx.wrapping_add(1);
         avail.idx.write(self.avail_idx);
         self.desc_state[head] = user_data;
-        return true;
     }
 
     // Add buffers to the virtqueue and notify device about it
@@ -207,8 +267,8 @@ impl VirtIOVirtqueue {
         let index = used.ring[last_used_slot].id.read() as usize;
         let len = used.ring[last_used_slot].len.read();
 
-        let user_data = self.desc_state[last_used_slot];
-        self.desc_state[last_used_slot] = 0;
+        let user_data = self.desc_state[index];
+        self.desc_state[index] = 0;
 
         let mut cur = index;
         let desc = unsafe {
@@ -254,6 +314,20 @@ impl VirtIOVirtqueue {
         }
     }
 
+    // Ask the device to interrupt or not when it uses buffers
+    // Disabling is only a hint, the device may still interrupt
+    pub fn set_interrupt(&mut self, enable: bool) {
+        let avail = unsafe { &mut *(self.avail as *mut VirtIOVirtqueueAvailableRing) };
+        let flags = if enable {
+            VirtIOVirtqueueAvailableFlag::empty()
+        } else {
+            VirtIOVirtqueueAvailableFlag::NO_INTERRUPT
+        };
+        avail.flags.write(flags.bits());
+        // make it visible before checking the used ring again
+        fence(Ordering::SeqCst);
+    }
+
     // Notify device about new buffers
     pub fn notify(&mut self) {
         let header = unsafe { &mut *(self.header as *mut VirtIOHeader) };
@@ -311,6 +385,12 @@ bitflags! {
     }
 }
 
+bitflags! {
+    pub struct VirtIOVirtqueueAvailableFlag : u16 {
+        const NO_INTERRUPT = 1;
+    }
+}
+
 #[repr(C)]
 #[derive(Debug)]
 pub struct VirtIOVirtqueueAvailableRing {
@@ -1,12 +1,12 @@
 use alloc::string::String;
 use alloc::sync::Arc;
 use alloc::vec::Vec;
+use core::time::Duration;
 
 use lazy_static::lazy_static;
 use smoltcp::wire::{EthernetAddress, IpAddress, IpCidr, Ipv4Address};
 use spin::RwLock;
 
-use crate::sync::Condvar;
 use rcore_fs::dev::{self, BlockDevice, DevError};
 
 #[allow(dead_code)]
@@ -22,6 +22,8 @@ mod input;
 pub mod net;
 mod provider;
 
+pub use self::net::napi::NetStats;
+
 #[derive(Debug, Eq, PartialEq)]
 pub enum DeviceType {
     Net,
@@ -66,11 +68,22 @@ pub trait Driver: Send + Sync {
         unimplemented!("not a net driver")
     }
 
-    // manually trigger a poll, use it after sending packets
-    fn poll(&self) {
+    // poll the device, with a budget of received packets if it has one
+    // return true if the budget ran out, i.e. there may be more packets
+    fn poll(&self) -> bool {
         unimplemented!("not a net driver")
     }
 
+    // time until the interface has to be polled for its timers, None if never
+    fn poll_delay(&self) -> Option<Duration> {
+        None
+    }
+
+    // get packet counters for this device
+    fn get_stats(&self) -> NetStats {
+        NetStats::default()
+    }
+
     // send an ethernet frame, only use it when necessary
     fn send(&self, _data: &[u8]) -> Option<usize> {
         unimplemented!("not a net driver")
@@ -89,6 +102,11 @@ pub trait Driver: Send + Sync {
     fn write_block(&self, _block_id: usize, _buf: &[u8]) -> bool {
         unimplemented!("not a block driver")
     }
+
+    // flush volatile write cache of the device, if it has one
+    fn sync(&self) -> bool {
+        true
+    }
 }
 
 lazy_static! {
@@ -117,14 +135,13 @@ impl BlockDevice for BlockDriver {
     }
 
     fn sync(&self) -> dev::Result<()> {
-        Ok(())
+        match self.0.sync() {
+            true => Ok(()),
+            false => Err(DevError),
+        }
     }
 }
 
-lazy_static! {
-    pub static ref SOCKET_ACTIVITY: Condvar = Condvar::new();
-}
-
 #[cfg(any(target_arch = "riscv32", target_arch = "riscv64", target_arch = "mips"))]
 pub fn init(dtb: usize) {
     device_tree::init(dtb);
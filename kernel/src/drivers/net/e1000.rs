@@ -1,10 +1,13 @@
 //! Intel PRO/1000 Network Adapter i.e. e1000 network driver
 //! Datasheet: https://www.intel.ca/content/dam/doc/datasheet/82574l-gbe-controller-datasheet.pdf
 
+use alloc::boxed::Box;
 use alloc::collections::BTreeMap;
 use alloc::string::String;
 use alloc::sync::Arc;
 use alloc::vec::Vec;
+use core::ptr::{read_volatile, write_volatile};
+use core::time::Duration;
 
 use smoltcp::iface::*;
 use smoltcp::phy::{self, DeviceCapabilities};
@@ -14,16 +17,54 @@ use smoltcp::Result;
 
 use isomorphic_drivers::net::ethernet::intel::e1000::E1000;
 use isomorphic_drivers::net::ethernet::structs::EthernetAddress as DriverEthernetAddress;
-use rcore_memory::PAGE_SIZE;
 
 use crate::drivers::provider::Provider;
 use crate::net::SOCKETS;
 use crate::sync::SpinNoIrqLock as Mutex;
 
-use super::super::{DeviceType, Driver, DRIVERS, NET_DRIVERS, SOCKET_ACTIVITY};
+use super::super::{DeviceType, Driver, NetStats, DRIVERS, NET_DRIVERS};
+use super::napi::NapiState;
+
+/// Max frame size
+const E1000_MTU: usize = 1536;
+/// Max packets per poll
+const E1000_BURST: usize = 64;
+
+/// Interrupt Mask Set/Read register
+const E1000_IMS: usize = 0xD0;
+/// Interrupt Mask Clear register
+const E1000_IMC: usize = 0xD8;
+
+/// The device and the frame being transmitted, locked together
+struct E1000Device {
+    e1000: E1000<Provider>,
+    /// filled by smoltcp in place, then copied to the TX ring by the device
+    tx_frame: Box<[u8]>,
+}
 
 #[derive(Clone)]
-pub struct E1000Driver(Arc<Mutex<E1000<Provider>>>);
+pub struct E1000Driver {
+    inner: Arc<Mutex<E1000Device>>,
+    napi: Arc<NapiState>,
+    /// virtual address of registers
+    header: usize,
+    /// interrupts enabled by the driver
+    irq_mask: u32,
+}
+
+impl E1000Driver {
+    fn write_reg(&self, reg: usize, value: u32) {
+        unsafe { write_volatile((self.header + reg) as *mut u32, value) }
+    }
+
+    fn disable_irq(&self) {
+        self.write_reg(E1000_IMC, !0);
+    }
+
+    fn enable_irq(&self) {
+        self.write_reg(E1000_IMS, self.irq_mask);
+    }
+}
 
 pub struct E1000Interface {
     iface: Mutex<EthernetInterface<'static, 'static, 'static, E1000Driver>>,
@@ -39,19 +80,12 @@ impl Driver for E1000Interface {
             return false;
         }
 
-        let data = self.driver.0.lock().handle_interrupt();
+        let data = self.driver.inner.lock().e1000.handle_interrupt();
 
         if data {
-            let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
-            let mut sockets = SOCKETS.lock();
-            match self.iface.lock().poll(&mut sockets, timestamp) {
-                Ok(_) => {
-                    SOCKET_ACTIVITY.notify_all();
-                }
-                Err(err) => {
-                    debug!("poll got err {}", err);
-                }
-            }
+            // poll in the net thread until the device is drained
+            self.driver.napi.mask_irq(|| self.driver.disable_irq());
+            crate::net::kick();
         }
 
         return data;
@@ -82,21 +116,36 @@ impl Driver for E1000Interface {
         self.iface.lock().ipv4_address()
     }
 
-    fn poll(&self) {
+    fn poll(&self) -> bool {
         let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
         let mut sockets = SOCKETS.lock();
-        match self.iface.lock().poll(&mut sockets, timestamp) {
-            Ok(_) => {
-                SOCKET_ACTIVITY.notify_all();
-            }
-            Err(err) => {
+        let more = self.driver.napi.poll(E1000_BURST, || {
+            if let Err(err) = self.iface.lock().poll(&mut sockets, timestamp) {
                 debug!("poll got err {}", err);
             }
+        });
+        if !more {
+            self.driver.napi.unmask_irq(|| self.driver.enable_irq());
         }
+        more
+    }
+
+    fn poll_delay(&self) -> Option<Duration> {
+        let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
+        let sockets = SOCKETS.lock();
+        let delay = self.iface.lock().poll_delay(&sockets, timestamp)?;
+        Some(Duration::from_millis(delay.total_millis()))
+    }
+
+    fn get_stats(&self) -> NetStats {
+        self.driver.napi.stats()
     }
 
     fn send(&self, data: &[u8]) -> Option<usize> {
         use smoltcp::phy::TxToken;
+        if data.len() > E1000_MTU {
+            return None;
+        }
         let token = E1000TxToken(self.driver.clone());
         if token
             .consume(Instant::from_millis(0), data.len(), |buffer| {
@@ -126,14 +175,16 @@ impl phy::Device<'_> for E1000Driver {
     type TxToken = E1000TxToken;
 
     fn receive(&mut self) -> Option<(Self::RxToken, Self::TxToken)> {
-        self.0
-            .lock()
-            .receive()
-            .map(|vec| (E1000RxToken(vec), E1000TxToken(self.clone())))
+        if !self.napi.has_budget() {
+            return None;
+        }
+        let packet = self.inner.lock().e1000.receive()?;
+        self.napi.on_receive(&packet);
+        Some((E1000RxToken(packet), E1000TxToken(self.clone())))
     }
 
     fn transmit(&mut self) -> Option<Self::TxToken> {
-        if self.0.lock().can_send() {
+        if self.inner.lock().e1000.can_send() {
             Some(E1000TxToken(self.clone()))
         } else {
             None
@@ -142,8 +193,8 @@ impl phy::Device<'_> for E1000Driver {
 
     fn capabilities(&self) -> DeviceCapabilities {
         let mut caps = DeviceCapabilities::default();
-        caps.max_transmission_unit = 1536;
-        caps.max_burst_size = Some(64);
+        caps.max_transmission_unit = E1000_MTU;
+        caps.max_burst_size = Some(E1000_BURST);
         caps
     }
 }
@@ -162,12 +213,13 @@ impl phy::TxToken for E1000TxToken {
     where
         F: FnOnce(&mut [u8]) -> Result<R>,
     {
-        let mut buffer = [0u8; PAGE_SIZE];
-        let result = f(&mut buffer[..len]);
-
-        let mut driver = (self.0).0.lock();
-        driver.send(&buffer);
-
+        let mut device = self.0.inner.lock();
+        let E1000Device { e1000, tx_frame } = &mut *device;
+        let result = f(&mut tx_frame[..len]);
+        if result.is_ok() {
+            e1000.send(&tx_frame[..len]);
+            self.0.napi.on_transmit();
+        }
         result
     }
 }
@@ -181,7 +233,16 @@ pub fn init(name: String, irq: Option<u32>, header: usize, size: usize, index: u
 
     let e1000 = E1000::new(header, size, DriverEthernetAddress::from_bytes(&mac));
 
-    let net_driver = E1000Driver(Arc::new(Mutex::new(e1000)));
+    let irq_mask = unsafe { read_volatile((header + E1000_IMS) as *const u32) };
+    let net_driver = E1000Driver {
+        inner: Arc::new(Mutex::new(E1000Device {
+            e1000,
+            tx_frame: vec![0u8; E1000_MTU].into_boxed_slice(),
+        })),
+        napi: NapiState::new(NET_DRIVERS.read().len()),
+        header,
+        irq_mask,
+    };
 
     let ethernet_addr = EthernetAddress::from_bytes(&mac);
     let ip_addrs = [IpCidr::new(IpAddress::v4(10, 0, index as u8, 2), 24)];
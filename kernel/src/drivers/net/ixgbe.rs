@@ -1,9 +1,12 @@
 //! Intel 10Gb Network Adapter 82599 i.e. ixgbe network driver
 //! Datasheet: https://www.intel.com/content/dam/www/public/us/en/documents/datasheets/82599-10-gbe-controller-datasheet.pdf
 
+use alloc::boxed::Box;
 use alloc::string::String;
 use alloc::sync::Arc;
 use alloc::vec::Vec;
+use core::ptr::{read_volatile, write_volatile};
+use core::time::Duration;
 
 use alloc::collections::BTreeMap;
 use isomorphic_drivers::net::ethernet::intel::ixgbe;
@@ -19,14 +22,53 @@ use crate::net::SOCKETS;
 use crate::sync::FlagsGuard;
 use crate::sync::SpinNoIrqLock as Mutex;
 
-use super::super::{provider::Provider, DeviceType, Driver, DRIVERS, NET_DRIVERS, SOCKET_ACTIVITY};
+use super::super::{provider::Provider, DeviceType, Driver, NetStats, DRIVERS, NET_DRIVERS};
+use super::napi::NapiState;
+
+/// Max packets per poll
+const IXGBE_BURST: usize = 256;
+
+/// Extended Interrupt Throttle register of vector 0
+const IXGBE_EITR0: usize = 0x820;
+/// Extended Interrupt Mask Set/Read register
+const IXGBE_EIMS: usize = 0x880;
+/// Extended Interrupt Mask Clear register
+const IXGBE_EIMC: usize = 0x888;
+
+/// Min interval between two interrupts of a device in microseconds
+const IRQ_THROTTLE_USEC: usize = 20;
+
+/// The device and the frame being transmitted, locked together
+struct IXGBEDevice {
+    ixgbe: ixgbe::IXGBE<Provider>,
+    /// `mtu` bytes, as the MTU of smoltcp includes the Ethernet header.
+    /// Filled by smoltcp in place, then copied to the TX ring by the device.
+    tx_frame: Box<[u8]>,
+}
 
 #[derive(Clone)]
 struct IXGBEDriver {
-    inner: Arc<Mutex<ixgbe::IXGBE<Provider>>>,
+    inner: Arc<Mutex<IXGBEDevice>>,
     header: usize,
     size: usize,
     mtu: usize,
+    napi: Arc<NapiState>,
+    /// interrupts enabled by the driver
+    irq_mask: u32,
+}
+
+impl IXGBEDriver {
+    fn write_reg(&self, reg: usize, value: u32) {
+        unsafe { write_volatile((self.header + reg) as *mut u32, value) }
+    }
+
+    fn disable_irq(&self) {
+        self.write_reg(IXGBE_EIMC, !0);
+    }
+
+    fn enable_irq(&self) {
+        self.write_reg(IXGBE_EIMS, self.irq_mask);
+    }
 }
 
 pub struct IXGBEInterface {
@@ -46,20 +88,13 @@ impl Driver for IXGBEInterface {
 
         let handled = {
             let _ = FlagsGuard::no_irq_region();
-            self.driver.inner.lock().try_handle_interrupt()
+            self.driver.inner.lock().ixgbe.try_handle_interrupt()
         };
 
         if handled {
-            let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
-            let mut sockets = SOCKETS.lock();
-            match self.iface.lock().poll(&mut sockets, timestamp) {
-                Ok(_) => {
-                    SOCKET_ACTIVITY.notify_all();
-                }
-                Err(err) => {
-                    debug!("poll got err {}", err);
-                }
-            }
+            // poll in the net thread until the device is drained
+            self.driver.napi.mask_irq(|| self.driver.disable_irq());
+            crate::net::kick();
         }
 
         return handled;
@@ -90,21 +125,35 @@ impl Driver for IXGBEInterface {
         self.iface.lock().ipv4_address()
     }
 
-    fn poll(&self) {
+    fn poll(&self) -> bool {
         let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
         let mut sockets = SOCKETS.lock();
-        match self.iface.lock().poll(&mut sockets, timestamp) {
-            Ok(_) => {
-                SOCKET_ACTIVITY.notify_all();
-            }
-            Err(err) => {
+        let more = self.driver.napi.poll(IXGBE_BURST, || {
+            if let Err(err) = self.iface.lock().poll(&mut sockets, timestamp) {
                 debug!("poll got err {}", err);
             }
+        });
+        if !more {
+            let _guard = FlagsGuard::no_irq_region();
+            self.driver.napi.unmask_irq(|| self.driver.enable_irq());
         }
+        more
+    }
+
+    fn poll_delay(&self) -> Option<Duration> {
+        let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
+        let sockets = SOCKETS.lock();
+        let delay = self.iface.lock().poll_delay(&sockets, timestamp)?;
+        Some(Duration::from_millis(delay.total_millis()))
+    }
+
+    fn get_stats(&self) -> NetStats {
+        self.driver.napi.stats()
     }
 
     fn send(&self, data: &[u8]) -> Option<usize> {
-        self.driver.inner.lock().send(&data);
+        self.driver.inner.lock().ixgbe.send(&data);
+        self.driver.napi.on_transmit();
         Some(data.len())
     }
 
@@ -114,6 +163,7 @@ impl Driver for IXGBEInterface {
         cache.lookup_pure(&ip, Instant::from_millis(0))
     }
 }
+
 pub struct IXGBERxToken(Vec<u8>);
 pub struct IXGBETxToken(IXGBEDriver);
 
@@ -122,21 +172,22 @@ impl<'a> phy::Device<'a> for IXGBEDriver {
     type TxToken = IXGBETxToken;
 
     fn receive(&'a mut self) -> Option<(Self::RxToken, Self::TxToken)> {
+        if !self.napi.has_budget() {
+            return None;
+        }
         let _ = FlagsGuard::no_irq_region();
-        if self.inner.lock().can_send() {
-            if let Some(data) = self.inner.lock().recv() {
-                Some((IXGBERxToken(data), IXGBETxToken(self.clone())))
-            } else {
-                None
-            }
-        } else {
-            None
+        let mut driver = self.inner.lock();
+        if !driver.ixgbe.can_send() {
+            return None;
         }
+        let data = driver.ixgbe.recv()?;
+        self.napi.on_receive(&data);
+        Some((IXGBERxToken(data), IXGBETxToken(self.clone())))
     }
 
     fn transmit(&'a mut self) -> Option<Self::TxToken> {
         let _ = FlagsGuard::no_irq_region();
-        if self.inner.lock().can_send() {
+        if self.inner.lock().ixgbe.can_send() {
             Some(IXGBETxToken(self.clone()))
         } else {
             None
@@ -148,7 +199,7 @@ impl<'a> phy::Device<'a> for IXGBEDriver {
         // do not use max MTU by default
         //caps.max_transmission_unit = ixgbe::IXGBEDriver::get_mtu(); // max MTU
         caps.max_transmission_unit = self.mtu;
-        caps.max_burst_size = Some(256);
+        caps.max_burst_size = Some(IXGBE_BURST);
         // IP Rx checksum is offloaded with RXCSUM
         caps.checksum.ipv4 = Checksum::Tx;
         caps
@@ -170,10 +221,12 @@ impl phy::TxToken for IXGBETxToken {
         F: FnOnce(&mut [u8]) -> Result<R>,
     {
         let _ = FlagsGuard::no_irq_region();
-        let mut buffer = [0u8; ixgbe::IXGBE::<Provider>::get_mtu()];
-        let result = f(&mut buffer[..len]);
+        let mut device = self.0.inner.lock();
+        let IXGBEDevice { ixgbe, tx_frame } = &mut *device;
+        let result = f(&mut tx_frame[..len]);
         if result.is_ok() {
-            self.0.inner.lock().send(&buffer[..len]);
+            ixgbe.send(&tx_frame[..len]);
+            self.0.napi.on_transmit();
         }
         result
     }
@@ -189,14 +242,21 @@ pub fn ixgbe_init(
     let _ = FlagsGuard::no_irq_region();
     let mut ixgbe = ixgbe::IXGBE::new(header, size);
     ixgbe.enable_irq();
+    let irq_mask = unsafe { read_volatile((header + IXGBE_EIMS) as *const u32) };
 
     let ethernet_addr = EthernetAddress::from_bytes(&ixgbe.get_mac().as_bytes());
 
+    let mtu = 1500;
     let net_driver = IXGBEDriver {
-        inner: Arc::new(Mutex::new(ixgbe)),
+        inner: Arc::new(Mutex::new(IXGBEDevice {
+            ixgbe,
+            tx_frame: vec![0u8; mtu].into_boxed_slice(),
+        })),
         header,
         size,
-        mtu: 1500,
+        mtu,
+        napi: NapiState::new(NET_DRIVERS.read().len()),
+        irq_mask,
     };
 
     let ip_addrs = [IpCidr::new(IpAddress::v4(10, 0, index as u8, 2), 24)];
@@ -219,6 +279,11 @@ pub fn ixgbe_init(
         irq,
     };
 
+    // limit the interrupt rate, the interval is in 2us units at bits 3..11,
+    // counter write disable at bit 31
+    let interval = ((IRQ_THROTTLE_USEC / 2) as u32 & 0x1FF) << 3;
+    net_driver.write_reg(IXGBE_EITR0, interval | 1 << 31);
+
     let driver = Arc::new(ixgbe_iface);
     DRIVERS.write().push(driver.clone());
     NET_DRIVERS.write().push(driver.clone());
@@ -1,4 +1,5 @@
 pub mod e1000;
 pub mod ixgbe;
+pub mod napi;
 pub mod router;
 pub mod virtio_net;
@@ -0,0 +1,98 @@
+//! NAPI-style budgeted polling of network devices
+//!
+//! On an interrupt, a driver masks the interrupts of its device and kicks
+//! the net thread, which polls the device for up to a budget of packets
+//! at a time. The interrupts are unmasked once a poll drains the device,
+//! so a packet flood is handled by polling instead of an interrupt storm.
+
+use alloc::sync::Arc;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+/// Packet counters of a network interface
+#[derive(Debug, Default, Clone, Copy)]
+pub struct NetStats {
+    pub polls: usize,
+    pub rx_packets: usize,
+    pub tx_packets: usize,
+    /// polls which used up the budget
+    pub budget_exhausted: usize,
+}
+
+#[derive(Default)]
+pub struct NapiState {
+    /// index of the device in `NET_DRIVERS`
+    ifindex: usize,
+    /// packets left to receive in the current poll
+    budget: AtomicUsize,
+    /// device interrupts masked until a poll drains the device
+    masked: AtomicBool,
+    polls: AtomicUsize,
+    rx_packets: AtomicUsize,
+    tx_packets: AtomicUsize,
+    budget_exhausted: AtomicUsize,
+}
+
+impl NapiState {
+    pub fn new(ifindex: usize) -> Arc<Self> {
+        Arc::new(NapiState {
+            ifindex,
+            ..NapiState::default()
+        })
+    }
+
+    /// Called by `phy::Device::receive`.
+    /// Return false if the budget of this poll ran out.
+    pub fn has_budget(&self) -> bool {
+        self.budget.load(Ordering::Relaxed) != 0
+    }
+
+    /// Called when `packet` is received, taking one from the budget.
+    /// The packet is also copied to the RX rings of packet sockets.
+    pub fn on_receive(&self, packet: &[u8]) {
+        crate::net::packet_tap(self.ifindex, packet);
+        let left = self.budget.load(Ordering::Relaxed);
+        self.budget.store(left.saturating_sub(1), Ordering::Relaxed);
+        self.rx_packets.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Called when a packet is sent
+    pub fn on_transmit(&self) {
+        self.tx_packets.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Run `poll` with a budget of `budget` received packets.
+    /// Return true if it ran out, i.e. the device may have more packets.
+    pub fn poll(&self, budget: usize, poll: impl FnOnce()) -> bool {
+        self.budget.store(budget, Ordering::Relaxed);
+        poll();
+        self.polls.fetch_add(1, Ordering::Relaxed);
+        let exhausted = self.budget.load(Ordering::Relaxed) == 0;
+        if exhausted {
+            self.budget_exhausted.fetch_add(1, Ordering::Relaxed);
+        }
+        exhausted
+    }
+
+    /// Mask the device interrupts by `disable`, if not masked yet
+    pub fn mask_irq(&self, disable: impl FnOnce()) {
+        if !self.masked.swap(true, Ordering::AcqRel) {
+            disable();
+        }
+    }
+
+    /// Unmask the device interrupts by `enable`, if masked
+    pub fn unmask_irq(&self, enable: impl FnOnce()) {
+        if self.masked.swap(false, Ordering::AcqRel) {
+            enable();
+        }
+    }
+
+    pub fn stats(&self) -> NetStats {
+        NetStats {
+            polls: self.polls.load(Ordering::Relaxed),
+            rx_packets: self.rx_packets.load(Ordering::Relaxed),
+            tx_packets: self.tx_packets.load(Ordering::Relaxed),
+            budget_exhausted: self.budget_exhausted.load(Ordering::Relaxed),
+        }
+    }
+}
@@ -4,6 +4,7 @@ use alloc::collections::BTreeMap;
 use alloc::string::String;
 use alloc::sync::Arc;
 use alloc::vec::Vec;
+use core::time::Duration;
 
 use bitflags::*;
 use smoltcp::iface::*;
@@ -15,7 +16,7 @@ use smoltcp::Result;
 use crate::net::SOCKETS;
 use crate::sync::SpinNoIrqLock as Mutex;
 
-use super::super::{DeviceType, Driver, DRIVERS, NET_DRIVERS, SOCKET_ACTIVITY};
+use super::super::{DeviceType, Driver, DRIVERS, NET_DRIVERS};
 use crate::memory::phys_to_virt;
 
 const AXI_STREAM_FIFO_ISR: *mut u32 = phys_to_virt(0x64A0_0000) as *mut u32;
@@ -52,6 +53,8 @@ bitflags! {
 
 pub struct Router {
     buffer: [Vec<Vec<u8>>; ENABLED_PORTS as usize],
+    /// index of port 0 in `NET_DRIVERS`
+    ifindex_base: usize,
 }
 
 impl Router {
@@ -108,6 +111,7 @@ impl phy::RxToken for RouterRxToken {
     {
         let mut router = (self.0).0.lock();
         let buffer = router.buffer[(self.0).1 as usize].pop().unwrap();
+        crate::net::packet_tap(router.ifindex_base + (self.0).1 as usize, &buffer);
         f(&buffer)
     }
 }
@@ -175,16 +179,8 @@ impl Driver for RouterInterface {
                 }
                 drop(driver);
 
-                let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
-                let mut sockets = SOCKETS.lock();
-                match self.iface.lock().poll(&mut sockets, timestamp) {
-                    Ok(_) => {
-                        SOCKET_ACTIVITY.notify_all();
-                    }
-                    Err(err) => {
-                        debug!("poll got err {}", err);
-                    }
-                }
+                // poll in the net thread
+                crate::net::kick();
             }
             return true;
         }
@@ -211,8 +207,20 @@ impl Driver for RouterInterface {
         unimplemented!()
     }
 
-    fn poll(&self) {
-        unimplemented!()
+    fn poll(&self) -> bool {
+        let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
+        let mut sockets = SOCKETS.lock();
+        if let Err(err) = self.iface.lock().poll(&mut sockets, timestamp) {
+            debug!("poll got err {}", err);
+        }
+        false
+    }
+
+    fn poll_delay(&self) -> Option<Duration> {
+        let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
+        let sockets = SOCKETS.lock();
+        let delay = self.iface.lock().poll_delay(&sockets, timestamp)?;
+        Some(Duration::from_millis(delay.total_millis()))
     }
 }
 
@@ -224,12 +232,14 @@ pub fn router_init() {
         AXI_STREAM_FIFO_RDFR.write_volatile(0xA5);
     }
 
+    let ifindex_base = NET_DRIVERS.read().len();
     for i in 0..ENABLED_PORTS {
         let ethernet_addr = EthernetAddress::from_bytes(&[2, 2, 3, 3, 0, i]);
 
         let net_driver = RouterDriver(
             Arc::new(Mutex::new(Router {
                 buffer: [Vec::new(), Vec::new()],
+                ifindex_base,
             })),
             i,
         );
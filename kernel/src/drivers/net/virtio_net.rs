@@ -1,58 +1,109 @@
 use alloc::alloc::{GlobalAlloc, Layout};
+use alloc::collections::BTreeMap;
 use alloc::format;
 use alloc::string::String;
 use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::cmp::min;
 use core::mem::size_of;
 use core::slice;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use core::time::Duration;
 
 use bitflags::*;
 use device_tree::util::SliceRead;
 use device_tree::Node;
 use log::*;
 use rcore_memory::PAGE_SIZE;
+use smoltcp::iface::*;
 use smoltcp::phy::{self, DeviceCapabilities};
 use smoltcp::time::Instant;
-use smoltcp::wire::{EthernetAddress, Ipv4Address};
-use smoltcp::Result;
+use smoltcp::wire::*;
+use smoltcp::{Error, Result};
 use volatile::{ReadOnly, Volatile};
 
+use crate::arch::cpu;
+use crate::net::SOCKETS;
 use crate::sync::SpinNoIrqLock as Mutex;
 use crate::HEAP_ALLOCATOR;
 
 use super::super::bus::virtio_mmio::*;
-use super::super::{DeviceType, Driver, DRIVERS, NET_DRIVERS};
+use super::super::{DeviceType, Driver, NetStats, DRIVERS, NET_DRIVERS};
+use super::napi::NapiState;
 use crate::memory::phys_to_virt;
 
+/// Virtqueue size, limited by the ring arrays of `VirtIOVirtqueueAvailableRing`
+const VIRTIO_NET_QUEUE_SIZE: usize = 32;
+/// Size of the control virtqueue, one command at a time
+const VIRTIO_NET_CTRL_QUEUE_SIZE: usize = 4;
+/// Max queue pairs used, as buffers of each pair take kernel heap
+const VIRTIO_NET_MAX_QUEUE_PAIRS: usize = 4;
+/// Receive buffers posted to each receive queue
+const VIRTIO_NET_RX_BUFFERS: usize = 16;
+/// Transmit buffers shared by all transmit queues, fewer than descriptors of one queue
+const VIRTIO_NET_TX_BUFFERS: usize = 32;
+/// Size of a buffer, enough for the virtio-net header and a frame
+const VIRTIO_NET_BUF_SIZE: usize = 2048;
+/// Max frame size
+const VIRTIO_NET_MTU: usize = 1536;
+/// Max packets per poll
+const VIRTIO_NET_BURST: usize = 64;
+
+/// A receive and a transmit virtqueue
+struct VirtIONetQueuePair {
+    rx: VirtIOVirtqueue,
+    tx: VirtIOVirtqueue,
+}
+
 pub struct VirtIONet {
     interrupt_parent: u32,
     interrupt: u32,
     header: usize,
     mac: EthernetAddress,
-    // 0 for receive, 1 for transmit
-    queues: [VirtIOVirtqueue; 2],
+    /// the pair of a CPU is its id modulo the number of pairs
+    pairs: Vec<Mutex<VirtIONetQueuePair>>,
+    /// addresses of transmit buffers not owned by the device
+    tx_free: Mutex<Vec<usize>>,
+    /// receive queue checked first by the next receive, for fairness
+    next_rx: AtomicUsize,
+    napi: Arc<NapiState>,
 }
 
 #[derive(Clone)]
-pub struct VirtIONetDriver(Arc<Mutex<VirtIONet>>);
+pub struct VirtIONetDriver(Arc<VirtIONet>);
 
-const VIRTIO_QUEUE_RECEIVE: usize = 0;
-const VIRTIO_QUEUE_TRANSMIT: usize = 1;
+pub struct VirtIONetInterface {
+    iface: Mutex<EthernetInterface<'static, 'static, 'static, VirtIONetDriver>>,
+    driver: VirtIONetDriver,
+    name: String,
+}
 
-impl Driver for VirtIONetDriver {
+impl Driver for VirtIONetInterface {
     fn try_handle_interrupt(&self, _irq: Option<u32>) -> bool {
-        let driver = self.0.lock();
+        let driver = &self.driver.0;
 
         let header = unsafe { &mut *(driver.header as *mut VirtIOHeader) };
         let interrupt = header.interrupt_status.read();
-        if interrupt != 0 {
-            header.interrupt_ack.write(interrupt);
-            let interrupt_status = VirtIONetworkInterruptStatus::from_bits_truncate(interrupt);
-            debug!("Got interrupt {:?}", interrupt_status);
-
-            return true;
-        } else {
+        if interrupt == 0 {
             return false;
         }
+        header.interrupt_ack.write(interrupt);
+        let interrupt_status = VirtIONetworkInterruptStatus::from_bits_truncate(interrupt);
+        debug!("Got interrupt {:?}", interrupt_status);
+
+        // silence receive queues with frames until the net thread drains them
+        let mut received = false;
+        for pair in driver.pairs.iter() {
+            let mut pair = pair.lock();
+            if pair.rx.can_get() {
+                pair.rx.set_interrupt(false);
+                received = true;
+            }
+        }
+        if received {
+            crate::net::kick();
+        }
+        true
     }
 
     fn device_type(&self) -> DeviceType {
@@ -64,33 +115,174 @@ impl Driver for VirtIONetDriver {
     }
 
     fn get_mac(&self) -> EthernetAddress {
-        self.0.lock().mac
+        self.driver.0.mac
     }
 
     fn get_ifname(&self) -> String {
-        format!("virtio{}", self.0.lock().interrupt)
+        self.name.clone()
+    }
+
+    // get ip addresses
+    fn get_ip_addresses(&self) -> Vec<IpCidr> {
+        Vec::from(self.iface.lock().ip_addrs())
     }
 
     fn ipv4_address(&self) -> Option<Ipv4Address> {
-        unimplemented!()
+        self.iface.lock().ipv4_address()
+    }
+
+    fn poll(&self) -> bool {
+        let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
+        let mut sockets = SOCKETS.lock();
+        let driver = &self.driver.0;
+        let more = driver.napi.poll(VIRTIO_NET_BURST, || {
+            if let Err(err) = self.iface.lock().poll(&mut sockets, timestamp) {
+                debug!("poll got err {}", err);
+            }
+        });
+        if more {
+            return true;
+        }
+        // frames received after the last check do not interrupt, poll them again
+        let mut pending = false;
+        for pair in driver.pairs.iter() {
+            let mut pair = pair.lock();
+            pair.rx.set_interrupt(true);
+            pending |= pair.rx.can_get();
+        }
+        pending
     }
 
-    fn poll(&self) {
-        unimplemented!()
+    fn poll_delay(&self) -> Option<Duration> {
+        let timestamp = Instant::from_millis(crate::trap::uptime_msec() as i64);
+        let sockets = SOCKETS.lock();
+        let delay = self.iface.lock().poll_delay(&sockets, timestamp)?;
+        Some(Duration::from_millis(delay.total_millis()))
+    }
+
+    fn get_stats(&self) -> NetStats {
+        self.driver.0.napi.stats()
+    }
+
+    fn send(&self, data: &[u8]) -> Option<usize> {
+        if data.len() > VIRTIO_NET_MTU {
+            return None;
+        }
+        let driver = &self.driver.0;
+        let buffer = driver.alloc_tx_buffer()?;
+        driver.frame(buffer, data.len()).copy_from_slice(data);
+        // senders on different CPUs do not contend on a queue
+        driver.transmit(cpu::id() % driver.pairs.len(), buffer, data.len());
+        Some(data.len())
+    }
+
+    fn get_arp(&self, ip: IpAddress) -> Option<EthernetAddress> {
+        let iface = self.iface.lock();
+        let cache = iface.neighbor_cache();
+        cache.lookup_pure(&ip, Instant::from_millis(0))
     }
 }
 
 impl VirtIONet {
+    /// Move transmit buffers used by the device to `free`
+    fn reclaim_tx_buffers(&self, free: &mut Vec<usize>) {
+        for pair in self.pairs.iter() {
+            let mut pair = pair.lock();
+            while let Some((_, _, _, buffer)) = pair.tx.get() {
+                free.push(buffer);
+            }
+        }
+    }
+
     fn transmit_available(&self) -> bool {
-        self.queues[VIRTIO_QUEUE_TRANSMIT].can_add(1, 0)
+        let mut free = self.tx_free.lock();
+        if free.is_empty() {
+            self.reclaim_tx_buffers(&mut free);
+        }
+        !free.is_empty()
     }
 
-    fn receive_available(&self) -> bool {
-        self.queues[VIRTIO_QUEUE_RECEIVE].can_get()
+    fn alloc_tx_buffer(&self) -> Option<usize> {
+        let mut free = self.tx_free.lock();
+        if free.is_empty() {
+            self.reclaim_tx_buffers(&mut free);
+        }
+        free.pop()
+    }
+
+    /// The frame of `len` bytes after the virtio-net header in `buffer`
+    fn frame(&self, buffer: usize, len: usize) -> &'static mut [u8] {
+        let offset = size_of::<VirtIONetHeader>();
+        unsafe { slice::from_raw_parts_mut((buffer + offset) as *mut u8, len) }
+    }
+
+    /// Send the frame of `len` bytes in `buffer` on the transmit queue of pair `pair`
+    fn transmit(&self, pair: usize, buffer: usize, len: usize) {
+        let data = unsafe {
+            slice::from_raw_parts(buffer as *const u8, size_of::<VirtIONetHeader>() + len)
+        };
+        // there are fewer buffers than descriptors, so it never fails
+        assert!(self.pairs[pair]
+            .lock()
+            .tx
+            .add_and_notify(&[], &[data], buffer));
+        self.napi.on_transmit();
+    }
+
+    /// Take a received frame, checking each receive queue in turn.
+    /// Return the pair, the buffer, and the length including the virtio-net header.
+    fn receive(&self) -> Option<(usize, usize, usize)> {
+        let num = self.pairs.len();
+        let start = self.next_rx.fetch_add(1, Ordering::Relaxed);
+        for i in 0..num {
+            let pair = (start + i) % num;
+            if let Some((_, _, len, buffer)) = self.pairs[pair].lock().rx.get() {
+                return Some((pair, buffer, len));
+            }
+        }
+        None
     }
+
+    /// Give `buffer` back to the receive queue of pair `pair`
+    fn recycle_rx_buffer(&self, pair: usize, buffer: usize) {
+        let input = unsafe { slice::from_raw_parts(buffer as *const u8, VIRTIO_NET_BUF_SIZE) };
+        self.pairs[pair]
+            .lock()
+            .rx
+            .add_and_notify(&[input], &[], buffer);
+    }
+}
+
+/// Hash of the addresses and ports of an IPv4 frame
+fn flow_hash(frame: &[u8]) -> Result<u32> {
+    let eth = EthernetFrame::new_checked(frame)?;
+    if eth.ethertype() != EthernetProtocol::Ipv4 {
+        return Err(Error::Unrecognized);
+    }
+    let ip = Ipv4Packet::new_checked(eth.payload())?;
+    let (src_port, dst_port) = match ip.protocol() {
+        IpProtocol::Tcp => {
+            let tcp = TcpPacket::new_checked(ip.payload())?;
+            (tcp.src_port(), tcp.dst_port())
+        }
+        IpProtocol::Udp => {
+            let udp = UdpPacket::new_checked(ip.payload())?;
+            (udp.src_port(), udp.dst_port())
+        }
+        _ => (0, 0),
+    };
+    let src = u32::from_be_bytes(ip.src_addr().0);
+    let dst = u32::from_be_bytes(ip.dst_addr().0);
+    let ports = (src_port as u32) << 16 | dst_port as u32;
+    Ok((src ^ dst ^ ports).wrapping_mul(0x9e37_79b9) >> 16)
 }
 
-pub struct VirtIONetRxToken(VirtIONetDriver);
+pub struct VirtIONetRxToken {
+    driver: VirtIONetDriver,
+    pair: usize,
+    buffer: usize,
+    len: usize,
+}
 pub struct VirtIONetTxToken(VirtIONetDriver);
 
 impl<'a> phy::Device<'a> for VirtIONetDriver {
@@ -98,21 +290,23 @@ impl<'a> phy::Device<'a> for VirtIONetDriver {
     type TxToken = VirtIONetTxToken;
 
     fn receive(&'a mut self) -> Option<(Self::RxToken, Self::TxToken)> {
-        let driver = self.0.lock();
-        if driver.transmit_available() && driver.receive_available() {
-            // potential racing
-            Some((
-                VirtIONetRxToken(self.clone()),
-                VirtIONetTxToken(self.clone()),
-            ))
-        } else {
-            None
+        if !self.0.napi.has_budget() || !self.0.transmit_available() {
+            return None;
         }
+        let (pair, buffer, len) = self.0.receive()?;
+        let frame_len = len.saturating_sub(size_of::<VirtIONetHeader>());
+        self.0.napi.on_receive(self.0.frame(buffer, frame_len));
+        let token = VirtIONetRxToken {
+            driver: self.clone(),
+            pair,
+            buffer,
+            len,
+        };
+        Some((token, VirtIONetTxToken(self.clone())))
     }
 
     fn transmit(&'a mut self) -> Option<Self::TxToken> {
-        let driver = self.0.lock();
-        if driver.transmit_available() {
+        if self.0.transmit_available() {
             Some(VirtIONetTxToken(self.clone()))
         } else {
             None
@@ -121,8 +315,8 @@ impl<'a> phy::Device<'a> for VirtIONetDriver {
 
     fn capabilities(&self) -> DeviceCapabilities {
         let mut caps = DeviceCapabilities::default();
-        caps.max_transmission_unit = 1536;
-        caps.max_burst_size = Some(1);
+        caps.max_transmission_unit = VIRTIO_NET_MTU;
+        caps.max_burst_size = Some(VIRTIO_NET_TX_BUFFERS);
         caps
     }
 }
@@ -132,14 +326,10 @@ impl phy::RxToken for VirtIONetRxToken {
     where
         F: FnOnce(&[u8]) -> Result<R>,
     {
-        let (input, output, _, user_data) = {
-            let mut driver = (self.0).0.lock();
-            driver.queues[VIRTIO_QUEUE_RECEIVE].get().unwrap()
-        };
-        let result = f(&input[0][size_of::<VirtIONetHeader>()..]);
-
-        let mut driver = (self.0).0.lock();
-        driver.queues[VIRTIO_QUEUE_RECEIVE].add_and_notify(&input, &output, user_data);
+        let driver = &self.driver.0;
+        let len = self.len.saturating_sub(size_of::<VirtIONetHeader>());
+        let result = f(driver.frame(self.buffer, len));
+        driver.recycle_rx_buffer(self.pair, self.buffer);
         result
     }
 }
@@ -149,25 +339,18 @@ impl phy::TxToken for VirtIONetTxToken {
     where
         F: FnOnce(&mut [u8]) -> Result<R>,
     {
-        let output = {
-            let mut driver = (self.0).0.lock();
-            if let Some((_, output, _, _)) = driver.queues[VIRTIO_QUEUE_TRANSMIT].get() {
-                unsafe { slice::from_raw_parts_mut(output[0].as_ptr() as *mut u8, output[0].len()) }
-            } else {
-                // allocate a page for buffer
-                let page = unsafe {
-                    HEAP_ALLOCATOR
-                        .alloc_zeroed(Layout::from_size_align(PAGE_SIZE, PAGE_SIZE).unwrap())
-                } as usize;
-                unsafe { slice::from_raw_parts_mut(page as *mut u8, PAGE_SIZE) }
-            }
-        };
-        let output_buffer =
-            &mut output[size_of::<VirtIONetHeader>()..(size_of::<VirtIONetHeader>() + len)];
-        let result = f(output_buffer);
-
-        let mut driver = (self.0).0.lock();
-        assert!(driver.queues[VIRTIO_QUEUE_TRANSMIT].add_and_notify(&[], &[output], 0));
+        let driver = &(self.0).0;
+        let buffer = driver.alloc_tx_buffer().ok_or(Error::Exhausted)?;
+        let frame = driver.frame(buffer, len);
+        let result = f(&mut frame[..]);
+        if result.is_ok() {
+            // frames of a flow go out on one queue, and the device steers
+            // received frames of the flow to the same pair
+            let hash = flow_hash(frame).unwrap_or(0) as usize;
+            driver.transmit(hash % driver.pairs.len(), buffer, len);
+        } else {
+            driver.tx_free.lock().push(buffer);
+        }
         result
     }
 }
@@ -223,6 +406,8 @@ bitflags! {
 struct VirtIONetworkConfig {
     mac: [u8; 6],
     status: ReadOnly<u16>,
+    /// only valid with VirtIONetFeature::MQ
+    max_virtqueue_pairs: ReadOnly<u16>,
 }
 
 // virtio 5.1.6 Device Operation
@@ -238,6 +423,28 @@ struct VirtIONetHeader {
     // payload starts from here
 }
 
+const VIRTIO_NET_CTRL_MQ: u8 = 4;
+const VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET: u8 = 0;
+const VIRTIO_NET_OK: u8 = 0;
+
+/// Tell the device to use `pairs` queue pairs through the control virtqueue
+fn set_queue_pairs(ctrl: &mut VirtIOVirtqueue, pairs: usize) -> bool {
+    // class and command, number of pairs, and ack written by the device
+    // in separate buffers, as required by legacy devices
+    let mut command = vec![VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET];
+    command.extend_from_slice(&(pairs as u16).to_le_bytes());
+    command.push(!VIRTIO_NET_OK);
+    ctrl.add_and_notify(&[&command[4..]], &[&command[..2], &command[2..4]], 0);
+    let (input, _, _, _) = ctrl.get_block();
+    input[0][0] == VIRTIO_NET_OK
+}
+
+/// Allocate a zeroed buffer for frames, which never crosses a page
+fn alloc_buffer() -> usize {
+    let layout = Layout::from_size_align(VIRTIO_NET_BUF_SIZE, VIRTIO_NET_BUF_SIZE).unwrap();
+    unsafe { HEAP_ALLOCATOR.alloc_zeroed(layout) as usize }
+}
+
 pub fn virtio_net_init(node: &Node) {
     let reg = node.prop_raw("reg").unwrap();
     let paddr = reg.as_slice().read_be_u64(0).unwrap();
@@ -251,44 +458,111 @@ pub fn virtio_net_init(node: &Node) {
     debug!("Device features {:?}", device_features);
 
     // negotiate these flags only
-    let supported_features = VirtIONetFeature::MAC | VirtIONetFeature::STATUS;
-    let driver_features = (device_features & supported_features).bits();
-    header.write_driver_features(driver_features);
+    let supported_features = VirtIONetFeature::MAC
+        | VirtIONetFeature::STATUS
+        | VirtIONetFeature::CTRL_VQ
+        | VirtIONetFeature::MQ;
+    let mut features = device_features & supported_features;
+    if !features.contains(VirtIONetFeature::CTRL_VQ) {
+        // queue pairs are enabled through the control virtqueue
+        features.remove(VirtIONetFeature::MQ);
+    }
+    header.write_driver_features(features.bits());
 
     // read configuration space
     let config =
         unsafe { &mut *((vaddr + VIRTIO_CONFIG_SPACE_OFFSET) as *mut VirtIONetworkConfig) };
     let mac = config.mac;
     let status = VirtIONetworkStatus::from_bits_truncate(config.status.read());
-    debug!("Got MAC address {:?} and status {:?}", mac, status);
+    let max_pairs = if features.contains(VirtIONetFeature::MQ) {
+        config.max_virtqueue_pairs.read() as usize
+    } else {
+        1
+    };
+    debug!(
+        "Got MAC address {:?}, status {:?} and {} queue pairs",
+        mac, status, max_pairs
+    );
 
     // virtio 4.2.4 Legacy interface
-    // configure two virtqueues: ingress and egress
     header.guest_page_size.write(PAGE_SIZE as u32); // one page
 
-    let queue_num = 2; // for simplicity
-    let mut driver = VirtIONet {
-        interrupt: node.prop_u32("interrupts").unwrap(),
-        interrupt_parent: node.prop_u32("interrupt-parent").unwrap(),
-        header: vaddr as usize,
-        mac: EthernetAddress(mac),
-        queues: [
-            VirtIOVirtqueue::new(header, VIRTIO_QUEUE_RECEIVE, queue_num),
-            VirtIOVirtqueue::new(header, VIRTIO_QUEUE_TRANSMIT, queue_num),
-        ],
+    // virtio 5.1.2 Virtqueues
+    // receiveq1, transmitq1, ..., receiveqN, transmitqN, then controlq
+    let pair_num = min(max_pairs, VIRTIO_NET_MAX_QUEUE_PAIRS);
+    let mut pairs: Vec<_> = (0..pair_num)
+        .map(|i| {
+            let mut pair = VirtIONetQueuePair {
+                rx: VirtIOVirtqueue::new(header, 2 * i, VIRTIO_NET_QUEUE_SIZE),
+                tx: VirtIOVirtqueue::new(header, 2 * i + 1, VIRTIO_NET_QUEUE_SIZE),
+            };
+            for _ in 0..VIRTIO_NET_RX_BUFFERS {
+                let buffer = alloc_buffer();
+                let input =
+                    unsafe { slice::from_raw_parts(buffer as *const u8, VIRTIO_NET_BUF_SIZE) };
+                pair.rx.add(&[input], &[], buffer);
+            }
+            // sent buffers are reclaimed when running out of them
+            pair.tx.set_interrupt(false);
+            pair
+        })
+        .collect();
+    let mut ctrl = if features.contains(VirtIONetFeature::CTRL_VQ) {
+        Some(VirtIOVirtqueue::new(
+            header,
+            2 * max_pairs,
+            VIRTIO_NET_CTRL_QUEUE_SIZE,
+        ))
+    } else {
+        None
     };
 
-    // allocate a page for buffer
-    let page = unsafe {
-        HEAP_ALLOCATOR.alloc_zeroed(Layout::from_size_align(PAGE_SIZE, PAGE_SIZE).unwrap())
-    } as usize;
-    let input = unsafe { slice::from_raw_parts(page as *const u8, PAGE_SIZE) };
-    driver.queues[VIRTIO_QUEUE_RECEIVE].add_and_notify(&[input], &[], 0);
-
     header.status.write(VirtIODeviceStatus::DRIVER_OK.bits());
 
-    let net_driver = Arc::new(VirtIONetDriver(Arc::new(Mutex::new(driver))));
+    if features.contains(VirtIONetFeature::MQ) {
+        if !set_queue_pairs(ctrl.as_mut().unwrap(), pair_num) {
+            warn!("virtio-net: failed to enable {} queue pairs", pair_num);
+            // only the first pair is used by the device
+            pairs.truncate(1);
+        }
+    }
+    for pair in pairs.iter_mut() {
+        pair.rx.notify();
+    }
 
-    DRIVERS.write().push(net_driver.clone());
-    NET_DRIVERS.write().push(net_driver);
+    let name = format!("virtio{}", node.prop_u32("interrupts").unwrap());
+    let index = NET_DRIVERS.read().len();
+    let pair_num = pairs.len();
+    let driver = VirtIONetDriver(Arc::new(VirtIONet {
+        interrupt: node.prop_u32("interrupts").unwrap(),
+        interrupt_parent: node.prop_u32("interrupt-parent").unwrap(),
+        header: vaddr as usize,
+        mac: EthernetAddress(mac),
+        pairs: pairs.into_iter().map(Mutex::new).collect(),
+        tx_free: Mutex::new((0..VIRTIO_NET_TX_BUFFERS).map(|_| alloc_buffer()).collect()),
+        next_rx: AtomicUsize::new(0),
+        napi: NapiState::new(index),
+    }));
+
+    let ethernet_addr = EthernetAddress(mac);
+    let ip_addrs = [IpCidr::new(IpAddress::v4(10, 0, index as u8, 2), 24)];
+    let neighbor_cache = NeighborCache::new(BTreeMap::new());
+    let iface = EthernetInterfaceBuilder::new(driver.clone())
+        .ethernet_addr(ethernet_addr)
+        .ip_addrs(ip_addrs)
+        .neighbor_cache(neighbor_cache)
+        .finalize();
+
+    info!(
+        "virtio-net interface {} up with {} queue pairs and addr 10.0.{}.2/24",
+        name, pair_num, index
+    );
+    let net_iface = Arc::new(VirtIONetInterface {
+        iface: Mutex::new(iface),
+        driver,
+        name,
+    });
+
+    DRIVERS.write().push(net_iface.clone());
+    NET_DRIVERS.write().push(net_iface);
 }
@@ -0,0 +1,205 @@
+//! Dentry cache for path lookup
+//!
+//! Maps (directory, name) to the inode found in it, or to nothing for names
+//! known not to exist, so that resolving a hot path does not read directory blocks.
+//!
+//! Directories are identified by the address of their `INode`.
+//! Each entry holds a `Weak` of its directory, so the address can not be
+//! reused by another inode while the entry exists.
+//! `.` and `..` are not cached, since `..` changes when a directory is renamed.
+
+use alloc::{
+    collections::VecDeque,
+    string::String,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::str;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use rcore_fs::vfs::*;
+
+use crate::sync::SpinNoIrqLock as Mutex;
+
+const DCACHE_BUCKETS: usize = 256;
+
+/// Entries kept in each bucket, the least recently used one is evicted
+const DCACHE_BUCKET_SIZE: usize = 16;
+
+struct Dentry {
+    dir: usize,
+    /// Keeps the address of `dir` from being reused
+    _dir_ref: Weak<INode>,
+    name: String,
+    /// The inode and its type, None if `name` does not exist
+    target: Option<(Arc<INode>, FileType)>,
+}
+
+#[derive(Default)]
+struct DentryBucket {
+    /// Most recently used first
+    entries: VecDeque<Dentry>,
+    /// Changed on every invalidation, so that a lookup racing with it
+    /// does not insert a stale entry
+    gen: usize,
+}
+
+lazy_static! {
+    static ref DCACHE: Vec<Mutex<DentryBucket>> = (0..DCACHE_BUCKETS)
+        .map(|_| Mutex::new(DentryBucket::default()))
+        .collect();
+}
+
+fn dir_key(dir: &Arc<INode>) -> usize {
+    &**dir as *const INode as *const u8 as usize
+}
+
+fn bucket(dir: usize, name: &str) -> &'static Mutex<DentryBucket> {
+    // FNV-1a
+    let mut hash = 0xcbf2_9ce4_8422_2325u64 ^ (dir as u64 >> 4);
+    for &byte in name.as_bytes() {
+        hash ^= byte as u64;
+        hash = hash.wrapping_mul(0x100_0000_01b3);
+    }
+    &DCACHE[(hash as usize) % DCACHE_BUCKETS]
+}
+
+/// Find `name` in directory `dir` through the cache, returning the inode and its type
+fn find(dir: &Arc<INode>, name: &str) -> Result<(Arc<INode>, FileType)> {
+    let key = dir_key(dir);
+    let bucket = bucket(key, name);
+    let gen = {
+        let mut bucket = bucket.lock();
+        let pos = bucket
+            .entries
+            .iter()
+            .position(|d| d.dir == key && d.name == name);
+        if let Some(pos) = pos {
+            DCACHE_STATS.hits.fetch_add(1, Ordering::Relaxed);
+            let dentry = bucket.entries.remove(pos).unwrap();
+            let target = dentry.target.clone();
+            bucket.entries.push_front(dentry);
+            return target.ok_or(FsError::EntryNotFound);
+        }
+        bucket.gen
+    };
+    DCACHE_STATS.misses.fetch_add(1, Ordering::Relaxed);
+    let target = match dir.find(name) {
+        Ok(inode) => {
+            let type_ = inode.metadata()?.type_;
+            Some((inode, type_))
+        }
+        Err(FsError::EntryNotFound) => None,
+        Err(err) => return Err(err),
+    };
+    let mut bucket = bucket.lock();
+    let mut evicted = None;
+    if bucket.gen == gen {
+        bucket.entries.push_front(Dentry {
+            dir: key,
+            _dir_ref: Arc::downgrade(dir),
+            name: String::from(name),
+            target: target.clone(),
+        });
+        if bucket.entries.len() > DCACHE_BUCKET_SIZE {
+            evicted = bucket.entries.pop_back();
+        }
+    }
+    // the last reference to an inode may sync it to disk when dropped
+    drop(bucket);
+    drop(evicted);
+    target.ok_or(FsError::EntryNotFound)
+}
+
+/// Forget `name` in directory `dir`, must be called after it is created, removed or renamed
+pub fn invalidate(dir: &Arc<INode>, name: &str) {
+    let key = dir_key(dir);
+    let mut bucket = bucket(key, name).lock();
+    bucket.gen += 1;
+    let pos = bucket
+        .entries
+        .iter()
+        .position(|d| d.dir == key && d.name == name);
+    let removed = pos.and_then(|pos| bucket.entries.remove(pos));
+    drop(bucket);
+    drop(removed);
+}
+
+/// Lookup `path` from directory `base` like `INode::lookup_follow`,
+/// resolving each component through the cache.
+pub fn lookup_follow(base: &Arc<INode>, path: &str, mut max_follow: usize) -> Result<Arc<INode>> {
+    if base.metadata()?.type_ != FileType::Dir {
+        return Err(FsError::NotDir);
+    }
+    let mut dir = (base.clone(), FileType::Dir);
+    let mut path = String::from(path);
+    let mut start = 0;
+    while start < path.len() {
+        if dir.1 != FileType::Dir {
+            return Err(FsError::NotDir);
+        }
+        // absolute path
+        if path[start..].starts_with('/') {
+            let root = base.fs().root_inode();
+            dir = (root, FileType::Dir);
+            start += 1;
+            continue;
+        }
+        let end = path[start..]
+            .find('/')
+            .map(|i| start + i)
+            .unwrap_or(path.len());
+        let next = (end + 1).min(path.len());
+        let child = match &path[start..end] {
+            "" | "." => dir.clone(),
+            ".." => {
+                let inode = dir.0.find("..")?;
+                (inode, FileType::Dir)
+            }
+            name => find(&dir.0, name)?,
+        };
+        if child.1 == FileType::SymLink && max_follow > 0 {
+            max_follow -= 1;
+            let mut content = [0u8; 256];
+            let len = child.0.read_at(0, &mut content)?;
+            let link = str::from_utf8(&content[..len]).map_err(|_| FsError::NotDir)?;
+            // continue from the link target, relative to the same directory
+            let mut new_path = String::from(link);
+            if !new_path.ends_with('/') {
+                new_path.push('/');
+            }
+            new_path += &path[next..];
+            path = new_path;
+            start = 0;
+        } else {
+            dir = child;
+            start = next;
+        }
+    }
+    Ok(dir.0)
+}
+
+struct DcacheStats {
+    hits: AtomicUsize,
+    misses: AtomicUsize,
+}
+
+static DCACHE_STATS: DcacheStats = DcacheStats {
+    hits: AtomicUsize::new(0),
+    misses: AtomicUsize::new(0),
+};
+
+/// Snapshot of the dentry cache counters
+#[derive(Debug, Clone, Copy)]
+pub struct DentryCacheStats {
+    /// Components resolved from the cache
+    pub hits: usize,
+    /// Components looked up in the directory
+    pub misses: usize,
+}
+
+pub fn dcache_stats() -> DentryCacheStats {
+    DentryCacheStats {
+        hits: DCACHE_STATS.hits.load(Ordering::Relaxed),
+        misses: DCACHE_STATS.misses.load(Ordering::Relaxed),
+    }
+}
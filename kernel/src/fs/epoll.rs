@@ -0,0 +1,242 @@
+//! epoll: readiness notification of many files
+//!
+//! Each file in the interest list registers a callback on its wait queue,
+//! which puts the fd on the ready list. `epoll_wait` only polls the files on
+//! the ready list, so the cost scales with active files instead of all files.
+//!
+//! Interests are keyed by fd, and a closed fd may be reused by another file.
+//! The wait queue of the file tells them apart: an interest whose fd now has
+//! another queue is stale, and is dropped with its callback when found.
+//! Files without a wait queue are always ready and have no callback,
+//! so they are not told apart.
+
+use alloc::collections::{BTreeMap, BTreeSet};
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use bitflags::*;
+use core::mem;
+
+use rcore_fs::vfs::PollStatus;
+
+use crate::sync::SpinNoIrqLock as Mutex;
+use crate::sync::{Condvar, WakeCallback};
+use crate::syscall::SysError;
+
+pub const EPOLL_CTL_ADD: usize = 1;
+pub const EPOLL_CTL_DEL: usize = 2;
+pub const EPOLL_CTL_MOD: usize = 3;
+
+bitflags! {
+    pub struct EpollFlags: u32 {
+        const IN = 0x001;
+        const PRI = 0x002;
+        const OUT = 0x004;
+        const ERR = 0x008;
+        const HUP = 0x010;
+        const RDHUP = 0x2000;
+        const EXCLUSIVE = 1 << 28;
+        const WAKEUP = 1 << 29;
+        const ONESHOT = 1 << 30;
+        const ET = 1 << 31;
+    }
+}
+
+#[repr(C)]
+#[cfg_attr(target_arch = "x86_64", repr(packed))]
+#[derive(Debug, Clone, Copy)]
+pub struct EpollEvent {
+    pub events: EpollFlags,
+    pub data: u64,
+}
+
+pub struct EpollInstance {
+    /// fd -> interest
+    interests: Mutex<BTreeMap<usize, EpollInterest>>,
+    /// fds which may be ready
+    ready: Mutex<BTreeSet<usize>>,
+    /// notified when a fd is put on the ready list
+    pub new_ready: Arc<Condvar>,
+}
+
+struct EpollInterest {
+    event: EpollEvent,
+    /// wait queue of the file, None if the file is always ready
+    queue: Option<Arc<Condvar>>,
+    callback: WakeCallback,
+}
+
+impl EpollInstance {
+    pub fn new() -> Self {
+        EpollInstance {
+            interests: Mutex::new(BTreeMap::new()),
+            ready: Mutex::new(BTreeSet::new()),
+            new_ready: Arc::new(Condvar::new()),
+        }
+    }
+
+    /// Add, modify or delete the interest of `fd`, whose wait queue is `queue`
+    pub fn control(
+        epoll: &Arc<EpollInstance>,
+        op: usize,
+        fd: usize,
+        event: EpollEvent,
+        queue: Option<Arc<Condvar>>,
+    ) -> Result<(), SysError> {
+        let mut interests = epoll.interests.lock();
+        let stale = match interests.get(&fd) {
+            Some(interest) => !interest.is_of(&queue),
+            None => false,
+        };
+        if stale {
+            interests.remove(&fd).unwrap().unregister();
+        }
+        match op {
+            EPOLL_CTL_ADD => {
+                if interests.contains_key(&fd) {
+                    return Err(SysError::EEXIST);
+                }
+                let weak = Arc::downgrade(epoll);
+                let callback: WakeCallback = Arc::new(move || {
+                    if let Some(epoll) = weak.upgrade() {
+                        epoll.set_ready(fd);
+                    }
+                });
+                if let Some(queue) = &queue {
+                    queue.register_callback(callback.clone());
+                }
+                interests.insert(
+                    fd,
+                    EpollInterest {
+                        event,
+                        queue,
+                        callback,
+                    },
+                );
+            }
+            EPOLL_CTL_MOD => {
+                interests.get_mut(&fd).ok_or(SysError::ENOENT)?.event = event;
+            }
+            EPOLL_CTL_DEL => {
+                let interest = interests.remove(&fd).ok_or(SysError::ENOENT)?;
+                interest.unregister();
+                epoll.ready.lock().remove(&fd);
+                return Ok(());
+            }
+            _ => return Err(SysError::EINVAL),
+        }
+        drop(interests);
+        // poll it on the next wait
+        epoll.set_ready(fd);
+        Ok(())
+    }
+
+    fn set_ready(&self, fd: usize) {
+        self.ready.lock().insert(fd);
+        self.new_ready.notify_all();
+    }
+
+    pub fn has_ready(&self) -> bool {
+        !self.ready.lock().is_empty()
+    }
+
+    /// Poll the fds on the ready list by `poll` and fill `events`.
+    /// `poll` returns the status and the wait queue of the file of the fd,
+    /// or None if the fd is closed.
+    /// Return the number of events filled.
+    pub fn poll_ready(
+        &self,
+        events: &mut [EpollEvent],
+        mut poll: impl FnMut(usize) -> Option<(PollStatus, Option<Arc<Condvar>>)>,
+    ) -> usize {
+        let fds = mem::replace(&mut *self.ready.lock(), BTreeSet::new());
+        let mut count = 0;
+        // level-triggered fds stay on the ready list while ready
+        let mut still_ready = Vec::new();
+        for fd in fds {
+            if count == events.len() {
+                still_ready.push(fd);
+                continue;
+            }
+            let event = match self.interests.lock().get(&fd) {
+                Some(interest) => interest.event,
+                None => continue,
+            };
+            // poll without locks, it may lock the file
+            let polled = poll(fd).filter(|(_, queue)| self.is_of(fd, queue));
+            let status = match polled {
+                Some((status, _)) => status,
+                // closed, or reused by another file
+                None => {
+                    if let Some(interest) = self.interests.lock().remove(&fd) {
+                        interest.unregister();
+                    }
+                    continue;
+                }
+            };
+            let mut revents = EpollFlags::empty();
+            if status.read {
+                revents |= EpollFlags::IN;
+            }
+            if status.write {
+                revents |= EpollFlags::OUT;
+            }
+            if status.error {
+                revents |= EpollFlags::HUP;
+            }
+            let flags = event.events;
+            revents &= flags | EpollFlags::ERR | EpollFlags::HUP;
+            if revents.is_empty() {
+                continue;
+            }
+            events[count] = EpollEvent {
+                events: revents,
+                data: event.data,
+            };
+            count += 1;
+            if flags.contains(EpollFlags::ONESHOT) {
+                // disabled until EPOLL_CTL_MOD
+                if let Some(interest) = self.interests.lock().get_mut(&fd) {
+                    interest.event.events = EpollFlags::empty();
+                }
+            } else if !flags.contains(EpollFlags::ET) {
+                still_ready.push(fd);
+            }
+        }
+        if !still_ready.is_empty() {
+            self.ready.lock().extend(still_ready);
+        }
+        count
+    }
+
+    /// Whether the interest of `fd` is of the file with wait queue `queue`
+    fn is_of(&self, fd: usize, queue: &Option<Arc<Condvar>>) -> bool {
+        match self.interests.lock().get(&fd) {
+            Some(interest) => interest.is_of(queue),
+            None => true,
+        }
+    }
+}
+
+impl EpollInterest {
+    fn is_of(&self, queue: &Option<Arc<Condvar>>) -> bool {
+        match (&self.queue, queue) {
+            (Some(ours), Some(theirs)) => Arc::ptr_eq(ours, theirs),
+            (None, None) => true,
+            _ => false,
+        }
+    }
+
+    fn unregister(&self) {
+        if let Some(queue) = &self.queue {
+            queue.unregister_callback(&self.callback);
+        }
+    }
+}
+
+impl Drop for EpollInstance {
+    fn drop(&mut self) {
+        for interest in self.interests.lock().values() {
+            interest.unregister();
+        }
+    }
+}
@@ -1,10 +1,17 @@
 //! File handle for process
 
+use super::page_cache;
+use super::pipe::Pipe;
+use super::readahead::{self, Advice, ReadAhead};
+use super::stdio::Stdin;
+use crate::process::image;
+use crate::sync::Condvar;
 use crate::thread;
-use alloc::{string::String, sync::Arc};
+use alloc::{string::String, sync::Arc, vec::Vec};
 use core::fmt;
 
 use rcore_fs::vfs::{FsError, INode, Metadata, PollStatus, Result};
+use rcore_memory::PAGE_SIZE;
 
 #[derive(Clone)]
 pub struct FileHandle {
@@ -12,6 +19,9 @@ pub struct FileHandle {
     offset: u64,
     options: OpenOptions,
     pub path: String,
+    /// whether to read through the page cache
+    cached: bool,
+    readahead: ReadAhead,
 }
 
 #[derive(Debug, Clone)]
@@ -32,11 +42,14 @@ pub enum SeekFrom {
 
 impl FileHandle {
     pub fn new(inode: Arc<INode>, options: OpenOptions, path: String) -> Self {
+        let cached = page_cache::is_cacheable(&inode);
         return FileHandle {
             inode,
             offset: 0,
             options,
             path,
+            cached,
+            readahead: ReadAhead::default(),
         };
     }
 
@@ -50,6 +63,11 @@ impl FileHandle {
         if !self.options.read {
             return Err(FsError::InvalidParam); // FIXME: => EBADF
         }
+        if self.cached {
+            let len = page_cache::read_at(&self.inode, offset, buf)?;
+            self.readahead.on_read(&self.inode, offset, len);
+            return Ok(len);
+        }
         let mut len: usize = 0;
         if !self.options.nonblock {
             // block
@@ -73,6 +91,52 @@ impl FileHandle {
         Ok(len)
     }
 
+    /// Read up to `len` bytes and pass them to `f` in page-sized chunks,
+    /// see `splice_at`.
+    pub fn splice<E: From<FsError>>(
+        &mut self,
+        len: usize,
+        f: impl FnMut(&[u8]) -> core::result::Result<usize, E>,
+    ) -> core::result::Result<usize, E> {
+        let len = self.splice_at(self.offset as usize, len, f)?;
+        self.offset += len as u64;
+        Ok(len)
+    }
+
+    /// Read up to `len` bytes at `offset` and pass them to `f` in page-sized chunks.
+    /// Cached files are passed straight from the page cache, others through
+    /// a bounce buffer. `f` returns how many bytes it consumed, stop if it is short.
+    pub fn splice_at<E: From<FsError>>(
+        &mut self,
+        offset: usize,
+        len: usize,
+        mut f: impl FnMut(&[u8]) -> core::result::Result<usize, E>,
+    ) -> core::result::Result<usize, E> {
+        if !self.options.read {
+            return Err(FsError::InvalidParam.into()); // FIXME: => EBADF
+        }
+        if self.cached {
+            let len = page_cache::splice_read(&self.inode, offset, len, f)?;
+            self.readahead.on_read(&self.inode, offset, len);
+            return Ok(len);
+        }
+        let mut buf: Vec<u8> = vec![0; PAGE_SIZE.min(len)];
+        let mut pos = 0;
+        while pos < len {
+            let chunk = buf.len().min(len - pos);
+            let read_len = self.read_at(offset + pos, &mut buf[..chunk])?;
+            if read_len == 0 {
+                break;
+            }
+            let consumed = f(&buf[..read_len])?;
+            pos += consumed;
+            if consumed < read_len {
+                break;
+            }
+        }
+        Ok(pos)
+    }
+
     pub fn write(&mut self, buf: &[u8]) -> Result<usize> {
         let offset = match self.options.append {
             true => self.inode.metadata()?.size as u64,
@@ -88,10 +152,15 @@ impl FileHandle {
             return Err(FsError::InvalidParam); // FIXME: => EBADF
         }
         let len = self.inode.write_at(offset, buf)?;
+        if self.cached {
+            page_cache::write_at(&self.inode, offset, &buf[..len]);
+            image::invalidate(&self.inode);
+        }
         Ok(len)
     }
 
     pub fn seek(&mut self, pos: SeekFrom) -> Result<u64> {
+        self.readahead.on_seek();
         self.offset = match pos {
             SeekFrom::Start(offset) => offset,
             SeekFrom::End(offset) => (self.inode.metadata()?.size as i64 + offset) as u64,
@@ -100,11 +169,55 @@ impl FileHandle {
         Ok(self.offset)
     }
 
+    /// Set the access pattern followed by readahead, for `fadvise`
+    pub fn advise(&mut self, advice: Advice) {
+        self.readahead.advise(advice);
+    }
+
+    /// Read `len` bytes at `offset` (up to the end if `len` is 0) into page cache
+    /// in background, for `POSIX_FADV_WILLNEED`. Only the first readahead window
+    /// of the range is read.
+    pub fn will_need(&self, offset: usize, len: usize) -> Result<()> {
+        if !self.cached {
+            return Ok(());
+        }
+        let size = self.inode.metadata()?.size;
+        let end = match len {
+            0 => size,
+            len => offset.saturating_add(len).min(size),
+        };
+        readahead::will_need(
+            &self.inode,
+            offset / PAGE_SIZE,
+            (end + PAGE_SIZE - 1) / PAGE_SIZE,
+        );
+        Ok(())
+    }
+
+    /// Apply the moves of `clone`, a clone of this handle taken at offset `start`
+    /// and used while the process was unlocked. The offset is advanced by the
+    /// distance `clone` moved, so moves made meanwhile through this handle are kept.
+    /// Ignored if the fd was reopened to another file meanwhile.
+    pub fn sync_offset(&mut self, clone: &FileHandle, start: usize) {
+        if Arc::ptr_eq(&self.inode, &clone.inode) {
+            self.offset = match self.options.append {
+                // appending always leaves the offset at the end of the file
+                true => clone.offset.max(self.offset),
+                false => self.offset + (clone.offset - start as u64),
+            };
+            self.readahead = clone.readahead.clone();
+        }
+    }
+
     pub fn set_len(&mut self, len: u64) -> Result<()> {
         if !self.options.write {
             return Err(FsError::InvalidParam); // FIXME: => EBADF
         }
         self.inode.resize(len as usize)?;
+        if self.cached {
+            page_cache::truncate(&self.inode, len as usize);
+            image::invalidate(&self.inode);
+        }
         Ok(())
     }
 
@@ -121,7 +234,7 @@ impl FileHandle {
     }
 
     pub fn lookup_follow(&self, path: &str, max_follow: usize) -> Result<Arc<INode>> {
-        self.inode.lookup_follow(path, max_follow)
+        super::dcache::lookup_follow(&self.inode, path, max_follow)
     }
 
     pub fn read_entry(&mut self) -> Result<String> {
@@ -137,6 +250,18 @@ impl FileHandle {
         self.inode.poll()
     }
 
+    /// Wait queue notified when the readiness may change, None if always ready
+    pub fn wait_queue(&self) -> Option<Arc<Condvar>> {
+        let inode = self.inode.as_any_ref();
+        if let Some(pipe) = inode.downcast_ref::<Pipe>() {
+            Some(pipe.wait_queue())
+        } else if let Some(stdin) = inode.downcast_ref::<Stdin>() {
+            Some(stdin.pushed.clone())
+        } else {
+            None
+        }
+    }
+
     pub fn io_control(&self, cmd: u32, arg: usize) -> Result<()> {
         self.inode.io_control(cmd, arg)
     }
@@ -145,6 +270,24 @@ impl FileHandle {
         self.inode.clone()
     }
 
+    /// Whether both handles are of the same file
+    pub fn same_file(&self, other: &FileHandle) -> bool {
+        Arc::ptr_eq(&self.inode, &other.inode)
+    }
+
+    pub fn offset(&self) -> usize {
+        self.offset as usize
+    }
+
+    /// The pipe if this is an end of one
+    pub fn pipe(&self) -> Option<&Pipe> {
+        self.inode.as_any_ref().downcast_ref::<Pipe>()
+    }
+
+    pub fn nonblock(&self) -> bool {
+        self.options.nonblock
+    }
+
     pub fn fcntl(&mut self, cmd: usize, arg: usize) -> Result<()> {
         if arg == 2048 && cmd == 4 {
             self.options.nonblock = true;
@@ -1,32 +1,47 @@
 use core::fmt;
 
+use super::epoll::EpollInstance;
 use super::ioctl::*;
 use super::FileHandle;
 use crate::net::Socket;
+use crate::sync::Condvar;
 use crate::syscall::{SysError, SysResult};
 use alloc::boxed::Box;
+use alloc::sync::Arc;
 use rcore_fs::vfs::PollStatus;
 
+const F_SETPIPE_SZ: usize = 1031;
+const F_GETPIPE_SZ: usize = 1032;
+
 // TODO: merge FileLike to FileHandle ?
 // TODO: fix dup and remove Clone
 #[derive(Clone)]
 pub enum FileLike {
     File(FileHandle),
     Socket(Box<dyn Socket>),
+    Epoll(Arc<EpollInstance>),
 }
 
 impl FileLike {
     pub fn read(&mut self, buf: &mut [u8]) -> SysResult {
         let len = match self {
-            FileLike::File(file) => file.read(buf)?,
+            FileLike::File(file) => match file.pipe() {
+                Some(pipe) => pipe.read(buf, file.nonblock())?,
+                None => file.read(buf)?,
+            },
             FileLike::Socket(socket) => socket.read(buf).0?,
+            FileLike::Epoll(_) => return Err(SysError::EINVAL),
         };
         Ok(len)
     }
     pub fn write(&mut self, buf: &[u8]) -> SysResult {
         let len = match self {
-            FileLike::File(file) => file.write(buf)?,
+            FileLike::File(file) => match file.pipe() {
+                Some(pipe) => pipe.write(buf, file.nonblock())?,
+                None => file.write(buf)?,
+            },
             FileLike::Socket(socket) => socket.write(buf, None)?,
+            FileLike::Epoll(_) => return Err(SysError::EINVAL),
         };
         Ok(len)
     }
@@ -41,6 +56,7 @@ impl FileLike {
                     FileLike::Socket(socket) => {
                         socket.ioctl(request, arg1, arg2, arg3)?;
                     }
+                    FileLike::Epoll(_) => return Err(SysError::ENOTTY),
                 }
                 Ok(0)
             }
@@ -53,16 +69,40 @@ impl FileLike {
                 let (read, write, error) = socket.poll();
                 PollStatus { read, write, error }
             }
+            FileLike::Epoll(epoll) => PollStatus {
+                read: epoll.has_ready(),
+                write: false,
+                error: false,
+            },
         };
         Ok(status)
     }
 
+    /// Wait queue notified when the readiness may change, None if always ready
+    pub fn wait_queue(&self) -> Option<Arc<Condvar>> {
+        match self {
+            FileLike::File(file) => file.wait_queue(),
+            FileLike::Socket(socket) => socket.wait_queue(),
+            FileLike::Epoll(epoll) => Some(epoll.new_ready.clone()),
+        }
+    }
+
     pub fn fcntl(&mut self, cmd: usize, arg: usize) -> SysResult {
         match self {
-            FileLike::File(file) => file.fcntl(cmd, arg)?,
+            FileLike::File(file) => {
+                if let Some(pipe) = file.pipe() {
+                    match cmd {
+                        F_SETPIPE_SZ => return pipe.set_capacity(arg),
+                        F_GETPIPE_SZ => return Ok(pipe.capacity()),
+                        _ => {}
+                    }
+                }
+                file.fcntl(cmd, arg)?
+            }
             FileLike::Socket(socket) => {
                 //TODO
             }
+            FileLike::Epoll(_) => {}
         }
         Ok(0)
     }
@@ -73,6 +113,7 @@ impl fmt::Debug for FileLike {
         match self {
             FileLike::File(file) => write!(f, "File({:?})", file),
             FileLike::Socket(socket) => write!(f, "Socket({:?})", socket),
+            FileLike::Epoll(_) => write!(f, "Epoll"),
         }
     }
 }
@@ -6,6 +6,7 @@ use rcore_fs_sfs::SimpleFileSystem;
 
 use crate::drivers::BlockDriver;
 
+pub use self::epoll::*;
 pub use self::file::*;
 pub use self::file_like::*;
 pub use self::pipe::Pipe;
@@ -13,12 +14,16 @@ pub use self::pseudo::*;
 pub use self::stdio::{STDIN, STDOUT};
 pub use self::vga::*;
 
+pub mod dcache;
 mod device;
+mod epoll;
 mod file;
 mod file_like;
 mod ioctl;
+pub mod page_cache;
 mod pipe;
 mod pseudo;
+pub mod readahead;
 mod stdio;
 pub mod vga;
 
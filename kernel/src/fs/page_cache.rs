@@ -0,0 +1,301 @@
+//! Page cache of regular files
+//!
+//! Pages are keyed by (inode, page index) and shared by `FileHandle` reads,
+//! `INodeForMap` and read-only file mappings.
+//! A page is pinned while it is mapped or being copied, and only unpinned pages
+//! are evicted in LRU order, when the cache is full or frames run out.
+
+use alloc::collections::BTreeMap;
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::slice;
+
+use rcore_fs::vfs::{FileType, FsError, INode, Result};
+use rcore_memory::PAGE_SIZE;
+
+use crate::memory::{alloc_frame, dealloc_frame, phys_to_virt};
+use crate::sync::SpinNoIrqLock as Mutex;
+
+/// Max number of frames held by the page cache
+const PAGE_CACHE_MAX_PAGES: usize = 4096;
+
+/// Pages evicted at once when a read runs out of frames
+const PAGE_CACHE_SHRINK_BATCH: usize = 32;
+
+lazy_static! {
+    static ref PAGE_CACHE: Mutex<PageCache> = Mutex::new(PageCache::default());
+}
+
+#[derive(Default)]
+struct PageCache {
+    /// cached files, by address of the inode
+    files: BTreeMap<usize, CachedFile>,
+    /// frame -> (file, page index)
+    frames: BTreeMap<usize, (usize, usize)>,
+    /// last access time -> (file, page index), oldest first
+    lru: BTreeMap<u64, (usize, usize)>,
+    clock: u64,
+}
+
+struct CachedFile {
+    inode: Arc<INode>,
+    pages: BTreeMap<usize, CachedPage>,
+}
+
+struct CachedPage {
+    frame: usize,
+    /// number of mappings and readers using the frame
+    pins: usize,
+    last_access: u64,
+}
+
+fn inode_key(inode: &Arc<INode>) -> usize {
+    inode.as_ref() as *const INode as *const u8 as usize
+}
+
+fn frame_data(frame: usize) -> &'static mut [u8] {
+    unsafe { slice::from_raw_parts_mut(phys_to_virt(frame) as *mut u8, PAGE_SIZE) }
+}
+
+impl PageCache {
+    /// Find the page and pin it
+    fn get(&mut self, key: usize, index: usize) -> Option<usize> {
+        let page = self.files.get_mut(&key)?.pages.get_mut(&index)?;
+        page.pins += 1;
+        self.lru.remove(&page.last_access);
+        self.clock += 1;
+        page.last_access = self.clock;
+        self.lru.insert(self.clock, (key, index));
+        Some(page.frame)
+    }
+
+    /// Insert a pinned page filled by the caller
+    fn insert(&mut self, inode: &Arc<INode>, index: usize, frame: usize) {
+        let key = inode_key(inode);
+        self.clock += 1;
+        self.files
+            .entry(key)
+            .or_insert_with(|| CachedFile {
+                inode: inode.clone(),
+                pages: BTreeMap::new(),
+            })
+            .pages
+            .insert(
+                index,
+                CachedPage {
+                    frame,
+                    pins: 1,
+                    last_access: self.clock,
+                },
+            );
+        self.frames.insert(frame, (key, index));
+        self.lru.insert(self.clock, (key, index));
+    }
+
+    fn unpin(&mut self, frame: usize) -> bool {
+        match self.frames.get(&frame) {
+            Some(&(key, index)) => {
+                self.files.get_mut(&key).unwrap().pages.get_mut(&index).unwrap().pins -= 1;
+                true
+            }
+            None => false,
+        }
+    }
+
+    /// Remove an unpinned page and return its frame
+    fn remove(&mut self, key: usize, index: usize) -> Option<usize> {
+        let file = self.files.get_mut(&key)?;
+        if file.pages.get(&index)?.pins != 0 {
+            return None;
+        }
+        let page = file.pages.remove(&index).unwrap();
+        if file.pages.is_empty() {
+            self.files.remove(&key);
+        }
+        self.frames.remove(&page.frame);
+        self.lru.remove(&page.last_access);
+        Some(page.frame)
+    }
+
+    /// Evict up to `count` least recently used unpinned pages
+    fn evict(&mut self, count: usize) -> usize {
+        let victims: Vec<(usize, usize)> = self
+            .lru
+            .values()
+            .filter(|(key, index)| self.files[key].pages[index].pins == 0)
+            .take(count)
+            .cloned()
+            .collect();
+        for &(key, index) in victims.iter() {
+            let frame = self.remove(key, index).unwrap();
+            dealloc_frame(frame);
+        }
+        victims.len()
+    }
+}
+
+/// Whether reads of `inode` should go through the page cache
+pub fn is_cacheable(inode: &Arc<INode>) -> bool {
+    inode.as_any_ref().is::<rcore_fs_sfs::INodeImpl>()
+        && inode
+            .metadata()
+            .map(|m| m.type_ == FileType::File)
+            .unwrap_or(false)
+}
+
+/// Get the frame caching page `index` of `inode`, reading it if missing.
+/// The frame is pinned until `put_page`.
+pub fn get_page(inode: &Arc<INode>, index: usize) -> Result<usize> {
+    let key = inode_key(inode);
+    if let Some(frame) = PAGE_CACHE.lock().get(key, index) {
+        return Ok(frame);
+    }
+    // read without holding the lock, the device may sleep
+    let frame = match alloc_frame() {
+        Some(frame) => frame,
+        None => {
+            // `alloc_frame` skips shrinking if the cache is busy, wait for it here
+            if PAGE_CACHE.lock().evict(PAGE_CACHE_SHRINK_BATCH) == 0 {
+                return Err(FsError::NoDeviceSpace);
+            }
+            alloc_frame().ok_or(FsError::NoDeviceSpace)?
+        }
+    };
+    let data = frame_data(frame);
+    let len = match inode.read_at(index * PAGE_SIZE, data) {
+        Ok(len) => len,
+        Err(err) => {
+            dealloc_frame(frame);
+            return Err(err);
+        }
+    };
+    data[len..].iter_mut().for_each(|x| *x = 0);
+
+    let mut cache = PAGE_CACHE.lock();
+    if let Some(cached) = cache.get(key, index) {
+        // filled by someone else meanwhile
+        drop(cache);
+        dealloc_frame(frame);
+        return Ok(cached);
+    }
+    if cache.frames.len() >= PAGE_CACHE_MAX_PAGES {
+        cache.evict(1);
+    }
+    cache.insert(inode, index, frame);
+    Ok(frame)
+}
+
+/// Unpin a frame got from `get_page`.
+/// Return false if it is not a frame of page cache.
+pub fn put_page(frame: usize) -> bool {
+    PAGE_CACHE.lock().unpin(frame)
+}
+
+/// Read `inode` at `offset` through the page cache
+pub fn read_at(inode: &Arc<INode>, offset: usize, buf: &mut [u8]) -> Result<usize> {
+    let size = inode.metadata()?.size;
+    if offset >= size {
+        return Ok(0);
+    }
+    let end = size.min(offset + buf.len());
+    let mut pos = offset;
+    while pos < end {
+        let index = pos / PAGE_SIZE;
+        let begin = pos % PAGE_SIZE;
+        let len = (PAGE_SIZE - begin).min(end - pos);
+        let frame = get_page(inode, index)?;
+        // copy without the lock, `buf` may fault
+        buf[pos - offset..pos - offset + len]
+            .copy_from_slice(&frame_data(frame)[begin..begin + len]);
+        put_page(frame);
+        pos += len;
+    }
+    Ok(end - offset)
+}
+
+/// Pass the data of `inode` in `offset..offset + len` to `f` page by page,
+/// straight from the cached frames without copying.
+/// `f` returns how many bytes of the slice it consumed, stop if it is short.
+/// Return the total bytes consumed.
+pub fn splice_read<E: From<FsError>>(
+    inode: &Arc<INode>,
+    offset: usize,
+    len: usize,
+    mut f: impl FnMut(&[u8]) -> core::result::Result<usize, E>,
+) -> core::result::Result<usize, E> {
+    let size = inode.metadata()?.size;
+    if offset >= size {
+        return Ok(0);
+    }
+    let end = size.min(offset + len);
+    let mut pos = offset;
+    while pos < end {
+        let index = pos / PAGE_SIZE;
+        let begin = pos % PAGE_SIZE;
+        let len = (PAGE_SIZE - begin).min(end - pos);
+        let frame = get_page(inode, index)?;
+        // the frame is pinned, `f` may sleep
+        let ret = f(&frame_data(frame)[begin..begin + len]);
+        put_page(frame);
+        let consumed = ret?;
+        pos += consumed;
+        if consumed < len {
+            break;
+        }
+    }
+    Ok(pos - offset)
+}
+
+/// Update cached pages after `buf` is written to `inode` at `offset`
+pub fn write_at(inode: &Arc<INode>, offset: usize, buf: &[u8]) {
+    if buf.is_empty() {
+        return;
+    }
+    let key = inode_key(inode);
+    let cache = PAGE_CACHE.lock();
+    let file = match cache.files.get(&key) {
+        Some(file) => file,
+        None => return,
+    };
+    let end = offset + buf.len();
+    for (&index, page) in file.pages.range(offset / PAGE_SIZE..=(end - 1) / PAGE_SIZE) {
+        let page_start = index * PAGE_SIZE;
+        let begin = page_start.max(offset);
+        let stop = (page_start + PAGE_SIZE).min(end);
+        frame_data(page.frame)[begin - page_start..stop - page_start]
+            .copy_from_slice(&buf[begin - offset..stop - offset]);
+    }
+}
+
+/// Drop cached data beyond `len` after `inode` is resized
+pub fn truncate(inode: &Arc<INode>, len: usize) {
+    let key = inode_key(inode);
+    let mut cache = PAGE_CACHE.lock();
+    let indexes: Vec<usize> = match cache.files.get(&key) {
+        Some(file) => file.pages.range(len / PAGE_SIZE..).map(|(&i, _)| i).collect(),
+        None => return,
+    };
+    for index in indexes {
+        let page_start = index * PAGE_SIZE;
+        if page_start >= len {
+            if let Some(frame) = cache.remove(key, index) {
+                dealloc_frame(frame);
+                continue;
+            }
+        }
+        // partial page or still mapped
+        let frame = cache.files[&key].pages[&index].frame;
+        let begin = len.max(page_start) - page_start;
+        frame_data(frame)[begin..].iter_mut().for_each(|x| *x = 0);
+    }
+}
+
+/// Evict up to `count` pages to free frames.
+/// Return the number of frames freed.
+/// Called when frames run out, so skip if the cache is in use.
+pub fn shrink(count: usize) -> usize {
+    match PAGE_CACHE.try_lock() {
+        Some(mut cache) => cache.evict(count),
+        None => 0,
+    }
+}
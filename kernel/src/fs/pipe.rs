@@ -1,12 +1,28 @@
 //! Implement INode for Pipe
+//!
+//! A pipe is a bounded ring of pages. Readers and writers copy whole
+//! chunks in and out of the pages and block on their own wait queue,
+//! readers until there is data and writers until there is room.
+//! `splice` and `tee` move data between pages directly, without a
+//! bounce buffer.
 
-use alloc::{collections::vec_deque::VecDeque, string::String, sync::Arc};
+use alloc::{boxed::Box, collections::vec_deque::VecDeque, string::String, sync::Arc, vec::Vec};
 use core::any::Any;
+use core::cmp::min;
 
 use rcore_fs::vfs::*;
+use rcore_memory::PAGE_SIZE;
 
-use crate::sync::Condvar;
 use crate::sync::SpinNoIrqLock as Mutex;
+use crate::sync::{Condvar, SleepLock};
+use crate::syscall::{SysError, SysResult};
+
+/// Default capacity of a pipe
+pub const PIPE_DEFAULT_SIZE: usize = 16 * PAGE_SIZE;
+/// Max capacity set by F_SETPIPE_SZ, like /proc/sys/fs/pipe-max-size in Linux
+pub const PIPE_MAX_SIZE: usize = 1024 * 1024;
+/// Writes up to this size are atomic
+const PIPE_BUF: usize = PAGE_SIZE;
 
 #[derive(Clone)]
 pub enum PipeEnd {
@@ -14,32 +30,123 @@ pub enum PipeEnd {
     Write,
 }
 
+/// A page of a pipe, with data in `start..end`
+struct PipePage {
+    data: Box<[u8]>,
+    start: usize,
+    end: usize,
+}
+
 pub struct PipeData {
-    buf: VecDeque<u8>,
-    new_data: Condvar,
+    pages: VecDeque<PipePage>,
+    /// a drained page, kept for the next write
+    spare: Option<Box<[u8]>>,
+    /// bytes in the pipe
+    len: usize,
+    /// max bytes in the pipe, a multiple of PAGE_SIZE
+    capacity: usize,
+    /// number of open ends
+    ends: usize,
+}
+
+impl PipeData {
+    /// Append as much of `buf` as fits, return the length appended
+    fn push(&mut self, buf: &[u8]) -> usize {
+        let len = min(buf.len(), self.capacity - self.len);
+        let mut pos = 0;
+        while pos < len {
+            let room = self.pages.back().map_or(0, |page| PAGE_SIZE - page.end);
+            if room == 0 {
+                let data = self
+                    .spare
+                    .take()
+                    .unwrap_or_else(|| vec![0u8; PAGE_SIZE].into_boxed_slice());
+                self.pages.push_back(PipePage {
+                    data,
+                    start: 0,
+                    end: 0,
+                });
+                continue;
+            }
+            let page = self.pages.back_mut().unwrap();
+            let chunk = min(room, len - pos);
+            page.data[page.end..page.end + chunk].copy_from_slice(&buf[pos..pos + chunk]);
+            page.end += chunk;
+            pos += chunk;
+        }
+        self.len += len;
+        len
+    }
+
+    /// The data at the front of the pipe
+    fn front(&self) -> &[u8] {
+        match self.pages.front() {
+            Some(page) => &page.data[page.start..page.end],
+            None => &[],
+        }
+    }
+
+    /// Address and length of the data in each page
+    fn chunks(&self) -> Vec<(*const u8, usize)> {
+        self.pages
+            .iter()
+            .map(|page| (page.data[page.start..].as_ptr(), page.end - page.start))
+            .collect()
+    }
+
+    /// Drop `len` bytes of the front page
+    fn consume(&mut self, len: usize) {
+        let page = self.pages.front_mut().unwrap();
+        page.start += len;
+        self.len -= len;
+        if page.start == page.end {
+            let page = self.pages.pop_front().unwrap();
+            // a page filled up to the end can't be appended to any more
+            if self.spare.is_none() {
+                self.spare = Some(page.data);
+            }
+        }
+    }
+}
+
+struct PipeInner {
+    data: Mutex<PipeData>,
+    /// notified when the pipe becomes readable or broken
+    readable: Arc<Condvar>,
+    /// notified when the pipe becomes writable or broken
+    writable: Arc<Condvar>,
+    /// held by a reader, so that a splice can use the front page unlocked
+    reader: SleepLock<()>,
 }
 
-#[derive(Clone)]
 pub struct Pipe {
-    data: Arc<Mutex<PipeData>>,
+    inner: Arc<PipeInner>,
     direction: PipeEnd,
 }
 
 impl Pipe {
     /// Create a pair of INode: (read, write)
     pub fn create_pair() -> (Pipe, Pipe) {
-        let inner = PipeData {
-            buf: VecDeque::new(),
-            new_data: Condvar::new(),
+        let data = PipeData {
+            pages: VecDeque::new(),
+            spare: None,
+            len: 0,
+            capacity: PIPE_DEFAULT_SIZE,
+            ends: 2,
         };
-        let data = Arc::new(Mutex::new(inner));
+        let inner = Arc::new(PipeInner {
+            data: Mutex::new(data),
+            readable: Arc::new(Condvar::new()),
+            writable: Arc::new(Condvar::new()),
+            reader: SleepLock::new(()),
+        });
         (
             Pipe {
-                data: data.clone(),
+                inner: inner.clone(),
                 direction: PipeEnd::Read,
             },
             Pipe {
-                data: data.clone(),
+                inner,
                 direction: PipeEnd::Write,
             },
         )
@@ -47,7 +154,8 @@ impl Pipe {
 
     fn can_read(&self) -> bool {
         if let PipeEnd::Read = self.direction {
-            self.data.lock().buf.len() > 0 || self.is_broken()
+            let data = self.inner.data.lock();
+            data.len > 0 || data.ends < 2
         } else {
             false
         }
@@ -55,14 +163,229 @@ impl Pipe {
 
     fn can_write(&self) -> bool {
         if let PipeEnd::Write = self.direction {
-            !self.is_broken()
+            let data = self.inner.data.lock();
+            data.len < data.capacity || data.ends < 2
         } else {
             false
         }
     }
 
-    fn is_broken(&self) -> bool {
-        Arc::strong_count(&self.data) < 2
+    /// Notified when the readiness of this end may change
+    pub fn wait_queue(&self) -> Arc<Condvar> {
+        match self.direction {
+            PipeEnd::Read => self.inner.readable.clone(),
+            PipeEnd::Write => self.inner.writable.clone(),
+        }
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.inner.data.lock().capacity
+    }
+
+    /// Set the capacity to at least `size` bytes, for F_SETPIPE_SZ.
+    /// Return the capacity set.
+    pub fn set_capacity(&self, size: usize) -> SysResult {
+        if size > PIPE_MAX_SIZE {
+            return Err(SysError::EPERM);
+        }
+        let capacity = ((size + PAGE_SIZE - 1) / PAGE_SIZE).max(1) * PAGE_SIZE;
+        let mut data = self.inner.data.lock();
+        if capacity < data.len {
+            return Err(SysError::EBUSY);
+        }
+        data.capacity = capacity;
+        drop(data);
+        self.inner.writable.notify_all();
+        Ok(capacity)
+    }
+
+    /// Wait until the pipe has data, then pass the front of it to `f`
+    /// and drop the bytes `f` consumed. Return 0 at the end of file.
+    ///
+    /// `f` is called without the pipe locked, so it may block, e.g. when
+    /// it writes to another pipe. Other readers wait until it returns.
+    fn read_with(&self, nonblock: bool, mut f: impl FnMut(&[u8]) -> SysResult) -> SysResult {
+        if let PipeEnd::Write = self.direction {
+            return Err(SysError::EBADF);
+        }
+        let _reader = self.inner.reader.lock();
+        let mut data = self.inner.data.lock();
+        while data.len == 0 {
+            if data.ends < 2 {
+                return Ok(0);
+            }
+            if nonblock {
+                return Err(SysError::EAGAIN);
+            }
+            data = self.inner.readable.wait(data);
+        }
+        let front = data.front();
+        let chunk = unsafe { core::slice::from_raw_parts(front.as_ptr(), front.len()) };
+        // The front page is only dropped by readers, and we are the only one.
+        // Writers only append after it.
+        drop(data);
+        let result = f(chunk);
+        if let Ok(len) = result {
+            if len > 0 {
+                self.inner.data.lock().consume(len);
+                self.inner.writable.notify_all();
+            }
+        }
+        result
+    }
+
+    /// Read to `buf`, blocking until there is data unless `nonblock`.
+    ///
+    /// `buf` is usually user memory, which may fault and sleep,
+    /// so it is only touched with the pipe unlocked.
+    pub fn read(&self, buf: &mut [u8], nonblock: bool) -> SysResult {
+        if let PipeEnd::Write = self.direction {
+            return Err(SysError::EBADF);
+        }
+        if buf.is_empty() {
+            return Ok(0);
+        }
+        let mut pos = 0;
+        self.splice_to(buf.len(), nonblock, |chunk| {
+            buf[pos..pos + chunk.len()].copy_from_slice(chunk);
+            pos += chunk.len();
+            Ok(chunk.len())
+        })
+    }
+
+    /// Write `buf`, blocking until all of it is written unless `nonblock`.
+    /// Writes up to PIPE_BUF are not interleaved with others.
+    ///
+    /// `buf` is copied to a kernel buffer a PIPE_BUF at a time
+    /// with the pipe unlocked, since touching user memory may fault and sleep.
+    pub fn write(&self, buf: &[u8], nonblock: bool) -> SysResult {
+        if let PipeEnd::Read = self.direction {
+            return Err(SysError::EBADF);
+        }
+        let mut written = 0;
+        let mut bounce = Vec::with_capacity(min(buf.len(), PIPE_BUF));
+        while written < buf.len() {
+            let piece = min(buf.len() - written, PIPE_BUF);
+            bounce.clear();
+            bounce.extend_from_slice(&buf[written..written + piece]);
+            let mut pushed = 0;
+            let mut data = self.inner.data.lock();
+            while pushed < piece {
+                if data.ends < 2 {
+                    return if written + pushed > 0 {
+                        Ok(written + pushed)
+                    } else {
+                        Err(SysError::EPIPE)
+                    };
+                }
+                let left = buf.len() - written - pushed;
+                let room = data.capacity - data.len;
+                if room > 0 && (room >= left || left > PIPE_BUF) {
+                    pushed += data.push(&bounce[pushed..]);
+                    drop(data);
+                    self.inner.readable.notify_all();
+                    data = self.inner.data.lock();
+                    continue;
+                }
+                if nonblock {
+                    return if written + pushed > 0 {
+                        Ok(written + pushed)
+                    } else {
+                        Err(SysError::EAGAIN)
+                    };
+                }
+                data = self.inner.writable.wait(data);
+            }
+            drop(data);
+            written += pushed;
+        }
+        Ok(written)
+    }
+
+    /// Move up to `len` bytes from the front of the pipe to `f` in chunks,
+    /// see `read_with`. `f` returns how many bytes it consumed, stop if it is short.
+    /// Only waits for the first chunk.
+    pub fn splice_to(
+        &self,
+        len: usize,
+        nonblock: bool,
+        mut f: impl FnMut(&[u8]) -> SysResult,
+    ) -> SysResult {
+        let mut pos = 0;
+        while pos < len {
+            let mut short = false;
+            let result = self.read_with(nonblock || pos > 0, |chunk| {
+                let chunk = &chunk[..min(chunk.len(), len - pos)];
+                let consumed = f(chunk)?;
+                short = consumed < chunk.len();
+                Ok(consumed)
+            });
+            match result {
+                Ok(0) => break,
+                Ok(consumed) => pos += consumed,
+                Err(_) if pos > 0 => break,
+                Err(err) => return Err(err),
+            }
+            if short {
+                break;
+            }
+        }
+        Ok(pos)
+    }
+
+    /// Copy up to `len` bytes from the front of this pipe to the pipe `out`,
+    /// without consuming them. Only waits for the first chunk.
+    pub fn tee(&self, out: &Pipe, len: usize, nonblock: bool) -> SysResult {
+        if Arc::ptr_eq(&self.inner, &out.inner) {
+            return Err(SysError::EINVAL);
+        }
+        match (&self.direction, &out.direction) {
+            (PipeEnd::Read, PipeEnd::Write) => {}
+            _ => return Err(SysError::EBADF),
+        }
+        let _reader = self.inner.reader.lock();
+        let mut data = self.inner.data.lock();
+        while data.len == 0 {
+            if data.ends < 2 {
+                return Ok(0);
+            }
+            if nonblock {
+                return Err(SysError::EAGAIN);
+            }
+            data = self.inner.readable.wait(data);
+        }
+        // The pages present stay until we drop the reader lock,
+        // so they are copied unlocked, like `read_with`.
+        let pages = data.chunks();
+        drop(data);
+        let mut pos = 0;
+        for (ptr, page_len) in pages {
+            if pos >= len {
+                break;
+            }
+            let chunk = unsafe { core::slice::from_raw_parts(ptr, page_len) };
+            let chunk = &chunk[..min(chunk.len(), len - pos)];
+            match out.write(chunk, nonblock || pos > 0) {
+                Ok(written) => {
+                    pos += written;
+                    if written < chunk.len() {
+                        break;
+                    }
+                }
+                Err(_) if pos > 0 => break,
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(pos)
+    }
+}
+
+impl Drop for Pipe {
+    fn drop(&mut self) {
+        // the other end sees the pipe broken
+        self.inner.data.lock().ends -= 1;
+        self.inner.readable.notify_all();
+        self.inner.writable.notify_all();
     }
 }
 
@@ -86,33 +409,21 @@ macro_rules! impl_inode {
     };
 }
 
+/// The INode interface never blocks, `FileHandle` uses `Pipe::read/write` instead
 impl INode for Pipe {
     fn read_at(&self, _offset: usize, buf: &mut [u8]) -> Result<usize> {
-        if let PipeEnd::Read = self.direction {
-            let mut data = self.data.lock();
-            if let Some(ch) = data.buf.pop_front() {
-                buf[0] = ch;
-                Ok(1)
-            } else {
-                Ok(0)
-            }
-        } else {
-            Ok(0)
+        match self.read(buf, true) {
+            Ok(len) => Ok(len),
+            Err(SysError::EAGAIN) => Err(FsError::Again),
+            Err(_) => Err(FsError::InvalidParam),
         }
     }
 
     fn write_at(&self, _offset: usize, buf: &[u8]) -> Result<usize> {
-        if let PipeEnd::Write = self.direction {
-            if buf.len() > 0 {
-                let mut data = self.data.lock();
-                data.buf.push_back(buf[0]);
-                data.new_data.notify_all();
-                Ok(1)
-            } else {
-                Ok(0)
-            }
-        } else {
-            Ok(0)
+        match self.write(buf, true) {
+            Ok(len) => Ok(len),
+            Err(SysError::EAGAIN) => Err(FsError::Again),
+            Err(_) => Err(FsError::InvalidParam),
         }
     }
 
@@ -0,0 +1,174 @@
+//! Readahead of sequentially read files into page cache
+//!
+//! Each `FileHandle` detects sequential reads and keeps a window of pages
+//! to prefetch, which doubles on every hit up to `READAHEAD_MAX_PAGES`.
+//! Pages are read by `READAHEAD_WORKERS` kernel threads, so the reader does not
+//! wait for them. The workers take adjacent pages from one queue and read them
+//! at the same time, so the block driver can merge them into one request.
+//! `fadvise` tunes it per file handle: `Random` turns it off, and `Sequential`
+//! keeps it going across seeks.
+
+use alloc::{collections::VecDeque, sync::Arc};
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use rcore_fs::vfs::INode;
+use rcore_memory::PAGE_SIZE;
+
+use super::page_cache;
+use crate::sync::Condvar;
+use crate::sync::SpinNoIrqLock as Mutex;
+use crate::thread;
+
+/// Initial readahead window in pages
+const READAHEAD_INIT_PAGES: usize = 4;
+/// Max readahead window in pages
+const READAHEAD_MAX_PAGES: usize = 64;
+/// Number of kernel threads reading pages
+const READAHEAD_WORKERS: usize = 4;
+/// Max pages queued for the workers, more readahead is dropped
+const READAHEAD_MAX_JOBS: usize = 1024;
+
+/// Access pattern of a file handle, set by `fadvise`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Advice {
+    /// Read ahead while reads are sequential, restart after a seek
+    Normal,
+    /// Read ahead from wherever the reads are, even after a seek
+    Sequential,
+    /// No readahead
+    Random,
+}
+
+impl Default for Advice {
+    fn default() -> Self {
+        Advice::Normal
+    }
+}
+
+/// Sequential access state of a file handle
+#[derive(Debug, Clone, Default)]
+pub struct ReadAhead {
+    /// end offset of the last read
+    prev_end: usize,
+    /// readahead window in pages, 0 if the access is not sequential
+    window: usize,
+    /// end page index of the issued readahead
+    issued_end: usize,
+    advice: Advice,
+}
+
+impl ReadAhead {
+    /// Record a read of `len` bytes at `offset` of `inode`,
+    /// and issue readahead if it is sequential.
+    pub fn on_read(&mut self, inode: &Arc<INode>, offset: usize, len: usize) {
+        if self.advice == Advice::Random {
+            return;
+        }
+        let sequential = offset == self.prev_end;
+        self.prev_end = offset + len;
+        if len == 0 || (!sequential && self.advice == Advice::Normal) {
+            self.window = 0;
+            return;
+        }
+        // the first page not read yet
+        let next = (offset + len + PAGE_SIZE - 1) / PAGE_SIZE;
+        if self.window == 0 {
+            self.window = READAHEAD_INIT_PAGES;
+            self.issued_end = next;
+        } else if !sequential {
+            // advised sequential: go on from the new position
+            self.issued_end = next;
+        }
+        // still far enough from the end of issued readahead
+        if next + self.window / 2 < self.issued_end {
+            return;
+        }
+        let start = self.issued_end.max(next);
+        let end = start + self.window;
+        READAHEAD.push(inode.clone(), start, end);
+        self.issued_end = end;
+        self.window = (self.window * 2).min(READAHEAD_MAX_PAGES);
+    }
+
+    /// Called on `lseek`
+    pub fn on_seek(&mut self) {
+        if self.advice == Advice::Normal {
+            *self = ReadAhead::default();
+            // a read from the new position is not treated as sequential
+            self.prev_end = usize::max_value();
+        }
+    }
+
+    /// Set the access pattern, for `fadvise`
+    pub fn advise(&mut self, advice: Advice) {
+        self.advice = advice;
+        if advice == Advice::Random {
+            self.window = 0;
+        }
+    }
+}
+
+/// Read pages `start..end` of `inode` into page cache in background,
+/// for `POSIX_FADV_WILLNEED`. At most `READAHEAD_MAX_PAGES` are read.
+pub fn will_need(inode: &Arc<INode>, start: usize, end: usize) {
+    let end = end.min(start.saturating_add(READAHEAD_MAX_PAGES));
+    READAHEAD.push(inode.clone(), start, end);
+}
+
+struct ReadAheadQueue {
+    /// Pages to read, one job per page so that workers take adjacent pages
+    jobs: Mutex<VecDeque<(Arc<INode>, usize)>>,
+    pushed: Condvar,
+    started: AtomicBool,
+}
+
+lazy_static! {
+    static ref READAHEAD: ReadAheadQueue = ReadAheadQueue {
+        jobs: Mutex::new(VecDeque::new()),
+        pushed: Condvar::new(),
+        started: AtomicBool::new(false),
+    };
+}
+
+impl ReadAheadQueue {
+    fn push(&self, inode: Arc<INode>, start: usize, end: usize) {
+        if !self.started.swap(true, Ordering::Relaxed) {
+            for _ in 0..READAHEAD_WORKERS {
+                thread::spawn(|| READAHEAD.work());
+            }
+        }
+        let size = match inode.metadata() {
+            Ok(metadata) => metadata.size,
+            Err(_) => return,
+        };
+        let end = end.min((size + PAGE_SIZE - 1) / PAGE_SIZE);
+        if start >= end {
+            return;
+        }
+        let mut jobs = self.jobs.lock();
+        let end = end.min(start + READAHEAD_MAX_JOBS.saturating_sub(jobs.len()));
+        for index in start..end {
+            jobs.push_back((inode.clone(), index));
+        }
+        drop(jobs);
+        self.pushed.notify_all();
+    }
+
+    /// Fill page cache with requested pages
+    fn work(&self) {
+        loop {
+            let mut jobs = self.jobs.lock();
+            let (inode, index) = match jobs.pop_front() {
+                Some(job) => job,
+                None => {
+                    self.pushed.wait(jobs);
+                    continue;
+                }
+            };
+            drop(jobs);
+            if let Ok(frame) = page_cache::get_page(&inode, index) {
+                page_cache::put_page(frame);
+            }
+        }
+    }
+}
@@ -12,7 +12,7 @@ use crate::sync::SpinNoIrqLock as Mutex;
 #[derive(Default)]
 pub struct Stdin {
     buf: Mutex<VecDeque<char>>,
-    pub pushed: Condvar,
+    pub pushed: Arc<Condvar>,
 }
 
 impl Stdin {
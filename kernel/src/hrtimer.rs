@@ -0,0 +1,259 @@
+//! High resolution timers and tickless idle
+//!
+//! Time is read from the cycle counter of the CPU (`arch::timer::get_cycle`),
+//! so clocks, sleeps and timeouts are no longer rounded to the tick.
+//! Each CPU keeps its pending timers ordered by deadline and programs its timer
+//! interrupt for the earliest one: the LAPIC in TSC-deadline mode on x86_64,
+//! `mtimecmp` through SBI on riscv and the board timer on aarch64.
+//!
+//! The periodic tick, which drives `trap::TICK` and time slices, is one more deadline
+//! of each CPU. A CPU that is idle while every run queue is empty stops its tick
+//! until it switches to a thread again, so it only wakes up for its own timers and interrupts.
+//!
+//! Where the timer can only be periodic (mips, x86_64 without TSC-deadline),
+//! every timer interrupt is a tick and timers fire at the first tick after their deadline.
+//!
+//! `rcore_thread`'s `thread::sleep` counts the ticks of CPU 0, use `sleep` here instead.
+
+use alloc::boxed::{Box, FnBox};
+use alloc::collections::BTreeMap;
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use core::time::Duration;
+
+use crate::arch::{cpu, timer};
+use crate::consts::{MAX_CPU_NUM, USEC_PER_TICK};
+use crate::process::{processor, sched};
+use crate::sync::{FlagsGuard, SpinNoIrqLock as Mutex};
+use crate::thread;
+
+pub const NSEC_PER_SEC: u64 = 1_000_000_000;
+pub const NSEC_PER_TICK: u64 = USEC_PER_TICK as u64 * 1000;
+
+type Callback = Box<FnBox() + Send>;
+
+struct CpuTimers {
+    /// Pending timers by (deadline, id)
+    timers: BTreeMap<(u64, usize), Callback>,
+    /// Deadline of the next tick, 0 if the tick is stopped
+    next_tick: u64,
+    /// Deadline the timer interrupt is programmed for
+    programmed: u64,
+    /// The timer interrupt can be programmed for any deadline
+    oneshot: bool,
+}
+
+struct CpuTimerBase {
+    timers: Mutex<CpuTimers>,
+    /// Read on every switch, to restart the tick without taking the lock
+    tick_stopped: AtomicBool,
+}
+
+lazy_static! {
+    static ref CPU_TIMERS: Vec<CpuTimerBase> = (0..MAX_CPU_NUM)
+        .map(|_| CpuTimerBase {
+            timers: Mutex::new(CpuTimers {
+                timers: BTreeMap::new(),
+                next_tick: 0,
+                programmed: u64::max_value(),
+                oneshot: false,
+            }),
+            tick_stopped: AtomicBool::new(false),
+        })
+        .collect();
+}
+
+static NEXT_ID: AtomicUsize = AtomicUsize::new(0);
+
+/// Nanoseconds since the cycle counter started, falling back to ticks without one
+pub fn now() -> u64 {
+    if !has_clock() {
+        return crate::trap::TICK.load(Ordering::Relaxed) as u64 * NSEC_PER_TICK;
+    }
+    cycle_to_nsec(timer::get_cycle())
+}
+
+/// Nanoseconds of `now` at `cycle` of the cycle counter
+pub fn cycle_to_nsec(cycle: u64) -> u64 {
+    let freq = timer::cycle_freq();
+    // split to avoid overflow, without 128-bit division on 32-bit targets
+    cycle / freq * NSEC_PER_SEC + cycle % freq * NSEC_PER_SEC / freq
+}
+
+/// Whether `now` reads a cycle counter rather than the tick
+pub fn has_clock() -> bool {
+    timer::cycle_freq() != 0
+}
+
+fn nsec_to_cycle(nsec: u64) -> u64 {
+    if nsec == u64::max_value() {
+        return nsec;
+    }
+    let freq = timer::cycle_freq();
+    nsec / NSEC_PER_SEC * freq + nsec % NSEC_PER_SEC * freq / NSEC_PER_SEC
+}
+
+fn duration_to_nsec(duration: Duration) -> u64 {
+    duration
+        .as_secs()
+        .saturating_mul(NSEC_PER_SEC)
+        .saturating_add(duration.subsec_nanos() as u64)
+}
+
+/// Deadline `duration` from now, in nanoseconds of `now`
+pub fn deadline_after(duration: Duration) -> u64 {
+    now().saturating_add(duration_to_nsec(duration))
+}
+
+/// Program the timer interrupt of this CPU for its earliest deadline
+fn program(timers: &mut CpuTimers) {
+    let next_timer = timers.timers.keys().next().map(|&(deadline, _)| deadline);
+    let next_tick = match timers.next_tick {
+        0 => None,
+        deadline => Some(deadline),
+    };
+    let deadline = match (next_timer, next_tick) {
+        (Some(a), Some(b)) => a.min(b),
+        (a, b) => a.or(b).unwrap_or(u64::max_value()),
+    };
+    timers.programmed = deadline;
+    timers.oneshot = timer::set_deadline(nsec_to_cycle(deadline));
+}
+
+/// A pending timer, which can be cancelled
+pub struct HrTimer {
+    cpu: usize,
+    key: (u64, usize),
+}
+
+impl HrTimer {
+    /// Run `callback` in the timer interrupt of this CPU at `deadline` nanoseconds of `now`
+    pub fn new(deadline: u64, callback: impl FnOnce() + Send + 'static) -> Self {
+        let _guard = FlagsGuard::no_irq_region();
+        let cpu = cpu::id();
+        let key = (deadline, NEXT_ID.fetch_add(1, Ordering::Relaxed));
+        let mut timers = CPU_TIMERS[cpu].timers.lock();
+        timers.timers.insert(key, Box::new(callback));
+        // a periodic timer must not be reprogrammed, it would delay the tick
+        if timers.oneshot && deadline < timers.programmed {
+            program(&mut timers);
+        }
+        HrTimer { cpu, key }
+    }
+
+    /// Cancel the timer, return false if it has fired already
+    pub fn cancel(&self) -> bool {
+        let callback = CPU_TIMERS[self.cpu].timers.lock().timers.remove(&self.key);
+        callback.is_some()
+    }
+}
+
+/// Sleep until `deadline` nanoseconds of `now`
+pub fn sleep_until(deadline: u64) {
+    let thread = Arc::new(thread::current());
+    let tid = thread.id();
+    while now() < deadline {
+        let timer = {
+            // the timer fires on this CPU, so not before the thread is marked sleeping
+            let _guard = FlagsGuard::no_irq_region();
+            let thread = thread.clone();
+            let timer = HrTimer::new(deadline, move || thread.unpark());
+            processor().manager().sleep(tid, 0);
+            timer
+        };
+        processor().yield_now();
+        timer.cancel();
+    }
+}
+
+/// Sleep for `duration`
+pub fn sleep(duration: Duration) {
+    sleep_until(deadline_after(duration));
+}
+
+/// Timer interrupt of this CPU, from the arch trap handler
+pub fn interrupt() {
+    let cpu = cpu::id();
+    let base = &CPU_TIMERS[cpu];
+    let now = now();
+    let mut expired = Vec::new();
+    let tick = {
+        let mut timers = base.timers.lock();
+        loop {
+            let key = match timers.timers.keys().next() {
+                Some(&key) if key.0 <= now => key,
+                _ => break,
+            };
+            expired.push(timers.timers.remove(&key).unwrap());
+        }
+        // every interrupt of a periodic timer is a tick
+        let tick = !timers.oneshot || (timers.next_tick != 0 && timers.next_tick <= now);
+        if tick {
+            timers.next_tick = now + NSEC_PER_TICK;
+        }
+        if timers.oneshot && processor().tid_option().is_none() && sched::queued() == 0 {
+            // idle with nothing to steal, restarted by `resume_tick`
+            if timers.next_tick != 0 {
+                HRTIMER_STATS.tick_stops.fetch_add(1, Ordering::Relaxed);
+            }
+            timers.next_tick = 0;
+            base.tick_stopped.store(true, Ordering::Relaxed);
+        }
+        // before the tick, which may switch to another thread
+        program(&mut timers);
+        tick
+    };
+    HRTIMER_STATS
+        .fired
+        .fetch_add(expired.len(), Ordering::Relaxed);
+    for callback in expired {
+        callback();
+    }
+    if tick {
+        crate::trap::timer();
+    }
+}
+
+/// Restart the tick of this CPU if it was stopped while idle, called on every switch
+pub fn resume_tick() {
+    let base = &CPU_TIMERS[cpu::id()];
+    if !base.tick_stopped.load(Ordering::Relaxed) {
+        return;
+    }
+    let mut timers = base.timers.lock();
+    base.tick_stopped.store(false, Ordering::Relaxed);
+    timers.next_tick = now() + NSEC_PER_TICK;
+    if timers.next_tick < timers.programmed {
+        program(&mut timers);
+    }
+    drop(timers);
+    // nobody refreshed the clock of the vDSO if every CPU was idle
+    crate::vdso::update();
+}
+
+struct TimerStats {
+    fired: AtomicUsize,
+    tick_stops: AtomicUsize,
+}
+
+static HRTIMER_STATS: TimerStats = TimerStats {
+    fired: AtomicUsize::new(0),
+    tick_stops: AtomicUsize::new(0),
+};
+
+/// Snapshot of the timer counters
+#[derive(Debug, Clone, Copy)]
+pub struct HrTimerStats {
+    /// Timers run
+    pub fired: usize,
+    /// Times an idle CPU stopped its tick
+    pub tick_stops: usize,
+}
+
+pub fn hrtimer_stats() -> HrTimerStats {
+    HrTimerStats {
+        fired: HRTIMER_STATS.fired.load(Ordering::Relaxed),
+        tick_stops: HRTIMER_STATS.tick_stops.load(Ordering::Relaxed),
+    }
+}
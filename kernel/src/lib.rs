@@ -31,6 +31,7 @@ mod backtrace;
 mod consts;
 mod drivers;
 mod fs;
+mod hrtimer;
 mod lang;
 mod memory;
 mod net;
@@ -39,6 +40,7 @@ mod shell;
 mod sync;
 mod syscall;
 mod trap;
+mod vdso;
 
 #[allow(dead_code)]
 #[cfg(target_arch = "x86_64")]
@@ -14,13 +14,15 @@
 
 use super::HEAP_ALLOCATOR;
 pub use crate::arch::paging::*;
-use crate::consts::{MEMORY_OFFSET, PHYSICAL_MEMORY_OFFSET};
+use crate::consts::{MAX_CPU_NUM, MEMORY_OFFSET, PHYSICAL_MEMORY_OFFSET};
 use crate::process::current_thread;
-use crate::sync::SpinNoIrqLock;
+use crate::sync::{FlagsGuard, MutexGuard, SpinNoIrq, SpinNoIrqLock};
+use alloc::vec::Vec;
 use bitmap_allocator::BitAlloc;
 use buddy_system_allocator::Heap;
 use core::mem;
 use core::mem::size_of;
+use core::sync::atomic::{AtomicUsize, Ordering};
 use lazy_static::*;
 use log::*;
 pub use rcore_memory::memory_set::{handler::*, MemoryArea, MemoryAttr};
@@ -64,28 +66,260 @@ pub const fn virt_to_phys(vaddr: usize) -> usize {
     vaddr - PHYSICAL_MEMORY_OFFSET
 }
 
+/// Max number of free frames cached by one CPU
+const FRAME_CACHE_SIZE: usize = 64;
+/// Number of frames moved between a CPU cache and FRAME_ALLOCATOR at once
+const FRAME_CACHE_BATCH: usize = FRAME_CACHE_SIZE / 2;
+
+/// Per-CPU magazine of free frame ids in front of FRAME_ALLOCATOR.
+///
+/// Touched by its own CPU, under a lock which is only contended
+/// when another CPU runs out of frames and drains it.
+struct FrameCache {
+    frames: [usize; FRAME_CACHE_SIZE],
+    len: usize,
+}
+
+lazy_static! {
+    static ref FRAME_CACHES: Vec<SpinNoIrqLock<FrameCache>> = (0..MAX_CPU_NUM)
+        .map(|_| {
+            SpinNoIrqLock::new(FrameCache {
+                frames: [0; FRAME_CACHE_SIZE],
+                len: 0,
+            })
+        })
+        .collect();
+}
+
+impl FrameCache {
+    /// Take frames from the global allocator until the cache is half full
+    fn refill(&mut self) {
+        let mut ba = lock_frame_allocator();
+        while self.len < FRAME_CACHE_BATCH {
+            match ba.alloc() {
+                Some(id) => {
+                    self.frames[self.len] = id;
+                    self.len += 1;
+                }
+                None => break,
+            }
+        }
+        FRAME_STATS.refills.fetch_add(1, Ordering::Relaxed);
+    }
+    /// Return frames to the global allocator until only `keep` are left
+    fn drain(&mut self, keep: usize) {
+        let mut ba = lock_frame_allocator();
+        while self.len > keep {
+            self.len -= 1;
+            ba.dealloc(self.frames[self.len]);
+        }
+        FRAME_STATS.drains.fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// Lock FRAME_ALLOCATOR, counting the times it was held by someone else
+fn lock_frame_allocator() -> MutexGuard<'static, FrameAlloc, SpinNoIrq> {
+    if let Some(guard) = FRAME_ALLOCATOR.try_lock() {
+        return guard;
+    }
+    FRAME_STATS.contended.fetch_add(1, Ordering::Relaxed);
+    FRAME_ALLOCATOR.lock()
+}
+
+/// Run `f` on the frame cache of current CPU.
+/// If the thread migrated right before locking, it touches the cache of
+/// the previous CPU, which is still safe under the lock.
+fn with_frame_cache<R>(f: impl FnOnce(&mut FrameCache) -> R) -> R {
+    with_frame_cache_of(crate::arch::cpu::id(), f)
+}
+
+/// Run `f` on the frame cache of `cpu` with the cache locked
+fn with_frame_cache_of<R>(cpu: usize, f: impl FnOnce(&mut FrameCache) -> R) -> R {
+    f(&mut FRAME_CACHES[cpu].lock())
+}
+
+/// Return the frames cached by other CPUs to FRAME_ALLOCATOR,
+/// when current CPU found none left there. Return the number of frames returned.
+fn drain_remote_frame_caches() -> usize {
+    let this = crate::arch::cpu::id();
+    let mut drained = 0;
+    for cpu in (0..MAX_CPU_NUM).filter(|&cpu| cpu != this) {
+        drained += with_frame_cache_of(cpu, |cache| {
+            let len = cache.len;
+            if len > 0 {
+                cache.drain(0);
+            }
+            len
+        });
+    }
+    FRAME_STATS.stolen.fetch_add(drained, Ordering::Relaxed);
+    drained
+}
+
+struct FrameStats {
+    hits: AtomicUsize,
+    misses: AtomicUsize,
+    refills: AtomicUsize,
+    drains: AtomicUsize,
+    contended: AtomicUsize,
+    contiguous: AtomicUsize,
+    contiguous_failed: AtomicUsize,
+    stolen: AtomicUsize,
+}
+
+static FRAME_STATS: FrameStats = FrameStats {
+    hits: AtomicUsize::new(0),
+    misses: AtomicUsize::new(0),
+    refills: AtomicUsize::new(0),
+    drains: AtomicUsize::new(0),
+    contended: AtomicUsize::new(0),
+    contiguous: AtomicUsize::new(0),
+    contiguous_failed: AtomicUsize::new(0),
+    stolen: AtomicUsize::new(0),
+};
+
+/// Snapshot of the frame allocator counters
+#[derive(Debug, Clone, Copy)]
+pub struct FrameAllocStats {
+    /// Allocations served by the per-CPU cache
+    pub hits: usize,
+    /// Allocations that had to go to FRAME_ALLOCATOR
+    pub misses: usize,
+    /// Batched refills from FRAME_ALLOCATOR
+    pub refills: usize,
+    /// Batched drains to FRAME_ALLOCATOR
+    pub drains: usize,
+    /// Times FRAME_ALLOCATOR was found locked by another CPU
+    pub contended: usize,
+    /// Contiguous ranges allocated, i.e. huge pages
+    pub contiguous: usize,
+    /// Contiguous allocations that found no free range
+    pub contiguous_failed: usize,
+    /// Frames drained from the caches of other CPUs when FRAME_ALLOCATOR ran out
+    pub stolen: usize,
+    /// Free frames currently held in per-CPU caches
+    pub cached: usize,
+}
+
+pub fn frame_alloc_stats() -> FrameAllocStats {
+    let cached = FRAME_CACHES.iter().map(|c| c.lock().len).sum();
+    FrameAllocStats {
+        hits: FRAME_STATS.hits.load(Ordering::Relaxed),
+        misses: FRAME_STATS.misses.load(Ordering::Relaxed),
+        refills: FRAME_STATS.refills.load(Ordering::Relaxed),
+        drains: FRAME_STATS.drains.load(Ordering::Relaxed),
+        contended: FRAME_STATS.contended.load(Ordering::Relaxed),
+        contiguous: FRAME_STATS.contiguous.load(Ordering::Relaxed),
+        contiguous_failed: FRAME_STATS.contiguous_failed.load(Ordering::Relaxed),
+        stolen: FRAME_STATS.stolen.load(Ordering::Relaxed),
+        cached,
+    }
+}
+
 #[derive(Debug, Clone, Copy)]
 pub struct GlobalFrameAlloc;
 
+/// Take a frame id from the cache of current CPU
+fn alloc_frame_id() -> Option<usize> {
+    with_frame_cache(|cache| {
+        if cache.len > 0 {
+            FRAME_STATS.hits.fetch_add(1, Ordering::Relaxed);
+        } else {
+            FRAME_STATS.misses.fetch_add(1, Ordering::Relaxed);
+            cache.refill();
+            if cache.len == 0 {
+                return None;
+            }
+        }
+        cache.len -= 1;
+        Some(cache.frames[cache.len])
+    })
+}
+
 impl FrameAllocator for GlobalFrameAlloc {
     fn alloc(&self) -> Option<usize> {
+        let mut id = alloc_frame_id();
+        if id.is_none() && drain_remote_frame_caches() > 0 {
+            // FRAME_ALLOCATOR is empty: retry with frames cached by other CPUs
+            id = alloc_frame_id();
+        }
+        if id.is_none() && crate::fs::page_cache::shrink(FRAME_CACHE_BATCH) > 0 {
+            // memory pressure: retry with frames from page cache
+            id = alloc_frame_id();
+        }
         // get the real address of the alloc frame
-        let ret = FRAME_ALLOCATOR
-            .lock()
-            .alloc()
-            .map(|id| id * PAGE_SIZE + MEMORY_OFFSET);
+        let ret = id.map(|id| id * PAGE_SIZE + MEMORY_OFFSET);
         trace!("Allocate frame: {:x?}", ret);
         ret
         // TODO: try to swap out when alloc failed
     }
     fn dealloc(&self, target: usize) {
         trace!("Deallocate frame: {:x}", target);
-        FRAME_ALLOCATOR
-            .lock()
-            .dealloc((target - MEMORY_OFFSET) / PAGE_SIZE);
+        let id = (target - MEMORY_OFFSET) / PAGE_SIZE;
+        with_frame_cache(|cache| {
+            if cache.len == FRAME_CACHE_SIZE {
+                cache.drain(FRAME_CACHE_BATCH);
+            }
+            cache.frames[cache.len] = id;
+            cache.len += 1;
+        });
+    }
+    fn alloc_contiguous(&self, count: usize, align: usize) -> Option<usize> {
+        let align = (align / PAGE_SIZE).max(1);
+        // frame ids are relative to MEMORY_OFFSET, align the physical address
+        let skew = (MEMORY_OFFSET / PAGE_SIZE) % align;
+        let align_up = |id: usize| (id + skew + align - 1) / align * align - skew;
+        let mut ba = lock_frame_allocator();
+        let mut key = CONTIGUOUS_HINT.load(Ordering::Relaxed);
+        let mut wrapped = false;
+        for _ in 0..CONTIGUOUS_TRIES {
+            let start = match ba.next(key).map(align_up) {
+                Some(start) if start + count <= FrameAlloc::CAP => start,
+                _ if !wrapped => {
+                    wrapped = true;
+                    key = 0;
+                    continue;
+                }
+                _ => break,
+            };
+            match (start..start + count).find(|&id| !ba.test(id)) {
+                Some(used) => key = used + 1,
+                None => {
+                    ba.remove(start..start + count);
+                    CONTIGUOUS_HINT.store(start + count, Ordering::Relaxed);
+                    FRAME_STATS.contiguous.fetch_add(1, Ordering::Relaxed);
+                    let ret = start * PAGE_SIZE + MEMORY_OFFSET;
+                    trace!("Allocate {} contiguous frames: {:x}", count, ret);
+                    return Some(ret);
+                }
+            }
+        }
+        FRAME_STATS
+            .contiguous_failed
+            .fetch_add(1, Ordering::Relaxed);
+        None
+    }
+    fn dealloc_contiguous(&self, target: usize, count: usize) {
+        trace!("Deallocate {} contiguous frames: {:x}", count, target);
+        // bypass the frame caches, so that the range can be allocated at once again
+        let start = (target - MEMORY_OFFSET) / PAGE_SIZE;
+        let mut ba = lock_frame_allocator();
+        for id in start..start + count {
+            ba.dealloc(id);
+        }
+    }
+    fn no_irq<R>(&self, f: impl FnOnce() -> R) -> R {
+        let _guard = FlagsGuard::no_irq_region();
+        f()
     }
 }
 
+/// Frame id to look for contiguous frames from
+static CONTIGUOUS_HINT: AtomicUsize = AtomicUsize::new(0);
+/// Max candidate ranges checked by one `alloc_contiguous`,
+/// bounding the time FRAME_ALLOCATOR is held with a fragmented memory
+const CONTIGUOUS_TRIES: usize = 64;
+
 pub fn alloc_frame() -> Option<usize> {
     GlobalFrameAlloc.alloc()
 }
@@ -139,6 +373,8 @@ pub fn init_heap() {
             .lock()
             .init(HEAP.as_ptr() as usize, HEAP_BLOCK * MACHINE_ALIGN);
     }
+    // allocated now, as frames are allocated while the heap is enlarged
+    lazy_static::initialize(&FRAME_CACHES);
     info!("heap init end");
 }
 
@@ -1,5 +1,9 @@
+mod packet_ring;
+mod softirq;
 mod structs;
 mod test;
 
+pub use self::packet_ring::{packet_tap, PacketRingMap};
+pub use self::softirq::{init, kick};
 pub use self::structs::*;
-pub use self::test::server;
+pub use self::test::{bench_raw_send, bench_udp_send, server};
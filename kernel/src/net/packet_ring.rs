@@ -0,0 +1,477 @@
+//! Memory-mapped RX/TX rings of packet sockets, like PACKET_MMAP in Linux
+//!
+//! A ring is an array of frames in pages shared by the kernel and the user.
+//! Each frame starts with a `TPacketHdr`, whose `tp_status` tells who owns it.
+//! The kernel fills an RX frame with a received packet and hands it to the user.
+//! The user fills TX frames and hands them to the kernel, which sends all of
+//! them on the next `send`. So a batch of packets moves without a syscall
+//! and without a copy per packet between the user and the kernel.
+
+use alloc::boxed::Box;
+use alloc::sync::{Arc, Weak};
+use alloc::vec::Vec;
+use core::cmp::min;
+use core::fmt;
+use core::mem::size_of;
+use core::ptr::copy_nonoverlapping;
+use core::slice;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use rcore_memory::memory_set::handler::MemoryHandler;
+use rcore_memory::memory_set::MemoryAttr;
+use rcore_memory::paging::PageTable;
+use rcore_memory::{VirtAddr, PAGE_SIZE};
+use spin::RwLock;
+
+use crate::hrtimer::{self, NSEC_PER_SEC};
+use crate::memory::{alloc_frame, dealloc_frame, phys_to_virt};
+use crate::sync::{Condvar, SpinNoIrqLock as Mutex};
+use crate::syscall::{epoch_nsec_at, AddressFamily, SockAddrLl, SysError};
+
+/// RX frame owned by the kernel
+pub const TP_STATUS_KERNEL: usize = 0;
+/// RX frame holding a packet for the user
+pub const TP_STATUS_USER: usize = 1;
+/// RX packet truncated to the frame
+pub const TP_STATUS_COPY: usize = 1 << 1;
+/// packets were dropped since the last RX frame, because the ring was full
+pub const TP_STATUS_LOSING: usize = 1 << 2;
+/// TX frame free for the user
+pub const TP_STATUS_AVAILABLE: usize = 0;
+/// TX frame filled by the user, to be sent
+pub const TP_STATUS_SEND_REQUEST: usize = 1;
+/// TX frame the kernel failed to send
+pub const TP_STATUS_WRONG_FORMAT: usize = 1 << 2;
+
+/// Max pages of a ring
+const PACKET_RING_MAX_PAGES: usize = 1024;
+const TPACKET_ALIGNMENT: usize = 16;
+/// Length of an ethernet header
+const ETHERNET_HEADER_LEN: usize = 14;
+
+const fn tpacket_align(len: usize) -> usize {
+    (len + TPACKET_ALIGNMENT - 1) & !(TPACKET_ALIGNMENT - 1)
+}
+
+/// Offset of the packet in a TX frame
+const TX_DATA_OFFSET: usize = tpacket_align(size_of::<TPacketHdr>());
+/// Offset of the packet in an RX frame, after the header and a `sockaddr_ll`
+const RX_DATA_OFFSET: usize = tpacket_align(TX_DATA_OFFSET + size_of::<SockAddrLl>());
+
+/// `struct tpacket_req`, argument of PACKET_RX_RING and PACKET_TX_RING
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct TPacketReq {
+    pub block_size: u32,
+    pub block_nr: u32,
+    pub frame_size: u32,
+    pub frame_nr: u32,
+}
+
+/// `struct tpacket_hdr`, at the start of every frame
+#[repr(C)]
+struct TPacketHdr {
+    tp_status: AtomicUsize,
+    tp_len: u32,
+    tp_snaplen: u32,
+    tp_mac: u16,
+    tp_net: u16,
+    tp_sec: u32,
+    tp_usec: u32,
+}
+
+/// A ring of frames shared with the user
+pub struct PacketRing {
+    /// physical address of the pages, in the order they are mapped
+    pages: Vec<usize>,
+    block_size: usize,
+    frame_size: usize,
+    frame_nr: usize,
+    frames_per_block: usize,
+    /// next frame the kernel fills (RX) or looks at for sending (TX)
+    head: Mutex<usize>,
+    packets: AtomicUsize,
+    /// packets dropped because the ring was full
+    drops: AtomicUsize,
+}
+
+impl PacketRing {
+    /// Allocate a ring of zeroed pages as asked by `req`
+    ///
+    /// Blocks are laid out as in Linux, but a frame must not cross a page,
+    /// because the pages are not contiguous in the kernel.
+    pub fn new(req: &TPacketReq) -> Result<Arc<Self>, SysError> {
+        let block_size = req.block_size as usize;
+        let block_nr = req.block_nr as usize;
+        let frame_size = req.frame_size as usize;
+        let frame_nr = req.frame_nr as usize;
+        if block_size == 0 || block_size % PAGE_SIZE != 0 {
+            return Err(SysError::EINVAL);
+        }
+        if frame_size < RX_DATA_OFFSET
+            || frame_size % TPACKET_ALIGNMENT != 0
+            || frame_size > PAGE_SIZE
+            || (block_size != PAGE_SIZE && PAGE_SIZE % frame_size != 0)
+        {
+            return Err(SysError::EINVAL);
+        }
+        let frames_per_block = block_size / frame_size;
+        if frame_nr == 0 || frame_nr != frames_per_block * block_nr {
+            return Err(SysError::EINVAL);
+        }
+        let page_nr = block_nr * (block_size / PAGE_SIZE);
+        if page_nr > PACKET_RING_MAX_PAGES {
+            return Err(SysError::ENOMEM);
+        }
+
+        let mut ring = PacketRing {
+            pages: Vec::with_capacity(page_nr),
+            block_size,
+            frame_size,
+            frame_nr,
+            frames_per_block,
+            head: Mutex::new(0),
+            packets: AtomicUsize::new(0),
+            drops: AtomicUsize::new(0),
+        };
+        for _ in 0..page_nr {
+            // the pages allocated so far are freed by drop
+            let paddr = alloc_frame().ok_or(SysError::ENOMEM)?;
+            unsafe {
+                (phys_to_virt(paddr) as *mut u8).write_bytes(0, PAGE_SIZE);
+            }
+            ring.pages.push(paddr);
+        }
+        Ok(Arc::new(ring))
+    }
+
+    /// Size of the ring in user memory
+    pub fn size(&self) -> usize {
+        self.pages.len() * PAGE_SIZE
+    }
+
+    /// Return (packets, drops) since the last call
+    pub fn take_stats(&self) -> (usize, usize) {
+        (
+            self.packets.swap(0, Ordering::Relaxed),
+            self.drops.swap(0, Ordering::Relaxed),
+        )
+    }
+
+    /// Kernel virtual address of frame `index`
+    fn frame(&self, index: usize) -> usize {
+        let block = index / self.frames_per_block;
+        let offset = block * self.block_size + index % self.frames_per_block * self.frame_size;
+        phys_to_virt(self.pages[offset / PAGE_SIZE]) + offset % PAGE_SIZE
+    }
+
+    fn header(&self, index: usize) -> &mut TPacketHdr {
+        unsafe { &mut *(self.frame(index) as *mut TPacketHdr) }
+    }
+
+    /// Copy a received `packet` of interface `ifindex` to the next frame.
+    /// Return false if the frame is still owned by the user.
+    pub fn receive(&self, ifindex: usize, packet: &[u8]) -> bool {
+        let mut head = self.head.lock();
+        let header = self.header(*head);
+        if header.tp_status.load(Ordering::Acquire) != TP_STATUS_KERNEL {
+            self.drops.fetch_add(1, Ordering::Relaxed);
+            return false;
+        }
+        let snaplen = min(packet.len(), self.frame_size - RX_DATA_OFFSET);
+        let frame = self.frame(*head);
+        unsafe {
+            copy_nonoverlapping(
+                packet.as_ptr(),
+                (frame + RX_DATA_OFFSET) as *mut u8,
+                snaplen,
+            );
+            let addr = &mut *((frame + TX_DATA_OFFSET) as *mut SockAddrLl);
+            addr.sll_family = AddressFamily::Packet.into();
+            addr.sll_protocol = if packet.len() >= ETHERNET_HEADER_LEN {
+                u16::from_ne_bytes([packet[12], packet[13]])
+            } else {
+                0
+            };
+            // ifindex counts from 1 for the user
+            addr.sll_ifindex = ifindex as u32 + 1;
+            addr.sll_hatype = 1; // ARPHRD_ETHER
+            addr.sll_pkttype = 0;
+            addr.sll_halen = 6;
+            addr.sll_addr = [0; 8];
+            if packet.len() >= ETHERNET_HEADER_LEN {
+                addr.sll_addr[..6].copy_from_slice(&packet[6..12]);
+            }
+        }
+        let nsec = epoch_nsec_at(hrtimer::now());
+        header.tp_len = packet.len() as u32;
+        header.tp_snaplen = snaplen as u32;
+        header.tp_mac = RX_DATA_OFFSET as u16;
+        header.tp_net = (RX_DATA_OFFSET + ETHERNET_HEADER_LEN) as u16;
+        header.tp_sec = (nsec / NSEC_PER_SEC) as u32;
+        header.tp_usec = (nsec % NSEC_PER_SEC / 1000) as u32;
+        let mut status = TP_STATUS_USER;
+        if snaplen < packet.len() {
+            status |= TP_STATUS_COPY;
+        }
+        if self.drops.load(Ordering::Relaxed) != 0 {
+            status |= TP_STATUS_LOSING;
+        }
+        // hand the frame to the user after its content
+        header.tp_status.store(status, Ordering::Release);
+        self.packets.fetch_add(1, Ordering::Relaxed);
+        *head = (*head + 1) % self.frame_nr;
+        true
+    }
+
+    /// Whether the last filled RX frame is waiting for the user
+    pub fn has_user_frames(&self) -> bool {
+        let head = *self.head.lock();
+        let last = (head + self.frame_nr - 1) % self.frame_nr;
+        self.header(last).tp_status.load(Ordering::Acquire) != TP_STATUS_KERNEL
+    }
+
+    /// Send the TX frames filled by the user in order, by `send`,
+    /// until a frame is not ready. Return the number of bytes sent.
+    pub fn transmit(&self, mut send: impl FnMut(&[u8]) -> bool) -> Result<usize, SysError> {
+        let mut head = self.head.lock();
+        let mut bytes = 0;
+        for _ in 0..self.frame_nr {
+            let header = self.header(*head);
+            if header.tp_status.load(Ordering::Acquire) != TP_STATUS_SEND_REQUEST {
+                break;
+            }
+            let len = header.tp_len as usize;
+            let status = if len > self.frame_size - TX_DATA_OFFSET {
+                TP_STATUS_WRONG_FORMAT
+            } else {
+                let data = unsafe {
+                    slice::from_raw_parts((self.frame(*head) + TX_DATA_OFFSET) as *const u8, len)
+                };
+                if !send(data) {
+                    // keep the frame for the next send
+                    return if bytes == 0 {
+                        Err(SysError::ENOBUFS)
+                    } else {
+                        Ok(bytes)
+                    };
+                }
+                bytes += len;
+                self.packets.fetch_add(1, Ordering::Relaxed);
+                TP_STATUS_AVAILABLE
+            };
+            header.tp_status.store(status, Ordering::Release);
+            *head = (*head + 1) % self.frame_nr;
+        }
+        Ok(bytes)
+    }
+}
+
+impl Drop for PacketRing {
+    fn drop(&mut self) {
+        for &paddr in self.pages.iter() {
+            dealloc_frame(paddr);
+        }
+    }
+}
+
+impl fmt::Debug for PacketRing {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(
+            f,
+            "PacketRing {{ frame_size: {}, frame_nr: {} }}",
+            self.frame_size, self.frame_nr
+        )
+    }
+}
+
+/// Map the RX ring and then the TX ring of a packet socket to user memory,
+/// keeping them alive as long as they are mapped
+#[derive(Debug, Clone)]
+pub struct PacketRingMap {
+    mem_start: VirtAddr,
+    rx: Option<Arc<PacketRing>>,
+    tx: Option<Arc<PacketRing>>,
+}
+
+impl PacketRingMap {
+    pub fn new(
+        mem_start: VirtAddr,
+        rx: Option<Arc<PacketRing>>,
+        tx: Option<Arc<PacketRing>>,
+    ) -> Self {
+        PacketRingMap { mem_start, rx, tx }
+    }
+
+    pub fn size(&self) -> usize {
+        self.rx
+            .iter()
+            .chain(self.tx.iter())
+            .map(|ring| ring.size())
+            .sum()
+    }
+
+    fn target(&self, addr: VirtAddr) -> usize {
+        let mut index = (addr - self.mem_start) / PAGE_SIZE;
+        for ring in self.rx.iter().chain(self.tx.iter()) {
+            if index < ring.pages.len() {
+                return ring.pages[index];
+            }
+            index -= ring.pages.len();
+        }
+        panic!("address {:#x} out of packet rings", addr);
+    }
+}
+
+impl MemoryHandler for PacketRingMap {
+    fn box_clone(&self) -> Box<MemoryHandler> {
+        Box::new(self.clone())
+    }
+
+    fn map(&self, pt: &mut PageTable, addr: VirtAddr, attr: &MemoryAttr) {
+        let entry = pt.map(addr, self.target(addr));
+        attr.apply(entry);
+    }
+
+    fn unmap(&self, pt: &mut PageTable, addr: VirtAddr) {
+        pt.unmap(addr);
+    }
+
+    fn clone_map(
+        &self,
+        pt: &mut PageTable,
+        _src_pt: &mut PageTable,
+        addr: VirtAddr,
+        attr: &MemoryAttr,
+    ) {
+        // the rings stay shared with the child
+        self.map(pt, addr, attr);
+    }
+
+    fn handle_page_fault(&self, _pt: &mut PageTable, _addr: VirtAddr) -> bool {
+        false
+    }
+}
+
+/// Interface index of a packet socket bound to no interface
+const ANY_IFINDEX: usize = usize::max_value();
+
+/// Packet socket state shared by its clones and `packet_tap`
+pub struct PacketSocketShared {
+    /// bound interface as an index of `NET_DRIVERS`, or ANY_IFINDEX.
+    /// The user sees it plus 1, as ifindex counts from 1.
+    ifindex: AtomicUsize,
+    rx_ring: Mutex<Option<Arc<PacketRing>>>,
+    tx_ring: Mutex<Option<Arc<PacketRing>>>,
+    pub wait_queue: Arc<Condvar>,
+}
+
+impl PacketSocketShared {
+    pub fn new() -> Arc<Self> {
+        Arc::new(PacketSocketShared {
+            ifindex: AtomicUsize::new(ANY_IFINDEX),
+            rx_ring: Mutex::new(None),
+            tx_ring: Mutex::new(None),
+            wait_queue: Arc::new(Condvar::new()),
+        })
+    }
+
+    /// Bind to interface `ifindex`, or to any with None
+    pub fn bind(&self, ifindex: Option<usize>) {
+        self.ifindex
+            .store(ifindex.unwrap_or(ANY_IFINDEX), Ordering::Relaxed);
+    }
+
+    /// The bound interface, if any
+    pub fn ifindex(&self) -> Option<usize> {
+        match self.ifindex.load(Ordering::Relaxed) {
+            ANY_IFINDEX => None,
+            index => Some(index),
+        }
+    }
+
+    /// Set up or tear down (with `block_nr` 0) the RX or TX ring
+    pub fn set_ring(socket: &Arc<Self>, tx: bool, req: &TPacketReq) -> Result<(), SysError> {
+        let ring = if req.block_nr == 0 {
+            None
+        } else {
+            Some(PacketRing::new(req)?)
+        };
+        let mut slot = if tx {
+            socket.tx_ring.lock()
+        } else {
+            socket.rx_ring.lock()
+        };
+        if let Some(old) = slot.as_ref() {
+            // still mapped by someone
+            if Arc::strong_count(old) > 1 {
+                return Err(SysError::EBUSY);
+            }
+        }
+        *slot = ring;
+        if !tx && slot.is_some() {
+            drop(slot);
+            register_packet_tap(socket);
+        }
+        Ok(())
+    }
+
+    pub fn rx_ring(&self) -> Option<Arc<PacketRing>> {
+        self.rx_ring.lock().clone()
+    }
+
+    pub fn tx_ring(&self) -> Option<Arc<PacketRing>> {
+        self.tx_ring.lock().clone()
+    }
+
+    /// Map the rings to user memory at `mem_start`
+    pub fn mmap(
+        &self,
+        mem_start: VirtAddr,
+        len: usize,
+        offset: usize,
+    ) -> Result<PacketRingMap, SysError> {
+        let map = PacketRingMap::new(mem_start, self.rx_ring(), self.tx_ring());
+        if map.size() == 0 {
+            return Err(SysError::EINVAL);
+        }
+        if offset != 0 || (len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE != map.size() {
+            return Err(SysError::EINVAL);
+        }
+        Ok(map)
+    }
+}
+
+lazy_static! {
+    /// Packet sockets with an RX ring
+    static ref PACKET_TAPS: RwLock<Vec<Weak<PacketSocketShared>>> = RwLock::new(Vec::new());
+}
+
+/// Start delivering received packets to `socket`, until it is dropped
+fn register_packet_tap(socket: &Arc<PacketSocketShared>) {
+    let mut taps = PACKET_TAPS.write();
+    taps.retain(|tap| match tap.upgrade() {
+        Some(tap) => !Arc::ptr_eq(&tap, socket),
+        None => false,
+    });
+    taps.push(Arc::downgrade(socket));
+}
+
+/// Copy a packet received by interface `ifindex` to the RX rings capturing it.
+/// Called by the drivers for every received frame.
+pub fn packet_tap(ifindex: usize, packet: &[u8]) {
+    let taps = PACKET_TAPS.read();
+    if taps.is_empty() {
+        return;
+    }
+    for socket in taps.iter().filter_map(|tap| tap.upgrade()) {
+        if socket.ifindex().map_or(false, |index| index != ifindex) {
+            continue;
+        }
+        if let Some(ring) = socket.rx_ring() {
+            if ring.receive(ifindex, packet) {
+                socket.wait_queue.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,62 @@
+//! Net thread polling the interfaces for all sockets
+//!
+//! Interrupt handlers and socket operations only `kick` the thread,
+//! which moves socket data in and out of `SOCKETS` and polls the interfaces
+//! in one place, instead of every caller locking `SOCKETS` to poll.
+//! Between kicks it sleeps until the next timer of smoltcp is due,
+//! so an idle CPU is not woken up when there is nothing to do.
+
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use super::structs::{poll_delay, poll_ifaces};
+use crate::sync::Condvar;
+use crate::thread;
+
+struct NetSoftirq {
+    /// set by `kick`, cleared by the net thread before polling
+    pending: AtomicBool,
+    kicked: Condvar,
+}
+
+lazy_static! {
+    static ref NET_SOFTIRQ: NetSoftirq = NetSoftirq {
+        pending: AtomicBool::new(false),
+        kicked: Condvar::new(),
+    };
+}
+
+/// Start the net thread
+pub fn init() {
+    thread::spawn(|| NET_SOFTIRQ.work());
+}
+
+/// Request a poll from the net thread
+pub fn kick() {
+    NET_SOFTIRQ.pending.store(true, Ordering::Release);
+    NET_SOFTIRQ.kicked.notify_one();
+}
+
+impl NetSoftirq {
+    fn work(&self) {
+        loop {
+            let kicked = || {
+                if self.pending.swap(false, Ordering::Acquire) {
+                    Some(())
+                } else {
+                    None
+                }
+            };
+            match poll_delay() {
+                Some(delay) => {
+                    Condvar::wait_events_timeout(&[&self.kicked], delay, kicked);
+                }
+                None => Condvar::wait_events(&[&self.kicked], kicked),
+            }
+            if poll_ifaces() {
+                // out of budget with packets left, poll again after others ran
+                self.pending.store(true, Ordering::Release);
+                thread::yield_now();
+            }
+        }
+    }
+}
@@ -1,16 +1,22 @@
+use super::kick;
+use super::packet_ring::{PacketRing, PacketRingMap, PacketSocketShared, TPacketReq};
 use crate::arch::rand;
-use crate::drivers::{NET_DRIVERS, SOCKET_ACTIVITY};
-use crate::sync::SpinNoIrqLock as Mutex;
+use crate::drivers::NET_DRIVERS;
+use crate::hrtimer;
+use crate::sync::{Condvar, MutexGuard, SpinNoIrq, SpinNoIrqLock as Mutex};
 use crate::syscall::*;
 use crate::util;
 use alloc::boxed::Box;
+use alloc::collections::{BTreeMap, BTreeSet, VecDeque};
 use alloc::fmt::Debug;
-use alloc::sync::Arc;
+use alloc::sync::{Arc, Weak};
 use alloc::vec::Vec;
 use bitflags::*;
 use core::cmp::min;
+use core::fmt;
 use core::mem::size_of;
 use core::slice;
+use core::time::Duration;
 
 use smoltcp::socket::*;
 use smoltcp::wire::*;
@@ -54,6 +60,49 @@ pub enum Endpoint {
 pub trait Socket: Send + Sync + Debug {
     fn read(&self, data: &mut [u8]) -> (SysResult, Endpoint);
     fn write(&self, data: &[u8], sendto_endpoint: Option<Endpoint>) -> SysResult;
+    /// Read a packet scattered to `bufs`
+    fn read_vectored(&self, bufs: &mut IoVecs) -> (SysResult, Endpoint) {
+        let mut buf = bufs.new_buf(true);
+        let (result, endpoint) = self.read(&mut buf);
+        if let Ok(len) = result {
+            bufs.write_all_from_slice(&buf[..len]);
+        }
+        (result, endpoint)
+    }
+    /// Write a packet gathered from `bufs`
+    fn write_vectored(&self, bufs: &IoVecs, sendto_endpoint: Option<Endpoint>) -> SysResult {
+        self.write(&bufs.read_all_to_vec(), sendto_endpoint)
+    }
+    /// Read a packet into each of `msgs`, waiting only for the first one.
+    /// Return the length and the source of each packet read.
+    fn read_batch(&self, msgs: &mut [IoVecs]) -> Result<Vec<(usize, Endpoint)>, SysError> {
+        let mut packets = Vec::new();
+        for bufs in msgs.iter_mut() {
+            if !packets.is_empty() && !self.poll().0 {
+                break;
+            }
+            let (result, endpoint) = self.read_vectored(bufs);
+            match result {
+                Ok(len) => packets.push((len, endpoint)),
+                Err(err) if packets.is_empty() => return Err(err),
+                Err(_) => break,
+            }
+        }
+        Ok(packets)
+    }
+    /// Write the packet of each of `msgs` until one fails.
+    /// Return the length of each packet written.
+    fn write_batch(&self, msgs: &[(IoVecs, Option<Endpoint>)]) -> Result<Vec<usize>, SysError> {
+        let mut lens = Vec::new();
+        for (bufs, endpoint) in msgs.iter() {
+            match self.write_vectored(bufs, endpoint.clone()) {
+                Ok(len) => lens.push(len),
+                Err(err) if lens.is_empty() => return Err(err),
+                Err(_) => break,
+            }
+        }
+        Ok(lens)
+    }
     fn poll(&self) -> (bool, bool, bool); // (in, out, err)
     fn connect(&mut self, endpoint: Endpoint) -> SysResult;
     fn bind(&mut self, _endpoint: Endpoint) -> SysResult {
@@ -78,11 +127,28 @@ pub trait Socket: Send + Sync + Debug {
         warn!("setsockopt is unimplemented");
         Ok(0)
     }
+    /// Write the option to `data`, return its length
+    fn getsockopt(&self, _level: usize, _opt: usize, _data: &mut [u8]) -> SysResult {
+        Err(SysError::ENOPROTOOPT)
+    }
+    /// Map the memory of the socket to user memory at `mem_start`
+    fn mmap(
+        &self,
+        _mem_start: usize,
+        _len: usize,
+        _offset: usize,
+    ) -> Result<PacketRingMap, SysError> {
+        Err(SysError::ENODEV)
+    }
     fn ioctl(&mut self, _request: usize, _arg1: usize, _arg2: usize, _arg3: usize) -> SysResult {
         warn!("ioctl is unimplemented for this socket");
         Ok(0)
     }
     fn box_clone(&self) -> Box<dyn Socket>;
+    /// Wait queue notified when the readiness may change, None if always ready
+    fn wait_queue(&self) -> Option<Arc<Condvar>> {
+        None
+    }
 }
 
 impl Clone for Box<dyn Socket> {
@@ -94,15 +160,33 @@ impl Clone for Box<dyn Socket> {
 lazy_static! {
     /// Global SocketSet in smoltcp.
     ///
-    /// Because smoltcp is a single thread network stack,
-    /// every socket operation needs to lock this.
+    /// Because smoltcp is a single thread network stack, every access to
+    /// the smoltcp sockets needs to lock this. Reads and writes of TCP and UDP
+    /// sockets only touch their `GlobalSocket` buffers, so it is mostly locked
+    /// by the net thread and control operations.
     pub static ref SOCKETS: Mutex<SocketSet<'static, 'static, 'static>> =
         Mutex::new(SocketSet::new(vec![]));
+
+    /// Sockets in `SOCKETS`, for the net thread to find their buffers and wait queues
+    static ref SOCKET_TABLE: Mutex<BTreeMap<SocketHandle, SocketEntry>> =
+        Mutex::new(BTreeMap::new());
+
+    /// Dropped sockets with their data left and the deadline to send it,
+    /// released by the net thread once it is sent
+    static ref DROPPED_SOCKETS: Mutex<Vec<(SocketHandle, SocketBuffers, u64)>> =
+        Mutex::new(Vec::new());
+}
+
+struct SocketEntry {
+    socket: Weak<GlobalSocket>,
+    /// notified when the socket has activity
+    wait_queue: Weak<Condvar>,
 }
 
 #[derive(Debug, Clone)]
 pub struct TcpSocketState {
     handle: GlobalSocketHandle,
+    wait_queue: Arc<Condvar>,
     local_endpoint: Option<IpEndpoint>, // save local endpoint for bind()
     is_listening: bool,
 }
@@ -110,18 +194,20 @@ pub struct TcpSocketState {
 #[derive(Debug, Clone)]
 pub struct UdpSocketState {
     handle: GlobalSocketHandle,
+    wait_queue: Arc<Condvar>,
     remote_endpoint: Option<IpEndpoint>, // remember remote endpoint for connect()
 }
 
 #[derive(Debug, Clone)]
 pub struct RawSocketState {
     handle: GlobalSocketHandle,
+    wait_queue: Arc<Condvar>,
     header_included: bool,
 }
 
-#[derive(Debug, Clone)]
+#[derive(Clone)]
 pub struct PacketSocketState {
-    // no state, only ethernet egress
+    shared: Arc<PacketSocketShared>,
 }
 
 #[derive(Debug, Clone)]
@@ -129,91 +215,391 @@ pub struct NetlinkSocketState {
     data: Arc<Mutex<Vec<Vec<u8>>>>,
 }
 
-/// A wrapper for `SocketHandle`.
-/// Auto increase and decrease reference count on Clone and Drop.
-#[derive(Debug)]
-struct GlobalSocketHandle(SocketHandle);
+/// Bytes buffered in each direction of a TCP socket, out of smoltcp
+const TCP_STAGING: usize = 64 * 1024;
+/// Packets buffered in each direction of a UDP socket, out of smoltcp
+const UDP_STAGING: usize = 64;
+/// Time a dropped socket is kept to send the data left in its buffers
+const DROPPED_LINGER: Duration = Duration::from_secs(30);
+
+/// Data path buffers of a socket, see `GlobalSocket`
+enum SocketBuffers {
+    Tcp(TcpBuffers),
+    Udp(UdpBuffers),
+    /// data is accessed in `SOCKETS` directly
+    None,
+}
 
-impl Clone for GlobalSocketHandle {
-    fn clone(&self) -> Self {
-        SOCKETS.lock().retain(self.0);
-        Self(self.0)
+struct TcpBuffers {
+    rx: VecDeque<u8>,
+    tx: VecDeque<u8>,
+    // state of the smoltcp socket, mirrored by `sync`
+    is_open: bool,
+    is_active: bool,
+    may_recv: bool,
+    may_send: bool,
+    remote_endpoint: IpEndpoint,
+}
+
+struct UdpBuffers {
+    rx: VecDeque<(Vec<u8>, IpEndpoint)>,
+    tx: VecDeque<(Vec<u8>, IpEndpoint)>,
+    /// bound to a local endpoint
+    is_open: bool,
+}
+
+impl SocketBuffers {
+    fn tcp(&mut self) -> &mut TcpBuffers {
+        match self {
+            SocketBuffers::Tcp(buffers) => buffers,
+            _ => unreachable!(),
+        }
+    }
+
+    fn udp(&mut self) -> &mut UdpBuffers {
+        match self {
+            SocketBuffers::Udp(buffers) => buffers,
+            _ => unreachable!(),
+        }
     }
 }
 
-impl Drop for GlobalSocketHandle {
+impl TcpBuffers {
+    fn new() -> Self {
+        TcpBuffers {
+            rx: VecDeque::new(),
+            tx: VecDeque::new(),
+            is_open: false,
+            is_active: false,
+            may_recv: false,
+            may_send: false,
+            remote_endpoint: IpEndpoint::UNSPECIFIED,
+        }
+    }
+
+    /// Move data between the buffers and `socket`, and mirror its state.
+    /// Return whether anything changed.
+    fn sync(&mut self, socket: &mut TcpSocket) -> bool {
+        let mut changed = false;
+        while !self.tx.is_empty() && socket.can_send() {
+            let len = socket.send_slice(self.tx.as_slices().0).unwrap_or(0);
+            if len == 0 {
+                break;
+            }
+            self.tx.drain(..len);
+            changed = true;
+        }
+        while self.rx.len() < TCP_STAGING && socket.can_recv() {
+            let room = TCP_STAGING - self.rx.len();
+            let rx = &mut self.rx;
+            let len = socket
+                .recv(|data| {
+                    let len = min(room, data.len());
+                    rx.extend(data[..len].iter());
+                    (len, len)
+                })
+                .unwrap_or(0);
+            if len == 0 {
+                break;
+            }
+            changed = true;
+        }
+        let state = (
+            socket.is_open(),
+            socket.is_active(),
+            socket.may_recv(),
+            socket.may_send(),
+        );
+        if state != (self.is_open, self.is_active, self.may_recv, self.may_send) {
+            self.is_open = state.0;
+            self.is_active = state.1;
+            self.may_recv = state.2;
+            self.may_send = state.3;
+            changed = true;
+        }
+        if socket.is_open() {
+            self.remote_endpoint = socket.remote_endpoint();
+        }
+        changed
+    }
+}
+
+impl UdpBuffers {
+    fn new() -> Self {
+        UdpBuffers {
+            rx: VecDeque::new(),
+            tx: VecDeque::new(),
+            is_open: false,
+        }
+    }
+
+    /// Move packets between the buffers and `socket`, and mirror its state.
+    /// Return whether anything changed.
+    fn sync(&mut self, socket: &mut UdpSocket) -> bool {
+        let mut changed = false;
+        while socket.can_send() {
+            match self.tx.front() {
+                Some((data, endpoint)) => match socket.send_slice(data, *endpoint) {
+                    Err(smoltcp::Error::Exhausted) => break,
+                    // sent, or dropped if unaddressable
+                    _ => {}
+                },
+                None => break,
+            }
+            self.tx.pop_front();
+            changed = true;
+        }
+        while self.rx.len() < UDP_STAGING && socket.can_recv() {
+            match socket.recv() {
+                Ok((data, endpoint)) => self.rx.push_back((data.to_vec(), endpoint)),
+                Err(_) => break,
+            }
+            changed = true;
+        }
+        if socket.is_open() != self.is_open {
+            self.is_open = socket.is_open();
+            changed = true;
+        }
+        changed
+    }
+}
+
+/// A socket in `SOCKETS` with the buffers of its data path.
+///
+/// Reads and writes copy between user buffers and these buffers under a
+/// per-socket lock, while the net thread moves data between them and `SOCKETS`,
+/// so that sockets on different CPUs do not contend on `SOCKETS`.
+/// Removed from `SOCKETS` by the net thread when dropped.
+struct GlobalSocket {
+    handle: SocketHandle,
+    buffers: Mutex<SocketBuffers>,
+}
+
+impl Drop for GlobalSocket {
     fn drop(&mut self) {
-        let mut sockets = SOCKETS.lock();
-        sockets.release(self.0);
+        // the data left is sent before releasing, e.g. before TCP FIN
+        let buffers = ::core::mem::replace(&mut *self.buffers.lock(), SocketBuffers::None);
+        let deadline = hrtimer::deadline_after(DROPPED_LINGER);
+        DROPPED_SOCKETS
+            .lock()
+            .push((self.handle, buffers, deadline));
+        kick();
+    }
+}
+
+impl fmt::Debug for GlobalSocket {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "GlobalSocket({:?})", self.handle)
+    }
+}
+
+/// A wrapper for `SocketHandle`, shared by clones of a socket.
+#[derive(Debug, Clone)]
+struct GlobalSocketHandle(SocketHandle, Arc<GlobalSocket>);
+
+impl GlobalSocketHandle {
+    /// Add `socket` to `sockets`, with `wait_queue` notified on its activity
+    fn new<T>(
+        sockets: &mut SocketSet<'static, 'static, 'static>,
+        socket: T,
+        buffers: SocketBuffers,
+        wait_queue: &Arc<Condvar>,
+    ) -> Self
+    where
+        T: Into<smoltcp::socket::Socket<'static, 'static>>,
+    {
+        let handle = sockets.add(socket);
+        let socket = Arc::new(GlobalSocket {
+            handle,
+            buffers: Mutex::new(buffers),
+        });
+        let entry = SocketEntry {
+            socket: Arc::downgrade(&socket),
+            wait_queue: Arc::downgrade(wait_queue),
+        };
+        SOCKET_TABLE.lock().insert(handle, entry);
+        GlobalSocketHandle(handle, socket)
+    }
+
+    fn set_wait_queue(&self, wait_queue: &Arc<Condvar>) {
+        if let Some(entry) = SOCKET_TABLE.lock().get_mut(&self.0) {
+            entry.wait_queue = Arc::downgrade(wait_queue);
+        }
+    }
+
+    fn buffers(&self) -> MutexGuard<SocketBuffers, SpinNoIrq> {
+        self.1.buffers.lock()
+    }
+}
+
+/// Move data of all sockets between their buffers and `sockets`,
+/// and collect the sockets changed
+fn sync_sockets(
+    sockets: &mut SocketSet<'static, 'static, 'static>,
+    changed: &mut BTreeSet<SocketHandle>,
+) {
+    let dropped = ::core::mem::replace(&mut *DROPPED_SOCKETS.lock(), Vec::new());
+    if !dropped.is_empty() {
+        let mut table = SOCKET_TABLE.lock();
+        let mut lingering = Vec::new();
+        for (handle, mut buffers, deadline) in dropped {
+            // released once the data left is sent or can't be any more,
+            // a TCP socket is closed by `prune` then, after its data
+            let sent = match &mut buffers {
+                SocketBuffers::Tcp(buffers) => {
+                    let mut socket = sockets.get::<TcpSocket>(handle);
+                    buffers.sync(&mut socket);
+                    buffers.tx.is_empty() || !socket.may_send()
+                }
+                SocketBuffers::Udp(buffers) => {
+                    let mut socket = sockets.get::<UdpSocket>(handle);
+                    buffers.sync(&mut socket);
+                    buffers.tx.is_empty() || !socket.is_open()
+                }
+                SocketBuffers::None => true,
+            };
+            if sent || hrtimer::now() >= deadline {
+                table.remove(&handle);
+                sockets.release(handle);
+            } else {
+                lingering.push((handle, buffers, deadline));
+            }
+        }
         sockets.prune();
+        drop(table);
+        DROPPED_SOCKETS.lock().extend(lingering);
+    }
 
-        // send FIN immediately when applicable
-        drop(sockets);
-        poll_ifaces();
+    let table = SOCKET_TABLE.lock();
+    for (&handle, entry) in table.iter() {
+        let socket = match entry.socket.upgrade() {
+            Some(socket) => socket,
+            None => continue,
+        };
+        let progress = match &mut *socket.buffers.lock() {
+            SocketBuffers::Tcp(buffers) => buffers.sync(&mut sockets.get::<TcpSocket>(handle)),
+            SocketBuffers::Udp(buffers) => buffers.sync(&mut sockets.get::<UdpSocket>(handle)),
+            SocketBuffers::None => sockets.get::<RawSocket>(handle).can_recv(),
+        };
+        if progress {
+            changed.insert(handle);
+        }
     }
 }
 
+/// Poll all interfaces, moving data of sockets before and after it,
+/// then wake up the sockets with activity. Run by the net thread.
+/// Return true if an interface ran out of budget with packets left.
+pub(super) fn poll_ifaces() -> bool {
+    let mut changed = BTreeSet::new();
+    sync_sockets(&mut SOCKETS.lock(), &mut changed);
+    let mut more = false;
+    for iface in NET_DRIVERS.read().iter() {
+        more |= iface.poll();
+    }
+    sync_sockets(&mut SOCKETS.lock(), &mut changed);
+
+    let table = SOCKET_TABLE.lock();
+    let queues: Vec<Arc<Condvar>> = changed
+        .iter()
+        .filter_map(|handle| table.get(handle)?.wait_queue.upgrade())
+        .collect();
+    drop(table);
+    for queue in queues {
+        queue.notify_all();
+    }
+    more
+}
+
+/// Time until some interface has to be polled for its timers, None if none has
+pub(super) fn poll_delay() -> Option<Duration> {
+    NET_DRIVERS
+        .read()
+        .iter()
+        .filter_map(|iface| iface.poll_delay())
+        .min()
+}
+
+/// Copy from the front of `queue` to `buf`, return the length copied
+fn pop_slice(queue: &mut VecDeque<u8>, buf: &mut [u8]) -> usize {
+    let len = min(queue.len(), buf.len());
+    let (front, back) = queue.as_slices();
+    let front_len = min(front.len(), len);
+    buf[..front_len].copy_from_slice(&front[..front_len]);
+    buf[front_len..len].copy_from_slice(&back[..len - front_len]);
+    queue.drain(..len);
+    len
+}
+
 impl TcpSocketState {
     pub fn new() -> Self {
         let rx_buffer = TcpSocketBuffer::new(vec![0; TCP_RECVBUF]);
         let tx_buffer = TcpSocketBuffer::new(vec![0; TCP_SENDBUF]);
         let socket = TcpSocket::new(rx_buffer, tx_buffer);
-        let handle = GlobalSocketHandle(SOCKETS.lock().add(socket));
+        let wait_queue = Arc::new(Condvar::new());
+        let handle = GlobalSocketHandle::new(
+            &mut SOCKETS.lock(),
+            socket,
+            SocketBuffers::Tcp(TcpBuffers::new()),
+            &wait_queue,
+        );
 
         TcpSocketState {
             handle,
+            wait_queue,
             local_endpoint: None,
             is_listening: false,
         }
     }
+
+    /// Sync the buffers with `socket` after a control operation
+    fn sync(&self, socket: &mut TcpSocket) {
+        self.handle.buffers().tcp().sync(socket);
+    }
 }
 
 impl Socket for TcpSocketState {
     fn read(&self, data: &mut [u8]) -> (SysResult, Endpoint) {
-        spin_and_wait(&[&SOCKET_ACTIVITY], move || {
-            poll_ifaces();
-            let mut sockets = SOCKETS.lock();
-            let mut socket = sockets.get::<TcpSocket>(self.handle.0);
-
-            if socket.is_open() {
-                if let Ok(size) = socket.recv_slice(data) {
-                    if size > 0 {
-                        let endpoint = socket.remote_endpoint();
-                        // avoid deadlock
-                        drop(socket);
-                        drop(sockets);
-
-                        poll_ifaces();
-                        return Some((Ok(size), Endpoint::Ip(endpoint)));
-                    }
-                }
-            } else {
+        // `data` may be user memory, which must not fault with the buffers locked
+        let mut buf = vec![0u8; min(data.len(), TCP_STAGING)];
+        let (result, endpoint) = spin_and_wait(&[&*self.wait_queue], || {
+            let mut buffers = self.handle.buffers();
+            let buffers = buffers.tcp();
+
+            if !buffers.rx.is_empty() {
+                let size = pop_slice(&mut buffers.rx, &mut buf);
+                // let the net thread refill it
+                kick();
+                return Some((Ok(size), Endpoint::Ip(buffers.remote_endpoint)));
+            } else if !buffers.is_open {
                 return Some((
                     Err(SysError::ENOTCONN),
                     Endpoint::Ip(IpEndpoint::UNSPECIFIED),
                 ));
+            } else if !buffers.may_recv {
+                // closed by peer
+                return Some((Ok(0), Endpoint::Ip(buffers.remote_endpoint)));
             }
             None
-        })
+        });
+        if let Ok(size) = result {
+            data[..size].copy_from_slice(&buf[..size]);
+        }
+        (result, endpoint)
     }
 
     fn write(&self, data: &[u8], sendto_endpoint: Option<Endpoint>) -> SysResult {
-        let mut sockets = SOCKETS.lock();
-        let mut socket = sockets.get::<TcpSocket>(self.handle.0);
-
-        if socket.is_open() {
-            if socket.can_send() {
-                match socket.send_slice(&data) {
-                    Ok(size) => {
-                        // avoid deadlock
-                        drop(socket);
-                        drop(sockets);
-
-                        poll_ifaces();
-                        Ok(size)
-                    }
-                    Err(err) => Err(SysError::ENOBUFS),
-                }
+        // `data` may be user memory, which must not fault with the buffers locked
+        let buf = data[..min(data.len(), TCP_STAGING)].to_vec();
+        let mut buffers = self.handle.buffers();
+        let buffers = buffers.tcp();
+
+        if buffers.is_open {
+            let size = min(buf.len(), TCP_STAGING - buffers.tx.len());
+            if buffers.may_send && size > 0 {
+                buffers.tx.extend(buf[..size].iter());
+                kick();
+                Ok(size)
             } else {
                 Err(SysError::ENOBUFS)
             }
@@ -223,20 +609,20 @@ impl Socket for TcpSocketState {
     }
 
     fn poll(&self) -> (bool, bool, bool) {
-        let mut sockets = SOCKETS.lock();
-        let socket = sockets.get::<TcpSocket>(self.handle.0);
+        let mut buffers = self.handle.buffers();
+        let buffers = buffers.tcp();
 
         let (mut input, mut output, mut err) = (false, false, false);
-        if self.is_listening && socket.is_active() {
+        if self.is_listening && buffers.is_active {
             // a new connection
             input = true;
-        } else if !socket.is_open() {
+        } else if !buffers.is_open {
             err = true;
         } else {
-            if socket.can_recv() {
+            if !buffers.rx.is_empty() {
                 input = true;
             }
-            if socket.can_send() {
+            if buffers.may_send && buffers.tx.len() < TCP_STAGING {
                 output = true;
             }
         }
@@ -258,16 +644,17 @@ impl Socket for TcpSocketState {
 
                     // wait for connection result
                     loop {
-                        poll_ifaces();
+                        kick();
 
                         let mut sockets = SOCKETS.lock();
-                        let socket = sockets.get::<TcpSocket>(self.handle.0);
+                        let mut socket = sockets.get::<TcpSocket>(self.handle.0);
+                        self.sync(&mut socket);
                         match socket.state() {
                             TcpState::SynSent => {
                                 // still connecting
                                 drop(socket);
                                 debug!("poll for connection wait");
-                                SOCKET_ACTIVITY.wait(sockets);
+                                self.wait_queue.wait(sockets);
                             }
                             TcpState::Established => {
                                 break Ok(0);
@@ -313,6 +700,7 @@ impl Socket for TcpSocketState {
         }
         match socket.listen(local_endpoint) {
             Ok(()) => {
+                self.sync(&mut socket);
                 self.is_listening = true;
                 Ok(0)
             }
@@ -323,7 +711,14 @@ impl Socket for TcpSocketState {
     fn shutdown(&self) -> SysResult {
         let mut sockets = SOCKETS.lock();
         let mut socket = sockets.get::<TcpSocket>(self.handle.0);
+        // send the data left before FIN
+        self.sync(&mut socket);
         socket.close();
+        self.sync(&mut socket);
+        drop(socket);
+        drop(sockets);
+
+        kick();
         Ok(0)
     }
 
@@ -342,23 +737,33 @@ impl Socket for TcpSocketState {
                     let tx_buffer = TcpSocketBuffer::new(vec![0; TCP_SENDBUF]);
                     let mut socket = TcpSocket::new(rx_buffer, tx_buffer);
                     socket.listen(endpoint).unwrap();
-                    let new_handle = GlobalSocketHandle(sockets.add(socket));
+                    // the listening socket keeps its wait queue
+                    let new_handle = GlobalSocketHandle::new(
+                        &mut sockets,
+                        socket,
+                        SocketBuffers::Tcp(TcpBuffers::new()),
+                        &self.wait_queue,
+                    );
                     let old_handle = ::core::mem::replace(&mut self.handle, new_handle);
+                    self.sync(&mut sockets.get::<TcpSocket>(self.handle.0));
+                    let wait_queue = Arc::new(Condvar::new());
+                    old_handle.set_wait_queue(&wait_queue);
 
                     Box::new(TcpSocketState {
                         handle: old_handle,
+                        wait_queue,
                         local_endpoint: self.local_endpoint,
                         is_listening: false,
                     })
                 };
 
                 drop(sockets);
-                poll_ifaces();
+                kick();
                 return Ok((new_socket, Endpoint::Ip(remote_endpoint)));
             }
 
             drop(socket);
-            SOCKET_ACTIVITY.wait(sockets);
+            self.wait_queue.wait(sockets);
         }
     }
 
@@ -391,6 +796,10 @@ impl Socket for TcpSocketState {
     fn box_clone(&self) -> Box<dyn Socket> {
         Box::new(self.clone())
     }
+
+    fn wait_queue(&self) -> Option<Arc<Condvar>> {
+        Some(self.wait_queue.clone())
+    }
 }
 
 impl UdpSocketState {
@@ -404,13 +813,111 @@ impl UdpSocketState {
             vec![0; UDP_SENDBUF],
         );
         let socket = UdpSocket::new(rx_buffer, tx_buffer);
-        let handle = GlobalSocketHandle(SOCKETS.lock().add(socket));
+        let wait_queue = Arc::new(Condvar::new());
+        let handle = GlobalSocketHandle::new(
+            &mut SOCKETS.lock(),
+            socket,
+            SocketBuffers::Udp(UdpBuffers::new()),
+            &wait_queue,
+        );
 
         UdpSocketState {
             handle,
+            wait_queue,
             remote_endpoint: None,
         }
     }
+
+    /// Wait for received packets, then pass up to `max` of them to `copy`
+    /// in one lock of the buffers.
+    /// Return the lengths `copy` returned, and the source of the last packet.
+    fn recv_packets(
+        &self,
+        max: usize,
+        mut copy: impl FnMut(&[u8], IpEndpoint) -> usize,
+    ) -> (Result<Vec<usize>, SysError>, Endpoint) {
+        let packets: Vec<(Vec<u8>, IpEndpoint)> = loop {
+            let mut buffers = self.handle.buffers();
+            let udp = buffers.udp();
+            if !udp.rx.is_empty() {
+                let count = min(max, udp.rx.len());
+                let packets = udp.rx.drain(..count).collect();
+                drop(buffers);
+                // let the net thread refill it
+                kick();
+                break packets;
+            } else if !udp.is_open {
+                return (
+                    Err(SysError::ENOTCONN),
+                    Endpoint::Ip(IpEndpoint::UNSPECIFIED),
+                );
+            }
+
+            self.wait_queue.wait(buffers);
+        };
+        let mut last = IpEndpoint::UNSPECIFIED;
+        let lens = packets
+            .iter()
+            .map(|(packet, endpoint)| {
+                last = *endpoint;
+                copy(packet, *endpoint)
+            })
+            .collect();
+        (Ok(lens), Endpoint::Ip(last))
+    }
+
+    /// Queue `packets` with their destinations, None for the connected one,
+    /// in one lock of the buffers. They are gathered from user memory beforehand,
+    /// which must not fault with the buffers locked.
+    /// Stop at the first packet that fails, and return the length of those queued.
+    fn send_packets(
+        &self,
+        packets: Vec<(Vec<u8>, Option<Endpoint>)>,
+    ) -> Result<Vec<usize>, SysError> {
+        if !self.handle.buffers().udp().is_open {
+            let mut sockets = SOCKETS.lock();
+            let mut socket = sockets.get::<UdpSocket>(self.handle.0);
+            if socket.endpoint().port == 0 {
+                let temp_port = get_ephemeral_port();
+                socket
+                    .bind(IpEndpoint::new(IpAddress::Unspecified, temp_port))
+                    .unwrap();
+            }
+            self.handle.buffers().udp().sync(&mut socket);
+        }
+
+        let mut lens = Vec::with_capacity(packets.len());
+        let mut error = SysError::ENOBUFS;
+        let mut buffers = self.handle.buffers();
+        let buffers = buffers.udp();
+        for (packet, endpoint) in packets {
+            if buffers.tx.len() >= UDP_STAGING {
+                error = SysError::ENOBUFS;
+                break;
+            }
+            let remote_endpoint = match endpoint {
+                Some(Endpoint::Ip(endpoint)) => endpoint,
+                _ => match self.remote_endpoint {
+                    Some(endpoint) => endpoint,
+                    None => {
+                        error = SysError::ENOTCONN;
+                        break;
+                    }
+                },
+            };
+            if packet.len() > UDP_SENDBUF {
+                error = SysError::ENOBUFS;
+                break;
+            }
+            lens.push(packet.len());
+            buffers.tx.push_back((packet, remote_endpoint));
+        }
+        if lens.is_empty() {
+            return Err(error);
+        }
+        kick();
+        Ok(lens)
+    }
 }
 
 #[repr(C)]
@@ -424,78 +931,64 @@ struct ArpReq {
 
 impl Socket for UdpSocketState {
     fn read(&self, data: &mut [u8]) -> (SysResult, Endpoint) {
-        loop {
-            let mut sockets = SOCKETS.lock();
-            let mut socket = sockets.get::<UdpSocket>(self.handle.0);
-
-            if socket.is_open() {
-                if let Ok((size, remote_endpoint)) = socket.recv_slice(data) {
-                    let endpoint = remote_endpoint;
-                    // avoid deadlock
-                    drop(socket);
-                    drop(sockets);
+        let (result, endpoint) = self.recv_packets(1, |packet, _| {
+            let size = min(packet.len(), data.len());
+            data[..size].copy_from_slice(&packet[..size]);
+            size
+        });
+        (result.map(|lens| lens[0]), endpoint)
+    }
 
-                    poll_ifaces();
-                    return (Ok(size), Endpoint::Ip(endpoint));
-                }
-            } else {
-                return (
-                    Err(SysError::ENOTCONN),
-                    Endpoint::Ip(IpEndpoint::UNSPECIFIED),
-                );
-            }
+    fn write(&self, data: &[u8], sendto_endpoint: Option<Endpoint>) -> SysResult {
+        let lens = self.send_packets(vec![(data.to_vec(), sendto_endpoint)])?;
+        Ok(lens[0])
+    }
 
-            drop(socket);
-            SOCKET_ACTIVITY.wait(sockets);
-        }
+    fn read_vectored(&self, bufs: &mut IoVecs) -> (SysResult, Endpoint) {
+        // scatter from the packet without a staging buffer
+        let (result, endpoint) =
+            self.recv_packets(1, |packet, _| bufs.write_all_from_slice(packet));
+        (result.map(|lens| lens[0]), endpoint)
     }
 
-    fn write(&self, data: &[u8], sendto_endpoint: Option<Endpoint>) -> SysResult {
-        let remote_endpoint = {
-            if let Some(Endpoint::Ip(ref endpoint)) = sendto_endpoint {
-                endpoint
-            } else if let Some(ref endpoint) = self.remote_endpoint {
-                endpoint
-            } else {
-                return Err(SysError::ENOTCONN);
-            }
-        };
-        let mut sockets = SOCKETS.lock();
-        let mut socket = sockets.get::<UdpSocket>(self.handle.0);
+    fn write_vectored(&self, bufs: &IoVecs, sendto_endpoint: Option<Endpoint>) -> SysResult {
+        let lens = self.send_packets(vec![(bufs.read_all_to_vec(), sendto_endpoint)])?;
+        Ok(lens[0])
+    }
 
-        if socket.endpoint().port == 0 {
-            let temp_port = get_ephemeral_port();
-            socket
-                .bind(IpEndpoint::new(IpAddress::Unspecified, temp_port))
-                .unwrap();
+    fn read_batch(&self, msgs: &mut [IoVecs]) -> Result<Vec<(usize, Endpoint)>, SysError> {
+        if msgs.is_empty() {
+            return Ok(Vec::new());
         }
+        let mut endpoints = Vec::with_capacity(msgs.len());
+        let (result, _) = self.recv_packets(msgs.len(), |packet, endpoint| {
+            let index = endpoints.len();
+            endpoints.push(Endpoint::Ip(endpoint));
+            msgs[index].write_all_from_slice(packet)
+        });
+        Ok(result?.into_iter().zip(endpoints).collect())
+    }
 
-        if socket.can_send() {
-            match socket.send_slice(&data, *remote_endpoint) {
-                Ok(()) => {
-                    // avoid deadlock
-                    drop(socket);
-                    drop(sockets);
-
-                    poll_ifaces();
-                    Ok(data.len())
-                }
-                Err(err) => Err(SysError::ENOBUFS),
-            }
-        } else {
-            Err(SysError::ENOBUFS)
+    fn write_batch(&self, msgs: &[(IoVecs, Option<Endpoint>)]) -> Result<Vec<usize>, SysError> {
+        if msgs.is_empty() {
+            return Ok(Vec::new());
         }
+        let packets = msgs
+            .iter()
+            .map(|(bufs, endpoint)| (bufs.read_all_to_vec(), endpoint.clone()))
+            .collect();
+        self.send_packets(packets)
     }
 
     fn poll(&self) -> (bool, bool, bool) {
-        let mut sockets = SOCKETS.lock();
-        let socket = sockets.get::<UdpSocket>(self.handle.0);
+        let mut buffers = self.handle.buffers();
+        let buffers = buffers.udp();
 
         let (mut input, mut output, err) = (false, false, false);
-        if socket.can_recv() {
+        if !buffers.rx.is_empty() {
             input = true;
         }
-        if socket.can_send() {
+        if buffers.tx.len() < UDP_STAGING {
             output = true;
         }
         (input, output, err)
@@ -515,7 +1008,10 @@ impl Socket for UdpSocketState {
         let mut socket = sockets.get::<UdpSocket>(self.handle.0);
         if let Endpoint::Ip(ip) = endpoint {
             match socket.bind(ip) {
-                Ok(()) => Ok(0),
+                Ok(()) => {
+                    self.handle.buffers().udp().sync(&mut socket);
+                    Ok(0)
+                }
                 Err(_) => Err(SysError::EINVAL),
             }
         } else {
@@ -578,6 +1074,10 @@ impl Socket for UdpSocketState {
     fn box_clone(&self) -> Box<dyn Socket> {
         Box::new(self.clone())
     }
+
+    fn wait_queue(&self) -> Option<Arc<Condvar>> {
+        Some(self.wait_queue.clone())
+    }
 }
 
 impl RawSocketState {
@@ -596,10 +1096,17 @@ impl RawSocketState {
             rx_buffer,
             tx_buffer,
         );
-        let handle = GlobalSocketHandle(SOCKETS.lock().add(socket));
+        let wait_queue = Arc::new(Condvar::new());
+        let handle = GlobalSocketHandle::new(
+            &mut SOCKETS.lock(),
+            socket,
+            SocketBuffers::None,
+            &wait_queue,
+        );
 
         RawSocketState {
             handle,
+            wait_queue,
             header_included: false,
         }
     }
@@ -624,7 +1131,7 @@ impl Socket for RawSocketState {
             }
 
             drop(socket);
-            SOCKET_ACTIVITY.wait(sockets);
+            self.wait_queue.wait(sockets);
         }
     }
 
@@ -665,7 +1172,7 @@ impl Socket for RawSocketState {
                     // avoid deadlock
                     drop(socket);
                     drop(sockets);
-                    iface.poll();
+                    kick();
 
                     Ok(len)
                 } else {
@@ -689,6 +1196,10 @@ impl Socket for RawSocketState {
         Box::new(self.clone())
     }
 
+    fn wait_queue(&self) -> Option<Arc<Condvar>> {
+        Some(self.wait_queue.clone())
+    }
+
     fn setsockopt(&mut self, level: usize, opt: usize, data: &[u8]) -> SysResult {
         match (level, opt) {
             (IPPROTO_IP, IP_HDRINCL) => {
@@ -703,40 +1214,145 @@ impl Socket for RawSocketState {
     }
 }
 
+/// Index in `NET_DRIVERS` of the interface with `ifindex`, which counts from 1 as in Linux
+fn driver_index(ifindex: usize) -> Option<usize> {
+    match ifindex {
+        0 => None,
+        ifindex if ifindex <= NET_DRIVERS.read().len() => Some(ifindex - 1),
+        _ => None,
+    }
+}
+
 impl PacketSocketState {
     pub fn new() -> Self {
-        PacketSocketState {}
+        PacketSocketState {
+            shared: PacketSocketShared::new(),
+        }
+    }
+
+    /// Send the frames of the TX ring on driver `index`, or the bound interface
+    fn flush_tx_ring(&self, ring: &PacketRing, index: Option<usize>) -> SysResult {
+        let index = index.or(self.shared.ifindex()).ok_or(SysError::ENXIO)?;
+        let ifaces = NET_DRIVERS.read();
+        let iface = ifaces.get(index).ok_or(SysError::ENXIO)?;
+        ring.transmit(|data| iface.send(data).is_some())
+    }
+}
+
+impl Debug for PacketSocketState {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(
+            f,
+            "PacketSocketState {{ ifindex: {:?} }}",
+            self.shared.ifindex()
+        )
     }
 }
 
 impl Socket for PacketSocketState {
-    fn read(&self, data: &mut [u8]) -> (SysResult, Endpoint) {
-        unimplemented!()
+    fn read(&self, _data: &mut [u8]) -> (SysResult, Endpoint) {
+        // packets are only received through the RX ring
+        (
+            Err(SysError::EINVAL),
+            Endpoint::LinkLevel(LinkLevelEndpoint::new(0)),
+        )
     }
 
     fn write(&self, data: &[u8], sendto_endpoint: Option<Endpoint>) -> SysResult {
-        if let Some(Endpoint::LinkLevel(endpoint)) = sendto_endpoint {
-            let ifaces = NET_DRIVERS.read();
-            match ifaces[endpoint.interface_index].send(data) {
-                Some(len) => Ok(len),
-                None => Err(SysError::ENOBUFS),
+        // ifindex 0 means the bound interface
+        let index = match sendto_endpoint {
+            Some(Endpoint::LinkLevel(endpoint)) => match endpoint.interface_index {
+                0 => None,
+                ifindex => Some(driver_index(ifindex).ok_or(SysError::ENXIO)?),
+            },
+            Some(_) => return Err(SysError::EINVAL),
+            None => None,
+        };
+        // an empty send with a TX ring sends the frames in it
+        if data.is_empty() {
+            if let Some(ring) = self.shared.tx_ring() {
+                return self.flush_tx_ring(&ring, index);
             }
-        } else {
-            Err(SysError::ENOTCONN)
+        }
+        let index = index.or(self.shared.ifindex()).ok_or(SysError::ENOTCONN)?;
+        let ifaces = NET_DRIVERS.read();
+        let iface = ifaces.get(index).ok_or(SysError::ENXIO)?;
+        match iface.send(data) {
+            Some(len) => Ok(len),
+            None => Err(SysError::ENOBUFS),
         }
     }
 
     fn poll(&self) -> (bool, bool, bool) {
-        unimplemented!()
+        let readable = self
+            .shared
+            .rx_ring()
+            .map_or(false, |ring| ring.has_user_frames());
+        (readable, true, false)
     }
 
     fn connect(&mut self, _endpoint: Endpoint) -> SysResult {
-        unimplemented!()
+        Err(SysError::EINVAL)
+    }
+
+    fn bind(&mut self, endpoint: Endpoint) -> SysResult {
+        if let Endpoint::LinkLevel(endpoint) = endpoint {
+            // ifindex 0 means any interface
+            let index = match endpoint.interface_index {
+                0 => None,
+                ifindex => Some(driver_index(ifindex).ok_or(SysError::ENXIO)?),
+            };
+            self.shared.bind(index);
+            Ok(0)
+        } else {
+            Err(SysError::EINVAL)
+        }
+    }
+
+    fn setsockopt(&mut self, level: usize, opt: usize, data: &[u8]) -> SysResult {
+        match (level, opt) {
+            (SOL_PACKET, PACKET_RX_RING) | (SOL_PACKET, PACKET_TX_RING) => {
+                if data.len() < size_of::<TPacketReq>() {
+                    return Err(SysError::EINVAL);
+                }
+                let req = unsafe { (data.as_ptr() as *const TPacketReq).read_unaligned() };
+                PacketSocketShared::set_ring(&self.shared, opt == PACKET_TX_RING, &req)?;
+                Ok(0)
+            }
+            _ => Ok(0),
+        }
+    }
+
+    fn getsockopt(&self, level: usize, opt: usize, data: &mut [u8]) -> SysResult {
+        match (level, opt) {
+            (SOL_PACKET, PACKET_STATISTICS) => {
+                // struct tpacket_stats { tp_packets, tp_drops }
+                if data.len() < 8 {
+                    return Err(SysError::EINVAL);
+                }
+                let (packets, drops) = self
+                    .shared
+                    .rx_ring()
+                    .map_or((0, 0), |ring| ring.take_stats());
+                data[..4].copy_from_slice(&(packets as u32).to_ne_bytes());
+                data[4..8].copy_from_slice(&(drops as u32).to_ne_bytes());
+                Ok(8)
+            }
+            _ => Err(SysError::ENOPROTOOPT),
+        }
+    }
+
+    fn mmap(&self, mem_start: usize, len: usize, offset: usize) -> Result<PacketRingMap, SysError> {
+        self.shared.mmap(mem_start, len, offset)
     }
 
     fn box_clone(&self) -> Box<dyn Socket> {
         Box::new(self.clone())
     }
+
+    fn wait_queue(&self) -> Option<Arc<Condvar>> {
+        Some(self.shared.wait_queue.clone())
+    }
 }
 
 /// Common structure:
@@ -948,7 +1564,7 @@ impl Socket for NetlinkSocketState {
                     let if_info = IfaceInfoMsg {
                         ifi_family: AddressFamily::Unspecified.into(),
                         ifi_type: 0,
-                        ifi_index: i as u32,
+                        ifi_index: i as u32 + 1,
                         ifi_flags: 0,
                         ifi_change: 0,
                     };
@@ -1009,7 +1625,7 @@ impl Socket for NetlinkSocketState {
                             ifa_prefixlen: ip_addrs[j].prefix_len(),
                             ifa_flags: 0,
                             ifa_scope: 0,
-                            ifa_index: i as u32,
+                            ifa_index: i as u32 + 1,
                         };
                         msg.align4();
                         msg.push_ext(if_addr);
@@ -1087,13 +1703,6 @@ fn get_ephemeral_port() -> u16 {
     }
 }
 
-/// Safety: call this without SOCKETS locked
-fn poll_ifaces() {
-    for iface in NET_DRIVERS.read().iter() {
-        iface.poll();
-    }
-}
-
 pub const TCP_SENDBUF: usize = 512 * 1024; // 512K
 pub const TCP_RECVBUF: usize = 512 * 1024; // 512K
 
@@ -1,9 +1,14 @@
 use crate::drivers::NET_DRIVERS;
-use crate::net::SOCKETS;
+use crate::hrtimer;
+use crate::net::{Endpoint, Socket, UdpSocketState, SOCKETS};
+use crate::syscall::SysError;
 use crate::thread;
 use alloc::vec;
+use alloc::vec::Vec;
 use core::fmt::Write;
+use core::time::Duration;
 use smoltcp::socket::*;
+use smoltcp::wire::IpEndpoint;
 
 pub extern "C" fn server(_arg: usize) -> ! {
     if NET_DRIVERS.read().len() < 1 {
@@ -81,3 +86,86 @@ pub extern "C" fn server(_arg: usize) -> ! {
         thread::yield_now();
     }
 }
+
+/// Length of each run of the benchmarks in milliseconds
+const BENCH_MSEC: usize = 1000;
+
+/// Send UDP datagrams to `endpoint` from 1 to `threads` threads, each with
+/// its own socket, and print the throughput to see how sends scale across CPUs,
+/// then the packet counters of the interfaces.
+pub fn bench_udp_send(endpoint: IpEndpoint, threads: usize) {
+    let payload = [0u8; 1024];
+    for n in 1..=threads {
+        let handles: Vec<_> = (0..n)
+            .map(|_| {
+                thread::spawn(move || {
+                    let socket = UdpSocketState::new();
+                    let mut sent = 0usize;
+                    let end = hrtimer::deadline_after(Duration::from_millis(BENCH_MSEC as u64));
+                    while hrtimer::now() < end {
+                        match socket.write(&payload, Some(Endpoint::Ip(endpoint))) {
+                            Ok(_) => sent += 1,
+                            Err(SysError::ENOBUFS) => thread::yield_now(),
+                            Err(err) => return Err(err),
+                        }
+                    }
+                    Ok(sent)
+                })
+            })
+            .collect();
+        let results: Vec<_> = handles.into_iter().map(|h| h.join().unwrap()).collect();
+        let sent: usize = match results.into_iter().sum() {
+            Ok(sent) => sent,
+            Err(err) => {
+                println!("udp send failed: {:?}", err);
+                return;
+            }
+        };
+        let pps = sent * 1000 / BENCH_MSEC;
+        println!(
+            "udp send with {} threads: {} packets, {} packets/s, {} KiB/s",
+            n,
+            sent,
+            pps,
+            pps * payload.len() / 1024
+        );
+    }
+    for iface in NET_DRIVERS.read().iter() {
+        println!("{}: {:?}", iface.get_ifname(), iface.get_stats());
+    }
+}
+
+/// Send minimal broadcast frames on each interface from 1 to `threads` threads,
+/// and print the packet rate to see how it scales with the queues of the device.
+pub fn bench_raw_send(threads: usize) {
+    let mut frame = [0u8; 64];
+    frame[..6].copy_from_slice(&[0xff; 6]);
+    for iface in NET_DRIVERS.read().iter() {
+        frame[6..12].copy_from_slice(iface.get_mac().as_bytes());
+        for n in 1..=threads {
+            let handles: Vec<_> = (0..n)
+                .map(|_| {
+                    let iface = iface.clone();
+                    thread::spawn(move || {
+                        let mut sent = 0usize;
+                        let end = hrtimer::deadline_after(Duration::from_millis(BENCH_MSEC as u64));
+                        while hrtimer::now() < end {
+                            match iface.send(&frame) {
+                                Some(_) => sent += 1,
+                                None => thread::yield_now(),
+                            }
+                        }
+                        sent
+                    })
+                })
+                .collect();
+            let sent: usize = handles.into_iter().map(|h| h.join().unwrap()).sum();
+            println!(
+                "{} raw send with {} threads: {} packets/s",
+                iface.get_ifname(),
+                n,
+                sent * 1000 / BENCH_MSEC
+            );
+        }
+    }
+}
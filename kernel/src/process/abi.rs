@@ -74,3 +74,4 @@ pub const AT_PHDR: u8 = 3;
 pub const AT_PHENT: u8 = 4;
 pub const AT_PHNUM: u8 = 5;
 pub const AT_PAGESZ: u8 = 6;
+pub const AT_SYSINFO_EHDR: u8 = 33;
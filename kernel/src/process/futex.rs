@@ -0,0 +1,239 @@
+//! Futex wait queues
+//!
+//! Waiters of all processes live in one table hashed by futex key,
+//! with a lock per bucket, so unrelated futexes rarely contend.
+//! Futexes are keyed by (address space, virtual address).
+
+use alloc::collections::VecDeque;
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, Ordering};
+use core::time::Duration;
+
+use crate::memory::MemorySet;
+use crate::sync::{AdaptiveLock, Condvar, MutexGuard, SpinNoIrq, SpinNoIrqLock as Mutex};
+use crate::syscall::SysError;
+
+/// Number of buckets of the futex table
+const FUTEX_BUCKETS: usize = 256;
+
+/// Bitset of waiters that any wake matches
+pub const FUTEX_BITSET_MATCH_ANY: u32 = !0;
+
+/// (address of the memory set, virtual address)
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct FutexKey(usize, usize);
+
+impl FutexKey {
+    /// Key of the futex at `uaddr` in `vm`.
+    ///
+    /// Every mapping here is private to its address space: file mappings are
+    /// copy-on-write after fork, so their frames change under the waiters just
+    /// like anonymous memory. A key by physical address is only right for
+    /// MAP_SHARED, which is not implemented yet.
+    pub fn new(vm: &Arc<AdaptiveLock<MemorySet>>, uaddr: usize) -> Self {
+        FutexKey(vm.as_ref() as *const _ as usize, uaddr)
+    }
+
+    fn bucket(&self) -> usize {
+        let FutexKey(space, addr) = *self;
+        // futex words are 4-byte aligned
+        let hash = (space ^ (addr >> 2)).wrapping_mul(0x9e37_79b9);
+        (hash >> 8) % FUTEX_BUCKETS
+    }
+}
+
+struct FutexWaiter {
+    /// changed by requeue, with both buckets locked
+    key: Mutex<FutexKey>,
+    bitset: u32,
+    /// set after removed from the bucket by a waker
+    woken: AtomicBool,
+    queue: Condvar,
+}
+
+type FutexBucket = VecDeque<Arc<FutexWaiter>>;
+
+lazy_static! {
+    static ref FUTEX_TABLE: Vec<Mutex<FutexBucket>> = (0..FUTEX_BUCKETS)
+        .map(|_| Mutex::new(VecDeque::new()))
+        .collect();
+}
+
+/// Buckets of two keys locked in index order
+struct BucketPair {
+    bucket: MutexGuard<'static, FutexBucket, SpinNoIrq>,
+    /// None if both keys are in the same bucket
+    bucket2: Option<MutexGuard<'static, FutexBucket, SpinNoIrq>>,
+}
+
+impl BucketPair {
+    fn lock(key: FutexKey, key2: FutexKey) -> Self {
+        let (i, j) = (key.bucket(), key2.bucket());
+        if i == j {
+            BucketPair {
+                bucket: FUTEX_TABLE[i].lock(),
+                bucket2: None,
+            }
+        } else if i < j {
+            let bucket = FUTEX_TABLE[i].lock();
+            BucketPair {
+                bucket,
+                bucket2: Some(FUTEX_TABLE[j].lock()),
+            }
+        } else {
+            let bucket2 = FUTEX_TABLE[j].lock();
+            BucketPair {
+                bucket: FUTEX_TABLE[i].lock(),
+                bucket2: Some(bucket2),
+            }
+        }
+    }
+
+    /// The bucket of the second key
+    fn second(&mut self) -> &mut FutexBucket {
+        match &mut self.bucket2 {
+            Some(bucket) => &mut **bucket,
+            None => &mut *self.bucket,
+        }
+    }
+}
+
+/// Remove up to `n` waiters of `key` matching `bitset` from `bucket`, in FIFO order
+fn take(bucket: &mut FutexBucket, key: FutexKey, bitset: u32, n: usize) -> Vec<Arc<FutexWaiter>> {
+    let mut taken = Vec::new();
+    bucket.retain(|waiter| {
+        if taken.len() < n && *waiter.key.lock() == key && waiter.bitset & bitset != 0 {
+            taken.push(waiter.clone());
+            false
+        } else {
+            true
+        }
+    });
+    taken
+}
+
+/// Wake up waiters removed from their bucket, without bucket locks
+fn wake_up(waiters: Vec<Arc<FutexWaiter>>) -> usize {
+    for waiter in waiters.iter() {
+        waiter.woken.store(true, Ordering::Release);
+        waiter.queue.notify_one();
+    }
+    waiters.len()
+}
+
+/// Remove a timed out waiter from its bucket.
+/// Return false if it has been woken up meanwhile.
+fn remove(waiter: &Arc<FutexWaiter>) -> bool {
+    loop {
+        let key = *waiter.key.lock();
+        let mut bucket = FUTEX_TABLE[key.bucket()].lock();
+        if *waiter.key.lock() != key {
+            // requeued meanwhile
+            continue;
+        }
+        let len = bucket.len();
+        bucket.retain(|w| !Arc::ptr_eq(w, waiter));
+        return bucket.len() != len;
+    }
+}
+
+/// Wait on `key` if `check` passes with its bucket locked,
+/// until woken up by a wake matching `bitset`, or `timeout` passed.
+pub fn wait(
+    key: FutexKey,
+    bitset: u32,
+    timeout: Option<Duration>,
+    check: impl FnOnce() -> bool,
+) -> Result<(), SysError> {
+    let waiter = Arc::new(FutexWaiter {
+        key: Mutex::new(key),
+        bitset,
+        woken: AtomicBool::new(false),
+        queue: Condvar::new(),
+    });
+    {
+        // wakers change the futex word before taking the lock,
+        // so a wake can not be lost between the check and queueing
+        let mut bucket = FUTEX_TABLE[key.bucket()].lock();
+        if !check() {
+            return Err(SysError::EAGAIN);
+        }
+        bucket.push_back(waiter.clone());
+    }
+
+    let woken = || {
+        if waiter.woken.load(Ordering::Acquire) {
+            Some(())
+        } else {
+            None
+        }
+    };
+    match timeout {
+        None => {
+            Condvar::wait_event(&waiter.queue, woken);
+            Ok(())
+        }
+        Some(timeout) => match Condvar::wait_events_timeout(&[&waiter.queue], timeout, woken) {
+            Some(()) => Ok(()),
+            None if remove(&waiter) => Err(SysError::ETIMEDOUT),
+            None => Ok(()),
+        },
+    }
+}
+
+/// Wake up to `n` waiters of `key` matching `bitset`.
+/// Return the number of waiters woken up.
+pub fn wake(key: FutexKey, n: usize, bitset: u32) -> usize {
+    let waiters = take(&mut FUTEX_TABLE[key.bucket()].lock(), key, bitset, n);
+    wake_up(waiters)
+}
+
+/// Wake up to `n_wake` waiters of `key`, and move up to `n_requeue` others to `key2`,
+/// if `check` passes with both buckets locked.
+/// Return the number of waiters woken up and requeued.
+pub fn requeue(
+    key: FutexKey,
+    key2: FutexKey,
+    n_wake: usize,
+    n_requeue: usize,
+    check: impl FnOnce() -> bool,
+) -> Result<(usize, usize), SysError> {
+    let mut buckets = BucketPair::lock(key, key2);
+    if !check() {
+        return Err(SysError::EAGAIN);
+    }
+    let woken = take(&mut buckets.bucket, key, FUTEX_BITSET_MATCH_ANY, n_wake);
+    let moved = take(&mut buckets.bucket, key, FUTEX_BITSET_MATCH_ANY, n_requeue);
+    let requeued = moved.len();
+    for waiter in moved.iter() {
+        *waiter.key.lock() = key2;
+    }
+    buckets.second().extend(moved);
+    drop(buckets);
+    Ok((wake_up(woken), requeued))
+}
+
+/// Run `op`, which atomically updates the futex word of `key2`
+/// and returns whether its old value passes the comparison.
+/// Then wake up to `n` waiters of `key`, and up to `n2` of `key2` if it passed.
+/// Return the number of waiters woken up.
+///
+/// `op` runs before the buckets are locked, since writing the word may fault
+/// and sleep. A waiter on `key2` that checks the word meanwhile sees the new value.
+pub fn wake_op(
+    key: FutexKey,
+    key2: FutexKey,
+    n: usize,
+    n2: usize,
+    op: impl FnOnce() -> Result<bool, SysError>,
+) -> Result<usize, SysError> {
+    let passed = op()?;
+    let mut buckets = BucketPair::lock(key, key2);
+    let mut waiters = take(&mut buckets.bucket, key, FUTEX_BITSET_MATCH_ANY, n);
+    if passed {
+        waiters.extend(take(buckets.second(), key2, FUTEX_BITSET_MATCH_ANY, n2));
+    }
+    drop(buckets);
+    Ok(wake_up(waiters))
+}
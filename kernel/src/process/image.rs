@@ -0,0 +1,322 @@
+//! Cache of parsed executable images
+//!
+//! Every exec of a program reads and parses the same ELF header and program headers.
+//! The parsed image is kept here per inode, so that a warm exec goes straight to
+//! building the memory set. Text and rodata frames are shared through the page cache
+//! by the `File` handler, so an image holds no file data itself.
+//!
+//! Images are keyed by the address of their `INode`, pinned by a `Weak` like the dentry cache,
+//! and must be dropped with `invalidate` whenever the file is written or truncated.
+//! When the cache is full, the least recently used image is evicted.
+
+use alloc::{
+    collections::VecDeque,
+    string::String,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::sync::atomic::{AtomicUsize, Ordering};
+use log::*;
+use rcore_fs::vfs::INode;
+use rcore_memory::PAGE_SIZE;
+use xmas_elf::{
+    header,
+    program::{Flags, Type},
+    ElfFile,
+};
+
+use super::structs::INodeForMap;
+use crate::fs::page_cache;
+use crate::memory::{File, GlobalFrameAlloc, MemoryAttr, MemorySet};
+use crate::sync::SpinNoIrqLock as Mutex;
+
+/// Images kept at most, the least recently used one is evicted
+const IMAGE_CACHE_SIZE: usize = 64;
+
+/// Bytes read for the headers when the program headers fit in them
+/// 0x3c0: magic number from ld-musl.so
+const HEADER_READ_SIZE: usize = 0x3c0;
+
+/// Largest program header table accepted
+const PH_MAX_SIZE: usize = 16 * PAGE_SIZE;
+
+/// Longest path of the dynamic loader accepted
+const INTERP_MAX_SIZE: usize = PAGE_SIZE;
+
+/// A `PT_LOAD` segment
+#[derive(Debug, Clone)]
+pub struct Segment {
+    pub vaddr: usize,
+    pub mem_size: usize,
+    pub file_offset: usize,
+    pub file_size: usize,
+    pub attr: MemoryAttr,
+}
+
+/// Everything exec needs from an ELF file besides its contents
+#[derive(Debug)]
+pub struct ExecImage {
+    pub entry: usize,
+    pub segments: Vec<Segment>,
+    /// Path of the dynamic loader, if any
+    pub interp: Option<String>,
+    /// Virtual address of the program headers, for `AT_PHDR`
+    pub phdr_vaddr: Option<usize>,
+    pub ph_entry_size: usize,
+    pub ph_count: usize,
+}
+
+struct CachedImage {
+    key: usize,
+    /// Keeps the address of the inode from being reused
+    inode: Weak<INode>,
+    image: Arc<ExecImage>,
+}
+
+struct ImageCache {
+    /// Most recently used first
+    images: VecDeque<CachedImage>,
+    /// Changed on every invalidation, so that a parse racing with it
+    /// does not insert a stale image
+    gen: usize,
+}
+
+lazy_static! {
+    static ref IMAGE_CACHE: Mutex<ImageCache> = Mutex::new(ImageCache {
+        images: VecDeque::new(),
+        gen: 0,
+    });
+}
+
+fn inode_key(inode: &Arc<INode>) -> usize {
+    &**inode as *const INode as *const u8 as usize
+}
+
+fn read_at(inode: &Arc<INode>, offset: usize, buf: &mut [u8]) -> Result<usize, &'static str> {
+    match page_cache::is_cacheable(inode) {
+        true => page_cache::read_at(inode, offset, buf),
+        false => inode.read_at(offset, buf),
+    }
+    .map_err(|_| "failed to read from INode")
+}
+
+/// Get the parsed image of executable `inode`, parsing it on the first exec
+pub fn get(inode: &Arc<INode>) -> Result<Arc<ExecImage>, &'static str> {
+    // only files in the page cache see every write through `invalidate`
+    if !page_cache::is_cacheable(inode) {
+        return ExecImage::parse(inode).map(Arc::new);
+    }
+    let key = inode_key(inode);
+    let gen = {
+        let mut cache = IMAGE_CACHE.lock();
+        let pos = cache.images.iter().position(|cached| cached.key == key);
+        if let Some(pos) = pos {
+            IMAGE_STATS.hits.fetch_add(1, Ordering::Relaxed);
+            let cached = cache.images.remove(pos).unwrap();
+            let image = cached.image.clone();
+            cache.images.push_front(cached);
+            return Ok(image);
+        }
+        cache.gen
+    };
+    IMAGE_STATS.misses.fetch_add(1, Ordering::Relaxed);
+    let image = Arc::new(ExecImage::parse(inode)?);
+    let mut cache = IMAGE_CACHE.lock();
+    if cache.gen == gen {
+        cache.images.push_front(CachedImage {
+            key,
+            inode: Arc::downgrade(inode),
+            image: image.clone(),
+        });
+        cache.images.truncate(IMAGE_CACHE_SIZE);
+    }
+    Ok(image)
+}
+
+/// Forget the image of `inode`, must be called after it is written or truncated
+pub fn invalidate(inode: &Arc<INode>) {
+    let mut cache = IMAGE_CACHE.lock();
+    cache.gen += 1;
+    let key = inode_key(inode);
+    cache.images.retain(|cached| cached.key != key);
+}
+
+impl ExecImage {
+    fn parse(inode: &Arc<INode>) -> Result<Self, &'static str> {
+        let file_size = inode
+            .metadata()
+            .map_err(|_| "failed to get metadata of INode")?
+            .size;
+        let mut data = vec![0u8; HEADER_READ_SIZE];
+        let len = read_at(inode, 0, &mut data)?;
+        data.truncate(len);
+        let ph_end = {
+            let elf = ElfFile::new(&data)?;
+            let pt2 = &elf.header.pt2;
+            let size = pt2.ph_entry_size() as u64 * pt2.ph_count() as u64;
+            let end = pt2.ph_offset().checked_add(size);
+            match end {
+                Some(end) if size <= PH_MAX_SIZE as u64 && end <= file_size as u64 => end as usize,
+                _ => return Err("invalid program headers"),
+            }
+        };
+        if ph_end > data.len() {
+            // program headers beyond the usual size, read all of them
+            data.resize(ph_end, 0);
+            let len = read_at(inode, 0, &mut data)?;
+            if len < ph_end {
+                return Err("truncated program headers");
+            }
+        }
+        let elf = ElfFile::new(&data)?;
+
+        // Check ELF type
+        match elf.header.pt2.type_().as_type() {
+            header::Type::Executable => {}
+            header::Type::SharedObject => {}
+            _ => return Err("ELF is not executable or shared object"),
+        }
+
+        // Check ELF arch
+        match elf.header.pt2.machine().as_machine() {
+            #[cfg(target_arch = "x86_64")]
+            header::Machine::X86_64 => {}
+            #[cfg(target_arch = "aarch64")]
+            header::Machine::AArch64 => {}
+            #[cfg(any(target_arch = "riscv32", target_arch = "riscv64"))]
+            header::Machine::Other(243) => {}
+            #[cfg(target_arch = "mips")]
+            header::Machine::Mips => {}
+            _ => return Err("invalid ELF arch"),
+        }
+
+        let segments = elf
+            .program_iter()
+            .filter(|ph| ph.get_type() == Ok(Type::Load))
+            .map(|ph| Segment {
+                vaddr: ph.virtual_addr() as usize,
+                mem_size: ph.mem_size() as usize,
+                file_offset: ph.offset() as usize,
+                file_size: ph.file_size() as usize,
+                attr: ph.flags().to_attr(),
+            })
+            .collect();
+
+        let interp = match elf
+            .program_iter()
+            .find(|ph| ph.get_type() == Ok(Type::Interp))
+        {
+            Some(ph) => {
+                // the path may lie outside of the headers read above
+                let size = ph.file_size();
+                let in_file = ph
+                    .offset()
+                    .checked_add(size)
+                    .map_or(false, |end| end <= file_size as u64);
+                if size > INTERP_MAX_SIZE as u64 || !in_file {
+                    return Err("invalid interpreter path");
+                }
+                let mut path = vec![0u8; size as usize];
+                let len = read_at(inode, ph.offset() as usize, &mut path)?;
+                path.truncate(len);
+                // skip NULL
+                while let Some(0) = path.last() {
+                    path.pop();
+                }
+                Some(String::from_utf8(path).map_err(|_| "failed to convert to utf8")?)
+            }
+            None => None,
+        };
+
+        let phdr_vaddr = if let Some(phdr) = elf
+            .program_iter()
+            .find(|ph| ph.get_type() == Ok(Type::Phdr))
+        {
+            // if phdr exists in program header, use it
+            Some(phdr.virtual_addr() as usize)
+        } else if let Some(elf_addr) = elf
+            .program_iter()
+            .find(|ph| ph.get_type() == Ok(Type::Load) && ph.offset() == 0)
+        {
+            // otherwise, check if elf is loaded from the beginning, then phdr can be inferred.
+            Some((elf_addr.virtual_addr() + elf.header.pt2.ph_offset()) as usize)
+        } else {
+            warn!("elf: no phdr found, tls might not work");
+            None
+        };
+
+        Ok(ExecImage {
+            entry: elf.header.pt2.entry_point() as usize,
+            segments,
+            interp,
+            phdr_vaddr,
+            ph_entry_size: elf.header.pt2.ph_entry_size() as usize,
+            ph_count: elf.header.pt2.ph_count() as usize,
+        })
+    }
+
+    /// Generate a MemorySet mapping the segments of the image from `inode`
+    pub fn make_memory_set(&self, inode: &Arc<INode>) -> MemorySet {
+        debug!("creating MemorySet from ELF");
+        let mut ms = MemorySet::new();
+        for seg in self.segments.iter() {
+            ms.push(
+                seg.vaddr,
+                seg.vaddr + seg.mem_size,
+                seg.attr,
+                File {
+                    file: INodeForMap(inode.clone()),
+                    mem_start: seg.vaddr,
+                    file_start: seg.file_offset,
+                    file_end: seg.file_offset + seg.file_size,
+                    allocator: GlobalFrameAlloc,
+                },
+                "elf",
+            );
+        }
+        ms
+    }
+}
+
+trait ToMemoryAttr {
+    fn to_attr(&self) -> MemoryAttr;
+}
+
+impl ToMemoryAttr for Flags {
+    fn to_attr(&self) -> MemoryAttr {
+        let mut flags = MemoryAttr::default().user();
+        if self.is_execute() {
+            flags = flags.execute();
+        }
+        if !self.is_write() {
+            flags = flags.readonly();
+        }
+        flags
+    }
+}
+
+struct ImageStats {
+    hits: AtomicUsize,
+    misses: AtomicUsize,
+}
+
+static IMAGE_STATS: ImageStats = ImageStats {
+    hits: AtomicUsize::new(0),
+    misses: AtomicUsize::new(0),
+};
+
+/// Snapshot of the image cache counters
+#[derive(Debug, Clone, Copy)]
+pub struct ImageCacheStats {
+    /// Execs served from the cache
+    pub hits: usize,
+    /// Execs that parsed the file
+    pub misses: usize,
+}
+
+pub fn image_cache_stats() -> ImageCacheStats {
+    ImageCacheStats {
+        hits: IMAGE_STATS.hits.load(Ordering::Relaxed),
+        misses: IMAGE_STATS.misses.load(Ordering::Relaxed),
+    }
+}
@@ -1,16 +1,22 @@
 pub use self::structs::*;
 use crate::arch::cpu;
 use crate::consts::{MAX_CPU_NUM, MAX_PROCESS_NUM};
-use alloc::{boxed::Box, sync::Arc};
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use core::sync::atomic::{AtomicUsize, Ordering};
+use lazy_static::*;
 use log::*;
 pub use rcore_thread::*;
 
 mod abi;
+pub mod futex;
+pub mod image;
+pub mod sched;
 pub mod structs;
+pub mod test;
 
 pub fn init() {
     // NOTE: max_time_slice <= 5 to ensure 'priority' test pass
-    let scheduler = scheduler::RRScheduler::new(5);
+    let scheduler = sched::PerCpuScheduler::new(MAX_CPU_NUM, MAX_PROCESS_NUM, 5);
     let manager = Arc::new(ThreadPool::new(scheduler, MAX_PROCESS_NUM));
 
     unsafe {
@@ -19,6 +25,7 @@ pub fn init() {
         }
     }
 
+    crate::net::init();
     crate::shell::add_user_shell();
 
     info!("process: init end");
@@ -108,6 +115,22 @@ static PROCESSORS: [Processor; MAX_CPU_NUM] = [
     //    Processor::new(),    Processor::new(),    Processor::new(),    Processor::new(),
 ];
 
+/// Context switches done on each CPU.
+///
+/// A thread is still running on its CPU as long as the count there is unchanged.
+lazy_static! {
+    static ref SWITCH_COUNTS: Vec<AtomicUsize> =
+        (0..MAX_CPU_NUM).map(|_| AtomicUsize::new(0)).collect();
+}
+
+fn switch_count_of(cpu: usize) -> &'static AtomicUsize {
+    &SWITCH_COUNTS[cpu]
+}
+
+pub fn switch_count(cpu: usize) -> usize {
+    switch_count_of(cpu).load(Ordering::Relaxed)
+}
+
 /// Get current thread
 ///
 /// `Thread` is a thread-local object.
@@ -118,6 +141,19 @@ pub unsafe fn current_thread() -> &'static mut Thread {
     process
 }
 
+/// Hand `thread` to the thread manager and add its tid to its process.
+///
+/// The process stays locked meanwhile, so the thread can't look for itself there
+/// before it is added. `Thread::set_tid` can't do it, since the manager calls it
+/// with its own spinlocks held, where the process lock must not park.
+pub fn add_thread(thread: Box<Thread>) -> Tid {
+    let proc = thread.proc.clone();
+    let mut proc = proc.lock();
+    let tid = processor().manager().add(thread);
+    proc.threads.push(tid);
+    tid
+}
+
 // Implement dependencies for std::thread
 
 #[no_mangle]
@@ -0,0 +1,185 @@
+//! Per-CPU run queues with work stealing
+//!
+//! Each CPU pops threads from its own queue, so ticks, yields and wakeups on
+//! different CPUs do not contend on one scheduler lock.
+//! A woken thread goes back to the CPU it last ran on, to keep its cache warm,
+//! unless that CPU is idle. An idle CPU steals from the busiest queue.
+//! A thread with priority `p` runs for `p` time slices at once,
+//! so it gets `p` times the CPU share of the default priority.
+
+use alloc::collections::VecDeque;
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use rcore_thread::{Scheduler, Tid};
+
+use crate::arch::cpu;
+use crate::consts::MAX_CPU_NUM;
+use crate::sync::SpinNoIrqLock as Mutex;
+
+/// Load balancing counters of a CPU
+#[derive(Default)]
+struct CpuCounters {
+    /// threads picked to run
+    switches: AtomicUsize,
+    /// threads stolen from other CPUs
+    steals: AtomicUsize,
+    /// wakeups to the CPU the thread last ran on
+    affine_wakeups: AtomicUsize,
+    /// wakeups moved to this CPU from an idle or unknown one
+    migrated_wakeups: AtomicUsize,
+}
+
+lazy_static! {
+    static ref COUNTERS: Vec<CpuCounters> =
+        (0..MAX_CPU_NUM).map(|_| CpuCounters::default()).collect();
+}
+
+/// Load balancing counters of a CPU
+#[derive(Debug, Clone, Copy)]
+pub struct CpuSchedStats {
+    pub cpu: usize,
+    pub switches: usize,
+    pub steals: usize,
+    pub affine_wakeups: usize,
+    pub migrated_wakeups: usize,
+}
+
+struct CpuQueue {
+    ready: Mutex<VecDeque<Tid>>,
+    /// no thread to run at the last pop
+    idle: AtomicBool,
+}
+
+/// Threads in all run queues, an idle CPU keeps ticking to steal while it is not zero
+static QUEUED: AtomicUsize = AtomicUsize::new(0);
+
+/// CPU of a thread which never ran
+const NO_CPU: usize = usize::max_value();
+
+pub struct PerCpuScheduler {
+    cpus: Vec<CpuQueue>,
+    /// last CPU of each thread
+    last_cpu: Vec<AtomicUsize>,
+    /// remaining ticks of each running thread
+    time_slice: Vec<AtomicUsize>,
+    /// priority of each thread, 0 for the default of 1
+    priority: Vec<AtomicUsize>,
+    max_time_slice: usize,
+}
+
+impl PerCpuScheduler {
+    pub fn new(cpu_num: usize, max_thread_num: usize, max_time_slice: usize) -> Self {
+        PerCpuScheduler {
+            cpus: (0..cpu_num)
+                .map(|_| CpuQueue {
+                    ready: Mutex::new(VecDeque::new()),
+                    idle: AtomicBool::new(true),
+                })
+                .collect(),
+            last_cpu: (0..max_thread_num)
+                .map(|_| AtomicUsize::new(NO_CPU))
+                .collect(),
+            time_slice: (0..max_thread_num).map(|_| AtomicUsize::new(0)).collect(),
+            priority: (0..max_thread_num).map(|_| AtomicUsize::new(0)).collect(),
+            max_time_slice,
+        }
+    }
+
+    /// Steal a thread from the back of the longest queue other than `cpu_id`
+    fn steal(&self, cpu_id: usize) -> Option<Tid> {
+        let victim = (0..self.cpus.len())
+            .filter(|&id| id != cpu_id)
+            .map(|id| (self.cpus[id].ready.lock().len(), id))
+            .max()
+            .filter(|&(len, _)| len > 0)?
+            .1;
+        // it may be emptied meanwhile, try again on the next pop
+        self.cpus[victim].ready.lock().pop_back()
+    }
+}
+
+impl Scheduler for PerCpuScheduler {
+    fn push(&self, tid: Tid) {
+        let current = cpu::id();
+        let last = self.last_cpu[tid].load(Ordering::Relaxed);
+        // an idle CPU may wait for an interrupt before it pops again
+        let cpu = if last != NO_CPU && !self.cpus[last].idle.load(Ordering::Relaxed) {
+            COUNTERS[last]
+                .affine_wakeups
+                .fetch_add(1, Ordering::Relaxed);
+            last
+        } else {
+            COUNTERS[current]
+                .migrated_wakeups
+                .fetch_add(1, Ordering::Relaxed);
+            current
+        };
+        self.cpus[cpu].ready.lock().push_back(tid);
+        QUEUED.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn pop(&self, cpu_id: usize) -> Option<Tid> {
+        let queue = &self.cpus[cpu_id];
+        let local = queue.ready.lock().pop_front();
+        let tid = local.or_else(|| {
+            let tid = self.steal(cpu_id)?;
+            COUNTERS[cpu_id].steals.fetch_add(1, Ordering::Relaxed);
+            Some(tid)
+        });
+        queue.idle.store(tid.is_none(), Ordering::Relaxed);
+        if let Some(tid) = tid {
+            QUEUED.fetch_sub(1, Ordering::Relaxed);
+            COUNTERS[cpu_id].switches.fetch_add(1, Ordering::Relaxed);
+            self.last_cpu[tid].store(cpu_id, Ordering::Relaxed);
+            let priority = self.priority[tid].load(Ordering::Relaxed).max(1);
+            self.time_slice[tid].store(self.max_time_slice * priority, Ordering::Relaxed);
+        }
+        tid
+    }
+
+    fn tick(&self, current_tid: Tid) -> bool {
+        let slice = &self.time_slice[current_tid];
+        let left = slice.load(Ordering::Relaxed);
+        if left > 1 {
+            slice.store(left - 1, Ordering::Relaxed);
+            return false;
+        }
+        // only switch if someone is waiting on this CPU
+        !self.cpus[cpu::id()].ready.lock().is_empty()
+    }
+
+    fn set_priority(&self, tid: Tid, priority: u8) {
+        self.priority[tid].store(priority as usize, Ordering::Relaxed);
+    }
+
+    fn remove(&self, tid: Tid) {
+        for queue in self.cpus.iter() {
+            let mut ready = queue.ready.lock();
+            let len = ready.len();
+            ready.retain(|&t| t != tid);
+            QUEUED.fetch_sub(len - ready.len(), Ordering::Relaxed);
+        }
+    }
+}
+
+/// Number of threads waiting in the run queues
+pub fn queued() -> usize {
+    QUEUED.load(Ordering::Relaxed)
+}
+
+/// Load balancing counters of the CPUs which ever ran a thread
+pub fn stats() -> Vec<CpuSchedStats> {
+    COUNTERS
+        .iter()
+        .enumerate()
+        .filter(|(_, counters)| counters.switches.load(Ordering::Relaxed) != 0)
+        .map(|(cpu, counters)| CpuSchedStats {
+            cpu,
+            switches: counters.switches.load(Ordering::Relaxed),
+            steals: counters.steals.load(Ordering::Relaxed),
+            affine_wakeups: counters.affine_wakeups.load(Ordering::Relaxed),
+            migrated_wakeups: counters.migrated_wakeups.load(Ordering::Relaxed),
+        })
+        .collect()
+}
@@ -1,25 +1,20 @@
 use alloc::{boxed::Box, collections::BTreeMap, string::String, sync::Arc, sync::Weak, vec::Vec};
 use core::fmt;
 
-use core::str;
+use core::sync::atomic::{AtomicBool, Ordering};
 use log::*;
 use rcore_memory::PAGE_SIZE;
 use rcore_thread::Tid;
 use spin::RwLock;
-use xmas_elf::{
-    header,
-    program::{Flags, SegmentData, Type},
-    ElfFile,
-};
 
 use crate::arch::interrupt::{Context, TrapFrame};
-use crate::fs::{FileHandle, FileLike, OpenOptions, FOLLOW_MAX_DEPTH};
-use crate::memory::{
-    ByFrame, Delay, File, GlobalFrameAlloc, KernelStack, MemoryAttr, MemorySet, Read,
-};
-use crate::sync::{Condvar, SpinNoIrqLock as Mutex};
+use crate::fs::{dcache, page_cache, FileHandle, FileLike, OpenOptions, FOLLOW_MAX_DEPTH};
+use crate::memory::{ByFrame, Delay, GlobalFrameAlloc, KernelStack, MemoryAttr, MemorySet, Read};
+use crate::sync::{AdaptiveLock as Mutex, Condvar};
+use crate::vdso;
 
 use super::abi::{self, ProcInitInfo};
+use super::image;
 use crate::processor;
 use core::mem::MaybeUninit;
 use rcore_fs::vfs::INode;
@@ -33,6 +28,8 @@ pub struct Thread {
     // This is same as `proc.vm`
     pub vm: Arc<Mutex<MemorySet>>,
     pub proc: Arc<Mutex<Process>>,
+    /// Set in the thread of a vfork child
+    vfork_done: Option<VforkRelease>,
 }
 
 /// Pid type
@@ -62,8 +59,9 @@ pub struct Process {
     pub vm: Arc<Mutex<MemorySet>>,
     pub files: BTreeMap<usize, FileLike>,
     pub cwd: String,
+    /// Inode of `cwd`, set by chdir
+    pub cwd_inode: Option<Arc<INode>>,
     pub exec_path: String,
-    futexes: BTreeMap<usize, Arc<Condvar>>,
 
     // relationship
     pub pid: Pid, // i.e. tgid, usually the tid of first thread
@@ -74,6 +72,50 @@ pub struct Process {
     // for waiting child
     pub child_exit: Arc<Condvar>, // notified when the a child process is going to terminate
     pub child_exit_code: BTreeMap<usize, usize>, // child process store its exit code here
+
+    /// Set while the process runs on the address space of its parent after `vfork`,
+    /// released when it execs or exits and gives the address space back
+    pub vfork_done: Option<Arc<VforkDone>>,
+}
+
+/// Blocks the parent in `vfork` until the child gives the address space back
+#[derive(Default)]
+pub struct VforkDone {
+    released: AtomicBool,
+    condvar: Condvar,
+}
+
+impl VforkDone {
+    pub fn new() -> Self {
+        VforkDone::default()
+    }
+
+    /// Wake up the parent, may be called more than once
+    pub fn release(&self) {
+        self.released.store(true, Ordering::Release);
+        self.condvar.notify_all();
+    }
+
+    /// Wait until the child releases the address space
+    pub fn wait(&self) {
+        Condvar::wait_event(&self.condvar, || {
+            if self.released.load(Ordering::Acquire) {
+                Some(())
+            } else {
+                None
+            }
+        });
+    }
+}
+
+/// Releases the vfork parent when the thread of the child is dropped,
+/// in case it dies without exec or exit, e.g. on a fault
+struct VforkRelease(Arc<VforkDone>);
+
+impl Drop for VforkRelease {
+    fn drop(&mut self) {
+        self.0.release();
+    }
 }
 
 lazy_static! {
@@ -87,13 +129,15 @@ impl rcore_thread::Context for Thread {
     unsafe fn switch_to(&mut self, target: &mut rcore_thread::Context) {
         use core::mem::transmute;
         let (target, _): (&mut Thread, *const ()) = transmute(target);
+        super::switch_count_of(crate::arch::cpu::id()).fetch_add(1, Ordering::Relaxed);
+        crate::hrtimer::resume_tick();
         self.context.switch(&mut target.context);
     }
 
     fn set_tid(&mut self, tid: Tid) {
-        let mut proc = self.proc.lock();
-        // add it to threads
-        proc.threads.push(tid);
+        // added to the process by `add_thread`
+        // the tid may be left by an exited thread, start at the default priority
+        processor().manager().set_priority(tid, 0);
     }
 }
 
@@ -117,26 +161,28 @@ impl Thread {
             context: unsafe { Context::new_kernel_thread(entry, arg, kstack.top(), vm_token) },
             kstack,
             clear_child_tid: 0,
+            vfork_done: None,
             vm: vm.clone(),
             // TODO: kernel thread should not have a process
             proc: Process {
                 vm,
                 files: BTreeMap::default(),
                 cwd: String::from("/"),
+                cwd_inode: None,
                 exec_path: String::new(),
-                futexes: BTreeMap::default(),
                 pid: Pid(0),
                 parent: Weak::new(),
                 children: Vec::new(),
                 threads: Vec::new(),
                 child_exit: Arc::new(Condvar::new()),
                 child_exit_code: BTreeMap::new(),
+                vfork_done: None,
             }
             .add_to_table(),
         })
     }
 
-    /// Construct virtual memory of a new user process from ELF `data`.
+    /// Construct virtual memory of a new user process from ELF `inode`.
     /// Return `(MemorySet, entry_point, ustack_top)`
     pub fn new_user_vm(
         inode: &Arc<INode>,
@@ -144,52 +190,24 @@ impl Thread {
         mut args: Vec<String>,
         envs: Vec<String>,
     ) -> Result<(MemorySet, usize, usize), &'static str> {
-        // Read ELF header
-        // 0x3c0: magic number from ld-musl.so
-        let mut data: [u8; 0x3c0] = unsafe { MaybeUninit::uninitialized().into_initialized() };
-        inode
-            .read_at(0, &mut data)
-            .map_err(|_| "failed to read from INode")?;
-
-        // Parse ELF
-        let elf = ElfFile::new(&data)?;
-
-        // Check ELF type
-        match elf.header.pt2.type_().as_type() {
-            header::Type::Executable => {}
-            header::Type::SharedObject => {}
-            _ => return Err("ELF is not executable or shared object"),
-        }
-
-        // Check ELF arch
-        match elf.header.pt2.machine().as_machine() {
-            #[cfg(target_arch = "x86_64")]
-            header::Machine::X86_64 => {}
-            #[cfg(target_arch = "aarch64")]
-            header::Machine::AArch64 => {}
-            #[cfg(any(target_arch = "riscv32", target_arch = "riscv64"))]
-            header::Machine::Other(243) => {}
-            #[cfg(target_arch = "mips")]
-            header::Machine::Mips => {}
-            _ => return Err("invalid ELF arch"),
-        }
+        let image = image::get(inode)?;
 
         // Check interpreter (for dynamic link)
-        if let Ok(loader_path) = elf.get_interpreter() {
+        if let Some(loader_path) = &image.interp {
             // assuming absolute path
-            let inode = crate::fs::ROOT_INODE
-                .lookup_follow(loader_path, FOLLOW_MAX_DEPTH)
-                .map_err(|_| "interpreter not found")?;
+            let inode =
+                dcache::lookup_follow(&crate::fs::ROOT_INODE, loader_path, FOLLOW_MAX_DEPTH)
+                    .map_err(|_| "interpreter not found")?;
             // modify args for loader
             args[0] = exec_path.into();
-            args.insert(0, loader_path.into());
+            args.insert(0, loader_path.clone());
             // Elf loader should not have INTERP
             // No infinite loop
             return Thread::new_user_vm(&inode, exec_path, args, envs);
         }
 
         // Make page table
-        let mut vm = elf.make_memory_set(inode);
+        let mut vm = image.make_memory_set(inode);
 
         // User stack
         use crate::consts::{USER_STACK_OFFSET, USER_STACK_SIZE};
@@ -214,18 +232,23 @@ impl Thread {
             ustack_top
         };
 
+        let vdso = vdso::map(&mut vm);
+
         // Make init info
         let init_info = ProcInitInfo {
             args,
             envs,
             auxv: {
                 let mut map = BTreeMap::new();
-                if let Some(phdr_vaddr) = elf.get_phdr_vaddr() {
-                    map.insert(abi::AT_PHDR, phdr_vaddr as usize);
+                if let Some(phdr_vaddr) = image.phdr_vaddr {
+                    map.insert(abi::AT_PHDR, phdr_vaddr);
                 }
-                map.insert(abi::AT_PHENT, elf.header.pt2.ph_entry_size() as usize);
-                map.insert(abi::AT_PHNUM, elf.header.pt2.ph_count() as usize);
+                map.insert(abi::AT_PHENT, image.ph_entry_size);
+                map.insert(abi::AT_PHNUM, image.ph_count);
                 map.insert(abi::AT_PAGESZ, PAGE_SIZE);
+                if let Some(vdso) = vdso {
+                    map.insert(abi::AT_SYSINFO_EHDR, vdso);
+                }
                 map
             },
         };
@@ -235,8 +258,7 @@ impl Thread {
 
         trace!("{:#x?}", vm);
 
-        let entry_addr = elf.header.pt2.entry_point() as usize;
-        Ok((vm, entry_addr, ustack_top))
+        Ok((vm, image.entry, ustack_top))
     }
 
     /// Make a new user process from ELF `data`
@@ -299,19 +321,21 @@ impl Thread {
             },
             kstack,
             clear_child_tid: 0,
+            vfork_done: None,
             vm: vm.clone(),
             proc: Process {
                 vm,
                 files,
                 cwd: String::from("/"),
+                cwd_inode: None,
                 exec_path: String::from(exec_path),
-                futexes: BTreeMap::default(),
                 pid: Pid(0),
                 parent: Weak::new(),
                 children: Vec::new(),
                 threads: Vec::new(),
                 child_exit: Arc::new(Condvar::new()),
                 child_exit_code: BTreeMap::new(),
+                vfork_done: None,
             }
             .add_to_table(),
         })
@@ -325,31 +349,85 @@ impl Thread {
         let vm = Arc::new(Mutex::new(vm));
         let context = unsafe { Context::new_fork(tf, kstack.top(), vm_token) };
 
+        Box::new(Thread {
+            context,
+            kstack,
+            clear_child_tid: 0,
+            vfork_done: None,
+            vm: vm.clone(),
+            proc: self.new_child_process(vm, None),
+        })
+    }
+
+    /// Fork a new process running on the address space of current one, for `vfork`.
+    /// `done` is released when the child execs or dies.
+    pub fn vfork(&self, tf: &TrapFrame, done: Arc<VforkDone>) -> Box<Thread> {
+        let kstack = KernelStack::new();
+        let vm_token = self.vm.lock().token();
+        let context = unsafe { Context::new_fork(tf, kstack.top(), vm_token) };
+
+        Box::new(Thread {
+            context,
+            kstack,
+            clear_child_tid: 0,
+            vfork_done: Some(VforkRelease(done.clone())),
+            vm: self.vm.clone(),
+            proc: self.new_child_process(self.vm.clone(), Some(done)),
+        })
+    }
+
+    /// Make a child process of current one running `exec_path` on a new `vm`
+    /// from `new_user_vm`, without copying the address space.
+    pub fn spawn(
+        &self,
+        vm: MemorySet,
+        entry_addr: usize,
+        ustack_top: usize,
+        exec_path: &str,
+    ) -> Box<Thread> {
+        let kstack = KernelStack::new();
+        let vm_token = vm.token();
+        let vm = Arc::new(Mutex::new(vm));
+        let context =
+            unsafe { Context::new_user_thread(entry_addr, ustack_top, kstack.top(), vm_token) };
+        let proc = self.new_child_process(vm.clone(), None);
+        proc.lock().exec_path = String::from(exec_path);
+
+        Box::new(Thread {
+            context,
+            kstack,
+            clear_child_tid: 0,
+            vfork_done: None,
+            vm,
+            proc,
+        })
+    }
+
+    /// Make a child process of current one on `vm`, inheriting files and cwd
+    fn new_child_process(
+        &self,
+        vm: Arc<Mutex<MemorySet>>,
+        vfork_done: Option<Arc<VforkDone>>,
+    ) -> Arc<Mutex<Process>> {
         let mut proc = self.proc.lock();
         let new_proc = Process {
-            vm: vm.clone(),
+            vm,
             files: proc.files.clone(),
             cwd: proc.cwd.clone(),
+            cwd_inode: proc.cwd_inode.clone(),
             exec_path: proc.exec_path.clone(),
-            futexes: BTreeMap::default(),
             pid: Pid(0),
             parent: Arc::downgrade(&self.proc),
             children: Vec::new(),
             threads: Vec::new(),
             child_exit: Arc::new(Condvar::new()),
             child_exit_code: BTreeMap::new(),
+            vfork_done,
         }
         .add_to_table();
         // link to parent
         proc.children.push(Arc::downgrade(&new_proc));
-
-        Box::new(Thread {
-            context,
-            kstack,
-            clear_child_tid: 0,
-            vm,
-            proc: new_proc,
-        })
+        new_proc
     }
 
     /// Create a new thread in the same process.
@@ -366,6 +444,7 @@ impl Thread {
             context: unsafe { Context::new_clone(tf, stack_top, kstack.top(), vm_token, tls) },
             kstack,
             clear_child_tid,
+            vfork_done: None,
             vm: self.vm.clone(),
             proc: self.proc.clone(),
         })
@@ -401,12 +480,6 @@ impl Process {
         self.files.insert(fd, file_like);
         fd
     }
-    pub fn get_futex(&mut self, uaddr: usize) -> Arc<Condvar> {
-        if !self.futexes.contains_key(&uaddr) {
-            self.futexes.insert(uaddr, Arc::new(Condvar::new()));
-        }
-        self.futexes.get(&uaddr).unwrap().clone()
-    }
     /// Exit the process.
     /// Kill all threads and notify parent with the exit code.
     pub fn exit(&mut self, exit_code: usize) {
@@ -414,6 +487,10 @@ impl Process {
         for tid in self.threads.iter() {
             processor().manager().exit(*tid, 1);
         }
+        // give the address space back to a vfork parent
+        if let Some(done) = self.vfork_done.take() {
+            done.release();
+        }
         // notify parent and fill exit code
         if let Some(parent) = self.parent.upgrade() {
             let mut parent = parent.lock();
@@ -423,104 +500,26 @@ impl Process {
     }
 }
 
-trait ToMemoryAttr {
-    fn to_attr(&self) -> MemoryAttr;
-}
-
-impl ToMemoryAttr for Flags {
-    fn to_attr(&self) -> MemoryAttr {
-        let mut flags = MemoryAttr::default().user();
-        if self.is_execute() {
-            flags = flags.execute();
-        }
-        if !self.is_write() {
-            flags = flags.readonly();
-        }
-        flags
-    }
-}
-
-/// Helper functions to process ELF file
-trait ElfExt {
-    /// Generate a MemorySet according to the ELF file.
-    fn make_memory_set(&self, inode: &Arc<INode>) -> MemorySet;
-
-    /// Get interpreter string if it has.
-    fn get_interpreter(&self) -> Result<&str, &str>;
-
-    /// Get virtual address of PHDR section if it has.
-    fn get_phdr_vaddr(&self) -> Option<u64>;
-}
-
-impl ElfExt for ElfFile<'_> {
-    fn make_memory_set(&self, inode: &Arc<INode>) -> MemorySet {
-        debug!("creating MemorySet from ELF");
-        let mut ms = MemorySet::new();
-
-        for ph in self.program_iter() {
-            if ph.get_type() != Ok(Type::Load) {
-                continue;
-            }
-            ms.push(
-                ph.virtual_addr() as usize,
-                ph.virtual_addr() as usize + ph.mem_size() as usize,
-                ph.flags().to_attr(),
-                File {
-                    file: INodeForMap(inode.clone()),
-                    mem_start: ph.virtual_addr() as usize,
-                    file_start: ph.offset() as usize,
-                    file_end: ph.offset() as usize + ph.file_size() as usize,
-                    allocator: GlobalFrameAlloc,
-                },
-                "elf",
-            );
-        }
-        ms
-    }
+#[derive(Clone)]
+pub struct INodeForMap(pub Arc<INode>);
 
-    fn get_interpreter(&self) -> Result<&str, &str> {
-        let header = self
-            .program_iter()
-            .filter(|ph| ph.get_type() == Ok(Type::Interp))
-            .next()
-            .ok_or("no interp header")?;
-        let mut data = match header.get_data(self)? {
-            SegmentData::Undefined(data) => data,
-            _ => unreachable!(),
-        };
-        // skip NULL
-        while let Some(0) = data.last() {
-            data = &data[..data.len() - 1];
+impl Read for INodeForMap {
+    fn read_at(&self, offset: usize, buf: &mut [u8]) -> usize {
+        if page_cache::is_cacheable(&self.0) {
+            page_cache::read_at(&self.0, offset, buf).unwrap()
+        } else {
+            self.0.read_at(offset, buf).unwrap()
         }
-        let path = str::from_utf8(data).map_err(|_| "failed to convert to utf8")?;
-        Ok(path)
     }
 
-    fn get_phdr_vaddr(&self) -> Option<u64> {
-        if let Some(phdr) = self
-            .program_iter()
-            .find(|ph| ph.get_type() == Ok(Type::Phdr))
-        {
-            // if phdr exists in program header, use it
-            Some(phdr.virtual_addr())
-        } else if let Some(elf_addr) = self
-            .program_iter()
-            .find(|ph| ph.get_type() == Ok(Type::Load) && ph.offset() == 0)
-        {
-            // otherwise, check if elf is loaded from the beginning, then phdr can be inferred.
-            Some(elf_addr.virtual_addr() + self.header.pt2.ph_offset())
-        } else {
-            warn!("elf: no phdr found, tls might not work");
-            None
+    fn get_page(&self, offset: usize) -> Option<usize> {
+        if !page_cache::is_cacheable(&self.0) {
+            return None;
         }
+        page_cache::get_page(&self.0, offset / PAGE_SIZE).ok()
     }
-}
-
-#[derive(Clone)]
-pub struct INodeForMap(pub Arc<INode>);
 
-impl Read for INodeForMap {
-    fn read_at(&self, offset: usize, buf: &mut [u8]) -> usize {
-        self.0.read_at(offset, buf).unwrap()
+    fn put_page(&self, frame: usize) -> bool {
+        page_cache::put_page(frame)
     }
 }
@@ -0,0 +1,139 @@
+//! Fork & exec latency and context switch benchmarks
+//!
+//! Run `bench_fork_exec` (`bench fork_exec` in the kernel shell) to compare fork cost
+//! with respect to the resident memory of the parent,
+//! `bench_spawn` (`bench spawn`) with `/bin/true` to measure the spawn rate with the image cache,
+//! and `bench_yield` (`bench yield`) to see how context switches scale with CPUs.
+
+use super::*;
+use crate::fs::ROOT_INODE;
+use crate::hrtimer;
+use crate::memory::{ByFrame, GlobalFrameAlloc, MemoryAttr};
+use crate::thread;
+use alloc::vec::Vec;
+
+const ROUNDS: usize = 100;
+
+fn now_usec() -> usize {
+    (hrtimer::now() / 1000) as usize
+}
+
+/// Make a process image of `path` with `resident` bytes of present anonymous memory,
+/// then fork it and exec `path` in the child for `ROUNDS` times.
+pub fn bench_fork_exec(path: &str, resident: usize) {
+    let inode = ROOT_INODE.lookup(path).expect("program not found");
+    let load = || {
+        Thread::new_user_vm(&inode, path, vec![path.into()], Vec::new())
+            .expect("failed to load program")
+            .0
+    };
+    let mut vm = load();
+    let start = vm.find_free_area(0x1000_0000, resident);
+    vm.push(
+        start,
+        start + resident,
+        MemoryAttr::default().user(),
+        ByFrame::new(GlobalFrameAlloc),
+        "bench",
+    );
+
+    let mut fork_usec = 0;
+    let mut exec_usec = 0;
+    for _ in 0..ROUNDS {
+        let t0 = now_usec();
+        let child_vm = vm.clone();
+        let t1 = now_usec();
+        // exec replaces and drops the forked memory set
+        let new_vm = load();
+        drop(child_vm);
+        let t2 = now_usec();
+        drop(new_vm);
+        fork_usec += t1 - t0;
+        exec_usec += t2 - t1;
+    }
+    println!(
+        "fork+exec {} with {} KiB resident: fork {} us, exec {} us, total {} us",
+        path,
+        resident / 1024,
+        fork_usec / ROUNDS,
+        exec_usec / ROUNDS,
+        (fork_usec + exec_usec) / ROUNDS
+    );
+}
+
+/// Spawn `path` as a child of the current kernel thread the way `sys_spawn` does,
+/// and wait for it to exit, `ROUNDS` times cold (image cache invalidated before each spawn)
+/// and `ROUNDS` times warm
+pub fn bench_spawn(path: &str) {
+    let inode = ROOT_INODE.lookup(path).expect("program not found");
+    let current = unsafe { current_thread() };
+    let parent = current.proc.clone();
+    let spawn = || {
+        let (vm, entry_addr, ustack_top) =
+            Thread::new_user_vm(&inode, path, vec![path.into()], Vec::new())
+                .expect("failed to load program");
+        let thread = current.spawn(vm, entry_addr, ustack_top, path);
+        let pid = thread.proc.lock().pid.get();
+        let tid = add_thread(thread);
+        processor().manager().detach(tid);
+        loop {
+            let mut proc = parent.lock();
+            if proc.child_exit_code.remove(&pid).is_some() {
+                break;
+            }
+            let condvar = proc.child_exit.clone();
+            condvar.wait(proc);
+        }
+    };
+
+    for &cold in [true, false].iter() {
+        let stats = image::image_cache_stats();
+        let t0 = now_usec();
+        for _ in 0..ROUNDS {
+            if cold {
+                image::invalidate(&inode);
+            }
+            spawn();
+        }
+        let usec = (now_usec() - t0).max(1);
+        let end = image::image_cache_stats();
+        println!(
+            "spawn {} ({}): {} us each, {} spawns/s, image cache {} hits {} misses",
+            path,
+            if cold { "cold" } else { "warm" },
+            usec / ROUNDS,
+            ROUNDS * 1_000_000 / usec,
+            end.hits - stats.hits,
+            end.misses - stats.misses
+        );
+    }
+}
+
+/// Spawn `threads` kernel threads yielding `rounds` times each,
+/// then print the switch rate and the load balancing counters
+pub fn bench_yield(threads: usize, rounds: usize) {
+    let t0 = now_usec();
+    let handles: Vec<_> = (0..threads)
+        .map(|_| {
+            thread::spawn(move || {
+                for _ in 0..rounds {
+                    thread::yield_now();
+                }
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+    let usec = (now_usec() - t0).max(1);
+    println!(
+        "yield with {} threads: {} switches in {} us, {} switches/s",
+        threads,
+        threads * rounds,
+        usec,
+        threads * rounds * 1000 / usec * 1000
+    );
+    for stats in super::sched::stats() {
+        println!("{:?}", stats);
+    }
+}
@@ -34,11 +34,9 @@ pub fn add_user_shell() {
     let init_args = vec!["busybox".into(), "ash".into()];
 
     if let Ok(inode) = ROOT_INODE.lookup(init_shell) {
-        processor()
-            .manager()
-            .add(Thread::new_user(&inode, init_shell, init_args, init_envs));
+        add_thread(Thread::new_user(&inode, init_shell, init_args, init_envs));
     } else {
-        processor().manager().add(Thread::new_kernel(shell, 0));
+        add_thread(Thread::new_kernel(shell, 0));
     }
 }
 
@@ -47,7 +45,7 @@ pub fn add_user_shell() {
     use crate::drivers::CMDLINE;
     let cmdline = CMDLINE.read();
     let inode = ROOT_INODE.lookup(&cmdline).unwrap();
-    processor().manager().add(Thread::new_user(
+    add_thread(Thread::new_user(
         &inode,
         &cmdline,
         cmdline.split(' ').map(|s| s.into()).collect(),
@@ -67,8 +65,11 @@ pub extern "C" fn shell(_arg: usize) -> ! {
             continue;
         }
         let name = cmd.trim().split(' ').next().unwrap();
+        if run_builtin(&cmd) {
+            continue;
+        }
         if let Ok(inode) = ROOT_INODE.lookup(name) {
-            let _tid = processor().manager().add(Thread::new_user(
+            let _tid = add_thread(Thread::new_user(
                 &inode,
                 &cmd,
                 cmd.split(' ').map(|s| s.into()).collect(),
@@ -81,6 +82,58 @@ pub extern "C" fn shell(_arg: usize) -> ! {
     }
 }
 
+/// Run `cmd` if it is a command of the kernel shell itself.
+/// Return false if it is not one.
+///
+/// Also run by `sys_kernel_cmd`, as this shell only starts without `/busybox`.
+pub fn run_builtin(cmd: &str) -> bool {
+    let mut args = cmd.split(' ').filter(|arg| !arg.is_empty());
+    match args.next() {
+        Some("stats") => {
+            println!("{:?}", crate::memory::frame_alloc_stats());
+            println!("{:?}", crate::sync::adaptive_lock_stats());
+            println!("{:?}", crate::process::image::image_cache_stats());
+            println!("{:?}", crate::fs::dcache::dcache_stats());
+            println!("{:?}", crate::hrtimer::hrtimer_stats());
+        }
+        Some("bench") => run_bench(args),
+        _ => return false,
+    }
+    true
+}
+
+const BENCH_USAGE: &str = "\
+usage: bench fork_exec <path> [resident KiB]
+       bench yield [threads] [rounds]
+       bench spawn [path]
+       bench raw_send [threads]
+       bench udp_send <addr:port> [threads]
+       bench mpsc [senders] [batch]";
+
+/// Run a benchmark of the kernel, `args` starts with its name
+fn run_bench<'a>(mut args: impl Iterator<Item = &'a str>) {
+    use crate::process::test::*;
+    let name = args.next().unwrap_or("");
+    let args: Vec<&str> = args.collect();
+    let num = |i: usize, default: usize| -> usize {
+        args.get(i)
+            .and_then(|arg| arg.parse().ok())
+            .unwrap_or(default)
+    };
+    match (name, args.get(0)) {
+        ("fork_exec", Some(path)) => bench_fork_exec(path, num(1, 0) * 1024),
+        ("yield", _) => bench_yield(num(0, 4), num(1, 10000)),
+        ("spawn", path) => bench_spawn(path.cloned().unwrap_or("/bin/true")),
+        ("raw_send", _) => crate::net::bench_raw_send(num(0, 4)),
+        ("udp_send", Some(endpoint)) => match endpoint.parse() {
+            Ok(endpoint) => crate::net::bench_udp_send(endpoint, num(1, 4)),
+            Err(_) => println!("bad endpoint {}", endpoint),
+        },
+        ("mpsc", _) => crate::sync::test::bench_mpsc(num(0, 4), num(1, 32)),
+        _ => println!("{}", BENCH_USAGE),
+    }
+}
+
 const BEL: u8 = 0x07u8;
 const BS: u8 = 0x08u8;
 const LF: u8 = 0x0au8;
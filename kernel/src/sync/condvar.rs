@@ -1,13 +1,20 @@
 use super::*;
+use crate::hrtimer::{self, HrTimer};
 use crate::process::processor;
 use crate::thread;
 use alloc::collections::VecDeque;
 use alloc::sync::Arc;
 use alloc::vec::Vec;
+use core::fmt;
+use core::time::Duration;
+
+/// Callback run on every notify, e.g. to put a file on an epoll ready list
+pub type WakeCallback = Arc<Fn() + Send + Sync>;
 
 #[derive(Default)]
 pub struct Condvar {
     wait_queue: SpinNoIrqLock<VecDeque<Arc<thread::Thread>>>,
+    callbacks: SpinNoIrqLock<Vec<WakeCallback>>,
 }
 
 impl Condvar {
@@ -39,7 +46,31 @@ impl Condvar {
     }
 
     /// Wait for condvars until condition() returns Some
-    pub fn wait_events<T>(condvars: &[&Condvar], mut condition: impl FnMut() -> Option<T>) -> T {
+    pub fn wait_events<T>(condvars: &[&Condvar], condition: impl FnMut() -> Option<T>) -> T {
+        Self::wait_events_until(condvars, None, condition)
+    }
+
+    /// Wait for condvars until condition() returns Some, or `timeout` passed.
+    /// Return None on timeout.
+    pub fn wait_events_timeout<T>(
+        condvars: &[&Condvar],
+        timeout: Duration,
+        mut condition: impl FnMut() -> Option<T>,
+    ) -> Option<T> {
+        let deadline = hrtimer::deadline_after(timeout);
+        Self::wait_events_until(condvars, Some(deadline), move || match condition() {
+            Some(res) => Some(Some(res)),
+            None if hrtimer::now() >= deadline => Some(None),
+            None => None,
+        })
+    }
+
+    /// `deadline` is in nanoseconds of `hrtimer::now`
+    fn wait_events_until<T>(
+        condvars: &[&Condvar],
+        deadline: Option<u64>,
+        mut condition: impl FnMut() -> Option<T>,
+    ) -> T {
         let thread = thread::current();
         let tid = thread.id();
         let token = Arc::new(thread);
@@ -47,18 +78,32 @@ impl Condvar {
             let mut lock = condvar.wait_queue.lock();
             lock.push_back(token.clone());
         }
+        let mut timer = None;
         let mut locks = Vec::with_capacity(condvars.len());
         loop {
+            // the timer fires on this CPU, so not before the thread is marked sleeping
+            let irq = FlagsGuard::no_irq_region();
             for condvar in condvars {
                 let mut lock = condvar.wait_queue.lock();
                 locks.push(lock);
             }
+            match deadline {
+                Some(deadline) if timer.is_none() => {
+                    let token = token.clone();
+                    timer = Some(HrTimer::new(deadline, move || token.unpark()));
+                }
+                _ => {}
+            }
             processor().manager().sleep(tid, 0);
             locks.clear();
+            drop(irq);
 
             if let Some(res) = condition() {
                 let _ = FlagsGuard::no_irq_region();
                 processor().manager().cancel_sleeping(tid);
+                if let Some(timer) = timer {
+                    timer.cancel();
+                }
                 for condvar in condvars {
                     let mut lock = condvar.wait_queue.lock();
                     lock.retain(|t| !Arc::ptr_eq(t, &token));
@@ -89,12 +134,29 @@ impl Condvar {
         ret
     }
 
+    /// Run `callback` on every notify until it is unregistered
+    pub fn register_callback(&self, callback: WakeCallback) {
+        self.callbacks.lock().push(callback);
+    }
+
+    pub fn unregister_callback(&self, callback: &WakeCallback) {
+        self.callbacks.lock().retain(|c| !Arc::ptr_eq(c, callback));
+    }
+
+    fn run_callbacks(&self) {
+        for callback in self.callbacks.lock().iter() {
+            callback();
+        }
+    }
+
     pub fn notify_one(&self) {
+        self.run_callbacks();
         if let Some(t) = self.wait_queue.lock().front() {
             t.unpark();
         }
     }
     pub fn notify_all(&self) {
+        self.run_callbacks();
         let queue = self.wait_queue.lock();
         for t in queue.iter() {
             t.unpark();
@@ -103,6 +165,7 @@ impl Condvar {
     /// Notify up to `n` waiters.
     /// Return the number of waiters that were woken up.
     pub fn notify_n(&self, n: usize) -> usize {
+        self.run_callbacks();
         let mut count = 0;
         let queue = self.wait_queue.lock();
         for t in queue.iter() {
@@ -116,3 +179,9 @@ impl Condvar {
         count
     }
 }
+
+impl fmt::Debug for Condvar {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("Condvar").finish()
+    }
+}
@@ -7,8 +7,8 @@
 //! # 模块简介
 //!
 //! * `mutex`: 互斥锁。
-//!     参考`spin::Mutex`实现了一套可替换底层支持的锁框架，在此基础上实现了三种锁：
-//!     自旋锁，禁用中断自旋锁，线程调度锁
+//!     参考`spin::Mutex`实现了一套可替换底层支持的锁框架，在此基础上实现了四种锁：
+//!     自旋锁，禁用中断自旋锁，线程调度锁，自适应锁
 //!
 //! * `condvar`: 条件变量。
 //!     依赖`thread`，为其它工具提供线程调度支持。
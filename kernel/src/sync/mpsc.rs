@@ -1,17 +1,120 @@
 use super::Condvar;
-use super::SpinLock as Mutex;
-use alloc::{collections::VecDeque, sync::Arc, sync::Weak};
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use core::cell::UnsafeCell;
+use core::sync::atomic::{fence, AtomicBool, AtomicUsize, Ordering};
 
+/// Capacity of the channels made by `channel`
+const CHANNEL_DEFAULT_CAPACITY: usize = 1024;
+
+struct Slot<T> {
+    /// `pos` when the slot is free for the message at `pos`,
+    /// `pos + 1` when that message is written
+    seq: AtomicUsize,
+    value: UnsafeCell<Option<T>>,
+}
+
+/// A bounded lock-free ring, written by many senders and read by one receiver.
+///
+/// Senders claim a position by CAS on `tail`, then publish the message by
+/// `seq` of its slot. Condvars are only touched when the other side sleeps.
 struct Channel<T> {
-    deque: Mutex<VecDeque<T>>,
+    slots: Box<[Slot<T>]>,
+    mask: usize,
+    /// Next position to write
+    tail: AtomicUsize,
+    /// Next position to read, only changed by the receiver
+    head: AtomicUsize,
+    senders: AtomicUsize,
+    receiver_alive: AtomicBool,
+    /// Set while the receiver is waiting for a message
+    receiver_waiting: AtomicBool,
+    /// Number of senders waiting for room
+    senders_waiting: AtomicUsize,
     pushed: Condvar,
+    popped: Condvar,
 }
 
-impl<T> Default for Channel<T> {
-    fn default() -> Self {
+unsafe impl<T: Send> Send for Channel<T> {}
+unsafe impl<T: Send> Sync for Channel<T> {}
+
+impl<T> Channel<T> {
+    fn new(capacity: usize) -> Self {
+        let capacity = capacity.max(2).next_power_of_two();
+        let slots: Vec<_> = (0..capacity)
+            .map(|i| Slot {
+                seq: AtomicUsize::new(i),
+                value: UnsafeCell::new(None),
+            })
+            .collect();
         Channel {
-            deque: Mutex::<_>::default(),
-            pushed: Condvar::default(),
+            slots: slots.into_boxed_slice(),
+            mask: capacity - 1,
+            tail: AtomicUsize::new(0),
+            head: AtomicUsize::new(0),
+            senders: AtomicUsize::new(1),
+            receiver_alive: AtomicBool::new(true),
+            receiver_waiting: AtomicBool::new(false),
+            senders_waiting: AtomicUsize::new(0),
+            pushed: Condvar::new(),
+            popped: Condvar::new(),
+        }
+    }
+
+    /// Push `t` at the tail, give it back if the ring is full
+    fn push(&self, t: T) -> Result<(), T> {
+        let mut pos = self.tail.load(Ordering::Relaxed);
+        loop {
+            let slot = &self.slots[pos & self.mask];
+            let diff = slot.seq.load(Ordering::Acquire).wrapping_sub(pos) as isize;
+            if diff == 0 {
+                match self.tail.compare_exchange_weak(
+                    pos,
+                    pos.wrapping_add(1),
+                    Ordering::Relaxed,
+                    Ordering::Relaxed,
+                ) {
+                    Ok(_) => {
+                        unsafe { *slot.value.get() = Some(t) };
+                        slot.seq.store(pos.wrapping_add(1), Ordering::Release);
+                        return Ok(());
+                    }
+                    Err(current) => pos = current,
+                }
+            } else if diff < 0 {
+                // the slot still holds the message of last round
+                return Err(t);
+            } else {
+                pos = self.tail.load(Ordering::Relaxed);
+            }
+        }
+    }
+
+    /// Pop the message at the head, must only be called by the receiver
+    fn pop(&self) -> Option<T> {
+        let pos = self.head.load(Ordering::Relaxed);
+        let slot = &self.slots[pos & self.mask];
+        if slot.seq.load(Ordering::Acquire) != pos.wrapping_add(1) {
+            return None;
+        }
+        let t = unsafe { (*slot.value.get()).take() };
+        slot.seq
+            .store(pos.wrapping_add(self.slots.len()), Ordering::Release);
+        self.head.store(pos.wrapping_add(1), Ordering::Relaxed);
+        t
+    }
+
+    fn wake_receiver(&self) {
+        // pairs with the fence in the waiting receiver
+        fence(Ordering::SeqCst);
+        if self.receiver_waiting.load(Ordering::Relaxed) {
+            self.pushed.notify_one();
+        }
+    }
+
+    fn wake_senders(&self) {
+        fence(Ordering::SeqCst);
+        if self.senders_waiting.load(Ordering::Relaxed) != 0 {
+            self.popped.notify_all();
         }
     }
 }
@@ -31,15 +134,74 @@ impl<T> !Sync for Receiver<T> {}
 #[derive(Debug)]
 pub struct RecvError;
 
+#[derive(Debug, PartialEq, Eq)]
+pub enum TryRecvError {
+    Empty,
+    Disconnected,
+}
+
 impl<T> Receiver<T> {
     /// Attempts to wait for a value on this receiver,
     /// returning an error if the corresponding channel has hung up.
     pub fn recv(&self) -> Result<T, RecvError> {
-        let mut deque = self.inner.deque.lock();
-        while deque.is_empty() {
-            deque = self.inner.pushed.wait(deque);
+        let t = self.wait()?;
+        self.inner.wake_senders();
+        Ok(t)
+    }
+
+    /// Attempts to return a pending value on this receiver without blocking.
+    pub fn try_recv(&self) -> Result<T, TryRecvError> {
+        let disconnected = self.inner.senders.load(Ordering::Acquire) == 0;
+        match self.inner.pop() {
+            Some(t) => {
+                self.inner.wake_senders();
+                Ok(t)
+            }
+            None if disconnected => Err(TryRecvError::Disconnected),
+            None => Err(TryRecvError::Empty),
+        }
+    }
+
+    /// Wait for a value, then move it and up to `max - 1` more pending values into `buf`.
+    /// Return the number of values received.
+    pub fn recv_many(&self, buf: &mut Vec<T>, max: usize) -> Result<usize, RecvError> {
+        buf.push(self.wait()?);
+        let mut count = 1;
+        while count < max {
+            match self.inner.pop() {
+                Some(t) => buf.push(t),
+                None => break,
+            }
+            count += 1;
         }
-        Ok(deque.pop_front().unwrap())
+        self.inner.wake_senders();
+        Ok(count)
+    }
+
+    fn wait(&self) -> Result<T, RecvError> {
+        if let Some(t) = self.inner.pop() {
+            return Ok(t);
+        }
+        self.inner.receiver_waiting.store(true, Ordering::Relaxed);
+        let res = Condvar::wait_event(&self.inner.pushed, || {
+            fence(Ordering::SeqCst);
+            // messages sent before the last sender dropped are still received
+            let disconnected = self.inner.senders.load(Ordering::Acquire) == 0;
+            match self.inner.pop() {
+                Some(t) => Some(Ok(t)),
+                None if disconnected => Some(Err(RecvError)),
+                None => None,
+            }
+        });
+        self.inner.receiver_waiting.store(false, Ordering::Relaxed);
+        res
+    }
+}
+
+impl<T> Drop for Receiver<T> {
+    fn drop(&mut self) {
+        self.inner.receiver_alive.store(false, Ordering::SeqCst);
+        self.inner.popped.notify_all();
     }
 }
 
@@ -47,9 +209,8 @@ impl<T> Receiver<T> {
 /// This half can only be owned by one thread, but it can be cloned to send to other threads.
 ///
 /// Messages can be sent through this channel with send.
-#[derive(Clone)]
 pub struct Sender<T> {
-    inner: Weak<Channel<T>>,
+    inner: Arc<Channel<T>>,
 }
 
 unsafe impl<T: Send> Send for Sender<T> {}
@@ -59,27 +220,89 @@ impl<T> !Sync for Sender<T> {}
 #[derive(Debug)]
 pub struct SendError<T>(pub T);
 
+#[derive(Debug)]
+pub enum TrySendError<T> {
+    Full(T),
+    Disconnected(T),
+}
+
 impl<T> Sender<T> {
-    /// Attempts to send a value on this channel,
+    /// Attempts to send a value on this channel, waiting for room if it is full,
     /// returning it back if it could not be sent.
     pub fn send(&self, t: T) -> Result<(), SendError<T>> {
-        match self.inner.upgrade() {
-            None => Err(SendError(t)),
-            Some(inner) => {
-                let mut deque = inner.deque.lock();
-                deque.push_back(t);
-                inner.pushed.notify_one();
+        let t = match self.try_send(t) {
+            Ok(()) => return Ok(()),
+            Err(TrySendError::Disconnected(t)) => return Err(SendError(t)),
+            Err(TrySendError::Full(t)) => t,
+        };
+        let mut t = Some(t);
+        self.inner.senders_waiting.fetch_add(1, Ordering::Relaxed);
+        let res = Condvar::wait_event(&self.inner.popped, || {
+            fence(Ordering::SeqCst);
+            if !self.inner.receiver_alive.load(Ordering::Relaxed) {
+                return Some(Err(SendError(t.take().unwrap())));
+            }
+            match self.inner.push(t.take().unwrap()) {
+                Ok(()) => Some(Ok(())),
+                Err(back) => {
+                    t = Some(back);
+                    None
+                }
+            }
+        });
+        self.inner.senders_waiting.fetch_sub(1, Ordering::Relaxed);
+        if res.is_ok() {
+            self.inner.wake_receiver();
+        }
+        res
+    }
+
+    /// Attempts to send a value on this channel without blocking.
+    pub fn try_send(&self, t: T) -> Result<(), TrySendError<T>> {
+        if !self.inner.receiver_alive.load(Ordering::Relaxed) {
+            return Err(TrySendError::Disconnected(t));
+        }
+        match self.inner.push(t) {
+            Ok(()) => {
+                self.inner.wake_receiver();
                 Ok(())
             }
+            Err(t) => Err(TrySendError::Full(t)),
+        }
+    }
+}
+
+impl<T> Clone for Sender<T> {
+    fn clone(&self) -> Self {
+        self.inner.senders.fetch_add(1, Ordering::Relaxed);
+        Sender {
+            inner: self.inner.clone(),
+        }
+    }
+}
+
+impl<T> Drop for Sender<T> {
+    fn drop(&mut self) {
+        if self.inner.senders.fetch_sub(1, Ordering::Release) == 1 {
+            self.inner.wake_receiver();
         }
     }
 }
 
 /// Creates a new asynchronous channel, returning the sender/receiver halves.
+///
+/// Unlike std, it holds at most `CHANNEL_DEFAULT_CAPACITY` messages,
+/// then `send` waits for the receiver.
 pub fn channel<T>() -> (Sender<T>, Receiver<T>) {
-    let channel = Arc::new(Channel::<T>::default());
+    sync_channel(CHANNEL_DEFAULT_CAPACITY)
+}
+
+/// Creates a new channel holding at least `bound` messages,
+/// returning the sender/receiver halves.
+pub fn sync_channel<T>(bound: usize) -> (Sender<T>, Receiver<T>) {
+    let channel = Arc::new(Channel::<T>::new(bound));
     let sender = Sender {
-        inner: Arc::downgrade(&channel),
+        inner: channel.clone(),
     };
     let receiver = Receiver { inner: channel };
     (sender, receiver)
@@ -133,6 +356,38 @@ pub mod test {
         assert!(tx.send(1).is_err());
     }
 
+    fn bounded_full() {
+        let (tx, rx) = sync_channel::<i32>(2);
+        tx.try_send(1).unwrap();
+        tx.try_send(2).unwrap();
+        match tx.try_send(3) {
+            Err(TrySendError::Full(3)) => {}
+            _ => panic!("channel should be full"),
+        }
+        assert_eq!(rx.recv().unwrap(), 1);
+        tx.try_send(3).unwrap();
+    }
+
+    fn recv_disconnected() {
+        let (tx, rx) = channel::<i32>();
+        tx.send(1).unwrap();
+        drop(tx);
+        assert_eq!(rx.recv().unwrap(), 1);
+        assert!(rx.recv().is_err());
+        assert_eq!(rx.try_recv(), Err(TryRecvError::Disconnected));
+    }
+
+    fn recv_many_batch() {
+        let (tx, rx) = channel::<i32>();
+        for i in 0..5 {
+            tx.send(i).unwrap();
+        }
+        let mut buf = Vec::new();
+        assert_eq!(rx.recv_many(&mut buf, 3).unwrap(), 3);
+        assert_eq!(rx.recv_many(&mut buf, 3).unwrap(), 2);
+        assert_eq!(buf, [0, 1, 2, 3, 4]);
+    }
+
     pub fn test_all() {
         smoke();
         drop_full();
@@ -140,6 +395,9 @@ pub mod test {
         smoke_shared();
         smoke_threads();
         smoke_port_gone();
+        bounded_full();
+        recv_disconnected();
+        recv_many_batch();
         println!("mpsc test end");
     }
 }
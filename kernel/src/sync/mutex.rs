@@ -20,6 +20,11 @@
 //!     等价于`std::sync::Mutex`，依赖于`thread`模块提供线程调度支持。
 //!     在获取锁失败时，将自己加入等待队列，让出CPU；在解锁时，唤醒一个等待队列中的线程。
 //!
+//! * `AdaptiveLock`: 自适应锁。
+//!     相当于Linux中的`mutex`，用于较长的临界区。
+//!     在获取锁失败时，若持有者正在运行则自旋等待，否则加入等待队列让出CPU；
+//!     在解锁时，按FIFO顺序把锁直接交给第一个等待者。
+//!
 //! # 实现方法
 //!
 //! 由一个struct提供底层支持，它impl trait `MutexSupport`，并嵌入`Mutex`中。
@@ -28,15 +33,20 @@
 
 use super::Condvar;
 use crate::arch::interrupt;
+use crate::consts::MAX_CPU_NUM;
 use crate::processor;
+use crate::thread;
+use alloc::collections::VecDeque;
+use alloc::sync::Arc;
 use core::cell::UnsafeCell;
 use core::fmt;
 use core::ops::{Deref, DerefMut};
-use core::sync::atomic::{AtomicBool, Ordering};
+use core::sync::atomic::{spin_loop_hint, AtomicBool, AtomicUsize, Ordering};
 
 pub type SpinLock<T> = Mutex<T, Spin>;
 pub type SpinNoIrqLock<T> = Mutex<T, SpinNoIrq>;
 pub type SleepLock<T> = Mutex<T, Condvar>;
+pub type AdaptiveLock<T> = Mutex<T, Adaptive>;
 
 pub struct Mutex<T: ?Sized, S: MutexSupport> {
     lock: AtomicBool,
@@ -96,6 +106,9 @@ impl<T, S: MutexSupport> Mutex<T, S> {
 impl<T: ?Sized, S: MutexSupport> Mutex<T, S> {
     fn obtain_lock(&self) {
         while self.lock.compare_and_swap(false, true, Ordering::Acquire) != false {
+            if self.support.lock_contended(&self.lock) {
+                break;
+            }
             let mut try_count = 0;
             // Wait until the lock looks unlocked before retrying
             while self.lock.load(Ordering::Relaxed) {
@@ -110,6 +123,7 @@ impl<T: ?Sized, S: MutexSupport> Mutex<T, S> {
                 }
             }
         }
+        self.support.after_lock();
         let cid = crate::arch::cpu::id();
         let tid = processor().tid_option().unwrap_or(0);
         unsafe { self.user.get().write((cid, tid)) };
@@ -155,6 +169,7 @@ impl<T: ?Sized, S: MutexSupport> Mutex<T, S> {
     pub fn try_lock(&self) -> Option<MutexGuard<T, S>> {
         let support_guard = S::before_lock();
         if self.lock.compare_and_swap(false, true, Ordering::Acquire) == false {
+            self.support.after_lock();
             Some(MutexGuard {
                 mutex: self,
                 support_guard,
@@ -200,7 +215,7 @@ impl<'a, T: ?Sized, S: MutexSupport> DerefMut for MutexGuard<'a, T, S> {
 impl<'a, T: ?Sized, S: MutexSupport> Drop for MutexGuard<'a, T, S> {
     /// The dropping of the MutexGuard will release the lock it was created from.
     fn drop(&mut self) {
-        self.mutex.lock.store(false, Ordering::Release);
+        self.mutex.support.unlock(&self.mutex.lock);
         self.mutex.support.after_unlock();
     }
 }
@@ -215,6 +230,17 @@ pub trait MutexSupport {
     fn before_lock() -> Self::GuardData;
     /// Called when MutexGuard dropping
     fn after_unlock(&self);
+    /// Called when `lock` is held by someone else.
+    /// Return true if the lock has been acquired in it, otherwise spin for the lock.
+    fn lock_contended(&self, _lock: &AtomicBool) -> bool {
+        false
+    }
+    /// Called when the lock is acquired
+    fn after_lock(&self) {}
+    /// Release `lock` when MutexGuard dropping
+    fn unlock(&self, lock: &AtomicBool) {
+        lock.store(false, Ordering::Release);
+    }
 }
 
 /// Spin lock
@@ -266,6 +292,9 @@ impl MutexSupport for SpinNoIrq {
         SpinNoIrq
     }
     fn cpu_relax(&self) {
+        // the owner may be waiting for this CPU to flush its TLB
+        #[cfg(target_arch = "x86_64")]
+        crate::arch::ipi::poll();
         unsafe {
             #[cfg(target_arch = "x86_64")]
             asm!("pause" :::: "volatile");
@@ -294,3 +323,177 @@ impl MutexSupport for Condvar {
         self.notify_one();
     }
 }
+
+/// Spin while the owner is running, park otherwise
+pub struct Adaptive {
+    /// CPU of the owner, `!0` if the lock is being handed over
+    owner_cpu: AtomicUsize,
+    /// Context switches on `owner_cpu` when the lock was acquired
+    owner_switches: AtomicUsize,
+    /// Threads in `queue`, only changed with `queue` locked
+    waiters: AtomicUsize,
+    queue: SpinNoIrqLock<VecDeque<Arc<AdaptiveWaiter>>>,
+}
+
+struct AdaptiveWaiter {
+    thread: thread::Thread,
+    /// Set when the lock is handed over to this thread
+    granted: AtomicBool,
+}
+
+/// Spin at most this many times for a running owner before parking
+const ADAPTIVE_SPIN_MAX: usize = 0x1000;
+
+impl Adaptive {
+    /// Whether the owner is still on its CPU,
+    /// a thread can not leave the CPU without a context switch
+    fn owner_running(&self) -> bool {
+        let cpu = self.owner_cpu.load(Ordering::Relaxed);
+        cpu < MAX_CPU_NUM
+            && crate::process::switch_count(cpu) == self.owner_switches.load(Ordering::Relaxed)
+    }
+
+    /// Park current thread at the tail of the queue until the lock is handed over to it
+    fn park(&self, lock: &AtomicBool) -> bool {
+        let waiter = Arc::new(AdaptiveWaiter {
+            thread: thread::current(),
+            granted: AtomicBool::new(false),
+        });
+        let mut queue = self.queue.lock();
+        self.waiters.fetch_add(1, Ordering::SeqCst);
+        // the owner may have unlocked before seeing us
+        if lock
+            .compare_exchange(false, true, Ordering::SeqCst, Ordering::SeqCst)
+            .is_ok()
+        {
+            self.waiters.fetch_sub(1, Ordering::SeqCst);
+            return true;
+        }
+        queue.push_back(waiter.clone());
+        ADAPTIVE_STATS.parked.fetch_add(1, Ordering::Relaxed);
+        loop {
+            thread::park_action(move || {
+                drop(queue);
+            });
+            queue = self.queue.lock();
+            if waiter.granted.load(Ordering::Acquire) {
+                return true;
+            }
+        }
+    }
+}
+
+impl MutexSupport for Adaptive {
+    type GuardData = ();
+    fn new() -> Self {
+        Adaptive {
+            owner_cpu: AtomicUsize::new(!0),
+            owner_switches: AtomicUsize::new(0),
+            waiters: AtomicUsize::new(0),
+            queue: SpinNoIrqLock::new(VecDeque::new()),
+        }
+    }
+    fn cpu_relax(&self) {
+        spin_loop_hint();
+    }
+    fn before_lock() -> Self::GuardData {}
+    fn after_unlock(&self) {}
+    fn lock_contended(&self, lock: &AtomicBool) -> bool {
+        ADAPTIVE_STATS.contended.fetch_add(1, Ordering::Relaxed);
+        // not in a thread, can only spin
+        if processor().tid_option().is_none() {
+            return false;
+        }
+        let mut spins = 0;
+        while lock.load(Ordering::Relaxed) && spins < ADAPTIVE_SPIN_MAX && self.owner_running() {
+            spin_loop_hint();
+            spins += 1;
+        }
+        if !lock.load(Ordering::Relaxed)
+            && lock
+                .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+                .is_ok()
+        {
+            ADAPTIVE_STATS.spun.fetch_add(1, Ordering::Relaxed);
+            return true;
+        }
+        self.park(lock)
+    }
+    fn after_lock(&self) {
+        let cpu = crate::arch::cpu::id();
+        self.owner_switches
+            .store(crate::process::switch_count(cpu), Ordering::Relaxed);
+        self.owner_cpu.store(cpu, Ordering::Relaxed);
+    }
+    fn unlock(&self, lock: &AtomicBool) {
+        if self.waiters.load(Ordering::SeqCst) == 0 {
+            lock.store(false, Ordering::SeqCst);
+            if self.waiters.load(Ordering::SeqCst) == 0 {
+                return;
+            }
+            // a thread is about to park, take the lock back to hand it over
+            if lock
+                .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+                .is_err()
+            {
+                return;
+            }
+        }
+        let mut queue = self.queue.lock();
+        match queue.pop_front() {
+            Some(waiter) => {
+                // the lock stays held, so no one can jump the queue
+                self.waiters.fetch_sub(1, Ordering::SeqCst);
+                self.owner_cpu.store(!0, Ordering::Relaxed);
+                waiter.granted.store(true, Ordering::Release);
+                waiter.thread.unpark();
+                ADAPTIVE_STATS.handoffs.fetch_add(1, Ordering::Relaxed);
+            }
+            None => lock.store(false, Ordering::Release),
+        }
+    }
+}
+
+impl fmt::Debug for Adaptive {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("Adaptive")
+            .field("waiters", &self.waiters.load(Ordering::Relaxed))
+            .finish()
+    }
+}
+
+struct AdaptiveStats {
+    contended: AtomicUsize,
+    spun: AtomicUsize,
+    parked: AtomicUsize,
+    handoffs: AtomicUsize,
+}
+
+static ADAPTIVE_STATS: AdaptiveStats = AdaptiveStats {
+    contended: AtomicUsize::new(0),
+    spun: AtomicUsize::new(0),
+    parked: AtomicUsize::new(0),
+    handoffs: AtomicUsize::new(0),
+};
+
+/// Snapshot of the counters of all `AdaptiveLock`s
+#[derive(Debug, Clone, Copy)]
+pub struct AdaptiveLockStats {
+    /// Times a lock was found held by someone else
+    pub contended: usize,
+    /// Contended locks acquired by spinning on a running owner
+    pub spun: usize,
+    /// Threads parked in a wait queue
+    pub parked: usize,
+    /// Locks handed over to a parked thread on unlock
+    pub handoffs: usize,
+}
+
+pub fn adaptive_lock_stats() -> AdaptiveLockStats {
+    AdaptiveLockStats {
+        contended: ADAPTIVE_STATS.contended.load(Ordering::Relaxed),
+        spun: ADAPTIVE_STATS.spun.load(Ordering::Relaxed),
+        parked: ADAPTIVE_STATS.parked.load(Ordering::Relaxed),
+        handoffs: ADAPTIVE_STATS.handoffs.load(Ordering::Relaxed),
+    }
+}
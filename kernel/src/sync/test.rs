@@ -2,6 +2,8 @@
 //!
 //! The code is borrowed from [RustDoc - Dining Philosophers](https://doc.rust-lang.org/1.6.0/book/dining-philosophers.html)
 
+use crate::hrtimer;
+use crate::sync::mpsc;
 use crate::sync::Condvar;
 use crate::sync::SleepLock as Mutex;
 use crate::thread;
@@ -27,7 +29,7 @@ impl Philosopher {
 
     fn think(&self) {
         println!("{} is thinking.", self.name);
-        thread::sleep(Duration::from_secs(1));
+        hrtimer::sleep(Duration::from_secs(1));
     }
 }
 
@@ -45,7 +47,7 @@ impl Table for MutexTable {
         let _right = self.forks[right].lock();
 
         println!("{} is eating.", name);
-        thread::sleep(Duration::from_secs(1));
+        hrtimer::sleep(Duration::from_secs(1));
     }
 }
 
@@ -68,7 +70,7 @@ impl Table for MonitorTable {
             fork_status[right] = true;
         }
         println!("{} is eating.", name);
-        thread::sleep(Duration::from_secs(1));
+        hrtimer::sleep(Duration::from_secs(1));
         {
             let mut fork_status = self.fork_status.lock();
             fork_status[left] = false;
@@ -141,3 +143,50 @@ pub fn philosopher_using_monitor() {
     });
     philosopher(table);
 }
+
+/// Length of each run of the channel benchmark in milliseconds
+const BENCH_MSEC: usize = 1000;
+
+/// Send through a channel from 1 to `senders` threads, receiving in batches
+/// of `batch`, and print the message rate to see how the ring scales.
+/// Messages of each sender must arrive in order.
+pub fn bench_mpsc(senders: usize, batch: usize) {
+    for n in 1..=senders {
+        let (tx, rx) = mpsc::channel::<(usize, usize)>();
+        let end = hrtimer::deadline_after(Duration::from_millis(BENCH_MSEC as u64));
+        let handles: Vec<_> = (0..n)
+            .map(|id| {
+                let tx = tx.clone();
+                thread::spawn(move || {
+                    let mut sent = 0usize;
+                    while hrtimer::now() < end {
+                        tx.send((id, sent)).unwrap();
+                        sent += 1;
+                    }
+                    sent
+                })
+            })
+            .collect();
+        drop(tx);
+
+        let mut next = vec![0usize; n];
+        let mut buf = Vec::with_capacity(batch);
+        let mut received = 0usize;
+        while let Ok(count) = rx.recv_many(&mut buf, batch) {
+            for &(id, seq) in buf.iter() {
+                assert_eq!(seq, next[id], "message of sender {} out of order", id);
+                next[id] += 1;
+            }
+            received += count;
+            buf.clear();
+        }
+        let sent: usize = handles.into_iter().map(|h| h.join().unwrap()).sum();
+        assert_eq!(sent, received);
+        println!(
+            "mpsc with {} senders, batch {}: {} messages/s",
+            n,
+            batch,
+            received * 1000 / BENCH_MSEC
+        );
+    }
+}
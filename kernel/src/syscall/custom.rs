@@ -55,4 +55,105 @@ impl Syscall<'_> {
         }
         Ok(0)
     }
+
+    /// Run a builtin command of the kernel shell, i.e. `stats` or `bench <name> ...`.
+    /// The output goes to the kernel console.
+    pub fn sys_kernel_cmd(&mut self, cmd: *const u8) -> SysResult {
+        let cmd = check_and_clone_cstr(cmd)?;
+        info!("kernel_cmd: {:?}", cmd);
+        match crate::shell::run_builtin(&cmd) {
+            true => Ok(0),
+            false => Err(SysError::EINVAL),
+        }
+    }
+
+    /// Spawn a child process running `path`, like `posix_spawn`.
+    ///
+    /// The child is built directly from the program image instead of copying
+    /// the address space of the caller. It inherits the files and cwd,
+    /// then `actions` are applied to its file table in order.
+    /// Return the PID of the child.
+    pub fn sys_spawn(
+        &mut self,
+        path: *const u8,
+        argv: *const *const u8,
+        envp: *const *const u8,
+        actions: *const SpawnFileAction,
+        action_count: usize,
+    ) -> SysResult {
+        let path = check_and_clone_cstr(path)?;
+        let args = check_and_clone_cstr_array(argv)?;
+        let envs = check_and_clone_cstr_array(envp)?;
+        if args.is_empty() {
+            return Err(SysError::EINVAL);
+        }
+        let actions = unsafe { self.vm().check_read_array(actions, action_count)? };
+        let mut action_paths = Vec::new();
+        for action in actions.iter() {
+            if action.cmd == SPAWN_FDOP_OPEN {
+                action_paths.push(check_and_clone_cstr(action.path)?);
+            }
+        }
+        info!(
+            "spawn: path: {:?}, args: {:?}, envs: {:?}, actions: {:?}",
+            path, args, envs, actions
+        );
+
+        let inode = self.process().lookup_inode(&path)?;
+        let (vm, entry_addr, ustack_top) =
+            Thread::new_user_vm(&inode, &path, args, envs).map_err(|_| SysError::EINVAL)?;
+        let new_thread = self.thread.spawn(vm, entry_addr, ustack_top, &path);
+
+        {
+            let mut proc = new_thread.proc.lock();
+            let mut action_paths = action_paths.iter();
+            for action in actions.iter() {
+                match action.cmd {
+                    SPAWN_FDOP_CLOSE => {
+                        proc.files.remove(&action.fd).ok_or(SysError::EBADF)?;
+                    }
+                    SPAWN_FDOP_DUP2 => {
+                        let file_like = proc.get_file_like(action.src_fd)?.clone();
+                        proc.files.insert(action.fd, file_like);
+                    }
+                    SPAWN_FDOP_OPEN => {
+                        let path = action_paths.next().unwrap();
+                        proc.files.remove(&action.fd);
+                        let fd = proc.open_at(AT_FDCWD, path, action.flags, action.mode)?;
+                        if fd != action.fd {
+                            let file_like = proc.files.remove(&fd).unwrap();
+                            proc.files.insert(action.fd, file_like);
+                        }
+                    }
+                    _ => return Err(SysError::EINVAL),
+                }
+            }
+        }
+
+        let pid = new_thread.proc.lock().pid.get();
+        let tid = add_thread(new_thread);
+        processor().manager().detach(tid);
+        info!("spawn: {} -> {}", thread::current().id(), pid);
+        Ok(pid)
+    }
+}
+
+/// Close `fd` in the child
+pub const SPAWN_FDOP_CLOSE: usize = 1;
+/// Duplicate `src_fd` to `fd` in the child
+pub const SPAWN_FDOP_DUP2: usize = 2;
+/// Open `path` with `flags` and `mode` as `fd` in the child
+pub const SPAWN_FDOP_OPEN: usize = 3;
+
+/// A file action of `sys_spawn`, like `posix_spawn_file_actions_t` entries
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct SpawnFileAction {
+    /// One of `SPAWN_FDOP_*`
+    pub cmd: usize,
+    pub fd: usize,
+    pub src_fd: usize,
+    pub flags: usize,
+    pub mode: usize,
+    pub path: *const u8,
 }
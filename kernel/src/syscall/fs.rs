@@ -1,13 +1,15 @@
 //! Syscalls for file system
 
-use core::cell::UnsafeCell;
 use core::cmp::min;
 use core::mem::size_of;
+use core::time::Duration;
 #[cfg(not(target_arch = "mips"))]
 use rcore_fs::vfs::Timespec;
+use rcore_fs::vfs::PollStatus;
 
-use crate::drivers::SOCKET_ACTIVITY;
+use crate::fs::readahead::Advice;
 use crate::fs::*;
+use crate::hrtimer;
 use crate::memory::MemorySet;
 use crate::sync::Condvar;
 
@@ -24,6 +26,14 @@ impl Syscall<'_> {
         }
         let slice = unsafe { self.vm().check_write_array(base, len)? };
         let file_like = proc.get_file_like(fd)?;
+        if let FileLike::File(file) = file_like {
+            if file.pipe().is_some() {
+                // don't hold the process while blocked on a pipe
+                let file = file.clone();
+                drop(proc);
+                return file.pipe().unwrap().read(slice, file.nonblock());
+            }
+        }
         let len = file_like.read(slice)?;
         Ok(len)
     }
@@ -36,6 +46,14 @@ impl Syscall<'_> {
         }
         let slice = unsafe { self.vm().check_read_array(base, len)? };
         let file_like = proc.get_file_like(fd)?;
+        if let FileLike::File(file) = file_like {
+            if file.pipe().is_some() {
+                // don't hold the process while blocked on a pipe
+                let file = file.clone();
+                drop(proc);
+                return file.pipe().unwrap().write(slice, file.nonblock());
+            }
+        }
         let len = file_like.write(slice)?;
         Ok(len)
     }
@@ -97,15 +115,22 @@ impl Syscall<'_> {
         }
 
         let polls = unsafe { self.vm().check_write_array(ufds, nfds)? };
+        let mut wait_queues = Vec::new();
+        let mut recheck = false;
         for poll in polls.iter() {
-            if proc.files.get(&(poll.fd as usize)).is_none() {
-                return Err(SysError::EINVAL);
+            match proc.files.get(&(poll.fd as usize)) {
+                Some(file_like) => match file_like.wait_queue() {
+                    Some(queue) => wait_queues.push(queue),
+                    None => recheck = true,
+                },
+                None => return Err(SysError::EINVAL),
             }
         }
         drop(proc);
 
-        let begin_time_ms = crate::trap::uptime_msec();
-        Condvar::wait_events(&[&STDIN.pushed, &(*SOCKET_ACTIVITY)], move || {
+        // sleep on the files polled only
+        let condvars: Vec<&Condvar> = wait_queues.iter().map(|queue| &**queue).collect();
+        let condition = move || {
             use PollEvents as PE;
             let proc = self.process();
             let mut events = 0;
@@ -138,13 +163,9 @@ impl Syscall<'_> {
             if events > 0 {
                 return Some(Ok(events));
             }
-
-            let current_time_ms = crate::trap::uptime_msec();
-            if timeout_msecs < (1 << 31) && current_time_ms - begin_time_ms > timeout_msecs {
-                return Some(Ok(0));
-            }
             return None;
-        })
+        };
+        wait_polled(&condvars, recheck, timeout_msecs, condition)
     }
 
     pub fn sys_select(
@@ -176,10 +197,23 @@ impl Syscall<'_> {
         if cfg!(debug_assertions) {
             debug!("files before select {:#?}", proc.files);
         }
+        let mut wait_queues = Vec::new();
+        let mut recheck = false;
+        for (&fd, file_like) in proc.files.iter() {
+            if fd < nfds
+                && (read_fds.contains(fd) || write_fds.contains(fd) || err_fds.contains(fd))
+            {
+                match file_like.wait_queue() {
+                    Some(queue) => wait_queues.push(queue),
+                    None => recheck = true,
+                }
+            }
+        }
         drop(proc);
 
-        let begin_time_ms = crate::trap::uptime_msec();
-        Condvar::wait_events(&[&STDIN.pushed, &(*SOCKET_ACTIVITY)], move || {
+        // sleep on the files selected only
+        let condvars: Vec<&Condvar> = wait_queues.iter().map(|queue| &**queue).collect();
+        let condition = move || {
             let proc = self.process();
             let mut events = 0;
             for (&fd, file_like) in proc.files.iter() {
@@ -211,21 +245,114 @@ impl Syscall<'_> {
             if events > 0 {
                 return Some(Ok(events));
             }
+            return None;
+        };
+        wait_polled(&condvars, recheck, timeout_msecs, condition)
+    }
 
-            if timeout_msecs == 0 {
-                // no timeout, return now;
-                return Some(Ok(0));
+    pub fn sys_epoll_create(&mut self, size: usize) -> SysResult {
+        info!("epoll_create: size: {}", size);
+        if size as isize <= 0 {
+            return Err(SysError::EINVAL);
+        }
+        self.sys_epoll_create1(0)
+    }
+
+    pub fn sys_epoll_create1(&mut self, flags: usize) -> SysResult {
+        info!("epoll_create1: flags: {:#x}", flags);
+        let mut proc = self.process();
+        let epoll = Arc::new(EpollInstance::new());
+        let fd = proc.add_file(FileLike::Epoll(epoll));
+        Ok(fd)
+    }
+
+    pub fn sys_epoll_ctl(
+        &mut self,
+        epfd: usize,
+        op: usize,
+        fd: usize,
+        event: *const EpollEvent,
+    ) -> SysResult {
+        info!(
+            "epoll_ctl: epfd: {}, op: {}, fd: {}, event: {:?}",
+            epfd, op, fd, event
+        );
+        if epfd == fd {
+            return Err(SysError::EINVAL);
+        }
+        let mut proc = self.process();
+        let event = if op == EPOLL_CTL_DEL {
+            EpollEvent {
+                events: EpollFlags::empty(),
+                data: 0,
             }
+        } else {
+            unsafe { *self.vm().check_read_ptr(event)? }
+        };
+        let queue = proc.get_file_like(fd)?.wait_queue();
+        let epoll = proc.get_epoll(epfd)?;
+        EpollInstance::control(&epoll, op, fd, event, queue)?;
+        Ok(0)
+    }
 
-            let current_time_ms = crate::trap::uptime_msec();
-            // infinity check
-            if timeout_msecs < (1 << 31) && current_time_ms - begin_time_ms > timeout_msecs as usize
-            {
-                return Some(Ok(0));
+    pub fn sys_epoll_wait(
+        &mut self,
+        epfd: usize,
+        events: *mut EpollEvent,
+        maxevents: usize,
+        timeout_msecs: isize,
+    ) -> SysResult {
+        info!(
+            "epoll_wait: epfd: {}, events: {:?}, maxevents: {}, timeout_msecs: {}",
+            epfd, events, maxevents, timeout_msecs
+        );
+        if maxevents == 0 {
+            return Err(SysError::EINVAL);
+        }
+        let mut proc = self.process();
+        let events = unsafe { self.vm().check_write_array(events, maxevents)? };
+        let epoll = proc.get_epoll(epfd)?;
+        drop(proc);
+
+        // only poll the files on the ready list
+        let mut condition = || {
+            let proc = self.process();
+            let count = epoll.poll_ready(events, |fd| {
+                let file_like = proc.files.get(&fd)?;
+                let status = file_like.poll().unwrap_or(PollStatus {
+                    read: false,
+                    write: false,
+                    error: true,
+                });
+                Some((status, file_like.wait_queue()))
+            });
+            if count > 0 {
+                Some(count)
+            } else {
+                None
+            }
+        };
+        let count = match timeout_msecs {
+            0 => condition().unwrap_or(0),
+            t if t < 0 => Condvar::wait_event(&epoll.new_ready, condition),
+            t => {
+                let timeout = Duration::from_millis(t as u64);
+                Condvar::wait_events_timeout(&[&*epoll.new_ready], timeout, condition).unwrap_or(0)
             }
+        };
+        Ok(count)
+    }
 
-            return None;
-        })
+    pub fn sys_epoll_pwait(
+        &mut self,
+        epfd: usize,
+        events: *mut EpollEvent,
+        maxevents: usize,
+        timeout_msecs: isize,
+        _sigmask: usize,
+    ) -> SysResult {
+        // ignore sigmask
+        self.sys_epoll_wait(epfd, events, maxevents, timeout_msecs)
     }
 
     pub fn sys_readv(&mut self, fd: usize, iov_ptr: *const IoVec, iov_count: usize) -> SysResult {
@@ -239,7 +366,22 @@ impl Syscall<'_> {
         // read all data to a buf
         let file_like = proc.get_file_like(fd)?;
         let mut buf = iovs.new_buf(true);
-        let len = file_like.read(buf.as_mut_slice())?;
+        let mut pipe_file = None;
+        if let FileLike::File(file) = file_like {
+            if file.pipe().is_some() {
+                pipe_file = Some(file.clone());
+            }
+        }
+        let len = match pipe_file {
+            Some(file) => {
+                // don't hold the process while blocked on a pipe
+                drop(proc);
+                file.pipe()
+                    .unwrap()
+                    .read(buf.as_mut_slice(), file.nonblock())?
+            }
+            None => file_like.read(buf.as_mut_slice())?,
+        };
         // copy data to user
         iovs.write_all_from_slice(&buf[..len]);
         Ok(len)
@@ -258,6 +400,14 @@ impl Syscall<'_> {
 
         let buf = iovs.read_all_to_vec();
         let file_like = proc.get_file_like(fd)?;
+        if let FileLike::File(file) = file_like {
+            if file.pipe().is_some() {
+                // don't hold the process while blocked on a pipe
+                let file = file.clone();
+                drop(proc);
+                return file.pipe().unwrap().write(buf.as_slice(), file.nonblock());
+            }
+        }
         let len = file_like.write(buf.as_slice())?;
         Ok(len)
     }
@@ -275,41 +425,14 @@ impl Syscall<'_> {
     ) -> SysResult {
         let mut proc = self.process();
         let path = unsafe { check_and_clone_cstr(path)? };
-        let flags = OpenFlags::from_bits_truncate(flags);
         info!(
             "openat: dir_fd: {}, path: {:?}, flags: {:?}, mode: {:#o}",
-            dir_fd as isize, path, flags, mode
+            dir_fd as isize,
+            path,
+            OpenFlags::from_bits_truncate(flags),
+            mode
         );
-
-        let inode = if flags.contains(OpenFlags::CREATE) {
-            let (dir_path, file_name) = split_path(&path);
-            // relative to cwd
-            let dir_inode = proc.lookup_inode_at(dir_fd, dir_path, true)?;
-            match dir_inode.find(file_name) {
-                Ok(file_inode) => {
-                    if flags.contains(OpenFlags::EXCLUSIVE) {
-                        return Err(SysError::EEXIST);
-                    }
-                    file_inode
-                }
-                Err(FsError::EntryNotFound) => {
-                    dir_inode.create(file_name, FileType::File, mode as u32)?
-                }
-                Err(e) => return Err(SysError::from(e)),
-            }
-        } else {
-            proc.lookup_inode_at(dir_fd, &path, true)?
-        };
-
-        let file = FileHandle::new(inode, flags.to_options(), String::from(path));
-
-        // for debugging
-        if cfg!(debug_assertions) {
-            debug!("files before open {:#?}", proc.files);
-        }
-
-        let fd = proc.add_file(FileLike::File(file));
-        Ok(fd)
+        proc.open_at(dir_fd, &path, flags, mode)
     }
 
     pub fn sys_close(&mut self, fd: usize) -> SysResult {
@@ -451,6 +574,34 @@ impl Syscall<'_> {
         Ok(offset as usize)
     }
 
+    /// Advise the access pattern of a file, which tunes its readahead
+    pub fn sys_fadvise(
+        &mut self,
+        fd: usize,
+        offset: usize,
+        len: usize,
+        advice: usize,
+    ) -> SysResult {
+        info!(
+            "fadvise: fd: {}, offset: {}, len: {}, advice: {}",
+            fd, offset, len, advice
+        );
+        let mut proc = self.process();
+        let file = proc.get_file(fd)?;
+        if file.pipe().is_some() {
+            return Err(SysError::ESPIPE);
+        }
+        match advice {
+            POSIX_FADV_NORMAL => file.advise(Advice::Normal),
+            POSIX_FADV_RANDOM => file.advise(Advice::Random),
+            POSIX_FADV_SEQUENTIAL => file.advise(Advice::Sequential),
+            POSIX_FADV_WILLNEED => file.will_need(offset, len)?,
+            POSIX_FADV_DONTNEED | POSIX_FADV_NOREUSE => {}
+            _ => return Err(SysError::EINVAL),
+        }
+        Ok(0)
+    }
+
     pub fn sys_fsync(&mut self, fd: usize) -> SysResult {
         info!("fsync: fd: {}", fd);
         self.process().get_file(fd)?.sync_all()?;
@@ -467,7 +618,10 @@ impl Syscall<'_> {
         let proc = self.process();
         let path = unsafe { check_and_clone_cstr(path)? };
         info!("truncate: path: {:?}, len: {}", path, len);
-        proc.lookup_inode(&path)?.resize(len)?;
+        let inode = proc.lookup_inode(&path)?;
+        inode.resize(len)?;
+        crate::fs::page_cache::truncate(&inode, len);
+        crate::process::image::invalidate(&inode);
         Ok(0)
     }
 
@@ -550,6 +704,7 @@ impl Syscall<'_> {
         if info.type_ != FileType::Dir {
             return Err(SysError::ENOTDIR);
         }
+        proc.cwd_inode = Some(inode);
 
         // BUGFIX: '..' and '.'
         if path.len() > 0 {
@@ -604,6 +759,8 @@ impl Syscall<'_> {
         let old_dir_inode = proc.lookup_inode_at(olddirfd, old_dir_path, false)?;
         let new_dir_inode = proc.lookup_inode_at(newdirfd, new_dir_path, false)?;
         old_dir_inode.move_(old_file_name, &new_dir_inode, new_file_name)?;
+        dcache::invalidate(&old_dir_inode, old_file_name);
+        dcache::invalidate(&new_dir_inode, new_file_name);
         Ok(0)
     }
 
@@ -626,6 +783,7 @@ impl Syscall<'_> {
             return Err(SysError::EEXIST);
         }
         inode.create(file_name, FileType::Dir, mode as u32)?;
+        dcache::invalidate(&inode, file_name);
         Ok(0)
     }
 
@@ -641,6 +799,7 @@ impl Syscall<'_> {
             return Err(SysError::ENOTDIR);
         }
         dir_inode.unlink(file_name)?;
+        dcache::invalidate(&dir_inode, file_name);
         Ok(0)
     }
 
@@ -669,6 +828,7 @@ impl Syscall<'_> {
         let inode = proc.lookup_inode_at(olddirfd, &oldpath, true)?;
         let new_dir_inode = proc.lookup_inode_at(newdirfd, new_dir_path, true)?;
         new_dir_inode.link(new_file_name, &inode)?;
+        dcache::invalidate(&new_dir_inode, new_file_name);
         Ok(0)
     }
 
@@ -692,11 +852,17 @@ impl Syscall<'_> {
             return Err(SysError::EISDIR);
         }
         dir_inode.unlink(file_name)?;
+        dcache::invalidate(&dir_inode, file_name);
         Ok(0)
     }
 
     pub fn sys_pipe(&mut self, fds: *mut u32) -> SysResult {
-        info!("pipe: fds: {:?}", fds);
+        self.sys_pipe2(fds, 0)
+    }
+
+    pub fn sys_pipe2(&mut self, fds: *mut u32, flags: usize) -> SysResult {
+        info!("pipe2: fds: {:?}, flags: {:#x}", fds, flags);
+        let nonblock = OpenFlags::from_bits_truncate(flags).contains(OpenFlags::NONBLOCK);
 
         let mut proc = self.process();
         let fds = unsafe { self.vm().check_write_array(fds, 2)? };
@@ -708,7 +874,7 @@ impl Syscall<'_> {
                 read: true,
                 write: false,
                 append: false,
-                nonblock: false,
+                nonblock,
             },
             String::from("pipe_r:[]"),
         )));
@@ -719,7 +885,7 @@ impl Syscall<'_> {
                 read: false,
                 write: true,
                 append: false,
-                nonblock: false,
+                nonblock,
             },
             String::from("pipe_w:[]"),
         )));
@@ -760,80 +926,246 @@ impl Syscall<'_> {
             "copy_file_range:BEG in: {}, out: {}, in_offset: {:?}, out_offset: {:?}, count: {} flags {}",
             in_fd, out_fd, in_offset, out_offset, count, flags
         );
-        let proc = self.process();
-        // We know it's save, pacify the borrow checker
-        let proc_cell = UnsafeCell::new(proc);
-        let in_file = unsafe { (*proc_cell.get()).get_file(in_fd)? };
-        let out_file = unsafe { (*proc_cell.get()).get_file(out_fd)? };
-        let mut buffer = [0u8; 1024];
-
-        // for in_offset and out_offset
-        // null means update file offset
-        // non-null means update {in,out}_offset instead
-
-        let mut read_offset = if !in_offset.is_null() {
-            unsafe { *self.vm().check_read_ptr(in_offset)? }
+        let read_offset = if !in_offset.is_null() {
+            Some(unsafe { *self.vm().check_write_ptr(in_offset)? })
         } else {
-            in_file.seek(SeekFrom::Current(0))? as usize
+            None
         };
-
-        let orig_out_file_offset = out_file.seek(SeekFrom::Current(0))?;
         let write_offset = if !out_offset.is_null() {
-            out_file.seek(SeekFrom::Start(
-                unsafe { *self.vm().check_read_ptr(out_offset)? } as u64,
-            ))? as usize
+            Some(unsafe { *self.vm().check_write_ptr(out_offset)? })
         } else {
-            0
+            None
         };
 
-        // read from specified offset and write new offset back
-        let mut bytes_read = 0;
-        let mut total_written = 0;
-        while bytes_read < count {
-            let len = min(buffer.len(), count - bytes_read);
-            let read_len = in_file.read_at(read_offset, &mut buffer[..len])?;
-            if read_len == 0 {
-                break;
+        let mut proc = self.process();
+        let mut in_file = proc.get_file(in_fd)?.clone();
+        let mut out_file = proc.get_file_like(out_fd)?.clone();
+        // the distances the clones moved are applied at the end
+        drop(proc);
+        let in_start = in_file.offset();
+        let (out_start, out_seekable) = match &out_file {
+            FileLike::File(file) => (file.offset(), file.pipe().is_none()),
+            _ => (0, false),
+        };
+        if (in_file.pipe().is_some() && read_offset.is_some())
+            || (!out_seekable && write_offset.is_some())
+        {
+            return Err(SysError::ESPIPE);
+        }
+        // copying within a file is fine as long as the ranges don't overlap
+        if let FileLike::File(out) = &out_file {
+            if in_file.same_file(out) {
+                let size = in_file.inode().metadata()?.size;
+                let read_start = read_offset.unwrap_or(in_file.offset());
+                let write_start = write_offset.unwrap_or(out.offset());
+                let len = count.min(size.saturating_sub(read_start));
+                if len > 0 && read_start < write_start + len && write_start < read_start + len {
+                    return Err(SysError::EINVAL);
+                }
             }
-            bytes_read += read_len;
-            read_offset += read_len;
-
-            let mut bytes_written = 0;
-            let mut rlen = read_len;
-            while bytes_written < read_len {
-                let write_len = out_file.write(&buffer[bytes_written..(bytes_written + rlen)])?;
-                if write_len == 0 {
-                    info!(
-                        "copy_file_range:END_ERR in: {}, out: {}, in_offset: {:?}, out_offset: {:?}, count: {} = bytes_read {}, bytes_written {}, write_len {}",
-                        in_fd, out_fd, in_offset, out_offset, count, bytes_read, bytes_written, write_len
-                    );
-                    return Err(SysError::EBADF);
+        }
+
+        // Pages of the source are passed to the destination directly,
+        // i.e. from page cache to socket tx buffer for sendfile.
+        let mut total_written = 0;
+        let mut write_chunk = |chunk: &[u8]| -> SysResult {
+            let mut written = 0;
+            while written < chunk.len() {
+                let ret = match (&mut out_file, write_offset) {
+                    (FileLike::File(file), Some(offset)) => file
+                        .write_at(offset + total_written, &chunk[written..])
+                        .map_err(SysError::from),
+                    (file_like, _) => file_like.write(&chunk[written..]),
+                };
+                match ret {
+                    Ok(0) => break,
+                    Ok(len) => {
+                        written += len;
+                        total_written += len;
+                    }
+                    // report the bytes already moved
+                    Err(_) if total_written > 0 => break,
+                    Err(err) => return Err(err),
                 }
-                bytes_written += write_len;
-                rlen -= write_len;
             }
-            total_written += bytes_written;
+            Ok(written)
+        };
+        let result = match read_offset {
+            Some(offset) => in_file.splice_at(offset, count, &mut write_chunk),
+            None => in_file.splice(count, &mut write_chunk),
+        };
+
+        let mut proc = self.process();
+        if read_offset.is_none() {
+            if let Ok(file) = proc.get_file(in_fd) {
+                file.sync_offset(&in_file, in_start);
+            }
+        }
+        if let (FileLike::File(out), None) = (&out_file, write_offset) {
+            if let Ok(file) = proc.get_file(out_fd) {
+                file.sync_offset(out, out_start);
+            }
         }
+        drop(proc);
 
-        if !in_offset.is_null() {
+        let bytes_read = result?;
+
+        if let Some(offset) = read_offset {
+            unsafe {
+                in_offset.write(offset + bytes_read);
+            }
+        }
+        if let Some(offset) = write_offset {
             unsafe {
-                in_offset.write(read_offset);
+                out_offset.write(offset + total_written);
             }
+        }
+        info!(
+            "copy_file_range:END in: {}, out: {}, in_offset: {:?}, out_offset: {:?}, count: {} = {}",
+            in_fd, out_fd, in_offset, out_offset, count, total_written
+        );
+        return Ok(total_written);
+    }
+
+    /// Move data between a pipe and another file without copying to user space.
+    /// Pages of a pipe are passed to the other end directly.
+    pub fn sys_splice(
+        &mut self,
+        fd_in: usize,
+        off_in: *mut usize,
+        fd_out: usize,
+        off_out: *mut usize,
+        len: usize,
+        flags: usize,
+    ) -> SysResult {
+        info!(
+            "splice: in: {}, off_in: {:?}, out: {}, off_out: {:?}, len: {}, flags: {:#x}",
+            fd_in, off_in, fd_out, off_out, len, flags
+        );
+        if fd_in == fd_out {
+            return Err(SysError::EINVAL);
+        }
+        let nonblock = flags & SPLICE_F_NONBLOCK != 0;
+        let read_offset = if !off_in.is_null() {
+            Some(unsafe { *self.vm().check_write_ptr(off_in)? })
         } else {
-            in_file.seek(SeekFrom::Current(bytes_read as i64))?;
+            None
+        };
+        let write_offset = if !off_out.is_null() {
+            Some(unsafe { *self.vm().check_write_ptr(off_out)? })
+        } else {
+            None
+        };
+
+        let mut proc = self.process();
+        let mut in_file = proc.get_file(fd_in)?.clone();
+        let mut out_file = proc.get_file_like(fd_out)?.clone();
+        // don't hold the process while blocked on a pipe,
+        // the distances the clones moved are applied at the end
+        drop(proc);
+        let in_start = in_file.offset();
+        let out_start = match &out_file {
+            FileLike::File(file) => file.offset(),
+            _ => 0,
+        };
+        let out_pipe = match &out_file {
+            FileLike::File(file) => file.pipe().is_some(),
+            _ => false,
+        };
+        if in_file.pipe().is_none() && !out_pipe {
+            return Err(SysError::EINVAL);
+        }
+        if (in_file.pipe().is_some() && read_offset.is_some())
+            || (out_pipe && write_offset.is_some())
+        {
+            return Err(SysError::ESPIPE);
+        }
+        if write_offset.is_some() {
+            if let FileLike::Socket(_) = out_file {
+                return Err(SysError::ESPIPE);
+            }
+        }
+
+        let mut total_written = 0;
+        let mut write_chunk = |chunk: &[u8]| -> SysResult {
+            let ret = match (&mut out_file, write_offset) {
+                (FileLike::File(file), Some(offset)) => file
+                    .write_at(offset + total_written, chunk)
+                    .map_err(SysError::from),
+                (FileLike::File(file), None) => match file.pipe() {
+                    Some(pipe) => {
+                        // only the first chunk may block
+                        let nonblock = nonblock || file.nonblock() || total_written > 0;
+                        pipe.write(chunk, nonblock)
+                    }
+                    None => file.write(chunk).map_err(SysError::from),
+                },
+                (file_like, _) => file_like.write(chunk),
+            };
+            if let Ok(len) = ret {
+                total_written += len;
+            }
+            ret
+        };
+        let result = match in_file.pipe() {
+            Some(pipe) => {
+                let nonblock = nonblock || in_file.nonblock();
+                pipe.splice_to(len, nonblock, &mut write_chunk)
+            }
+            None => match read_offset {
+                Some(offset) => in_file.splice_at(offset, len, &mut write_chunk),
+                None => in_file.splice(len, &mut write_chunk),
+            },
+        };
+
+        let mut proc = self.process();
+        if read_offset.is_none() && in_file.pipe().is_none() {
+            if let Ok(file) = proc.get_file(fd_in) {
+                file.sync_offset(&in_file, in_start);
+            }
+        }
+        if let FileLike::File(out) = &out_file {
+            if write_offset.is_none() && out.pipe().is_none() {
+                if let Ok(file) = proc.get_file(fd_out) {
+                    file.sync_offset(out, out_start);
+                }
+            }
         }
+        drop(proc);
 
-        if !out_offset.is_null() {
+        let bytes_read = result?;
+        if let (Some(offset), None) = (read_offset, in_file.pipe()) {
             unsafe {
-                out_offset.write(write_offset + total_written);
+                off_in.write(offset + bytes_read);
             }
-            out_file.seek(SeekFrom::Start(orig_out_file_offset))?;
         }
+        if let Some(offset) = write_offset {
+            unsafe {
+                off_out.write(offset + total_written);
+            }
+        }
+        Ok(total_written)
+    }
+
+    /// Duplicate up to `len` bytes from pipe `fd_in` to pipe `fd_out`,
+    /// without consuming them from `fd_in`
+    pub fn sys_tee(&mut self, fd_in: usize, fd_out: usize, len: usize, flags: usize) -> SysResult {
         info!(
-            "copy_file_range:END in: {}, out: {}, in_offset: {:?}, out_offset: {:?}, count: {} flags {}",
-            in_fd, out_fd, in_offset, out_offset, count, flags
+            "tee: in: {}, out: {}, len: {}, flags: {:#x}",
+            fd_in, fd_out, len, flags
         );
-        return Ok(total_written);
+        let mut proc = self.process();
+        let in_file = proc.get_file(fd_in)?.clone();
+        let out_file = proc.get_file(fd_out)?.clone();
+        drop(proc);
+        match (in_file.pipe(), out_file.pipe()) {
+            (Some(in_pipe), Some(out_pipe)) => {
+                let nonblock =
+                    flags & SPLICE_F_NONBLOCK != 0 || in_file.nonblock() || out_file.nonblock();
+                in_pipe.tee(out_pipe, len, nonblock)
+            }
+            _ => Err(SysError::EINVAL),
+        }
     }
 
     pub fn sys_fcntl(&mut self, fd: usize, cmd: usize, arg: usize) -> SysResult {
@@ -854,6 +1186,12 @@ impl Process {
             _ => Err(SysError::EBADF),
         }
     }
+    pub fn get_epoll(&mut self, fd: usize) -> Result<Arc<EpollInstance>, SysError> {
+        match self.get_file_like(fd)? {
+            FileLike::Epoll(epoll) => Ok(epoll.clone()),
+            _ => Err(SysError::EINVAL),
+        }
+    }
     pub fn get_file_const(&self, fd: usize) -> Result<&FileHandle, SysError> {
         match self.files.get(&fd).ok_or(SysError::EBADF)? {
             FileLike::File(file) => Ok(file),
@@ -904,9 +1242,11 @@ impl Process {
 
         let follow_max_depth = if follow { FOLLOW_MAX_DEPTH } else { 0 };
         if dirfd == AT_FDCWD {
-            Ok(ROOT_INODE
-                .lookup(&self.cwd)?
-                .lookup_follow(path, follow_max_depth)?)
+            let cwd = match self.cwd_inode {
+                Some(ref inode) => inode.clone(),
+                None => dcache::lookup_follow(&ROOT_INODE, &self.cwd, 0)?,
+            };
+            Ok(dcache::lookup_follow(&cwd, path, follow_max_depth)?)
         } else {
             let file = match self.files.get(&dirfd).ok_or(SysError::EBADF)? {
                 FileLike::File(file) => file,
@@ -919,6 +1259,47 @@ impl Process {
     pub fn lookup_inode(&self, path: &str) -> Result<Arc<INode>, SysError> {
         self.lookup_inode_at(AT_FDCWD, path, true)
     }
+
+    /// Open `path` relative to `dirfd` with open(2) `flags`, return the new fd.
+    pub fn open_at(
+        &mut self,
+        dirfd: usize,
+        path: &str,
+        flags: usize,
+        mode: usize,
+    ) -> Result<usize, SysError> {
+        let flags = OpenFlags::from_bits_truncate(flags);
+        let inode = if flags.contains(OpenFlags::CREATE) {
+            let (dir_path, file_name) = split_path(path);
+            // relative to cwd
+            let dir_inode = self.lookup_inode_at(dirfd, dir_path, true)?;
+            match dcache::lookup_follow(&dir_inode, file_name, 0) {
+                Ok(file_inode) => {
+                    if flags.contains(OpenFlags::EXCLUSIVE) {
+                        return Err(SysError::EEXIST);
+                    }
+                    file_inode
+                }
+                Err(FsError::EntryNotFound) => {
+                    let file_inode = dir_inode.create(file_name, FileType::File, mode as u32)?;
+                    dcache::invalidate(&dir_inode, file_name);
+                    file_inode
+                }
+                Err(e) => return Err(SysError::from(e)),
+            }
+        } else {
+            self.lookup_inode_at(dirfd, path, true)?
+        };
+
+        let file = FileHandle::new(inode, flags.to_options(), String::from(path));
+
+        // for debugging
+        if cfg!(debug_assertions) {
+            debug!("files before open {:#?}", self.files);
+        }
+
+        Ok(self.add_file(FileLike::File(file)))
+    }
 }
 
 /// Split a `path` str to `(base_path, file_name)`
@@ -978,9 +1359,14 @@ bitflags! {
         const TRUNCATE = 1 << 9;
         /// append on each write
         const APPEND = 1 << 10;
+        /// non-blocking I/O
+        const NONBLOCK = 1 << 11;
     }
 }
 
+/// Don't block on pipes, for splice and tee
+const SPLICE_F_NONBLOCK: usize = 2;
+
 impl OpenFlags {
     fn readable(&self) -> bool {
         let b = self.bits() & 0b11;
@@ -1361,6 +1747,13 @@ const SEEK_SET: u8 = 0;
 const SEEK_CUR: u8 = 1;
 const SEEK_END: u8 = 2;
 
+const POSIX_FADV_NORMAL: usize = 0;
+const POSIX_FADV_RANDOM: usize = 1;
+const POSIX_FADV_SEQUENTIAL: usize = 2;
+const POSIX_FADV_WILLNEED: usize = 3;
+const POSIX_FADV_DONTNEED: usize = 4;
+const POSIX_FADV_NOREUSE: usize = 5;
+
 #[derive(Debug, Copy, Clone)]
 #[repr(C)]
 pub struct IoVec {
@@ -1404,12 +1797,13 @@ impl IoVecs {
     pub fn read_all_to_vec(&self) -> Vec<u8> {
         let mut buf = self.new_buf(false);
         for slice in self.0.iter() {
-            buf.extend(slice.iter());
+            buf.extend_from_slice(slice);
         }
         buf
     }
 
-    pub fn write_all_from_slice(&mut self, buf: &[u8]) {
+    /// Scatter `buf` to the slices, return the length copied
+    pub fn write_all_from_slice(&mut self, buf: &[u8]) -> usize {
         let mut copied_len = 0;
         for slice in self.0.iter_mut() {
             let copy_len = min(slice.len(), buf.len() - copied_len);
@@ -1420,13 +1814,18 @@ impl IoVecs {
             slice[..copy_len].copy_from_slice(&buf[copied_len..copied_len + copy_len]);
             copied_len += copy_len;
         }
+        copied_len
+    }
+
+    pub fn total_len(&self) -> usize {
+        self.0.iter().map(|slice| slice.len()).sum::<usize>()
     }
 
     /// Create a new Vec buffer from IoVecs
     /// For readv:  `set_len` is true,  Vec.len = total_len.
     /// For writev: `set_len` is false, Vec.cap = total_len.
     pub fn new_buf(&self, set_len: bool) -> Vec<u8> {
-        let total_len = self.0.iter().map(|slice| slice.len()).sum::<usize>();
+        let total_len = self.total_len();
         let mut buf = Vec::with_capacity(total_len);
         if set_len {
             unsafe {
@@ -1460,6 +1859,49 @@ bitflags! {
     }
 }
 
+/// Interval to recheck polled files which have no wait queue to sleep on
+const POLL_RECHECK_INTERVAL: Duration = Duration::from_millis(10);
+
+/// Sleep on the wait queues of the polled files until `condition` returns Some,
+/// or `timeout_msecs` passed (infinite if not below `1 << 31`).
+/// If some files have no wait queue, `condition` is also rechecked periodically.
+fn wait_polled(
+    condvars: &[&Condvar],
+    recheck: bool,
+    timeout_msecs: usize,
+    mut condition: impl FnMut() -> Option<SysResult>,
+) -> SysResult {
+    let timeout = match timeout_msecs < (1 << 31) {
+        true => Some(Duration::from_millis(timeout_msecs as u64)),
+        false => None,
+    };
+    if !recheck {
+        return match timeout {
+            Some(timeout) => {
+                Condvar::wait_events_timeout(condvars, timeout, condition).unwrap_or(Ok(0))
+            }
+            None => Condvar::wait_events(condvars, condition),
+        };
+    }
+    let deadline = timeout.map(hrtimer::deadline_after);
+    loop {
+        let interval = match deadline {
+            Some(deadline) => {
+                let left = Duration::from_nanos(deadline.saturating_sub(hrtimer::now()));
+                left.min(POLL_RECHECK_INTERVAL)
+            }
+            None => POLL_RECHECK_INTERVAL,
+        };
+        if let Some(res) = Condvar::wait_events_timeout(condvars, interval, &mut condition) {
+            return res;
+        }
+        match deadline {
+            Some(deadline) if hrtimer::now() >= deadline => return Ok(0),
+            _ => {}
+        }
+    }
+}
+
 const FD_PER_ITEM: usize = 8 * size_of::<u32>();
 const MAX_FDSET_SIZE: usize = 1024 / FD_PER_ITEM;
 
@@ -1517,4 +1959,4 @@ impl FdSet {
 }
 
 /// Pathname is interpreted relative to the current working directory(CWD)
-const AT_FDCWD: usize = -100isize as usize;
+pub const AT_FDCWD: usize = -100isize as usize;
@@ -2,6 +2,7 @@ use rcore_memory::memory_set::handler::{Delay, File, Linear};
 use rcore_memory::memory_set::MemoryAttr;
 use rcore_memory::PAGE_SIZE;
 
+use crate::fs::FileLike;
 use crate::memory::GlobalFrameAlloc;
 
 use super::*;
@@ -51,6 +52,13 @@ impl Syscall<'_> {
             );
             return Ok(addr);
         } else {
+            if let FileLike::Socket(socket) = proc.get_file_like(fd)? {
+                // e.g. the packet rings, shared with the kernel
+                let handler = socket.mmap(addr, len, offset)?;
+                self.vm()
+                    .push(addr, addr + len, prot.to_attr(), handler, "mmap_socket");
+                return Ok(addr);
+            }
             let file = proc.get_file(fd)?;
             info!("mmap path is {} ", &*file.path);
             match &*file.path {
@@ -1,8 +1,10 @@
 use super::*;
 use crate::arch::cpu;
 use crate::consts::USER_STACK_SIZE;
+use crate::process::futex::{self, FutexKey, FUTEX_BITSET_MATCH_ANY};
 use core::mem::size_of;
 use core::sync::atomic::{AtomicI32, Ordering};
+use core::time::Duration;
 
 impl Syscall<'_> {
     #[cfg(target_arch = "x86_64")]
@@ -60,48 +62,90 @@ impl Syscall<'_> {
         op: u32,
         val: i32,
         timeout: *const TimeSpec,
+        uaddr2: usize,
+        val3: u32,
     ) -> SysResult {
         info!(
-            "futex: [{}] uaddr: {:#x}, op: {:#x}, val: {}, timeout_ptr: {:?}",
+            "futex: [{}] uaddr: {:#x}, op: {:#x}, val: {}, timeout_ptr: {:?}, uaddr2: {:#x}, val3: {:#x}",
             thread::current().id(),
             uaddr,
             op,
             val,
-            timeout
+            timeout,
+            uaddr2,
+            val3
         );
-        if op & OP_PRIVATE == 0 {
-            warn!("process-shared futex is unimplemented");
-        }
-        if uaddr % size_of::<u32>() != 0 {
-            return Err(SysError::EINVAL);
-        }
-        let atomic = unsafe { self.vm().check_write_ptr(uaddr as *mut AtomicI32)? };
-
         const OP_WAIT: u32 = 0;
         const OP_WAKE: u32 = 1;
+        const OP_REQUEUE: u32 = 3;
+        const OP_CMP_REQUEUE: u32 = 4;
+        const OP_WAKE_OP: u32 = 5;
+        const OP_WAIT_BITSET: u32 = 9;
+        const OP_WAKE_BITSET: u32 = 10;
         const OP_PRIVATE: u32 = 0x80;
+        const OP_CLOCK_REALTIME: u32 = 0x100;
 
-        let mut proc = self.process();
-        let queue = proc.get_futex(uaddr);
+        let atomic = self.futex_word(uaddr)?;
+        let key = FutexKey::new(&self.thread.vm, uaddr);
+        // requeue and wake_op take val2 in place of timeout
+        let val2 = timeout as usize;
 
-        match op & 0xf {
-            OP_WAIT => {
-                let _timeout = if timeout.is_null() {
-                    None
+        match op & !(OP_PRIVATE | OP_CLOCK_REALTIME) {
+            cmd @ OP_WAIT | cmd @ OP_WAIT_BITSET => {
+                let bitset = if cmd == OP_WAIT {
+                    FUTEX_BITSET_MATCH_ANY
                 } else {
-                    Some(unsafe { *self.vm().check_read_ptr(timeout)? })
+                    val3
                 };
-
-                if atomic.load(Ordering::Acquire) != val {
-                    return Err(SysError::EAGAIN);
+                if bitset == 0 {
+                    return Err(SysError::EINVAL);
                 }
-                // FIXME: support timeout
-                queue.wait(proc);
+                let timeout = if timeout.is_null() {
+                    None
+                } else {
+                    let timeout = unsafe { *self.vm().check_read_ptr(timeout)? };
+                    let mut timeout = timeout.to_duration();
+                    if cmd == OP_WAIT_BITSET {
+                        // absolute time, all clocks count from epoch here
+                        let now = TimeSpec::get_epoch().to_duration();
+                        timeout = timeout.checked_sub(now).unwrap_or(Duration::new(0, 0));
+                    }
+                    Some(timeout)
+                };
+                futex::wait(key, bitset, timeout, || {
+                    atomic.load(Ordering::Acquire) == val
+                })?;
                 Ok(0)
             }
-            OP_WAKE => {
-                let woken_up_count = queue.notify_n(val as usize);
-                Ok(woken_up_count)
+            cmd @ OP_WAKE | cmd @ OP_WAKE_BITSET => {
+                let bitset = if cmd == OP_WAKE {
+                    FUTEX_BITSET_MATCH_ANY
+                } else {
+                    val3
+                };
+                if bitset == 0 {
+                    return Err(SysError::EINVAL);
+                }
+                Ok(futex::wake(key, val as usize, bitset))
+            }
+            cmd @ OP_REQUEUE | cmd @ OP_CMP_REQUEUE => {
+                self.futex_word(uaddr2)?;
+                let key2 = FutexKey::new(&self.thread.vm, uaddr2);
+                let (woken, requeued) = futex::requeue(key, key2, val as usize, val2, || {
+                    cmd == OP_REQUEUE || atomic.load(Ordering::Acquire) == val3 as i32
+                })?;
+                if cmd == OP_REQUEUE {
+                    Ok(woken)
+                } else {
+                    Ok(woken + requeued)
+                }
+            }
+            OP_WAKE_OP => {
+                let atomic2 = self.futex_word(uaddr2)?;
+                let key2 = FutexKey::new(&self.thread.vm, uaddr2);
+                futex::wake_op(key, key2, val as usize, val2, || {
+                    futex_atomic_op(atomic2, val3)
+                })
             }
             _ => {
                 warn!("unsupported futex operation: {}", op);
@@ -110,6 +154,17 @@ impl Syscall<'_> {
         }
     }
 
+    /// Check the futex word at `uaddr` and fault in its page
+    fn futex_word(&self, uaddr: usize) -> Result<&'static AtomicI32, SysError> {
+        if uaddr % size_of::<u32>() != 0 {
+            return Err(SysError::EINVAL);
+        }
+        let atomic = unsafe { self.vm().check_write_ptr(uaddr as *mut AtomicI32)? };
+        // the futex key needs the frame, and the word is read with the bucket locked
+        atomic.load(Ordering::Relaxed);
+        Ok(atomic)
+    }
+
     pub fn sys_reboot(
         &mut self,
         _magic: u32,
@@ -178,9 +233,7 @@ impl Syscall<'_> {
         let slice = unsafe { self.vm().check_write_array(buf, len)? };
         let mut i = 0;
         for elm in slice {
-            unsafe {
-                *elm = i + crate::trap::TICK as u8;
-            }
+            *elm = i + crate::trap::TICK.load(Ordering::Relaxed) as u8;
             i += 1;
         }
 
@@ -218,3 +271,52 @@ pub struct RLimit {
     cur: u64, // soft limit
     max: u64, // hard limit
 }
+
+/// Apply the operation encoded in `encoded_op` of FUTEX_WAKE_OP to `atomic`,
+/// and return whether its old value passes the comparison
+fn futex_atomic_op(atomic: &AtomicI32, encoded_op: u32) -> Result<bool, SysError> {
+    const OP_SET: u32 = 0;
+    const OP_ADD: u32 = 1;
+    const OP_OR: u32 = 2;
+    const OP_ANDN: u32 = 3;
+    const OP_XOR: u32 = 4;
+    const OP_OPARG_SHIFT: u32 = 8;
+    const CMP_EQ: u32 = 0;
+    const CMP_NE: u32 = 1;
+    const CMP_LT: u32 = 2;
+    const CMP_LE: u32 = 3;
+    const CMP_GT: u32 = 4;
+    const CMP_GE: u32 = 5;
+
+    let op = (encoded_op >> 28) & 0xf;
+    let cmp = (encoded_op >> 24) & 0xf;
+    // sign-extended 12-bit arguments
+    let mut oparg = ((encoded_op as i32) << 8) >> 20;
+    let cmparg = ((encoded_op as i32) << 20) >> 20;
+    if cmp > CMP_GE {
+        return Err(SysError::ENOSYS);
+    }
+    if op & OP_OPARG_SHIFT != 0 {
+        if oparg < 0 || oparg > 31 {
+            return Err(SysError::EINVAL);
+        }
+        oparg = 1 << oparg;
+    }
+    let old = match op & !OP_OPARG_SHIFT {
+        OP_SET => atomic.swap(oparg, Ordering::AcqRel),
+        OP_ADD => atomic.fetch_add(oparg, Ordering::AcqRel),
+        OP_OR => atomic.fetch_or(oparg, Ordering::AcqRel),
+        OP_ANDN => atomic.fetch_and(!oparg, Ordering::AcqRel),
+        OP_XOR => atomic.fetch_xor(oparg, Ordering::AcqRel),
+        _ => return Err(SysError::ENOSYS),
+    };
+    match cmp {
+        CMP_EQ => Ok(old == cmparg),
+        CMP_NE => Ok(old != cmparg),
+        CMP_LT => Ok(old < cmparg),
+        CMP_LE => Ok(old <= cmparg),
+        CMP_GT => Ok(old > cmparg),
+        CMP_GE => Ok(old >= cmparg),
+        _ => unreachable!(),
+    }
+}
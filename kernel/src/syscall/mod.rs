@@ -10,9 +10,10 @@ use rcore_memory::VMError;
 use crate::arch::cpu;
 use crate::arch::interrupt::TrapFrame;
 use crate::arch::syscall::*;
+use crate::fs::EpollEvent;
 use crate::memory::{copy_from_user, MemorySet};
 use crate::process::*;
-use crate::sync::{Condvar, MutexGuard, SpinNoIrq};
+use crate::sync::{Adaptive, Condvar, MutexGuard};
 use crate::thread;
 use crate::util;
 
@@ -57,12 +58,12 @@ struct Syscall<'a> {
 
 impl Syscall<'_> {
     /// Get current process
-    pub fn process(&self) -> MutexGuard<'_, Process, SpinNoIrq> {
+    pub fn process(&self) -> MutexGuard<'_, Process, Adaptive> {
         self.thread.proc.lock()
     }
 
     /// Get current virtual memory
-    pub fn vm(&self) -> MutexGuard<'_, MemorySet, SpinNoIrq> {
+    pub fn vm(&self) -> MutexGuard<'_, MemorySet, Adaptive> {
         self.thread.vm.lock()
     }
 
@@ -111,6 +112,19 @@ impl Syscall<'_> {
             SYS_FLOCK => self.unimplemented("flock", Ok(0)),
             SYS_FSYNC => self.sys_fsync(args[0]),
             SYS_FDATASYNC => self.sys_fdatasync(args[0]),
+            #[cfg(target_pointer_width = "64")]
+            SYS_FADVISE64 => self.sys_fadvise(args[0], args[1], args[2], args[3]),
+            // the offset and length are passed in register pairs
+            #[cfg(target_arch = "riscv32")]
+            SYS_FADVISE64 => self.sys_fadvise(
+                args[0],
+                arg64(args[1], args[2]),
+                arg64(args[3], args[4]),
+                args[5],
+            ),
+            // the pairs start at an even register, leaving the advice out of `args`
+            #[cfg(target_arch = "mips")]
+            SYS_FADVISE64 => self.unimplemented("fadvise64", Ok(0)),
             SYS_TRUNCATE => self.sys_truncate(args[0] as *const u8, args[1]),
             SYS_FTRUNCATE => self.sys_ftruncate(args[0], args[1]),
             SYS_GETDENTS64 => self.sys_getdents64(args[0], args[1] as *mut LinuxDirent64, args[2]),
@@ -138,7 +152,16 @@ impl Syscall<'_> {
             SYS_FCHOWNAT => self.unimplemented("fchownat", Ok(0)),
             SYS_FACCESSAT => self.sys_faccessat(args[0], args[1] as *const u8, args[2], args[3]),
             SYS_DUP3 => self.sys_dup2(args[0], args[1]), // TODO: handle `flags`
-            SYS_PIPE2 => self.sys_pipe(args[0] as *mut u32), // TODO: handle `flags`
+            SYS_PIPE2 => self.sys_pipe2(args[0] as *mut u32, args[1]),
+            SYS_SPLICE => self.sys_splice(
+                args[0],
+                args[1] as *mut usize,
+                args[2],
+                args[3] as *mut usize,
+                args[4],
+                args[5],
+            ),
+            SYS_TEE => self.sys_tee(args[0], args[1], args[2], args[3]),
             SYS_UTIMENSAT => self.unimplemented("utimensat", Ok(0)),
             SYS_COPY_FILE_RANGE => self.sys_copy_file_range(
                 args[0],
@@ -153,7 +176,17 @@ impl Syscall<'_> {
             SYS_PPOLL => {
                 self.sys_ppoll(args[0] as *mut PollFd, args[1], args[2] as *const TimeSpec)
             } // ignore sigmask
-            SYS_EPOLL_CREATE1 => self.unimplemented("epoll_create1", Err(SysError::ENOSYS)),
+            SYS_EPOLL_CREATE1 => self.sys_epoll_create1(args[0]),
+            SYS_EPOLL_CTL => {
+                self.sys_epoll_ctl(args[0], args[1], args[2], args[3] as *const EpollEvent)
+            }
+            SYS_EPOLL_PWAIT => self.sys_epoll_pwait(
+                args[0],
+                args[1] as *mut EpollEvent,
+                args[2],
+                args[3] as isize,
+                args[4],
+            ),
 
             // file system
             SYS_STATFS => self.unimplemented("statfs", Err(SysError::EACCES)),
@@ -202,8 +235,16 @@ impl Syscall<'_> {
                 args[4] as *mut SockAddr,
                 args[5] as *mut u32,
             ),
-            //        SYS_SENDMSG => self.sys_sendmsg(),
+            SYS_SENDMSG => self.sys_sendmsg(args[0], args[1] as *const MsgHdr, args[2]),
             SYS_RECVMSG => self.sys_recvmsg(args[0], args[1] as *mut MsgHdr, args[2]),
+            SYS_SENDMMSG => self.sys_sendmmsg(args[0], args[1] as *mut MMsgHdr, args[2], args[3]),
+            SYS_RECVMMSG => self.sys_recvmmsg(
+                args[0],
+                args[1] as *mut MMsgHdr,
+                args[2],
+                args[3],
+                args[4] as *const TimeSpec,
+            ),
             SYS_SHUTDOWN => self.sys_shutdown(args[0], args[1]),
             SYS_BIND => self.sys_bind(args[0], args[1] as *const SockAddr, args[2]),
             SYS_LISTEN => self.sys_listen(args[0], args[1]),
@@ -246,6 +287,8 @@ impl Syscall<'_> {
                 args[1] as u32,
                 args[2] as i32,
                 args[3] as *const TimeSpec,
+                args[4],
+                args[5] as u32,
             ),
             SYS_TKILL => self.unimplemented("tkill", Ok(0)),
 
@@ -303,6 +346,14 @@ impl Syscall<'_> {
             SYS_GET_PADDR => {
                 self.sys_get_paddr(args[0] as *const u64, args[1] as *mut u64, args[2])
             }
+            SYS_SPAWN => self.sys_spawn(
+                args[0] as *const u8,
+                args[1] as *const *const u8,
+                args[2] as *const *const u8,
+                args[3] as *const SpawnFileAction,
+                args[4],
+            ),
+            SYS_KERNEL_CMD => self.sys_kernel_cmd(args[0] as *const u8),
             _ => {
                 let ret = match () {
                     #[cfg(target_arch = "x86_64")]
@@ -373,6 +424,10 @@ impl Syscall<'_> {
                 }
             }
             SYS_FCNTL64 => self.unimplemented("fcntl64", Ok(0)),
+            SYS_EPOLL_CREATE => self.sys_epoll_create(args[0]),
+            SYS_EPOLL_WAIT => {
+                self.sys_epoll_wait(args[0], args[1] as *mut EpollEvent, args[2], args[3] as isize)
+            }
             SYS_SET_THREAD_AREA => {
                 info!("set_thread_area: tls: 0x{:x}", args[0]);
                 extern "C" {
@@ -420,7 +475,10 @@ impl Syscall<'_> {
             SYS_CHOWN => self.unimplemented("chown", Ok(0)),
             SYS_ARCH_PRCTL => self.sys_arch_prctl(args[0] as i32, args[1]),
             SYS_TIME => self.sys_time(args[0] as *mut u64),
-            SYS_EPOLL_CREATE => self.unimplemented("epoll_create", Err(SysError::ENOSYS)),
+            SYS_EPOLL_CREATE => self.sys_epoll_create(args[0]),
+            SYS_EPOLL_WAIT => {
+                self.sys_epoll_wait(args[0], args[1] as *mut EpollEvent, args[2], args[3] as isize)
+            }
             _ => return None,
         };
         Some(ret)
@@ -429,6 +487,16 @@ impl Syscall<'_> {
 
 pub type SysResult = Result<usize, SysError>;
 
+/// A 64-bit argument passed in two registers, low word first,
+/// saturated to `usize`
+#[cfg(target_pointer_width = "32")]
+fn arg64(low: usize, high: usize) -> usize {
+    match high {
+        0 => low,
+        _ => usize::max_value(),
+    }
+}
+
 #[allow(dead_code)]
 #[repr(isize)]
 #[derive(Debug)]
@@ -480,6 +548,7 @@ pub enum SysError {
     ENOBUFS = 105,
     EISCONN = 106,
     ENOTCONN = 107,
+    ETIMEDOUT = 110,
     ECONNREFUSED = 111,
 }
 
@@ -537,6 +606,7 @@ impl fmt::Display for SysError {
                 ENOBUFS => "No buffer space available",
                 EISCONN => "Transport endpoint is already connected",
                 ENOTCONN => "Transport endpoint is not connected",
+                ETIMEDOUT => "Connection timed out",
                 ECONNREFUSED => "Connection refused",
                 _ => "Unknown error",
             },
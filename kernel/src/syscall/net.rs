@@ -9,6 +9,7 @@ use crate::net::{
     RawSocketState, Socket, TcpSocketState, UdpSocketState,
 };
 use alloc::boxed::Box;
+use alloc::vec::Vec;
 use core::cmp::min;
 use core::mem::size_of;
 use smoltcp::wire::*;
@@ -94,7 +95,13 @@ impl Syscall<'_> {
                 TCP_CONGESTION => Ok(0),
                 _ => Err(SysError::ENOPROTOOPT),
             },
-            _ => Err(SysError::ENOPROTOOPT),
+            _ => {
+                let mut proc = self.process();
+                let data = unsafe { self.vm().check_write_array(optval, *optlen as usize)? };
+                let socket = proc.get_socket(fd)?;
+                *optlen = socket.getsockopt(level, optname, data)? as u32;
+                Ok(0)
+            }
         }
     }
 
@@ -176,13 +183,10 @@ impl Syscall<'_> {
         let mut iovs =
             unsafe { IoVecs::check_and_new(hdr.msg_iov, hdr.msg_iovlen, &self.vm(), true)? };
 
-        let mut buf = iovs.new_buf(true);
         let socket = proc.get_socket(fd)?;
-        let (result, endpoint) = socket.read(&mut buf);
+        let (result, endpoint) = socket.read_vectored(&mut iovs);
 
-        if let Ok(len) = result {
-            // copy data to user
-            iovs.write_all_from_slice(&buf[..len]);
+        if result.is_ok() {
             let sockaddr_in = SockAddr::from(endpoint);
             unsafe {
                 sockaddr_in.write_to(
@@ -195,6 +199,87 @@ impl Syscall<'_> {
         result
     }
 
+    pub fn sys_sendmsg(&mut self, fd: usize, msg: *const MsgHdr, flags: usize) -> SysResult {
+        info!("sendmsg: fd: {}, msg: {:?}, flags: {}", fd, msg, flags);
+        let mut proc = self.process();
+        let hdr = unsafe { self.vm().check_read_ptr(msg)? };
+        let (iovs, endpoint) = hdr.check_for_send(&self.vm())?;
+
+        let socket = proc.get_socket(fd)?;
+        socket.write_vectored(&iovs, endpoint)
+    }
+
+    /// Receive up to `vlen` packets, only waiting for the first one
+    /// as with MSG_WAITFORONE. `timeout` is ignored.
+    pub fn sys_recvmmsg(
+        &mut self,
+        fd: usize,
+        msgvec: *mut MMsgHdr,
+        vlen: usize,
+        flags: usize,
+        timeout: *const TimeSpec,
+    ) -> SysResult {
+        info!(
+            "recvmmsg: fd: {}, msgvec: {:?}, vlen: {}, flags: {}, timeout: {:?}",
+            fd, msgvec, vlen, flags, timeout
+        );
+        let vlen = min(vlen, UIO_MAXIOV);
+        let mut proc = self.process();
+        let msgs = unsafe { self.vm().check_write_array(msgvec, vlen)? };
+        let mut iovs = Vec::with_capacity(vlen);
+        for msg in msgs.iter() {
+            let hdr = &msg.msg_hdr;
+            iovs.push(unsafe {
+                IoVecs::check_and_new(hdr.msg_iov, hdr.msg_iovlen, &self.vm(), true)?
+            });
+        }
+
+        let socket = proc.get_socket(fd)?;
+        let packets = socket.read_batch(&mut iovs)?;
+
+        for (msg, (len, endpoint)) in msgs.iter_mut().zip(packets.iter()) {
+            msg.msg_len = *len as u32;
+            let hdr = &mut msg.msg_hdr;
+            unsafe {
+                SockAddr::from(endpoint.clone()).write_to(
+                    &mut self.vm(),
+                    hdr.msg_name,
+                    &mut hdr.msg_namelen as *mut u32,
+                )?;
+            }
+        }
+        Ok(packets.len())
+    }
+
+    /// Send up to `vlen` packets, return the number sent
+    pub fn sys_sendmmsg(
+        &mut self,
+        fd: usize,
+        msgvec: *mut MMsgHdr,
+        vlen: usize,
+        flags: usize,
+    ) -> SysResult {
+        info!(
+            "sendmmsg: fd: {}, msgvec: {:?}, vlen: {}, flags: {}",
+            fd, msgvec, vlen, flags
+        );
+        let vlen = min(vlen, UIO_MAXIOV);
+        let mut proc = self.process();
+        let msgs = unsafe { self.vm().check_write_array(msgvec, vlen)? };
+        let mut packets = Vec::with_capacity(vlen);
+        for msg in msgs.iter() {
+            packets.push(msg.msg_hdr.check_for_send(&self.vm())?);
+        }
+
+        let socket = proc.get_socket(fd)?;
+        let lens = socket.write_batch(&packets)?;
+
+        for (msg, len) in msgs.iter_mut().zip(lens.iter()) {
+            msg.msg_len = *len as u32;
+        }
+        Ok(lens.len())
+    }
+
     pub fn sys_bind(&mut self, fd: usize, addr: *const SockAddr, addr_len: usize) -> SysResult {
         info!("sys_bind: fd: {} addr: {:?} len: {}", fd, addr, addr_len);
         let mut proc = self.process();
@@ -489,6 +574,35 @@ pub struct MsgHdr {
     msg_flags: usize,
 }
 
+impl MsgHdr {
+    /// Check the data and the destination of a message to send
+    fn check_for_send(&self, vm: &MemorySet) -> Result<(IoVecs, Option<Endpoint>), SysError> {
+        let iovs = unsafe { IoVecs::check_and_new(self.msg_iov, self.msg_iovlen, vm, false)? };
+        let endpoint = if self.msg_name.is_null() {
+            None
+        } else {
+            Some(sockaddr_to_endpoint(
+                vm,
+                self.msg_name,
+                self.msg_namelen as usize,
+            )?)
+        };
+        Ok((iovs, endpoint))
+    }
+}
+
+/// `struct mmsghdr` of sendmmsg and recvmmsg
+#[repr(C)]
+#[derive(Debug)]
+pub struct MMsgHdr {
+    msg_hdr: MsgHdr,
+    /// number of bytes transferred
+    msg_len: u32,
+}
+
+/// Max messages in a sendmmsg or recvmmsg
+const UIO_MAXIOV: usize = 1024;
+
 enum_with_unknown! {
     /// Address families
     pub doc enum AddressFamily(u16) {
@@ -531,3 +645,8 @@ const SO_LINGER: usize = 13;
 const TCP_CONGESTION: usize = 13;
 
 const IP_HDRINCL: usize = 3;
+
+pub const SOL_PACKET: usize = 263;
+pub const PACKET_RX_RING: usize = 5;
+pub const PACKET_STATISTICS: usize = 6;
+pub const PACKET_TX_RING: usize = 13;
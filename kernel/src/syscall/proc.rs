@@ -1,20 +1,31 @@
 //! Syscalls for process
 
 use super::*;
+use crate::process::futex::{self, FutexKey, FUTEX_BITSET_MATCH_ANY};
+use crate::sync::AdaptiveLock;
 
 impl Syscall<'_> {
     /// Fork the current process. Return the child's PID.
     pub fn sys_fork(&mut self) -> SysResult {
         let new_thread = self.thread.fork(self.tf);
         let pid = new_thread.proc.lock().pid.get();
-        let tid = processor().manager().add(new_thread);
+        let tid = add_thread(new_thread);
         processor().manager().detach(tid);
         info!("fork: {} -> {}", thread::current().id(), pid);
         Ok(pid)
     }
 
+    /// Create a child process running on the address space of the current one.
+    /// The caller is blocked until the child execs or exits.
     pub fn sys_vfork(&mut self) -> SysResult {
-        self.sys_fork()
+        let done = Arc::new(VforkDone::new());
+        let new_thread = self.thread.vfork(self.tf, done.clone());
+        let pid = new_thread.proc.lock().pid.get();
+        let tid = add_thread(new_thread);
+        processor().manager().detach(tid);
+        info!("vfork: {} -> {}", thread::current().id(), pid);
+        done.wait();
+        Ok(pid)
     }
 
     /// Create a new thread in the current process.
@@ -53,7 +64,7 @@ impl Syscall<'_> {
         let new_thread = self
             .thread
             .clone(self.tf, newsp, newtls, child_tid as usize);
-        let tid = processor().manager().add(new_thread);
+        let tid = add_thread(new_thread);
         processor().manager().detach(tid);
         info!("clone: {} -> {}", thread::current().id(), tid);
         *parent_tid_ref = tid as u32;
@@ -181,15 +192,27 @@ impl Syscall<'_> {
         let (mut vm, entry_addr, ustack_top) =
             Thread::new_user_vm(&inode, &path, args, envs).map_err(|_| SysError::EINVAL)?;
 
-        // Activate new page table
-        core::mem::swap(&mut *self.vm(), &mut vm);
-        unsafe {
-            self.vm().activate();
-        }
-
         // Modify exec path
         proc.exec_path = path.clone();
-        drop(proc);
+
+        // Activate new page table
+        if let Some(done) = proc.vfork_done.take() {
+            // the old address space belongs to the vfork parent, leave it intact
+            let vm = Arc::new(AdaptiveLock::new(vm));
+            proc.vm = vm.clone();
+            drop(proc);
+            self.thread.vm = vm;
+            unsafe {
+                self.vm().activate();
+            }
+            done.release();
+        } else {
+            drop(proc);
+            core::mem::swap(&mut *self.vm(), &mut vm);
+            unsafe {
+                self.vm().activate();
+            }
+        }
 
         // Modify the TrapFrame
         *self.tf = TrapFrame::new_user_thread(entry_addr, ustack_top);
@@ -269,8 +292,9 @@ impl Syscall<'_> {
             info!("exit: futex {:#?} wake 1", clear_child_tid);
             if let Ok(clear_child_tid_ref) = unsafe { self.vm().check_write_ptr(clear_child_tid) } {
                 *clear_child_tid_ref = 0;
-                let queue = proc.get_futex(clear_child_tid as usize);
-                queue.notify_one();
+                let uaddr = clear_child_tid as usize;
+                let key = FutexKey::new(&self.thread.vm, uaddr);
+                futex::wake(key, 1, FUTEX_BITSET_MATCH_ANY);
             }
         }
         drop(proc);
@@ -286,6 +310,7 @@ impl Syscall<'_> {
         info!("exit_group: {}, code: {}", proc.pid, exit_code);
 
         proc.exit(exit_code);
+        drop(proc);
 
         processor().yield_now();
         unreachable!();
@@ -294,8 +319,7 @@ impl Syscall<'_> {
     pub fn sys_nanosleep(&mut self, req: *const TimeSpec) -> SysResult {
         let time = unsafe { *self.vm().check_read_ptr(req)? };
         info!("nanosleep: time: {:#?}", time);
-        // TODO: handle spurious wakeup
-        thread::sleep(time.to_duration());
+        crate::hrtimer::sleep(time.to_duration());
         Ok(0)
     }
 
@@ -2,6 +2,8 @@
 
 use super::*;
 use crate::consts::USEC_PER_TICK;
+use crate::hrtimer::{self, NSEC_PER_SEC};
+use core::sync::atomic::Ordering;
 use core::time::Duration;
 use lazy_static::lazy_static;
 
@@ -43,7 +45,7 @@ impl Syscall<'_> {
         let rusage = unsafe { self.vm().check_write_ptr(rusage)? };
 
         let tick_base = *TICK_BASE;
-        let tick = unsafe { crate::trap::TICK as u64 };
+        let tick = crate::trap::TICK.load(Ordering::Relaxed) as u64;
 
         let usec = (tick - tick_base) * USEC_PER_TICK as u64;
         let new_rusage = RUsage {
@@ -65,7 +67,7 @@ impl Syscall<'_> {
         let buf = unsafe { self.vm().check_write_ptr(buf)? };
 
         let tick_base = *TICK_BASE;
-        let tick = unsafe { crate::trap::TICK as u64 };
+        let tick = crate::trap::TICK.load(Ordering::Relaxed) as u64;
 
         let new_buf = Tms {
             tms_utime: 0,
@@ -82,7 +84,8 @@ impl Syscall<'_> {
 // should be initialized together
 lazy_static! {
     pub static ref EPOCH_BASE: u64 = crate::arch::timer::read_epoch();
-    pub static ref TICK_BASE: u64 = unsafe { crate::trap::TICK as u64 };
+    pub static ref TICK_BASE: u64 = crate::trap::TICK.load(Ordering::Relaxed) as u64;
+    pub static ref NSEC_BASE: u64 = hrtimer::now();
 }
 
 // 1ms msec
@@ -95,13 +98,23 @@ const USEC_PER_MSEC: u64 = 1_000;
 const NSEC_PER_USEC: u64 = 1_000;
 const NSEC_PER_MSEC: u64 = 1_000_000;
 
-/// Get time since epoch in usec
-fn get_epoch_usec() -> u64 {
-    let tick_base = *TICK_BASE;
+/// Get time since epoch in nsec, read from the cycle counter
+fn get_epoch_nsec() -> u64 {
+    epoch_nsec_at(hrtimer::now())
+}
+
+/// Time since epoch in nsec at `nsec` of `hrtimer::now`
+pub fn epoch_nsec_at(nsec: u64) -> u64 {
+    let nsec_base = *NSEC_BASE;
     let epoch_base = *EPOCH_BASE;
-    let tick = unsafe { crate::trap::TICK as u64 };
 
-    (tick - tick_base) * USEC_PER_TICK as u64 + epoch_base * USEC_PER_SEC
+    // `nsec` may be read before the bases are
+    nsec.saturating_sub(nsec_base) + epoch_base * NSEC_PER_SEC
+}
+
+/// Get time since epoch in usec
+fn get_epoch_usec() -> u64 {
+    get_epoch_nsec() / NSEC_PER_USEC
 }
 
 #[repr(C)]
@@ -142,10 +155,10 @@ impl TimeSpec {
     }
 
     pub fn get_epoch() -> Self {
-        let usec = get_epoch_usec();
+        let nsec = get_epoch_nsec();
         TimeSpec {
-            sec: (usec / USEC_PER_SEC) as usize,
-            nsec: (usec % USEC_PER_SEC * NSEC_PER_USEC) as usize,
+            sec: (nsec / NSEC_PER_SEC) as usize,
+            nsec: (nsec % NSEC_PER_SEC) as usize,
         }
     }
 }
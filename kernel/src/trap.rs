@@ -1,20 +1,31 @@
 use crate::arch::cpu;
 use crate::arch::interrupt::TrapFrame;
 use crate::process::*;
+use core::sync::atomic::{AtomicUsize, Ordering};
 use log::*;
 
-pub static mut TICK: usize = 0;
+pub static TICK: AtomicUsize = AtomicUsize::new(0);
 
 pub fn uptime_msec() -> usize {
-    unsafe { crate::trap::TICK / crate::consts::USEC_PER_TICK / 1000 }
+    (crate::hrtimer::now() / 1_000_000) as usize
 }
 
+/// The tick of this CPU, from `hrtimer::interrupt`
 pub fn timer() {
-    if cpu::id() == 0 {
-        unsafe {
-            TICK += 1;
+    if crate::hrtimer::has_clock() {
+        // CPU 0 may have stopped its tick, so any CPU catches `TICK` up with the clock
+        let ticks = (crate::hrtimer::now() / crate::hrtimer::NSEC_PER_TICK) as usize;
+        let mut current = TICK.load(Ordering::Relaxed);
+        while current < ticks {
+            match TICK.compare_exchange_weak(current, ticks, Ordering::Relaxed, Ordering::Relaxed) {
+                Ok(_) => break,
+                Err(actual) => current = actual,
+            }
         }
+    } else if cpu::id() == 0 {
+        TICK.fetch_add(1, Ordering::Relaxed);
     }
+    crate::vdso::update();
     processor().tick();
 }
 
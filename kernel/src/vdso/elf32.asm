@@ -0,0 +1,31 @@
+# ELF32 layout for `vdso.asm`
+
+.equ VDSO_ELFCLASS,     1
+.equ VDSO_PTRSIZE,      4
+.equ VDSO_EHDR_SIZE,    52
+.equ VDSO_PHDR_SIZE,    32
+.equ VDSO_SYM_SIZE,     16
+
+.macro VDSO_PTR value
+    .long \value
+.endm
+
+.macro VDSO_PHDR type, flags, offset, size, align
+    .long \type
+    .long \offset            # p_offset
+    .long \offset            # p_vaddr
+    .long \offset            # p_paddr
+    .long \size              # p_filesz
+    .long \size              # p_memsz
+    .long \flags
+    .long \align
+.endm
+
+.macro VDSO_SYM name, info, value
+    .long \name
+    .long \value
+    .long 0                  # st_size
+    .byte \info
+    .byte 0                  # st_other
+    .short 1                 # st_shndx, any defined section
+.endm
@@ -0,0 +1,31 @@
+# ELF64 layout for `vdso.asm`
+
+.equ VDSO_ELFCLASS,     2
+.equ VDSO_PTRSIZE,      8
+.equ VDSO_EHDR_SIZE,    64
+.equ VDSO_PHDR_SIZE,    56
+.equ VDSO_SYM_SIZE,     24
+
+.macro VDSO_PTR value
+    .quad \value
+.endm
+
+.macro VDSO_PHDR type, flags, offset, size, align
+    .long \type
+    .long \flags
+    .quad \offset            # p_offset
+    .quad \offset            # p_vaddr
+    .quad \offset            # p_paddr
+    .quad \size              # p_filesz
+    .quad \size              # p_memsz
+    .quad \align
+.endm
+
+.macro VDSO_SYM name, info, value
+    .long \name
+    .byte \info
+    .byte 0                  # st_other
+    .short 1                 # st_shndx, any defined section
+    .quad \value
+    .quad 0                  # st_size
+.endm
@@ -0,0 +1,209 @@
+//! vDSO for `clock_gettime` without a syscall
+//!
+//! Every user address space maps two shared pages below the user stack:
+//! a read-only data page updated by the kernel, and after it a small shared object
+//! (`vdso.asm`) whose `__vdso_clock_gettime` reads the cycle counter and converts
+//! it with the data page. The address of the shared object is passed in `AT_SYSINFO_EHDR`,
+//! where musl finds it and uses it for `clock_gettime`, `gettimeofday` and `time`.
+//!
+//! The data page is a seqlock: `seq` is odd while the kernel writes it,
+//! and a reader retries if `seq` changed during its read.
+//! It holds the realtime clock at some cycle, and the cycle to nanosecond conversion
+//! `ns = cycles * mult >> shift`. The clock is taken again on every tick, so that
+//! the conversion never drifts away from `hrtimer::now`.
+//!
+//! The vDSO exists where user mode can read the cycle counter:
+//! the TSC on x86_64 and `rdtime` on riscv.
+
+use core::ptr::write_volatile;
+use core::slice;
+use core::sync::atomic::{fence, AtomicBool, AtomicUsize, Ordering};
+use rcore_memory::PAGE_SIZE;
+
+use crate::arch::timer;
+use crate::consts::{USEC_PER_TICK, USER_STACK_OFFSET};
+use crate::hrtimer::{self, NSEC_PER_SEC};
+use crate::memory::{alloc_frame, phys_to_virt, Linear, MemoryAttr, MemorySet};
+use crate::syscall::epoch_nsec_at;
+
+#[cfg(target_arch = "x86_64")]
+global_asm!(concat!(
+    include_str!("elf64.asm"),
+    include_str!("../arch/x86_64/vdso.asm"),
+    include_str!("vdso.asm")
+));
+#[cfg(target_arch = "riscv32")]
+global_asm!(concat!(
+    include_str!("elf32.asm"),
+    include_str!("../arch/riscv32/vdso.asm"),
+    include_str!("vdso.asm")
+));
+#[cfg(target_arch = "riscv64")]
+global_asm!(concat!(
+    include_str!("elf64.asm"),
+    include_str!("../arch/riscv32/vdso.asm"),
+    include_str!("vdso.asm")
+));
+
+/// User address of the data page, the image follows it
+const VDSO_BASE: usize = USER_STACK_OFFSET - 2 * PAGE_SIZE;
+
+/// The data page, offsets are mirrored in `vdso.asm`
+#[repr(C)]
+struct VdsoData {
+    /// Odd while the data is being written
+    seq: u32,
+    /// 0 without a cycle counter, the vDSO makes the syscall then
+    enabled: u32,
+    /// Cycle at which `sec` and `nsec` were taken
+    cycle_last: u64,
+    /// Realtime clock at `cycle_last`
+    sec: u64,
+    nsec: u32,
+    /// Nanoseconds = cycles * `mult` >> `shift`
+    mult: u32,
+    shift: u32,
+}
+
+struct VdsoPages {
+    /// Physical address of the data page
+    data: usize,
+    /// Physical address of the image
+    image: usize,
+}
+
+lazy_static! {
+    static ref VDSO: Option<VdsoPages> = VdsoPages::new();
+}
+
+/// Kernel address of the data page, 0 before it is initialized
+static DATA: AtomicUsize = AtomicUsize::new(0);
+
+/// Held by the CPU updating the data page
+static UPDATING: AtomicBool = AtomicBool::new(false);
+
+#[cfg(any(
+    target_arch = "x86_64",
+    target_arch = "riscv32",
+    target_arch = "riscv64"
+))]
+fn image() -> &'static [u8] {
+    extern "C" {
+        fn vdso_start();
+        fn vdso_end();
+    }
+    let start = vdso_start as usize;
+    let end = vdso_end as usize;
+    unsafe { slice::from_raw_parts(start as *const u8, end - start) }
+}
+
+#[cfg(not(any(
+    target_arch = "x86_64",
+    target_arch = "riscv32",
+    target_arch = "riscv64"
+)))]
+fn image() -> &'static [u8] {
+    &[]
+}
+
+impl VdsoPages {
+    fn new() -> Option<Self> {
+        let image = image();
+        if image.is_empty() {
+            return None;
+        }
+        assert!(image.len() <= PAGE_SIZE, "vDSO larger than a page");
+        let pages = VdsoPages {
+            data: alloc_frame().expect("failed to allocate vDSO"),
+            image: alloc_frame().expect("failed to allocate vDSO"),
+        };
+        unsafe {
+            let dst = slice::from_raw_parts_mut(phys_to_virt(pages.image) as *mut u8, PAGE_SIZE);
+            dst[..image.len()].copy_from_slice(image);
+            for byte in dst[image.len()..].iter_mut() {
+                *byte = 0;
+            }
+            let data = &mut *(phys_to_virt(pages.data) as *mut VdsoData);
+            *data = VdsoData {
+                seq: 0,
+                enabled: hrtimer::has_clock() as u32,
+                cycle_last: 0,
+                sec: 0,
+                nsec: 0,
+                mult: 0,
+                shift: 0,
+            };
+            if hrtimer::has_clock() {
+                let (mult, shift) = mult_shift(timer::cycle_freq());
+                data.mult = mult;
+                data.shift = shift;
+                DATA.store(data as *mut VdsoData as usize, Ordering::Release);
+                update();
+            }
+        }
+        Some(pages)
+    }
+}
+
+/// The largest `shift` below 32 for which `mult` fits in 32 bits
+fn mult_shift(freq: u64) -> (u32, u32) {
+    let mut shift = 31;
+    while shift > 1 && (NSEC_PER_SEC << shift) / freq > u32::max_value() as u64 {
+        shift -= 1;
+    }
+    (((NSEC_PER_SEC << shift) / freq) as u32, shift)
+}
+
+/// Map the vDSO into `vm`, return the address of its ELF header for `AT_SYSINFO_EHDR`
+pub fn map(vm: &mut MemorySet) -> Option<usize> {
+    let pages = VDSO.as_ref()?;
+    let image_base = VDSO_BASE + PAGE_SIZE;
+    vm.push(
+        VDSO_BASE,
+        image_base,
+        MemoryAttr::default().user().readonly(),
+        Linear::new(pages.data as isize - VDSO_BASE as isize),
+        "vdso_data",
+    );
+    vm.push(
+        image_base,
+        image_base + PAGE_SIZE,
+        MemoryAttr::default().user().readonly().execute(),
+        Linear::new(pages.image as isize - image_base as isize),
+        "vdso",
+    );
+    Some(image_base)
+}
+
+/// Take the realtime clock again if a tick has passed since the last time,
+/// called on every tick of any CPU
+pub fn update() {
+    let data = DATA.load(Ordering::Acquire);
+    if data == 0 {
+        return;
+    }
+    // another CPU is at it, or an interrupt came in the middle of it
+    if UPDATING
+        .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+        .is_err()
+    {
+        return;
+    }
+    let data = unsafe { &mut *(data as *mut VdsoData) };
+    let cycle = timer::get_cycle();
+    let cycles_per_tick = timer::cycle_freq() * USEC_PER_TICK as u64 / 1_000_000;
+    // the counter of this CPU may be behind the one which took it last time
+    if data.seq == 0 || cycle >= data.cycle_last + cycles_per_tick {
+        let nsec = epoch_nsec_at(hrtimer::cycle_to_nsec(cycle));
+        unsafe {
+            write_volatile(&mut data.seq, data.seq.wrapping_add(1));
+            fence(Ordering::Release);
+            write_volatile(&mut data.cycle_last, cycle);
+            write_volatile(&mut data.sec, nsec / NSEC_PER_SEC);
+            write_volatile(&mut data.nsec, (nsec % NSEC_PER_SEC) as u32);
+            fence(Ordering::Release);
+            write_volatile(&mut data.seq, data.seq.wrapping_add(1));
+        }
+    }
+    UPDATING.store(false, Ordering::Release);
+}
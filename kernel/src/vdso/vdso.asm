@@ -0,0 +1,92 @@
+# The vDSO image, a shared object of one page mapped after its data page
+#
+# Defined before this file:
+#   VDSO_ELFCLASS, VDSO_PTRSIZE, VDSO_EHDR_SIZE, VDSO_PHDR_SIZE, VDSO_SYM_SIZE
+#   VDSO_PTR, VDSO_PHDR, VDSO_SYM       (elf32.asm / elf64.asm)
+#   VDSO_MACHINE, VDSO_TEXT             (arch vdso.asm)
+#
+# The image only has what musl looks up: program headers, a dynamic section
+# with the symbol table, string table and hash table, and no section headers.
+
+# Offsets in the data page, see `VdsoData`
+.equ VDSO_DATA,         -4096
+.equ VDSO_SEQ,          0
+.equ VDSO_ENABLED,      4
+.equ VDSO_CYCLE_LAST,   8
+.equ VDSO_SEC,          16
+.equ VDSO_NSEC,         24
+.equ VDSO_MULT,         28
+.equ VDSO_SHIFT,        32
+
+.equ NSEC_PER_SEC,      1000000000
+
+.pushsection .rodata.vdso, "a"
+.balign 4096
+.global vdso_start, vdso_end
+vdso_start:
+    # ELF header
+    .byte 0x7f
+    .ascii "ELF"
+    .byte VDSO_ELFCLASS
+    .byte 1                     # little endian
+    .byte 1                     # EV_CURRENT
+    .byte 0                     # ELFOSABI_SYSV
+    .zero 8
+    .short 3                    # ET_DYN
+    .short VDSO_MACHINE
+    .long 1                     # EV_CURRENT
+    VDSO_PTR 0                  # e_entry
+    VDSO_PTR vdso_phdr - vdso_start
+    VDSO_PTR 0                  # e_shoff
+    .long 0                     # e_flags
+    .short VDSO_EHDR_SIZE
+    .short VDSO_PHDR_SIZE
+    .short 2                    # e_phnum
+    .short 0                    # e_shentsize
+    .short 0                    # e_shnum
+    .short 0                    # e_shstrndx
+
+vdso_phdr:
+    # PT_LOAD, R+X
+    VDSO_PHDR 1, 5, 0, vdso_end - vdso_start, 4096
+    # PT_DYNAMIC, R
+    VDSO_PHDR 2, 4, vdso_dynamic - vdso_start, vdso_dynamic_end - vdso_dynamic, VDSO_PTRSIZE
+
+.balign VDSO_PTRSIZE
+vdso_dynamic:
+    VDSO_PTR 4                  # DT_HASH
+    VDSO_PTR vdso_hash - vdso_start
+    VDSO_PTR 5                  # DT_STRTAB
+    VDSO_PTR vdso_strtab - vdso_start
+    VDSO_PTR 6                  # DT_SYMTAB
+    VDSO_PTR vdso_symtab - vdso_start
+    VDSO_PTR 10                 # DT_STRSZ
+    VDSO_PTR vdso_strtab_end - vdso_strtab
+    VDSO_PTR 11                 # DT_SYMENT
+    VDSO_PTR VDSO_SYM_SIZE
+    VDSO_PTR 0                  # DT_NULL
+    VDSO_PTR 0
+vdso_dynamic_end:
+
+vdso_hash:
+    .long 1                     # nbucket
+    .long 2                     # nchain
+    .long 1                     # bucket[0]
+    .long 0, 0                  # chain
+
+.balign VDSO_PTRSIZE
+vdso_symtab:
+    VDSO_SYM 0, 0, 0
+    # STB_GLOBAL, STT_FUNC
+    VDSO_SYM vdso_name_clock_gettime - vdso_strtab, 0x12, __vdso_clock_gettime - vdso_start
+
+vdso_strtab:
+    .byte 0
+vdso_name_clock_gettime:
+    .asciz "__vdso_clock_gettime"
+vdso_strtab_end:
+
+.balign 16
+    VDSO_TEXT
+vdso_end:
+.popsection